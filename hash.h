@@ -28,6 +28,7 @@
 #define MAP_CAT1(a,b) a ## b
 #define MAP_CAT2(a,b) MAP_CAT1(a,b)
 #define MAP_CAT(a,b)  MAP_CAT2(a,b)
+#define MAP_APPLY(m, args) m args // NOTE: pasting onto '(' only works with MSVC's preprocessor
 
 #define MAP_DECORATE_TYPE(x) MAP_CAT(Map, x)
 #define MAP_DECORATE_FUNC(x) MAP_CAT(map_fn, _ ## x)
@@ -41,15 +42,15 @@
 #endif//MAP_KEY_EQ
 
 #if 1 // BASIC TYPES
-#define MAP_TYPE(map_t, func_prefix, key_t, val_t) map_t
-#define MAP_FUNC(map_t, func_prefix, key_t, val_t) func_prefix
-#define MAP_KEY( map_t, func_prefix, key_t, val_t) key_t
-#define MAP_VAL( map_t, func_prefix, key_t, val_t) val_t
+#define MAP__TYPE(map_t, func_prefix, key_t, val_t) map_t
+#define MAP__FUNC(map_t, func_prefix, key_t, val_t) func_prefix
+#define MAP__KEY( map_t, func_prefix, key_t, val_t) key_t
+#define MAP__VAL( map_t, func_prefix, key_t, val_t) val_t
 
-#define Map    MAP_CAT(MAP_TYPE, MAP_TYPES)
-#define map_fn MAP_CAT(MAP_FUNC, MAP_TYPES)
-#define MapKey MAP_CAT(MAP_KEY,  MAP_TYPES)
-#define MapVal MAP_CAT(MAP_VAL,  MAP_TYPES)
+#define Map    MAP_APPLY(MAP__TYPE, MAP_TYPES)
+#define map_fn MAP_APPLY(MAP__FUNC, MAP_TYPES)
+#define MapKey MAP_APPLY(MAP__KEY,  MAP_TYPES)
+#define MapVal MAP_APPLY(MAP__VAL,  MAP_TYPES)
 
 #ifndef MapIdx
 #define MapIdx uint64_t
@@ -62,9 +63,9 @@
 #define MAP_MTX_UNLOCK(mtx_t, lock_fn, unlock_fn) unlock_fn
 
 #ifdef MAP_MUTEX
-#define MAP_MTX(name) MAP_CAT(MAP_MTX_TYPE,   MAP_MUTEX) name;
-#define MAP_LOCK      MAP_CAT(MAP_MTX_LOCK,   MAP_MUTEX)
-#define MAP_UNLOCK    MAP_CAT(MAP_MTX_UNLOCK, MAP_MUTEX)
+#define MAP_MTX(name) MAP_APPLY(MAP_MTX_TYPE,   MAP_MUTEX) name;
+#define MAP_LOCK      MAP_APPLY(MAP_MTX_LOCK,   MAP_MUTEX)
+#define MAP_UNLOCK    MAP_APPLY(MAP_MTX_UNLOCK, MAP_MUTEX)
 #else // MAP_MUTEX
 // mutex no-ops:
 #define MAP_MTX(x)
@@ -95,6 +96,7 @@
 #define map_update MAP_DECORATE_FUNC(update)
 #define map_insert MAP_DECORATE_FUNC(insert)
 #define map_remove MAP_DECORATE_FUNC(remove)
+#define map_free   MAP_DECORATE_FUNC(free)
 #define map_resize MAP_DECORATE_FUNC(resize)
 #endif // FUNCTIONS
 
@@ -111,12 +113,18 @@ static void map__test_invariants(Map *map);
 # define MAP_MIN_ELEMENTS 4
 #endif /*MAP_MIN_ELEMENTS*/
 
+#ifdef __cplusplus /* NOTE: {0} on a struct trips -Wmissing-field-initializers in C++, and {} isn't C until C23 */
+# define MAP_ZERO_INIT {}
+#else
+# define MAP_ZERO_INIT {0}
+#endif /*__cplusplus*/
+
 #ifndef  MAP_INVALID_VAL
-# define MAP_INVALID_VAL {0}
+# define MAP_INVALID_VAL MAP_ZERO_INIT
 #endif /*MAP_INVALID_VAL*/
 
 #ifndef  MAP_INVALID_KEY
-# define MAP_INVALID_KEY {0}
+# define MAP_INVALID_KEY MAP_ZERO_INIT
 #endif /*MAP_INVALID_KEY*/
 
 #define Map_Invalid_Key MAP_DECORATE_TYPE (_Invalid_Key)
@@ -477,6 +485,22 @@ MAP_API uint64_t map_clear(Map *map)
 	return n;
 }
 
+// frees the arrays and leaves an empty map, which can be used again
+MAP_API void map_free(Map *map)
+{
+    map__assert(map);
+    MAP_LOCK(&map->lock);
+    free(map->keys);
+    free(map->vals);
+    free(map->idxs);
+    map->keys = 0;
+    map->vals = 0;
+    map->idxs = 0;
+    map->max  = 0;
+    map->n    = 0;
+    MAP_UNLOCK(&map->lock);
+}
+
 #if 1 // INVARIANTS
 #ifdef MAP_TEST
 # ifndef MAP_TEST_CONSTANTS
@@ -537,16 +561,17 @@ static void map__test_invariants(Map *map)
 #endif // INVARIANTS
 
 #if 1 // UNDEFS
+#undef MAP_ZERO_INIT
 #undef MAP_INVALID_KEY
 #undef MAP_INVALID_VAL
 
 #undef MAP_KEY_EQ
 #undef MAP_HASH_KEY
 
-#undef MAP_TYPE
-#undef MAP_FUNC
-#undef MAP_KEY
-#undef MAP_VAL
+#undef MAP__TYPE
+#undef MAP__FUNC
+#undef MAP__KEY
+#undef MAP__VAL
 
 #undef Map
 #undef map_fn
@@ -584,6 +609,7 @@ static void map__test_invariants(Map *map)
 #undef map_update
 #undef map_insert
 #undef map_remove
+#undef map_free
 #undef map_resize
 
 #undef MAP_TYPES
@@ -592,4 +618,5 @@ static void map__test_invariants(Map *map)
 #undef MAP_CAT1
 #undef MAP_CAT2
 #undef MAP_CAT
+#undef MAP_APPLY
 #endif /*undefs*/
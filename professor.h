@@ -16,6 +16,8 @@
 // This may be a mistake though, let me know if you think so.
 // #include <intrin.h> // __rdtsc()
 uint64_t __rdtsc(void);
+#else
+#include <x86intrin.h> // __rdtsc()
 #endif
 
 // TODO: for DLLs prof_set_global_state
@@ -29,6 +31,10 @@ uint64_t __rdtsc(void);
 #define prof_atomic_add(a, b) (*(a) += (b))
 #endif
 
+#ifndef prof_atomic_fetch_add
+#define prof_atomic_fetch_add(a, b) ((*(a) += (b)) - (b))
+#endif
+
 #ifndef prof_atomic_exchange
 static inline uint64_t
 prof_atomic_exchange(uint64_t *a, uint64_t b)
@@ -39,9 +45,13 @@ prof_atomic_exchange(uint64_t *a, uint64_t b)
 }
 #endif
 
+#if PROF_INSTRUMENT && ! defined(PROF_ADDR)
+# define PROF_ADDR 1 // instrumented functions are address-keyed records
+#endif
+
 typedef uint32_t ProfIdx;
 
-// TODO: rolling buffer of multiple frames
+// TODO: rolling buffer of multiple frames (PROF_FRAMES keeps the slowest N)
 // TODO: add __func__?
 // NOTE: these are really source locations
 typedef struct ProfRecord {
@@ -61,6 +71,12 @@ typedef struct ProfRecordSmpl {
     // thread id/proc id?
 } ProfRecordSmpl;
 
+// a sample closed with hits_n != 1 (e.g. one prof_scope_n around n loop iterations)
+typedef struct ProfHitsSmpl {
+    ProfIdx  smpl_i;
+    uint32_t hits_n;
+} ProfHitsSmpl;
+
 
 typedef struct ProfPtr {
     char const *name;
@@ -77,12 +93,26 @@ typedef enum ProfPtrAction {
 // TODO: could do some sort of linked list to connect reallocs?
 typedef struct ProfPtrSmpl { // key'd by addr
     ProfIdx   record_i;
+    ProfIdx   smpl_i; // the scope open at the time, ~0 if none (a compact index with PROF_COMPACT)
     uintptr_t addr;
     uintptr_t addr_p; // if freed / realloc'd
     uint64_t  cycles;
     size_t    size;
 } ProfPtrSmpl;
 
+typedef struct ProfCounterSmpl {
+    uint64_t cycles;
+    double   value;
+    ProfIdx  record_i;
+} ProfCounterSmpl;
+
+typedef struct ProfCounter { // parallel with records
+    double   value;         // the latest value, whether or not it was sampled
+    double   sampled_value; // the last value put in counter_smpls
+    uint32_t calls_n;       // since the last sample
+    uint32_t is_sampled;    // whether sampled_value is valid
+} ProfCounter;
+
 // TODO: non variable length
 static inline size_t
 prof_fnv1a_record(ProfRecord data)
@@ -113,33 +143,178 @@ prof_record_eq(ProfRecord a, ProfRecord b)
 #define MAP_TYPES (ProfRecordMap, prof_record_map, ProfRecord, ProfIdx)
 #include "hash.h"
 
+static inline uint64_t
+prof_hash_addr(void const *addr)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)addr;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#define MAP_INVALID_VAL (~(ProfIdx) 0)
+#define MAP_HASH_KEY(key) prof_hash_addr(key)
+#define MAP_TYPES (ProfAddrMap, prof_addr_map, void const *, ProfIdx)
+#include "hash.h"
+
+#if 1 // BINARY CAPTURE FORMAT
+// NOTE: shared by the mmap'd sample buffers, crash dumps and the tools that read them back (see professor_recover.c)
+// Layout: ProfBinHeader | ProfBinRecord[records_m] | char strings[strings_m] | ProfRecordSmpl[smpls_m]
+// Samples are stored exactly as in memory, so readers must be on the same architecture.
+#define PROF_BIN_MAGIC   "PROFBIN"
+#define PROF_BIN_VERSION 1
+
+typedef struct ProfBinRecord {
+    uint32_t name_offset;     // into strings, ~0 if not stored
+    uint32_t filename_offset; // into strings, ~0 if not stored
+    uint32_t line_num;
+} ProfBinRecord;
+
+typedef struct ProfBinHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    double   freq;
+
+    uint64_t records_offset;
+    ProfIdx  records_n, records_m;
+    uint64_t strings_offset;
+    ProfIdx  strings_n, strings_m;
+    uint64_t smpls_offset;
+    ProfIdx  smpls_n, smpls_m; // smpls_n == 0 if unknown: samples are then read until cycles_start == 0
+    ProfIdx  open_record_smpl_tree_i; // ~0 if unknown; can be found from the last sample with cycles_end == ~0
+    uint32_t fork_gen;
+    uint64_t pid;
+} ProfBinHeader;
+
+// Pointer samples (prof_ptr_alloc/realloc/free), for replaying against other allocators (see professor_replay.c)
+// Layout: ProfBinPtrHeader | ProfBinPtrSmpl[smpls_n]
+#define PROF_BIN_PTR_MAGIC   "PROFPTR"
+#define PROF_BIN_PTR_VERSION 1
+
+typedef struct ProfBinPtrSmpl {
+    uint64_t addr;
+    uint64_t addr_p;   // the old block if realloc'd, else 0
+    uint64_t cycles;
+    uint64_t size;     // 0 if freed
+    uint32_t record_i;
+    uint32_t pad;
+} ProfBinPtrSmpl;
+
+typedef struct ProfBinPtrHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    double   freq;
+    uint64_t smpls_offset;
+    uint64_t smpls_n;
+    uint64_t pid;
+} ProfBinPtrHeader;
+#endif // BINARY CAPTURE FORMAT
+
 typedef struct Prof {
     ProfRecord *records; // dynamic array
     ProfIdx     records_n, records_m;
     // could calculate this from the record tree...
 	/* uint64_t *hits_n__cycles_n; // Parallel with records, Top half hits_n, bottom half cycles_n */
     ProfRecordMap dyn_records_i_map[1]; // maps ProfRecord to index in records (or ~0 if not found)
+    ProfAddrMap   addr_records_i_map[1]; // maps code addresses to index in records (see PROF_ADDR)
 
     ProfRecordSmpl *record_smpl_tree; // dynamic
     ProfIdx         record_smpl_tree_n, record_smpl_tree_m;
     ProfIdx         open_record_smpl_tree_i; // the deepest record that is still open (check if this record is closed to see if all are closed)
+    ProfHitsSmpl   *hits_smpls; // sparse: samples without an entry here had 1 hit. In the order they were closed
+    ProfIdx         hits_smpls_n, hits_smpls_m;
 
     ProfPtrSmpl *ptr_smpls;
     ProfIdx      ptr_smpls_n, ptr_smpls_m;
 
+    ProfCounterSmpl *counter_smpls; // only when a counter's value changes, see prof_counter
+    ProfIdx          counter_smpls_n, counter_smpls_m;
+    ProfCounter     *counters;      // parallel with records, sparse
+    ProfIdx          counters_m;
+
+    struct ProfAsyncSmpl *async_smpls; // ring, see prof_async_init
+    uint64_t              async_smpls_n, async_smpls_m;
+    uint64_t              async_smpls_dumped;
+
     double freq;
 
+    uint64_t pid;      // 0 until prof_process_init
+    uint64_t tid;      // 0 until prof_thread_init
+    uint32_t fork_gen; // how many forks deep this process is, see prof_after_fork
+
+    struct ProfMmap    *mmap;    // if set, record_smpl_tree lives in a file (see PROF_MMAP)
+    struct ProfShm     *shm;     // if set, live stats are published to shared memory (see PROF_SHM)
+    struct ProfPerf    *perf;    // if set, hardware counters are sampled per scope (see PROF_PERF)
+    struct ProfCpu     *cpu;     // if set, CPU time and core are sampled per scope (see PROF_CPU_TIME)
+    struct ProfFrames  *frames;  // if set, only the slowest frames' samples are kept (see PROF_FRAMES)
+    struct ProfTrigger *trigger; // if set, samples go to a ring and slow scopes trigger captures (see PROF_TRIGGER)
+    struct ProfWriter  *writer;  // reused between dumps, see prof_dump_timings_file
+    struct ProfCompact *compact; // if set, samples are kept in 16 bytes until they're dumped (see PROF_COMPACT)
+    struct ProfWait    *wait;    // if set, blocking calls are tagged with what they waited on (see PROF_WAIT)
+    struct ProfStream  *stream;  // if set, flushes go to a collector process (see PROF_STREAM)
+
     // NOTE: this is needed so that different allocators aren't used across dll boundaries
     void *(*reallocate)(void *allocator, void *ptr, size_t size);
     void *allocator;
 } Prof;
 
+#if 1 // PROCESSES
+#if WIN32
+unsigned long __stdcall GetCurrentProcessId(void);
+unsigned long __stdcall GetCurrentThreadId(void);
+# define prof_getpid() GetCurrentProcessId()
+# define prof_gettid() GetCurrentThreadId()
+#else
+# include <unistd.h>
+# include <sys/syscall.h>
+# define prof_getpid() getpid()
+# ifdef SYS_gettid
+#  define prof_gettid() syscall(SYS_gettid)
+# else
+#  define prof_gettid() getpid()
+# endif
+#endif
+
+static inline uint64_t
+prof_thread_id(void)
+{   return (uint64_t)prof_gettid();   }
+
+// like prof_thread_id, for hot paths: gettid is a syscall, so each thread keeps its id after the first call.
+// prof_after_fork clears it, as the forking thread has a new id in the child
+#if WIN32
+# define prof_thread_id_cached() prof_thread_id() // NOTE: already cheap, it's read from the thread block
+#else
+static __thread uint64_t prof_thread_id_cache;
+
+static inline uint64_t
+prof_thread_id_cached(void)
+{
+    if (! prof_thread_id_cache)
+    {   prof_thread_id_cache = prof_thread_id();   }
+    return prof_thread_id_cache;
+}
+#endif
+
+static inline void
+prof_process_init(Prof *prof)
+{   prof->pid = (uint64_t)prof_getpid();   }
+
+// call from the thread that will use prof, so its samples go on that thread's track
+static inline void
+prof_thread_init(Prof *prof)
+{   prof->tid = prof_thread_id();   }
+#endif // PROCESSES
+
 // TODO: preprocessor gate
 #include <stdlib.h>
 static void *
 prof_realloc(void *allocator, void *ptr, size_t size)
 {
     (void)allocator;
+    if (! size) // NOTE: realloc(0, 0) allocates, and realloc(ptr, 0) is implementation-defined
+    {   free(ptr); return 0;   }
     return realloc(ptr, size);
 }
 
@@ -159,492 +334,5024 @@ prof_grow(Prof *prof, void *ptr, ProfIdx *max, size_t elem_size)
     return result;
 }
 
-static inline ProfIdx
-prof_top_record_i(Prof *prof)
+#if 1 // BLOCK COMPRESSION
+// A small LZ77 compressor (LZ4-like sequences: token, literals, 16-bit offset, match length) for the trace dumps,
+// which are mostly the same names and slowly changing numbers. With PROF_COMPRESS, the writer compresses each
+// flush into blocks of at most PROF_LZ_BLOCK_SIZE bytes, each decodable on its own.
+// Layout: ProfLzBlock | data_n bytes, repeated. data_n == raw_n means the block was stored as is.
+// Bytes written to the file around the blocks (e.g. the caller's closing "]") are left as they are, and passed
+// through by prof_lz_decompress_file. The tools read compressed traces directly (see prof_lz_fopen).
+#include <string.h>
+
+#define PROF_LZ_MAGIC        "\x9fPLZ"
+#define PROF_LZ_MIN_MATCH    4
+#define PROF_LZ_LAST_LITERALS 5  // a block always ends with at least this many literals
+#define PROF_LZ_MATCH_LIMIT  12 // no match starts this close to the end
+#define PROF_LZ_HASH_BITS    14
+#define PROF_LZ_BOUND(n)     ((n) + (n) / 255 + 16)
+
+#ifndef  PROF_LZ_BLOCK_SIZE
+# define PROF_LZ_BLOCK_SIZE (1 << 20)
+#endif //PROF_LZ_BLOCK_SIZE
+
+typedef struct ProfLzBlock {
+    char     magic[4];
+    uint32_t raw_n;
+    uint32_t data_n;
+} ProfLzBlock;
+
+static inline uint32_t
+prof_lz_read32(char const *p)
+{   uint32_t result; memcpy(&result, p, sizeof(result)); return result;   }
+
+static inline char *
+prof_lz_put_len(char *dst, size_t len)
 {
-    // TODO: thread id...
-    ProfIdx result = ((prof->record_smpl_tree_n &&
-                       ~prof->open_record_smpl_tree_i)
-                      ? prof->record_smpl_tree[prof->open_record_smpl_tree_i].record_i
-                      : ~(ProfIdx) 0);
-    return result;
+    for (; len >= 255; len -= 255)
+    {   *dst++ = (char)255;   }
+    *dst++ = (char)len;
+    return dst;
 }
 
-static inline ProfIdx
-prof_new_record(Prof *prof, char const *name, char const *filename, uint32_t line_num)
+// dst must have room for PROF_LZ_BOUND(src_n); table for 1 << PROF_LZ_HASH_BITS entries. returns the size written
+static size_t
+prof_lz_compress(char const *src, size_t src_n, char *dst, uint32_t *table)
 {
-    if (prof->records_n == prof->records_m)
-    {   prof->records = (ProfRecord *)prof_grow(prof, prof->records, &prof->records_m, sizeof(*prof->records));   }
+    char  *d      = dst;
+    size_t anchor = 0;
+    size_t src_i  = 0;
+    memset(table, 0, sizeof(*table) << PROF_LZ_HASH_BITS);
 
-    ProfRecord record = {0}; {
-        record.name     = name;
-        record.filename = filename;
-        record.line_num = line_num;
+    while (src_n >= PROF_LZ_MATCH_LIMIT && src_i < src_n - PROF_LZ_MATCH_LIMIT)
+    {
+        uint32_t seq    = prof_lz_read32(src + src_i);
+        uint32_t hash   = (seq * 2654435761u) >> (32 - PROF_LZ_HASH_BITS);
+        size_t   ref_i  = table[hash];
+        table[hash]     = (uint32_t)src_i;
+
+        if (ref_i >= src_i || src_i - ref_i > 0xffff || prof_lz_read32(src + ref_i) != seq)
+        {   src_i += 1 + ((src_i - anchor) >> 6); continue;   } // skip faster through incompressible runs
+
+        size_t match_n = PROF_LZ_MIN_MATCH;
+        while (src_i + match_n < src_n - PROF_LZ_LAST_LITERALS && src[ref_i + match_n] == src[src_i + match_n])
+        {   ++match_n;   }
+
+        size_t literals_n = src_i - anchor;
+        size_t match_x    = match_n - PROF_LZ_MIN_MATCH;
+        *d++ = (char)(((literals_n < 15 ? literals_n : 15) << 4) | (match_x < 15 ? match_x : 15));
+        if (literals_n >= 15) {   d = prof_lz_put_len(d, literals_n - 15);   }
+        memcpy(d, src + anchor, literals_n);
+        d += literals_n;
+        uint16_t offset = (uint16_t)(src_i - ref_i);
+        *d++ = (char)(offset & 0xff);
+        *d++ = (char)(offset >> 8);
+        if (match_x >= 15)    {   d = prof_lz_put_len(d, match_x - 15);      }
+
+        src_i += match_n;
+        anchor = src_i;
+        if (src_i >= 2 && src_i < src_n - PROF_LZ_MATCH_LIMIT) // so the next repeat of what was just matched is found
+        {   table[(prof_lz_read32(src + src_i - 2) * 2654435761u) >> (32 - PROF_LZ_HASH_BITS)] = (uint32_t)(src_i - 2);   }
     }
-    ProfIdx result        = prof->records_n++;
-    prof->records[result] = record;
 
-    return result;
+    size_t literals_n = src_n - anchor;
+    *d++ = (char)((literals_n < 15 ? literals_n : 15) << 4);
+    if (literals_n >= 15) {   d = prof_lz_put_len(d, literals_n - 15);   }
+    memcpy(d, src + anchor, literals_n);
+    d += literals_n;
+    return (size_t)(d - dst);
 }
 
-// checks if there's an existing record. If so, returns that index, otherwise creates a new one and returns the new index
-static inline ProfIdx
-prof_add_dyn_record(Prof *prof, char const *name, char const *filename, uint32_t line_num)
+// returns non-zero if src decoded to exactly dst_n bytes
+static int
+prof_lz_decompress(char const *src, size_t src_n, char *dst, size_t dst_n)
 {
-    ProfRecord record = {0}; {
-        record.name     = name;
-        record.filename = filename;
-        record.line_num = line_num;
+    unsigned char const *s     = (unsigned char const *)src;
+    unsigned char const *s_end = s + src_n;
+    size_t               dst_i = 0;
+    while (s < s_end)
+    {
+        unsigned token      = *s++;
+        size_t   literals_n = token >> 4;
+        if (literals_n == 15)
+        {
+            unsigned byte;
+            do {
+                if (s == s_end) {   return 0;   }
+                byte = *s++; literals_n += byte;
+            } while (byte == 255);
+        }
+        if (literals_n > (size_t)(s_end - s) || literals_n > dst_n - dst_i)
+        {   return 0;   }
+        memcpy(dst + dst_i, s, literals_n);
+        s     += literals_n;
+        dst_i += literals_n;
+        if (s == s_end)
+        {   break;   } // the last sequence is only literals
+
+        if (s_end - s < 2)
+        {   return 0;   }
+        size_t offset  = (size_t)s[0] | ((size_t)s[1] << 8);
+        size_t match_n = (token & 15);
+        s += 2;
+        if (match_n == 15)
+        {
+            unsigned byte;
+            do {
+                if (s == s_end) {   return 0;   }
+                byte = *s++; match_n += byte;
+            } while (byte == 255);
+        }
+        match_n += PROF_LZ_MIN_MATCH;
+        if (! offset || offset > dst_i || match_n > dst_n - dst_i)
+        {   return 0;   }
+
+        char const *ref = dst + dst_i - offset;
+        if (offset >= match_n)
+        {   memcpy(dst + dst_i, ref, match_n);   }
+        else
+        {
+            for (size_t match_i = 0; match_i < match_n; ++match_i) // overlapping: repeats the last offset bytes
+            {   dst[dst_i + match_i] = ref[match_i];   }
+        }
+        dst_i += match_n;
     }
+    return dst_i == dst_n;
+}
 
-    ProfIdx result = prof_record_map_get(prof->dyn_records_i_map, record);
-    if (! ~ result)
+// copies in to out, decompressing the blocks. returns non-zero on success
+static int
+prof_lz_decompress_file(FILE *in, FILE *out)
+{
+    char  *data   = (char *)malloc(PROF_LZ_BOUND(PROF_LZ_BLOCK_SIZE));
+    char  *raw    = (char *)malloc(PROF_LZ_BLOCK_SIZE);
+    size_t data_m = PROF_LZ_BOUND(PROF_LZ_BLOCK_SIZE);
+    size_t raw_m  = PROF_LZ_BLOCK_SIZE;
+    int    result = 1;
+    char   ahead[sizeof(ProfLzBlock)]; // read while looking for a block that wasn't there, so they're looked at again
+    size_t ahead_n = 0, ahead_i = 0;
+    int    c;
+    while (result && (c = (ahead_i < ahead_n ? (unsigned char)ahead[ahead_i++] : getc(in))) != EOF)
     {
-        result = prof_new_record(prof, name, filename, line_num);
-        prof_record_map_insert(prof->dyn_records_i_map, record, result);
-    }
+        if (c != (unsigned char)PROF_LZ_MAGIC[0])
+        {   putc(c, out); continue;   }
+
+        ProfLzBlock block;
+        char       *block_bytes = (char *)&block;
+        size_t      got_n       = 0;
+        block_bytes[0] = (char)c;
+        for (; got_n < sizeof(block) - 1 && ahead_i < ahead_n; ++got_n)
+        {   block_bytes[1 + got_n] = ahead[ahead_i++];   }
+        got_n += fread(block_bytes + 1 + got_n, 1, sizeof(block) - 1 - got_n, in);
+        if (got_n < sizeof(block) - 1 || memcmp(block.magic, PROF_LZ_MAGIC, sizeof(block.magic)))
+        { // not a block after all, but one could start in the bytes after this one
+            putc(c, out);
+            memcpy(ahead, block_bytes + 1, got_n);
+            ahead_n = got_n;
+            ahead_i = 0;
+            continue;
+        }
 
+        if (block.data_n > data_m)
+        {   data_m = block.data_n; data = (char *)realloc(data, data_m);   }
+        if (block.raw_n > raw_m)
+        {   raw_m = block.raw_n; raw = (char *)realloc(raw, raw_m);   }
+        result = (fread(data, 1, block.data_n, in) == block.data_n &&
+                  (block.data_n == block.raw_n
+                   ? (memcpy(raw, data, block.raw_n), 1)
+                   : prof_lz_decompress(data, block.data_n, raw, block.raw_n)) &&
+                  fwrite(raw, 1, block.raw_n, out) == block.raw_n);
+    }
+    free(data);
+    free(raw);
     return result;
 }
 
-static inline void
-prof_start_(Prof *prof, ProfIdx record_i)
+// like fopen(filename, "rb"), but if the file is compressed, returns it decompressed into a temporary file
+static FILE *
+prof_lz_fopen(char const *filename)
 {
-    uint64_t cycles_start = __rdtsc();
-    ProfIdx  parent_i = (~ prof->open_record_smpl_tree_i
-                         ? prof->open_record_smpl_tree_i
-                         : prof->record_smpl_tree_n);
-
-    if (prof->record_smpl_tree_n == prof->record_smpl_tree_m)
-    {   prof->record_smpl_tree = (ProfRecordSmpl *)prof_grow(prof, prof->record_smpl_tree, &prof->record_smpl_tree_m, sizeof(*prof->record_smpl_tree));   }
+    FILE *result = fopen(filename, "rb");
+    char  magic[4];
+    if (result && fread(magic, 1, sizeof(magic), result) == sizeof(magic) &&
+        ! memcmp(magic, PROF_LZ_MAGIC, sizeof(magic)))
+    {
+        FILE *tmp = tmpfile();
+        rewind(result);
+        if (! tmp || ! prof_lz_decompress_file(result, tmp))
+        {
+            fprintf(stderr, "'%s' is corrupt\n", filename);
+            if (tmp) {   fclose(tmp);   }
+            tmp = 0;
+        }
+        fclose(result);
+        result = tmp;
+    }
+    if (result)
+    {   rewind(result);   }
+    return result;
+}
+#endif // BLOCK COMPRESSION
 
-    ProfRecordSmpl record_smpl; {
-        record_smpl.record_i     = record_i;
-        record_smpl.parent_i     = parent_i;
-        record_smpl.cycles_start = cycles_start;
-        record_smpl.cycles_end   = ~(uint64_t) 0;
-    };
+#if 1 // JSON WRITER
+// Buffered output for the trace dumps. Timestamps are formatted from fixed-point integers rather than with
+// printf's %lf, record names are JSON-escaped once and cached, and the buffer goes out in large write()s.
+#include <string.h>
+#if ! WIN32
+# include <unistd.h>
+#endif
 
-    prof->open_record_smpl_tree_i = prof->record_smpl_tree_n++;
-    prof->record_smpl_tree[prof->open_record_smpl_tree_i] = record_smpl;
-}
+#ifndef  PROF_WRITER_BUF_SIZE
+# define PROF_WRITER_BUF_SIZE (1 << 20)
+#endif //PROF_WRITER_BUF_SIZE
 
-static inline void
-prof_mark_(Prof *prof, ProfIdx record_i)
-{
-    uint64_t cycles = __rdtsc();
-    ProfIdx  parent_i = prof->open_record_smpl_tree_i;
+typedef struct ProfWriter {
+    FILE    *out;
+    char    *buf; // PROF_WRITER_BUF_SIZE to start with
+    size_t   buf_n, buf_m; // without an out file, the buffer grows rather than being flushed
+    double   ts_scale;    // cycles to millionths of a ms
+    uint64_t freq_hz;     // 0 if unset, when a cycle is a ms
+    uint64_t events_n;    // written to out, for the commas between them
+    int      is_new_dump; // separate dumps appended to the same file with a blank line
 
-    if (prof->record_smpl_tree_n == prof->record_smpl_tree_m)
-    {   prof->record_smpl_tree = (ProfRecordSmpl *)prof_grow(prof, prof->record_smpl_tree, &prof->record_smpl_tree_m, sizeof(*prof->record_smpl_tree));   }
+    char    *names;        // escaped record names, back to back
+    size_t   names_n, names_m;
+    size_t  *name_offsets; // parallel with records, plus one for the end
+    ProfIdx  name_offsets_m, names_records_n;
+#if PROF_COMPRESS
+    char     *lz_buf;   // a block header and its compressed data
+    uint32_t *lz_table;
+#endif
 
-    ProfRecordSmpl record_smpl; {
-        record_smpl.record_i     = record_i;
-        record_smpl.parent_i     = parent_i;
-        record_smpl.cycles_start = cycles;
-        record_smpl.cycles_end   = cycles;
-    };
+    void *(*reallocate)(void *allocator, void *ptr, size_t size);
+    void *allocator;
+} ProfWriter;
 
-    prof->record_smpl_tree[prof->record_smpl_tree_n++] = record_smpl;
+static inline void
+prof_writer_set_freq(ProfWriter *w, double freq)
+{
+    w->ts_scale = 1000000.0 / (freq != 0.0 ? freq / 1000.0 : 1.0);
+    w->freq_hz  = (freq >= 1.0 ? (uint64_t)(freq + 0.5) : 0);
 }
 
+static void
+prof_writer_init(ProfWriter *w, FILE *out, double freq, void *(*reallocate)(void *, void *, size_t), void *allocator)
+{
+    memset(w, 0, sizeof(*w));
+    w->reallocate = reallocate ? reallocate : prof_realloc;
+    w->allocator  = allocator;
+    w->buf_m      = PROF_WRITER_BUF_SIZE;
+    w->buf        = (char *)w->reallocate(w->allocator, 0, w->buf_m);
+    w->out        = out;
+    prof_writer_set_freq(w, freq);
+}
 
-static inline void
-prof_ptr_realloc_(Prof *prof, ProfIdx record_i, void *addr, void *addr_p, size_t size)
+static void
+prof_writer_write(ProfWriter *w, char const *data, size_t data_n)
 {
-    uint64_t cycles = __rdtsc();
+#if WIN32
+    fwrite(data, 1, data_n, w->out);
+#else
+    int    fd      = fileno(w->out);
+    size_t written = 0;
+    while (written < data_n)
+    {
+        ssize_t result = write(fd, data + written, data_n - written);
+        if (result <= 0)
+        {   break;   } // NOTE: the rest of the dump is lost, like a failed fwrite
+        written += (size_t)result;
+    }
+#endif
+}
 
-    if (prof->ptr_smpls_n == prof->ptr_smpls_m)
-    {   prof->ptr_smpls = (ProfPtrSmpl *)prof_grow(prof, prof->ptr_smpls, &prof->ptr_smpls_m, sizeof(*prof->ptr_smpls));   }
+static void
+prof_writer_flush(ProfWriter *w)
+{
+    if (w->buf_n && w->out)
+    {
+#if ! WIN32
+        fflush(w->out); // anything the caller wrote with stdio goes first
+#endif
+#if PROF_COMPRESS
+        if (! w->lz_buf)
+        {
+            w->lz_buf   = (char *)w->reallocate(w->allocator, 0, sizeof(ProfLzBlock) + PROF_LZ_BOUND(PROF_LZ_BLOCK_SIZE));
+            w->lz_table = (uint32_t *)w->reallocate(w->allocator, 0, sizeof(*w->lz_table) << PROF_LZ_HASH_BITS);
+        }
+        for (size_t raw_i = 0; raw_i < w->buf_n; raw_i += PROF_LZ_BLOCK_SIZE)
+        {
+            size_t raw_n = w->buf_n - raw_i;
+            if (raw_n > PROF_LZ_BLOCK_SIZE)
+            {   raw_n = PROF_LZ_BLOCK_SIZE;   }
 
-    ProfPtrSmpl ptr_smpl = {0}; {
-        ptr_smpl.record_i = record_i;
-        ptr_smpl.addr     = (uintptr_t)addr;
-        ptr_smpl.addr_p   = (uintptr_t)addr_p; // if realloc'd
-        ptr_smpl.cycles   = cycles;
-        ptr_smpl.size     = size;   // if 0, was freed
+            ProfLzBlock block;
+            memcpy(block.magic, PROF_LZ_MAGIC, sizeof(block.magic));
+            block.raw_n  = (uint32_t)raw_n;
+            block.data_n = (uint32_t)prof_lz_compress(w->buf + raw_i, raw_n, w->lz_buf + sizeof(block), w->lz_table);
+            if (block.data_n >= block.raw_n)
+            { // incompressible
+                block.data_n = block.raw_n;
+                memcpy(w->lz_buf + sizeof(block), w->buf + raw_i, raw_n);
+            }
+            memcpy(w->lz_buf, &block, sizeof(block));
+            prof_writer_write(w, w->lz_buf, sizeof(block) + block.data_n);
+        }
+#else
+        prof_writer_write(w, w->buf, w->buf_n);
+#endif
+        w->buf_n = 0;
     }
+}
 
-    prof->ptr_smpls[prof->ptr_smpls_n++] = ptr_smpl;
+static void
+prof_writer_close(ProfWriter *w)
+{
+    prof_writer_flush(w);
+    w->reallocate(w->allocator, w->buf,          0);
+    w->reallocate(w->allocator, w->names,        0);
+    w->reallocate(w->allocator, w->name_offsets, 0);
+#if PROF_COMPRESS
+    w->reallocate(w->allocator, w->lz_buf,       0);
+    w->reallocate(w->allocator, w->lz_table,     0);
+#endif
+    memset(w, 0, sizeof(*w));
 }
 
-#ifdef  PROF_PRINT_SCOPE
-static inline void
-prof_print_scope(Prof const *prof)
+static inline char *
+prof_writer_reserve(ProfWriter *w, size_t n)
 {
-    ProfIdx smpl_i = prof->open_record_smpl_tree_i;
-    if (~smpl_i)
+    if (w->buf_n + n > w->buf_m)
     {
-        ProfRecordSmpl const *smpl_tree = prof->record_smpl_tree;
-        ProfRecord            record    = prof->records[smpl_tree[smpl_i].record_i];
-
-        while (smpl_i != smpl_tree[smpl_i].parent_i)
+        prof_writer_flush(w);
+        if (w->buf_n + n > w->buf_m)
         {
-            fputs("  ", stdout);
-            smpl_i = smpl_tree[smpl_i].parent_i;
+            while (w->buf_n + n > w->buf_m)
+            {   w->buf_m *= 2;   }
+            w->buf = (char *)w->reallocate(w->allocator, w->buf, w->buf_m);
         }
-
-        printf("%s (%s : %u)\n", record.name, record.filename, record.line_num);
     }
+    return w->buf + w->buf_n;
 }
 
-#else //PROF_PRINT_SCOPE
-#define prof_print_scope(...)
-#endif//PROF_PRINT_SCOPE
+static inline void
+prof_writer_put(ProfWriter *w, char const *str, size_t len)
+{
+    memcpy(prof_writer_reserve(w, len), str, len);
+    w->buf_n += len;
+}
 
-#if PROFESSOR_DISABLE
-# define prof_start(prof, name)
-# define prof_mark(prof, name)
-# define prof_ptr_realloc(prof, name, addr, addr_p)
-# define prof_ptr_alloc(prof, name, ptr, size)
-# define prof_ptr_free( prof, name, ptr)
-# define prof_scope(prof, name)
-# define prof_scope_n(prof, name, n)
+#define prof_writer_put_lit(w, lit) prof_writer_put(w, lit, sizeof(lit) - 1)
 
-# define prof_start_fn(prof)
-# define prof_end_n_fn(prof, n)
-# define prof_end_fn(prof)
-# define prof_end_unchecked(...)
-# define prof_end_n(...)
-# define prof_end(...)
+static char const prof_writer_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
 
-#else // PROFESSOR_DISABLE
-# define PROF_CAT1(a,b) a ## b
-# define PROF_CAT2(a,b) PROF_CAT1(a,b)
-# define PROF_CAT(a,b)  PROF_CAT2(a,b)
-# define prof_static_local_record_i_ PROF_CAT(prof_static_local_record_i_, __LINE__)
-# define prof_scope_once PROF_CAT(prof_scope_once, __LINE__)
+static inline void
+prof_writer_put_u64(ProfWriter *w, uint64_t x)
+{
+    char  digits[20];
+    char *digits_end = digits + sizeof(digits);
+    char *digit      = digits_end;
+    for (; x >= 100; x /= 100)
+    {   digit -= 2; memcpy(digit, &prof_writer_digit_pairs[2 * (x % 100)], 2);   }
+    if (x >= 10) {   digit -= 2; memcpy(digit, &prof_writer_digit_pairs[2 * x], 2);   }
+    else         {   *--digit = (char)('0' + x);                                      }
 
-# define PROF_NEW_RECORD(prof, name) \
-    static ProfIdx prof_static_local_record_i_ = ~(ProfIdx) 0; \
-    if (! ~prof_static_local_record_i_) /* TODO: atomic */ \
-    {   prof_static_local_record_i_ = prof_new_record(prof, name, __FILE__, __LINE__);   } \
+    size_t digits_n = (size_t)(digits_end - digit);
+    memcpy(prof_writer_reserve(w, digits_n), digit, digits_n);
+    w->buf_n += digits_n;
+}
 
-# define prof_start(prof, name) \
-    do { \
-        PROF_NEW_RECORD(prof, name) \
-        prof_start_(prof, prof_static_local_record_i_); \
-        prof_print_scope(prof); \
-        /* __itt_task_begin(0, __itt_null, __itt_null, __itt_string_handle_createA(name));\ */ \
-    } while (0)
+// whole + fraction / 1000000, written with 6 decimal places like %lf
+static inline void
+prof_writer_put_fixed6_parts(ProfWriter *w, uint64_t whole, uint32_t fraction)
+{
+    prof_writer_put_u64(w, whole);
+    char *dst = prof_writer_reserve(w, 7);
+    dst[0] = '.';
+    memcpy(dst + 1, &prof_writer_digit_pairs[2 * (fraction / 10000)],      2);
+    memcpy(dst + 3, &prof_writer_digit_pairs[2 * (fraction / 100 % 100)], 2);
+    memcpy(dst + 5, &prof_writer_digit_pairs[2 * (fraction % 100)],        2);
+    w->buf_n += 7;
+}
 
-# define prof_mark(prof, name) \
-    do { \
-        PROF_NEW_RECORD(prof, name) \
-        prof_mark_(prof, prof_static_local_record_i_); \
-        prof_print_scope(prof); \
-    } while (0)
+static inline void
+prof_writer_put_fixed6(ProfWriter *w, uint64_t millionths)
+{   prof_writer_put_fixed6_parts(w, millionths / 1000000, (uint32_t)(millionths % 1000000));   }
 
-# define prof_ptr_realloc(prof, name, addr, addr_p) \
-    do { \
-        PROF_NEW_RECORD(prof, name) \
-        prof_ptr_realloc_(prof, prof_static_local_record_i_, addr, addr_p, size); \
-    } while (0)
+// in the trace's time unit, ms. NOTE: integer math throughout, as raw TSC values times 10^6 don't fit in 64 bits,
+// and a double has too few bits for the fraction
+static inline void
+prof_writer_put_cycles(ProfWriter *w, uint64_t cycles)
+{
+    uint64_t freq_hz = w->freq_hz;
+    if (! freq_hz)
+    {   prof_writer_put_fixed6_parts(w, cycles, 0); return;   }
 
-# define prof_ptr_alloc(prof, name, ptr, size) prof_ptr_realloc(prof, name, addr, 0, size)
-# define prof_ptr_free( prof, name, ptr)       prof_ptr_realloc(prof, name, addr, 0, 0)
+    uint64_t secs    = cycles / freq_hz;
+    uint64_t nanos   = ((cycles % freq_hz) * 1000000000 + freq_hz / 2) / freq_hz; // NOTE: fits for freq < 18 GHz
+    prof_writer_put_fixed6_parts(w, secs * 1000 + nanos / 1000000, (uint32_t)(nanos % 1000000));
+}
 
+// any value with 6 decimal places like %lf, e.g. ms or ratios like IPC
+static inline void
+prof_writer_put_lf(ProfWriter *w, double x)
+{
+    if (x >= 0.0) {   prof_writer_put_fixed6(w, (uint64_t)(x * 1000000.0 + 0.5));   }
+    else          {   prof_writer_put_lit(w, "-"); prof_writer_put_fixed6(w, (uint64_t)(-x * 1000000.0 + 0.5));   }
+}
 
-// NOTE: can't nest without braces
-# define prof_scope(prof, name) prof_scope_n(prof, name, 1)
-# define prof_scope_n(prof, name, n) prof_start(prof, name); \
-    for (int prof_scope_once = 0; prof_scope_once++ == 0; prof_end_n_unchecked(prof, n))
-# define prof_exit_scope continue
+static void
+prof_writer_put_f64(ProfWriter *w, double x)
+{
+    if (x != x || x - x != 0.0) // NaN or infinite, which JSON can't represent
+    {   prof_writer_put_lit(w, "null"); return;   }
+    char *dst = prof_writer_reserve(w, 32);
+    w->buf_n += (size_t)snprintf(dst, 32, "%.17g", x);
+}
+
+// e.g. addresses, which can be too big for a double
+static void
+prof_writer_put_hex(ProfWriter *w, uint64_t x)
+{
+    char *dst = prof_writer_reserve(w, 2 + 16 + 1);
+    w->buf_n += (size_t)snprintf(dst, 2 + 16 + 1, "0x%llx", (unsigned long long)x);
+}
+
+// dst must have room for 6 * str_n; returns the escaped length
+static size_t
+prof_json_escape(char *dst, char const *str, size_t str_n)
+{
+    static char const hex[] = "0123456789abcdef";
+    char *dst_start = dst;
+    for (size_t char_i = 0; char_i < str_n; ++char_i)
+    {
+        unsigned char c = (unsigned char)str[char_i];
+        if (c == '"' || c == '\\') {   *dst++ = '\\'; *dst++ = (char)c;   }
+        else if (c < 0x20)          {   memcpy(dst, "\\u00", 4); dst[4] = hex[c >> 4]; dst[5] = hex[c & 0xF]; dst += 6;   }
+        else                        {   *dst++ = (char)c;   }
+    }
+    return (size_t)(dst - dst_start);
+}
+
+static void
+prof_writer_put_escaped(ProfWriter *w, char const *str)
+{
+    size_t str_n = str ? strlen(str) : 0;
+    char  *dst   = prof_writer_reserve(w, 6 * str_n);
+    w->buf_n += prof_json_escape(dst, str, str_n);
+}
+
+// escapes the names of any records added since the last call into the cache
+static void
+prof_writer_cache_names(ProfWriter *names, Prof const *prof)
+{
+    if (names->names_records_n < prof->records_n || ! names->name_offsets)
+    {
+        while (prof->records_n + 1 > names->name_offsets_m)
+        {
+            names->name_offsets_m = names->name_offsets_m ? names->name_offsets_m * 2 : 64;
+            names->name_offsets   = (size_t *)names->reallocate(names->allocator, names->name_offsets,
+                                                                names->name_offsets_m * sizeof(*names->name_offsets));
+        }
+
+        for (ProfIdx record_i = names->names_records_n; record_i < prof->records_n; ++record_i)
+        {
+            char const *name   = prof->records[record_i].name;
+            size_t      name_n = name ? strlen(name) : 0;
+            if (names->names_n + 6 * name_n > names->names_m || ! names->names)
+            {
+                while (names->names_n + 6 * name_n > names->names_m || ! names->names_m)
+                {   names->names_m = names->names_m ? names->names_m * 2 : 4096;   }
+                names->names = (char *)names->reallocate(names->allocator, names->names, names->names_m);
+            }
+            names->name_offsets[record_i] = names->names_n;
+            names->names_n += prof_json_escape(names->names + names->names_n, name, name_n);
+        }
+        names->name_offsets[prof->records_n] = names->names_n;
+        names->names_records_n               = prof->records_n;
+    }
+}
+
+// for when record names change, e.g. from prof_instrument_symbolize
+static void
+prof_writer_forget_names(ProfWriter *names)
+{   names->names_n = names->names_records_n = 0;   }
+
+// names can be a different writer, as long as it isn't adding to its cache at the same time
+static inline void
+prof_writer_put_cached_name(ProfWriter *w, ProfWriter const *names, ProfIdx record_i)
+{
+    size_t offset = names->name_offsets[record_i];
+    prof_writer_put(w, names->names + offset, names->name_offsets[record_i + 1] - offset);
+}
+
+static inline void
+prof_writer_put_name(ProfWriter *w, Prof const *prof, ProfIdx record_i)
+{
+    if (record_i >= w->names_records_n)
+    {   prof_writer_cache_names(w, prof);   }
+    prof_writer_put_cached_name(w, w, record_i);
+}
+
+// the separator and opening brace for the next event
+static inline void
+prof_writer_event(ProfWriter *w)
+{
+    if (! w->events_n++)          {   prof_writer_put_lit(w, "    {");        }
+    else if (w->is_new_dump)      {   prof_writer_put_lit(w, ",\n\n    {");    }
+    else                          {   prof_writer_put_lit(w, ",\n    {");      }
+    w->is_new_dump = 0;
+}
+
+static inline void
+prof_writer_put_pid_tid(ProfWriter *w, uint64_t pid, uint64_t tid)
+{
+    prof_writer_put_lit(w, "\"pid\": ");
+    prof_writer_put_u64(w, pid);
+    prof_writer_put_lit(w, ", \"tid\": ");
+    prof_writer_put_u64(w, tid);
+}
+#endif // JSON WRITER
+
+#if PROF_MMAP // FILE-BACKED SAMPLES
+// Samples are written straight into a MAP_SHARED file mapping, so they survive the process dying
+// without any syscalls on the hot path. Only growing the buffer touches the file.
+// Read the file back with professor_recover.
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef struct ProfMmap {
+    int            fd;
+    ProfBinHeader *hdr; // start of the mapping
+    size_t         size;
+
+    char const *last_filename; // most records in a row come from the same file
+    uint32_t    last_filename_offset;
+
+    // the allocator being wrapped, used for everything other than the samples
+    void *(*reallocate)(void *allocator, void *ptr, size_t size);
+    void *allocator;
+} ProfMmap;
+
+static inline ProfRecordSmpl *
+prof_mmap_smpls(ProfMmap *mm)
+{   return (ProfRecordSmpl *)((char *)mm->hdr + mm->hdr->smpls_offset);   }
+
+// returns 0 on failure, in which case the old mapping is still valid
+static int
+prof_mmap_resize(ProfMmap *mm, size_t size)
+{
+    if (ftruncate(mm->fd, (off_t)size))
+    {   return 0;   }
+
+    void *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mm->fd, 0);
+    if (base == MAP_FAILED)
+    {   return 0;   }
+
+    if (mm->hdr)
+    {   munmap(mm->hdr, mm->size);   }
+    mm->hdr  = (ProfBinHeader *)base;
+    mm->size = size;
+    return 1;
+}
+
+// installed as prof->reallocate while mapped
+static void *
+prof_mmap_reallocate(void *allocator, void *ptr, size_t size)
+{
+    ProfMmap *mm = (ProfMmap *)allocator;
+    if (! ptr || ptr != prof_mmap_smpls(mm))
+    {   return mm->reallocate(mm->allocator, ptr, size);   }
+
+    if (! prof_mmap_resize(mm, mm->hdr->smpls_offset + size))
+    {   return 0;   }
+    mm->hdr->smpls_m = (ProfIdx)(size / sizeof(ProfRecordSmpl));
+    return prof_mmap_smpls(mm);
+}
+
+// returns the offset of the copied string, or ~0 if there's no room
+static uint32_t
+prof_mmap_add_string(ProfMmap *mm, char const *str)
+{
+    ProfBinHeader *hdr    = mm->hdr;
+    size_t         len    = strlen(str) + 1;
+    uint32_t       result = ~(uint32_t)0;
+    if (hdr->strings_n + len <= hdr->strings_m)
+    {
+        result = hdr->strings_n;
+        memcpy((char *)hdr + hdr->strings_offset + result, str, len);
+        hdr->strings_n += (ProfIdx)len;
+    }
+    return result;
+}
+
+static void
+prof_mmap_add_record(ProfMmap *mm, ProfRecord record, ProfIdx record_i)
+{
+    ProfBinHeader *hdr = mm->hdr;
+    if (record_i < hdr->records_m)
+    {   // records that don't fit are still sampled, just without their names
+        ProfBinRecord bin_record; {
+            bin_record.name_offset = (record.name
+                                      ? prof_mmap_add_string(mm, record.name)
+                                      : ~(uint32_t)0);
+            if (! record.filename)
+            {   bin_record.filename_offset = ~(uint32_t)0;   }
+            else if (record.filename == mm->last_filename)
+            {   bin_record.filename_offset = mm->last_filename_offset;   }
+            else
+            {
+                bin_record.filename_offset = prof_mmap_add_string(mm, record.filename);
+                mm->last_filename          = record.filename;
+                mm->last_filename_offset   = bin_record.filename_offset;
+            }
+            bin_record.line_num = record.line_num;
+        }
+
+        ((ProfBinRecord *)((char *)hdr + hdr->records_offset))[record_i] = bin_record;
+        hdr->records_n = record_i + 1; // only after the record is valid
+    }
+}
+
+// must be called before any samples are taken; records that already exist are copied in.
+// returns non-zero on success
+static int
+prof_mmap_open(Prof *prof, ProfMmap *mm, char const *filename,
+               ProfIdx records_m, ProfIdx strings_m, ProfIdx smpls_m)
+{
+    assert(! prof->record_smpl_tree_n && "mmap mode must be started before taking samples");
+    memset(mm, 0, sizeof(*mm));
+
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+
+    mm->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (mm->fd < 0)
+    {   return 0;   }
+
+    ProfBinHeader hdr; {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, PROF_BIN_MAGIC, sizeof(PROF_BIN_MAGIC));
+        hdr.version        = PROF_BIN_VERSION;
+        hdr.header_size    = sizeof(hdr);
+        hdr.freq           = prof->freq;
+        hdr.records_offset = sizeof(hdr);
+        hdr.records_m      = records_m;
+        hdr.strings_offset = hdr.records_offset + (uint64_t)records_m * sizeof(ProfBinRecord);
+        hdr.strings_m      = strings_m;
+        hdr.smpls_offset   = (hdr.strings_offset + strings_m + 63) & ~(uint64_t)63;
+        hdr.smpls_m        = smpls_m ? smpls_m : 64;
+        hdr.open_record_smpl_tree_i = ~(ProfIdx)0;
+        hdr.pid            = prof->pid;
+        hdr.fork_gen       = prof->fork_gen;
+    }
+
+    if (! prof_mmap_resize(mm, hdr.smpls_offset + (uint64_t)hdr.smpls_m * sizeof(ProfRecordSmpl)))
+    {   close(mm->fd); return 0;   }
+    *mm->hdr = hdr;
+
+    for (ProfIdx record_i = 0; record_i < prof->records_n; ++record_i)
+    {   prof_mmap_add_record(mm, prof->records[record_i], record_i);   }
+
+    if (prof->record_smpl_tree)
+    {   prof->record_smpl_tree = (ProfRecordSmpl *)prof->reallocate(prof->allocator, prof->record_smpl_tree, 0);   }
+
+    mm->reallocate   = prof->reallocate;
+    mm->allocator    = prof->allocator;
+    prof->reallocate = prof_mmap_reallocate;
+    prof->allocator  = mm;
+    prof->mmap       = mm;
+
+    prof->record_smpl_tree   = prof_mmap_smpls(mm);
+    prof->record_smpl_tree_m = mm->hdr->smpls_m;
+    prof->open_record_smpl_tree_i = ~(ProfIdx)0;
+    return 1;
+}
+
+// writes the exact sample count and open scope, then detaches the samples from prof
+static void
+prof_mmap_close(Prof *prof)
+{
+    ProfMmap *mm = prof->mmap;
+    if (mm)
+    {
+        mm->hdr->freq    = prof->freq;
+        mm->hdr->smpls_n = prof->record_smpl_tree_n;
+        mm->hdr->open_record_smpl_tree_i = prof->open_record_smpl_tree_i;
+        msync(mm->hdr, mm->size, MS_SYNC);
+        munmap(mm->hdr, mm->size);
+        close(mm->fd);
+
+        prof->reallocate = mm->reallocate;
+        prof->allocator  = mm->allocator;
+        prof->mmap       = 0;
+        prof->record_smpl_tree   = 0;
+        prof->record_smpl_tree_n = prof->record_smpl_tree_m = 0;
+        prof->open_record_smpl_tree_i = ~(ProfIdx)0;
+        memset(mm, 0, sizeof(*mm));
+    }
+}
+#endif // PROF_MMAP
+
+#if PROF_SHM // LIVE STATS
+// Publishes per-record aggregates and the currently open scopes into POSIX shared memory,
+// for an external viewer (see professor_top.c) to read while the process is running.
+// Each record and the open scope stack are guarded by seqlocks: the writer never waits,
+// readers retry if they see an odd or changed sequence number.
+// Use one segment per Prof, i.e. per thread. May need -lrt on older glibc.
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PROF_SHM_MAGIC   "PROFSHM"
+#define PROF_SHM_VERSION 1
+
+#ifndef  PROF_SHM_OPEN_MAX
+# define PROF_SHM_OPEN_MAX 64
+#endif //PROF_SHM_OPEN_MAX
+#define PROF_SHM_NAME_MAX 64
+
+#ifndef prof_fence_release
+# if defined(__GNUC__)
+#  define prof_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+#  define prof_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+# else
+#  define prof_fence_release() // NOTE: if not defined, readers may see torn values on weakly ordered CPUs
+#  define prof_fence_acquire()
+# endif
+#endif//prof_fence_release
+
+typedef struct ProfShmRecord {
+    volatile uint32_t seq; // odd while being written
+    uint32_t line_num;
+    uint64_t hits_n;
+    uint64_t cycles_n;
+    uint64_t last_cycles_n;
+    char     name[PROF_SHM_NAME_MAX];
+    char     filename[PROF_SHM_NAME_MAX];
+} ProfShmRecord;
+
+typedef struct ProfShmHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    double   freq;
+    uint64_t pid;
+
+    volatile ProfIdx records_n;
+    ProfIdx          records_m;
+
+    volatile uint32_t open_seq; // odd while being written
+    ProfIdx  open_n;            // may be more than PROF_SHM_OPEN_MAX, only that many are stored
+    ProfIdx  open_record_i[PROF_SHM_OPEN_MAX];     // outermost first
+    uint64_t open_cycles_start[PROF_SHM_OPEN_MAX];
+    // ProfShmRecord records[records_m];
+} ProfShmHeader;
+
+typedef struct ProfShm {
+    ProfShmHeader *hdr;
+    ProfShmRecord *records;
+    size_t         size;
+    char           name[256];
+} ProfShm;
+
+static inline void
+prof_shm_write_begin(volatile uint32_t *seq)
+{
+    *seq = *seq + 1;
+    prof_fence_release();
+}
+
+static inline void
+prof_shm_write_end(volatile uint32_t *seq)
+{
+    prof_fence_release();
+    *seq = *seq + 1;
+}
+
+static void
+prof_shm_copy_name(char *dst, char const *src)
+{
+    size_t len = src ? strlen(src) : 0;
+    if (len >= PROF_SHM_NAME_MAX)
+    {   src += len - (PROF_SHM_NAME_MAX - 1); len = PROF_SHM_NAME_MAX - 1;   } // keep the end of long paths
+    if (len)
+    {   memcpy(dst, src, len);   }
+    dst[len] = 0;
+}
+
+static void
+prof_shm_add_record(ProfShm *shm, ProfRecord record, ProfIdx record_i)
+{
+    ProfShmHeader *hdr = shm->hdr;
+    if (record_i < hdr->records_m)
+    {
+        ProfShmRecord *shm_record = &shm->records[record_i];
+        prof_shm_write_begin(&shm_record->seq);
+        prof_shm_copy_name(shm_record->name,     record.name);
+        prof_shm_copy_name(shm_record->filename, record.filename);
+        shm_record->line_num = record.line_num;
+        prof_shm_write_end(&shm_record->seq);
+
+        prof_fence_release();
+        if (record_i >= hdr->records_n)
+        {   hdr->records_n = record_i + 1;   }
+    }
+}
+
+static inline void
+prof_shm_push(ProfShm *shm, ProfIdx record_i, uint64_t cycles_start)
+{
+    ProfShmHeader *hdr = shm->hdr;
+    prof_shm_write_begin(&hdr->open_seq);
+    if (hdr->open_n < PROF_SHM_OPEN_MAX)
+    {
+        hdr->open_record_i[hdr->open_n]     = record_i;
+        hdr->open_cycles_start[hdr->open_n] = cycles_start;
+    }
+    ++hdr->open_n;
+    prof_shm_write_end(&hdr->open_seq);
+}
+
+static inline void
+prof_shm_hit(ProfShm *shm, ProfIdx record_i, uint64_t cycles_n, uint32_t hits_n)
+{
+    if (record_i < shm->hdr->records_m)
+    {
+        ProfShmRecord *shm_record = &shm->records[record_i];
+        prof_shm_write_begin(&shm_record->seq);
+        shm_record->hits_n       += hits_n;
+        shm_record->cycles_n     += cycles_n;
+        shm_record->last_cycles_n = cycles_n;
+        prof_shm_write_end(&shm_record->seq);
+    }
+}
+
+static inline void
+prof_shm_pop(ProfShm *shm, ProfIdx record_i, uint64_t cycles_n, uint32_t hits_n)
+{
+    ProfShmHeader *hdr = shm->hdr;
+    prof_shm_write_begin(&hdr->open_seq);
+    if (hdr->open_n)
+    {   --hdr->open_n;   }
+    prof_shm_write_end(&hdr->open_seq);
+
+    prof_shm_hit(shm, record_i, cycles_n, hits_n);
+}
+
+// name is a shm_open name, e.g. "/professor.1234". Records past records_m aren't published.
+// returns non-zero on success
+static int
+prof_shm_open(Prof *prof, ProfShm *shm, char const *name, ProfIdx records_m)
+{
+    memset(shm, 0, sizeof(*shm));
+    strncpy(shm->name, name, sizeof(shm->name) - 1);
+    records_m = records_m ? records_m : 1024;
+    shm->size = sizeof(ProfShmHeader) + (size_t)records_m * sizeof(ProfShmRecord);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {   return 0;   }
+    void *base = (! ftruncate(fd, (off_t)shm->size)
+                  ? mmap(0, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                  : MAP_FAILED);
+    close(fd);
+    if (base == MAP_FAILED)
+    {   shm_unlink(name); return 0;   }
+
+    shm->hdr     = (ProfShmHeader *)base;
+    shm->records = (ProfShmRecord *)(shm->hdr + 1);
+    memcpy(shm->hdr->magic, PROF_SHM_MAGIC, sizeof(PROF_SHM_MAGIC));
+    shm->hdr->version     = PROF_SHM_VERSION;
+    shm->hdr->header_size = sizeof(ProfShmHeader);
+    shm->hdr->freq        = prof->freq;
+    shm->hdr->pid         = prof->pid;
+    shm->hdr->records_m   = records_m;
+
+    for (ProfIdx record_i = 0; record_i < prof->records_n; ++record_i)
+    {   prof_shm_add_record(shm, prof->records[record_i], record_i);   }
+
+    prof->shm = shm;
+    return 1;
+}
+
+static void
+prof_shm_close(Prof *prof)
+{
+    ProfShm *shm = prof->shm;
+    if (shm)
+    {
+        munmap(shm->hdr, shm->size);
+        shm_unlink(shm->name);
+        prof->shm = 0;
+    }
+}
+#endif // PROF_SHM
+
+#if PROF_PERF // HARDWARE COUNTERS
+// Counts core cycles, instructions, last-level cache misses and branch misses per scope, for the calling thread.
+// Counters are read in user space with rdpmc from each event's mmap'd page (falling back to read() if the
+// kernel doesn't allow rdpmc), and stored parallel with record_smpl_tree: the start values while a scope is open,
+// then the deltas once it's closed. Dumps then report these along with IPC.
+// Open one per Prof (i.e. per thread) from the thread that uses it.
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+typedef enum ProfPerfCounter {
+    PROF_PERF_cycles,
+    PROF_PERF_instructions,
+    PROF_PERF_llc_misses,
+    PROF_PERF_branch_misses,
+    PROF_PERF_COUNTERS_N
+} ProfPerfCounter;
+
+static char const *const prof_perf_counter_names[PROF_PERF_COUNTERS_N] = {
+    "core_cycles", "instructions", "llc_misses", "branch_misses",
+};
+
+typedef struct ProfPerfSmpl {
+    uint64_t counts[PROF_PERF_COUNTERS_N];
+} ProfPerfSmpl;
+
+typedef struct ProfPerf {
+    int                          fds[PROF_PERF_COUNTERS_N];   // -1 if that counter isn't available
+    struct perf_event_mmap_page *pages[PROF_PERF_COUNTERS_N];
+
+    ProfPerfSmpl *smpls; // parallel with record_smpl_tree
+    ProfIdx       smpls_m;
+} ProfPerf;
+
+static inline uint64_t
+prof_perf_read(ProfPerf const *perf, int counter_i)
+{
+    struct perf_event_mmap_page *page = perf->pages[counter_i];
+    uint64_t result = 0;
+    if (page && page->cap_user_rdpmc)
+    { // see the comments on perf_event_mmap_page in linux/perf_event.h
+        uint32_t seq;
+        do {
+            seq = page->lock;
+            __asm__ __volatile__("" ::: "memory");
+            uint32_t idx = page->index;
+            result = page->offset;
+            if (idx)
+            {
+                int64_t pmc = (int64_t)__rdpmc((int)idx - 1);
+                pmc <<= 64 - page->pmc_width; // sign-extend from the counter width
+                pmc >>= 64 - page->pmc_width;
+                result += (uint64_t)pmc;
+            }
+            __asm__ __volatile__("" ::: "memory");
+        } while (page->lock != seq);
+    }
+    else if (perf->fds[counter_i] >= 0)
+    {
+        if (read(perf->fds[counter_i], &result, sizeof(result)) != sizeof(result))
+        {   result = 0;   }
+    }
+    return result;
+}
+
+static inline void
+prof_perf_start(Prof *prof, ProfIdx smpl_i)
+{
+    ProfPerf *perf = prof->perf;
+    while (smpl_i >= perf->smpls_m)
+    {   perf->smpls = (ProfPerfSmpl *)prof_grow(prof, perf->smpls, &perf->smpls_m, sizeof(*perf->smpls));   }
+
+    ProfPerfSmpl *smpl = &perf->smpls[smpl_i];
+    for (int counter_i = 0; counter_i < PROF_PERF_COUNTERS_N; ++counter_i)
+    {   smpl->counts[counter_i] = prof_perf_read(perf, counter_i);   }
+}
+
+static inline void
+prof_perf_end(Prof *prof, ProfIdx smpl_i)
+{
+    ProfPerf     *perf = prof->perf;
+    ProfPerfSmpl *smpl = &perf->smpls[smpl_i];
+    for (int counter_i = PROF_PERF_COUNTERS_N; counter_i-- > 0;)
+    {   smpl->counts[counter_i] = prof_perf_read(perf, counter_i) - smpl->counts[counter_i];   }
+}
+
+// returns the number of counters that could be opened (the rest read as 0); if none, prof is left unchanged
+static int
+prof_perf_open(Prof *prof, ProfPerf *perf)
+{
+    static uint64_t const configs[PROF_PERF_COUNTERS_N] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    memset(perf, 0, sizeof(*perf));
+    int  result    = 0;
+    int  group_fd  = -1;
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (int counter_i = 0; counter_i < PROF_PERF_COUNTERS_N; ++counter_i)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size           = sizeof(attr);
+        attr.type           = PERF_TYPE_HARDWARE;
+        attr.config         = configs[counter_i];
+        attr.disabled       = group_fd < 0; // the whole group is enabled at once below
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+        perf->fds[counter_i] = fd;
+        if (fd >= 0)
+        {
+            void *page = mmap(0, (size_t)page_size, PROT_READ, MAP_SHARED, fd, 0);
+            perf->pages[counter_i] = (page != MAP_FAILED
+                                      ? (struct perf_event_mmap_page *)page
+                                      : 0);
+            if (group_fd < 0)
+            {   group_fd = fd;   }
+            ++result;
+        }
+    }
+
+    if (group_fd >= 0)
+    {
+        ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        prof->perf = perf;
+    }
+    return result;
+}
+
+static void
+prof_perf_close(Prof *prof)
+{
+    ProfPerf *perf = prof->perf;
+    if (perf)
+    {
+        long page_size = sysconf(_SC_PAGESIZE);
+        for (int counter_i = PROF_PERF_COUNTERS_N; counter_i-- > 0;) // group leader last
+        {
+            if (perf->pages[counter_i]) {   munmap(perf->pages[counter_i], (size_t)page_size);   }
+            if (perf->fds[counter_i] >= 0) {   close(perf->fds[counter_i]);   }
+        }
+        perf->smpls = (ProfPerfSmpl *)prof->reallocate(prof->allocator, perf->smpls, 0);
+        perf->smpls_m = 0;
+        prof->perf = 0;
+    }
+}
+#endif // PROF_PERF
+
+#if PROF_CPU_TIME // ON-CPU TIME AND MIGRATIONS
+// Records the thread's CPU time and the core it's running on (from rdtscp's aux value) at the start and end of
+// each scope, parallel with record_smpl_tree. Dumps then split each scope's wall time into on- and off-CPU time
+// and flag those that finished on a different core to the one they started on.
+// NOTE: CLOCK_THREAD_CPUTIME_ID is a syscall rather than a vDSO call on Linux, so this costs ~100s of ns per
+// start/end. Define PROF_THREAD_CPU_NS to use something cheaper if you have it.
+// A scope that migrates and then returns to its original core isn't flagged.
+#include <string.h>
+#include <time.h>
+
+#ifndef PROF_THREAD_CPU_NS
+static inline uint64_t
+prof_thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+# define PROF_THREAD_CPU_NS() prof_thread_cpu_ns()
+#endif//PROF_THREAD_CPU_NS
+
+#ifndef PROF_CPU_ID_FROM_TSC_AUX
+# define PROF_CPU_ID_FROM_TSC_AUX(aux) ((aux) & 0xFFF) // Linux sets TSC_AUX to (node << 12) | cpu
+#endif//PROF_CPU_ID_FROM_TSC_AUX
+
+typedef struct ProfCpuSmpl {
+    uint64_t cpu_ns;    // thread CPU time at the start while open, the CPU time spent in the scope once closed
+    uint16_t cpu_start; // the core the scope started on
+    uint16_t cpu_end;   // the core the scope ended on
+} ProfCpuSmpl;
+
+typedef struct ProfCpu {
+    ProfCpuSmpl *smpls; // parallel with record_smpl_tree
+    ProfIdx      smpls_m;
+} ProfCpu;
+
+static inline void
+prof_cpu_start(Prof *prof, ProfIdx smpl_i)
+{
+    ProfCpu *cpu = prof->cpu;
+    while (smpl_i >= cpu->smpls_m)
+    {   cpu->smpls = (ProfCpuSmpl *)prof_grow(prof, cpu->smpls, &cpu->smpls_m, sizeof(*cpu->smpls));   }
+
+    unsigned int aux;
+    __rdtscp(&aux);
+    ProfCpuSmpl *smpl = &cpu->smpls[smpl_i];
+    smpl->cpu_start   = (uint16_t)PROF_CPU_ID_FROM_TSC_AUX(aux);
+    smpl->cpu_ns      = PROF_THREAD_CPU_NS();
+}
+
+static inline void
+prof_cpu_end(Prof *prof, ProfIdx smpl_i)
+{
+    ProfCpuSmpl *smpl   = &prof->cpu->smpls[smpl_i];
+    uint64_t     cpu_ns = PROF_THREAD_CPU_NS();
+    unsigned int aux;
+    __rdtscp(&aux);
+    smpl->cpu_end = (uint16_t)PROF_CPU_ID_FROM_TSC_AUX(aux);
+    smpl->cpu_ns  = cpu_ns - smpl->cpu_ns;
+}
+
+static void
+prof_cpu_open(Prof *prof, ProfCpu *cpu)
+{
+    memset(cpu, 0, sizeof(*cpu));
+    prof->cpu = cpu;
+}
+
+static void
+prof_cpu_close(Prof *prof)
+{
+    ProfCpu *cpu = prof->cpu;
+    if (cpu)
+    {
+        cpu->smpls   = (ProfCpuSmpl *)prof->reallocate(prof->allocator, cpu->smpls, 0);
+        cpu->smpls_m = 0;
+        prof->cpu    = 0;
+    }
+}
+#endif // PROF_CPU_TIME
+
+#if PROF_TRIGGER // SLOW-SCOPE FLIGHT RECORDER
+// Samples are recorded continuously into a fixed-size ring instead of growing record_smpl_tree (which is
+// emptied whenever no scope is open). When a scope takes longer than its rule's threshold, the ring's last
+// window_ms of samples, plus the next window_ms, are written to "<prefix>_<n>.json" by a background thread.
+//
+// ProfTrigger trigger;
+// prof_trigger_open(prof, &trigger, "slow", 50.0, 1 << 16); // freq must be set first
+// prof_trigger_add(prof, "handle_request", 2000.0);          // fires if handle_request takes > 2000 us
+// ...
+// prof_trigger_close(prof); // writes any capture still waiting for its trailing window
+//
+// NOTE: captures triggered while one is still collecting its trailing window are counted in suppressed_n.
+// Make the ring big enough to hold 2 * window_ms of samples, or the start of the window is lost.
+// Use one per Prof, i.e. per thread. Needs -lpthread.
+#include <string.h>
+#include <pthread.h>
+
+#ifndef  PROF_TRIGGER_RULES_MAX
+# define PROF_TRIGGER_RULES_MAX 16
+#endif //PROF_TRIGGER_RULES_MAX
+#ifndef  PROF_TRIGGER_QUEUE_MAX
+# define PROF_TRIGGER_QUEUE_MAX 4 // captures waiting to be written; more than this are dropped
+#endif //PROF_TRIGGER_QUEUE_MAX
+
+typedef struct ProfTriggerRule {
+    char const *name;   // matched against record names with strcmp
+    uint64_t    cycles; // threshold
+} ProfTriggerRule;
+
+typedef struct ProfTriggerEvent {
+    char const *name; // copied from the record, so the writer never reads prof->records
+    uint64_t    cycles_start, cycles_end;
+} ProfTriggerEvent;
+
+typedef struct ProfTriggerCapture {
+    ProfTriggerEvent *events;
+    size_t            events_n;
+    ProfTriggerEvent  cause;
+    uint64_t          threshold_cycles;
+    uint64_t          capture_i;
+} ProfTriggerCapture;
+
+typedef struct ProfTrigger {
+    ProfTriggerRule rules[PROF_TRIGGER_RULES_MAX];
+    ProfIdx         rules_n;
+    uint64_t       *record_thresholds; // parallel with records, 0 if no rule applies
+    ProfIdx         record_thresholds_m, resolved_records_n;
+
+    ProfTriggerEvent *ring;
+    uint64_t          ring_n, ring_m; // ring_n counts every event ever added, ring_m is a power of 2
+    uint64_t          window_cycles;
+
+    int                pending; // collecting the trailing window for this capture
+    uint64_t           pending_cycles_end;
+    ProfTriggerCapture pending_capture;
+
+    uint64_t captures_n, suppressed_n, dropped_n;
+
+    double   freq;
+    uint64_t pid, tid;
+    char     prefix[256];
+    void *(*reallocate)(void *allocator, void *ptr, size_t size);
+    void    *allocator;
+
+    pthread_t          writer;
+    pthread_mutex_t    mtx;
+    pthread_cond_t     cond;
+    ProfTriggerCapture queue[PROF_TRIGGER_QUEUE_MAX];
+    ProfIdx            queue_head, queue_n;
+    int                quit;
+} ProfTrigger;
+
+static void
+prof_trigger_write_capture(ProfTrigger *trigger, ProfTriggerCapture *capture)
+{
+    char filename[300];
+    snprintf(filename, sizeof(filename), "%s_%llu.json", trigger->prefix, (unsigned long long)capture->capture_i);
+    FILE *out = fopen(filename, "w");
+    if (! out)
+    {   return;   }
+
+    ProfWriter w[1];
+    prof_writer_init(w, out, trigger->freq, trigger->reallocate, trigger->allocator);
+    prof_writer_put_lit(w, "[\n");
+    prof_writer_event(w);
+    prof_writer_put_lit(w, "\"name\":\"trigger: ");
+    prof_writer_put_escaped(w, capture->cause.name);
+    prof_writer_put_lit(w, "\", \"ph\":\"i\", \"s\":\"g\", \"ts\": ");
+    prof_writer_put_cycles(w, capture->cause.cycles_end);
+    prof_writer_put_lit(w, ", ");
+    prof_writer_put_pid_tid(w, trigger->pid, trigger->tid);
+    prof_writer_put_lit(w, ", \"args\": {\"dur_ms\": ");
+    prof_writer_put_cycles(w, capture->cause.cycles_end - capture->cause.cycles_start);
+    prof_writer_put_lit(w, ", \"threshold_ms\": ");
+    prof_writer_put_cycles(w, capture->threshold_cycles);
+    prof_writer_put_lit(w, "}}");
+
+    for (size_t event_i = 0; event_i < capture->events_n; ++event_i)
+    {
+        ProfTriggerEvent event = capture->events[event_i];
+        prof_writer_event(w);
+        prof_writer_put_lit(w, "\"name\":\"");
+        prof_writer_put_escaped(w, event.name);
+        if (event.cycles_start != event.cycles_end)
+        {
+            prof_writer_put_lit(w, "\", \"ph\":\"X\", \"ts\": ");
+            prof_writer_put_cycles(w, event.cycles_start);
+            prof_writer_put_lit(w, ", \"dur\": ");
+            prof_writer_put_cycles(w, event.cycles_end - event.cycles_start);
+        }
+        else
+        {
+            prof_writer_put_lit(w, "\", \"ph\":\"i\", \"ts\": ");
+            prof_writer_put_cycles(w, event.cycles_start);
+        }
+        prof_writer_put_lit(w, ", ");
+        prof_writer_put_pid_tid(w, trigger->pid, trigger->tid);
+        prof_writer_put_lit(w, "}");
+    }
+    prof_writer_put_lit(w, "\n]\n");
+    prof_writer_close(w);
+    fclose(out);
+}
+
+static void *
+prof_trigger_writer(void *arg)
+{
+    ProfTrigger *trigger = (ProfTrigger *)arg;
+    pthread_mutex_lock(&trigger->mtx);
+    for (;;)
+    {
+        while (! trigger->queue_n && ! trigger->quit)
+        {   pthread_cond_wait(&trigger->cond, &trigger->mtx);   }
+        if (! trigger->queue_n)
+        {   break;   } // quitting, and everything has been written
+
+        ProfTriggerCapture capture = trigger->queue[trigger->queue_head];
+        trigger->queue_head = (trigger->queue_head + 1) % PROF_TRIGGER_QUEUE_MAX;
+        --trigger->queue_n;
+
+        pthread_mutex_unlock(&trigger->mtx);
+        prof_trigger_write_capture(trigger, &capture);
+        trigger->reallocate(trigger->allocator, capture.events, 0);
+        pthread_mutex_lock(&trigger->mtx);
+    }
+    pthread_mutex_unlock(&trigger->mtx);
+    return 0;
+}
+
+// copies the ring's events since window_cycles_start and hands them to the writer thread
+static void
+prof_trigger_submit(ProfTrigger *trigger)
+{
+    ProfTriggerCapture capture      = trigger->pending_capture;
+    uint64_t           window_start = capture.cause.cycles_end - trigger->window_cycles;
+    uint64_t           first_i      = (trigger->ring_n > trigger->ring_m
+                                       ? trigger->ring_n - trigger->ring_m
+                                       : 0);
+    uint64_t           event_i      = trigger->ring_n;
+    while (event_i > first_i &&
+           trigger->ring[(event_i - 1) & (trigger->ring_m - 1)].cycles_end >= window_start)
+    {   --event_i;   } // events are in the order they finished
+
+    capture.events_n = (size_t)(trigger->ring_n - event_i);
+    capture.events   = (ProfTriggerEvent *)trigger->reallocate(trigger->allocator, 0, (capture.events_n ? capture.events_n : 1) * sizeof(*capture.events));
+    for (size_t capture_event_i = 0; capture_event_i < capture.events_n; ++capture_event_i)
+    {   capture.events[capture_event_i] = trigger->ring[(event_i + capture_event_i) & (trigger->ring_m - 1)];   }
+
+    pthread_mutex_lock(&trigger->mtx);
+    if (trigger->queue_n < PROF_TRIGGER_QUEUE_MAX)
+    {
+        trigger->queue[(trigger->queue_head + trigger->queue_n++) % PROF_TRIGGER_QUEUE_MAX] = capture;
+        pthread_cond_signal(&trigger->cond);
+        capture.events = 0;
+    }
+    else
+    {   ++trigger->dropped_n;   }
+    pthread_mutex_unlock(&trigger->mtx);
+
+    if (capture.events) // dropped
+    {   trigger->reallocate(trigger->allocator, capture.events, 0);   }
+    trigger->pending = 0;
+}
+
+static void
+prof_trigger_resolve_records(Prof *prof)
+{
+    ProfTrigger *trigger = prof->trigger;
+    while (prof->records_n > trigger->record_thresholds_m)
+    {   trigger->record_thresholds = (uint64_t *)prof_grow(prof, trigger->record_thresholds, &trigger->record_thresholds_m, sizeof(*trigger->record_thresholds));   }
+
+    for (ProfIdx record_i = trigger->resolved_records_n; record_i < prof->records_n; ++record_i)
+    {
+        trigger->record_thresholds[record_i] = 0;
+        char const *name = prof->records[record_i].name;
+        for (ProfIdx rule_i = 0; name && rule_i < trigger->rules_n; ++rule_i)
+        {
+            if (! strcmp(name, trigger->rules[rule_i].name))
+            {   trigger->record_thresholds[record_i] = trigger->rules[rule_i].cycles; break;   }
+        }
+    }
+    trigger->resolved_records_n = prof->records_n;
+}
+
+// called for every closed scope and mark
+static inline void
+prof_trigger_smpl(Prof *prof, ProfRecordSmpl smpl)
+{
+    ProfTrigger     *trigger = prof->trigger;
+    ProfTriggerEvent event; {
+        event.name         = prof->records[smpl.record_i].name;
+        event.cycles_start = smpl.cycles_start;
+        event.cycles_end   = smpl.cycles_end;
+    }
+    trigger->ring[trigger->ring_n++ & (trigger->ring_m - 1)] = event;
+
+    if (trigger->pending && smpl.cycles_end >= trigger->pending_cycles_end)
+    {   prof_trigger_submit(trigger);   }
+
+    if (smpl.record_i >= trigger->resolved_records_n)
+    {   prof_trigger_resolve_records(prof);   }
+
+    uint64_t threshold = trigger->record_thresholds[smpl.record_i];
+    if (threshold && smpl.cycles_end - smpl.cycles_start > threshold)
+    {
+        if (trigger->pending)
+        {   ++trigger->suppressed_n;   }
+        else
+        {
+            trigger->pending            = 1;
+            trigger->pending_cycles_end = smpl.cycles_end + trigger->window_cycles;
+            memset(&trigger->pending_capture, 0, sizeof(trigger->pending_capture));
+            trigger->pending_capture.cause            = event;
+            trigger->pending_capture.threshold_cycles = threshold;
+            trigger->pending_capture.capture_i        = trigger->captures_n++;
+        }
+    }
+}
+
+// rules can be added at any time; threshold_us is exclusive
+static void
+prof_trigger_add(Prof *prof, char const *name, double threshold_us)
+{
+    ProfTrigger *trigger = prof->trigger;
+    assert(trigger->rules_n < PROF_TRIGGER_RULES_MAX && "too many trigger rules, increase PROF_TRIGGER_RULES_MAX");
+    ProfTriggerRule *rule = &trigger->rules[trigger->rules_n++];
+    rule->name   = name;
+    rule->cycles = (uint64_t)(threshold_us * trigger->freq / 1000000.0);
+    if (! rule->cycles)
+    {   rule->cycles = 1;   }
+    trigger->resolved_records_n = 0; // re-match every record
+}
+
+// ring_m is rounded up to a power of 2
+static int
+prof_trigger_open(Prof *prof, ProfTrigger *trigger, char const *prefix, double window_ms, uint64_t ring_m)
+{
+    assert(prof->freq != 0.0 && "set prof->freq before opening a trigger so thresholds can be converted to cycles");
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+
+    memset(trigger, 0, sizeof(*trigger));
+    uint64_t m = ring_m ? ring_m : 1 << 16;
+    --m, m|=m>>1, m|=m>>2, m|=m>>4, m|=m>>8, m|=m>>16, m|=m>>32, ++m; // ceiling pow 2
+
+    trigger->ring          = (ProfTriggerEvent *)prof->reallocate(prof->allocator, 0, m * sizeof(*trigger->ring));
+    trigger->ring_m        = m;
+    trigger->window_cycles = (uint64_t)(window_ms * prof->freq / 1000.0);
+    trigger->freq          = prof->freq;
+    trigger->pid           = prof->pid;
+    trigger->tid           = prof->tid;
+    trigger->reallocate    = prof->reallocate;
+    trigger->allocator     = prof->allocator;
+    snprintf(trigger->prefix, sizeof(trigger->prefix), "%s", prefix);
+
+    pthread_mutex_init(&trigger->mtx, 0);
+    pthread_cond_init(&trigger->cond, 0);
+    int result = ! pthread_create(&trigger->writer, 0, prof_trigger_writer, trigger);
+    if (result)
+    {   prof->trigger = trigger;   }
+    else
+    {
+        pthread_cond_destroy(&trigger->cond);
+        pthread_mutex_destroy(&trigger->mtx);
+        prof->reallocate(prof->allocator, trigger->ring, 0);
+        trigger->ring = 0;
+    }
+    return result;
+}
+
+static void
+prof_trigger_close(Prof *prof)
+{
+    ProfTrigger *trigger = prof->trigger;
+    if (trigger)
+    {
+        if (trigger->pending) // cut the trailing window short
+        {   prof_trigger_submit(trigger);   }
+
+        pthread_mutex_lock(&trigger->mtx);
+        trigger->quit = 1;
+        pthread_cond_signal(&trigger->cond);
+        pthread_mutex_unlock(&trigger->mtx);
+        pthread_join(trigger->writer, 0);
+        pthread_cond_destroy(&trigger->cond);
+        pthread_mutex_destroy(&trigger->mtx);
+
+        prof->reallocate(prof->allocator, trigger->ring, 0);
+        prof->reallocate(prof->allocator, trigger->record_thresholds, 0);
+        trigger->ring              = 0;
+        trigger->record_thresholds = 0;
+        prof->trigger              = 0;
+    }
+}
+#endif // PROF_TRIGGER
+
+#if PROF_COMPACT // COMPACT SAMPLES
+// Samples take 16 bytes rather than 24: starts are 32-bit offsets from their block's base, and durations
+// are 32 bits. Blocks are struct-of-arrays, and marks go to a separate stream as they have no duration.
+// prof->record_smpl_tree is only filled in when dumping (see prof_compact_expand).
+// Sample indices (open_record_smpl_tree_i, parent_i, hits) are block_i * PROF_COMPACT_BLOCK_N + slot.
+// NOTE: can't be used with PROF_MMAP, PROF_PERF, PROF_CPU_TIME, PROF_FRAMES or PROF_TRIGGER, which all
+// read record_smpl_tree while sampling. PROF_SIGNAL captures won't have the compact samples.
+#include <string.h>
+
+#ifndef  PROF_COMPACT_BLOCK_N
+# define PROF_COMPACT_BLOCK_N 1024
+#endif //PROF_COMPACT_BLOCK_N
+
+#define PROF_COMPACT_DUR_OPEN (~(uint32_t)0)
+#define PROF_COMPACT_DUR_LONG (~(uint32_t)0 - 1) // the real duration is in longs
+
+typedef struct ProfCompactBlock {
+    uint64_t cycles_base;
+    ProfIdx  smpls_n;
+    ProfIdx  record_i[PROF_COMPACT_BLOCK_N];
+    ProfIdx  parent_i[PROF_COMPACT_BLOCK_N];
+    uint32_t start_d [PROF_COMPACT_BLOCK_N]; // cycles_start - cycles_base
+    uint32_t dur     [PROF_COMPACT_BLOCK_N]; // cycles_end - cycles_start, or PROF_COMPACT_DUR_*
+} ProfCompactBlock;
+
+typedef struct ProfCompactMark {
+    uint64_t cycles;
+    ProfIdx  record_i;
+    ProfIdx  parent_i; // a compact sample index, or ~0
+} ProfCompactMark;
+
+typedef struct ProfCompactLong {
+    ProfIdx  smpl_i;
+    uint64_t cycles_n;
+} ProfCompactLong;
+
+typedef struct ProfCompact {
+    ProfCompactBlock **blocks; // kept allocated between dumps
+    ProfIdx            blocks_n, blocks_m, blocks_allocated_n;
+    ProfCompactBlock  *block;  // the one being filled, blocks[blocks_n - 1]
+
+    ProfCompactMark *marks;
+    ProfIdx          marks_n, marks_m;
+    ProfCompactLong *longs;      // durations that don't fit in 32 bits, in the order they were closed
+    ProfIdx          longs_n, longs_m;
+    ProfHitsSmpl    *hits_smpls; // with compact indices; prof->hits_smpls is made from these
+    ProfIdx          hits_smpls_n, hits_smpls_m;
+
+    ProfIdx *tree_i; // compact index to record_smpl_tree index, while expanding
+    ProfIdx  tree_i_m;
+} ProfCompact;
+
+static void
+prof_compact_open(Prof *prof, ProfCompact *compact)
+{
+    assert(! prof->record_smpl_tree_n && "compact mode must be started before taking samples");
+    assert(! prof->mmap && ! prof->perf && ! prof->cpu && ! prof->frames && ! prof->trigger &&
+           "these modes read record_smpl_tree while sampling");
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+
+    memset(compact, 0, sizeof(*compact));
+    prof->compact                 = compact;
+    prof->open_record_smpl_tree_i = ~(ProfIdx)0;
+}
+
+static void
+prof_compact_close(Prof *prof)
+{
+    ProfCompact *compact = prof->compact;
+    if (compact)
+    {
+        for (ProfIdx block_i = 0; block_i < compact->blocks_allocated_n; ++block_i)
+        {   prof->reallocate(prof->allocator, compact->blocks[block_i], 0);   }
+        prof->reallocate(prof->allocator, compact->blocks,     0);
+        prof->reallocate(prof->allocator, compact->marks,      0);
+        prof->reallocate(prof->allocator, compact->longs,      0);
+        prof->reallocate(prof->allocator, compact->hits_smpls, 0);
+        prof->reallocate(prof->allocator, compact->tree_i,     0);
+        memset(compact, 0, sizeof(*compact));
+        prof->compact = 0;
+    }
+}
+
+static ProfCompactBlock *
+prof_compact_new_block(Prof *prof, ProfCompact *compact, uint64_t cycles_base)
+{
+    if (compact->blocks_n == compact->blocks_allocated_n)
+    {
+        if (compact->blocks_allocated_n == compact->blocks_m)
+        {   compact->blocks = (ProfCompactBlock **)prof_grow(prof, compact->blocks, &compact->blocks_m, sizeof(*compact->blocks));   }
+        compact->blocks[compact->blocks_allocated_n++] = (ProfCompactBlock *)prof->reallocate(prof->allocator, 0, sizeof(ProfCompactBlock));
+    }
+
+    ProfCompactBlock *block = compact->blocks[compact->blocks_n++];
+    block->cycles_base = cycles_base;
+    block->smpls_n     = 0;
+    compact->block     = block;
+    return block;
+}
+
+static inline void
+prof_compact_start(Prof *prof, ProfIdx record_i, uint64_t cycles_start)
+{
+    ProfCompact      *compact = prof->compact;
+    ProfCompactBlock *block   = compact->block;
+    if (! compact->blocks_n ||
+        block->smpls_n == PROF_COMPACT_BLOCK_N ||
+        cycles_start - block->cycles_base > ~(uint32_t)0)
+    {   block = prof_compact_new_block(prof, compact, cycles_start);   }
+
+    ProfIdx slot     = block->smpls_n++;
+    ProfIdx smpl_i   = (compact->blocks_n - 1) * PROF_COMPACT_BLOCK_N + slot;
+    ProfIdx parent_i = prof->open_record_smpl_tree_i;
+    block->record_i[slot] = record_i;
+    block->parent_i[slot] = ~parent_i ? parent_i : smpl_i;
+    block->start_d[slot]  = (uint32_t)(cycles_start - block->cycles_base);
+    block->dur[slot]      = PROF_COMPACT_DUR_OPEN;
+    prof->open_record_smpl_tree_i = smpl_i;
+
+#if PROF_SHM
+    if (prof->shm)
+    {   prof_shm_push(prof->shm, record_i, cycles_start);   }
+#endif
+}
+
+static inline ProfIdx
+prof_compact_end(Prof *prof, uint32_t hits_n, uint64_t cycles_end)
+{
+    ProfCompact      *compact = prof->compact;
+    ProfIdx           smpl_i  = prof->open_record_smpl_tree_i;
+    assert(~smpl_i && "no open prof records - you've already closed them all. Mismatched start and end records?");
+
+    ProfCompactBlock *block    = compact->blocks[smpl_i / PROF_COMPACT_BLOCK_N];
+    ProfIdx           slot     = smpl_i % PROF_COMPACT_BLOCK_N;
+    uint64_t          cycles_n = cycles_end - (block->cycles_base + block->start_d[slot]);
+    if (cycles_n < PROF_COMPACT_DUR_LONG)
+    {   block->dur[slot] = (uint32_t)cycles_n;   }
+    else
+    {
+        block->dur[slot] = PROF_COMPACT_DUR_LONG;
+        if (compact->longs_n == compact->longs_m)
+        {   compact->longs = (ProfCompactLong *)prof_grow(prof, compact->longs, &compact->longs_m, sizeof(*compact->longs));   }
+        compact->longs[compact->longs_n].smpl_i   = smpl_i;
+        compact->longs[compact->longs_n].cycles_n = cycles_n;
+        ++compact->longs_n;
+    }
+
+    if (hits_n != 1)
+    {
+        if (compact->hits_smpls_n == compact->hits_smpls_m)
+        {   compact->hits_smpls = (ProfHitsSmpl *)prof_grow(prof, compact->hits_smpls, &compact->hits_smpls_m, sizeof(*compact->hits_smpls));   }
+        compact->hits_smpls[compact->hits_smpls_n].smpl_i = smpl_i;
+        compact->hits_smpls[compact->hits_smpls_n].hits_n = hits_n;
+        ++compact->hits_smpls_n;
+    }
+
+    ProfIdx record_i = block->record_i[slot];
+    ProfIdx parent_i = block->parent_i[slot];
+    prof->open_record_smpl_tree_i = (parent_i != smpl_i
+                                     ? parent_i
+                                     : ~(ProfIdx)0);
+
+#if PROF_SHM
+    if (prof->shm)
+    {   prof_shm_pop(prof->shm, record_i, cycles_n, hits_n);   }
+#endif
+    return record_i;
+}
+
+static inline void
+prof_compact_mark(Prof *prof, ProfIdx record_i, uint64_t cycles)
+{
+    ProfCompact *compact = prof->compact;
+    if (compact->marks_n == compact->marks_m)
+    {   compact->marks = (ProfCompactMark *)prof_grow(prof, compact->marks, &compact->marks_m, sizeof(*compact->marks));   }
+
+    ProfCompactMark *mark = &compact->marks[compact->marks_n++];
+    mark->cycles   = cycles;
+    mark->record_i = record_i;
+    mark->parent_i = prof->open_record_smpl_tree_i;
+
+#if PROF_SHM
+    if (prof->shm)
+    {   prof_shm_hit(prof->shm, record_i, 0, 1);   }
+#endif
+}
+
+static int
+prof_compact_long_cmp(void const *a, void const *b)
+{
+    ProfIdx a_smpl_i = ((ProfCompactLong const *)a)->smpl_i;
+    ProfIdx b_smpl_i = ((ProfCompactLong const *)b)->smpl_i;
+    return (a_smpl_i > b_smpl_i) - (a_smpl_i < b_smpl_i);
+}
+
+// fills in record_smpl_tree and hits_smpls from the compact samples, merging the marks back in by time.
+// Doesn't change the compact samples, so can be called more than once before prof_compact_reset
+static void
+prof_compact_expand(Prof *prof)
+{
+    ProfCompact *compact = prof->compact;
+    ProfIdx      smpls_n = compact->marks_n;
+    for (ProfIdx block_i = 0; block_i < compact->blocks_n; ++block_i)
+    {   smpls_n += compact->blocks[block_i]->smpls_n;   }
+
+    while (prof->record_smpl_tree_m < smpls_n)
+    {   prof->record_smpl_tree = (ProfRecordSmpl *)prof_grow(prof, prof->record_smpl_tree, &prof->record_smpl_tree_m, sizeof(*prof->record_smpl_tree));   }
+    while (compact->tree_i_m < compact->blocks_n * PROF_COMPACT_BLOCK_N)
+    {   compact->tree_i = (ProfIdx *)prof_grow(prof, compact->tree_i, &compact->tree_i_m, sizeof(*compact->tree_i));   }
+    while (prof->hits_smpls_m < compact->hits_smpls_n)
+    {   prof->hits_smpls = (ProfHitsSmpl *)prof_grow(prof, prof->hits_smpls, &prof->hits_smpls_m, sizeof(*prof->hits_smpls));   }
+
+    ProfRecordSmpl *tree   = prof->record_smpl_tree;
+    ProfIdx        *tree_i = compact->tree_i;
+    ProfIdx         tree_n = 0;
+    ProfIdx         mark_i = 0;
+    ProfIdx         long_i = 0;
+    if (compact->longs_n) // NOTE: longs is null until a gap doesn't fit in 32 bits
+    {   qsort(compact->longs, compact->longs_n, sizeof(*compact->longs), prof_compact_long_cmp);   } // from closing to sample order
+    for (ProfIdx block_i = 0; block_i < compact->blocks_n; ++block_i)
+    {
+        ProfCompactBlock const *block = compact->blocks[block_i];
+        for (ProfIdx slot = 0; slot < block->smpls_n; ++slot)
+        {
+            ProfIdx  smpl_i       = block_i * PROF_COMPACT_BLOCK_N + slot;
+            uint64_t cycles_start = block->cycles_base + block->start_d[slot];
+            for (; mark_i < compact->marks_n; ++mark_i)
+            { // marks from before this sample; with the same cycles, those whose parent is older
+                ProfCompactMark mark = compact->marks[mark_i];
+                if (mark.cycles > cycles_start ||
+                    (mark.cycles == cycles_start && ~mark.parent_i && mark.parent_i >= smpl_i))
+                {   break;   }
+
+                tree[tree_n].record_i     = mark.record_i;
+                tree[tree_n].parent_i     = ~mark.parent_i ? tree_i[mark.parent_i] : ~(ProfIdx)0;
+                tree[tree_n].cycles_start = tree[tree_n].cycles_end = mark.cycles;
+                ++tree_n;
+            }
+
+            uint64_t cycles_end = ~(uint64_t)0;
+            if (block->dur[slot] == PROF_COMPACT_DUR_LONG)
+            {
+                while (compact->longs[long_i].smpl_i != smpl_i)
+                {   ++long_i;   }
+                cycles_end = cycles_start + compact->longs[long_i].cycles_n;
+            }
+            else if (block->dur[slot] != PROF_COMPACT_DUR_OPEN)
+            {   cycles_end = cycles_start + block->dur[slot];   }
+
+            tree_i[smpl_i] = tree_n;
+            tree[tree_n].record_i     = block->record_i[slot];
+            tree[tree_n].parent_i     = tree_i[block->parent_i[slot]]; // parents come first, or are this one
+            tree[tree_n].cycles_start = cycles_start;
+            tree[tree_n].cycles_end   = cycles_end;
+            ++tree_n;
+        }
+    }
+    for (; mark_i < compact->marks_n; ++mark_i)
+    {
+        ProfCompactMark mark = compact->marks[mark_i];
+        tree[tree_n].record_i     = mark.record_i;
+        tree[tree_n].parent_i     = ~mark.parent_i ? tree_i[mark.parent_i] : ~(ProfIdx)0;
+        tree[tree_n].cycles_start = tree[tree_n].cycles_end = mark.cycles;
+        ++tree_n;
+    }
+    prof->record_smpl_tree_n = tree_n;
+
+    for (ProfIdx hits_smpl_i = 0; hits_smpl_i < compact->hits_smpls_n; ++hits_smpl_i)
+    {
+        prof->hits_smpls[hits_smpl_i].smpl_i = tree_i[compact->hits_smpls[hits_smpl_i].smpl_i];
+        prof->hits_smpls[hits_smpl_i].hits_n = compact->hits_smpls[hits_smpl_i].hits_n;
+    }
+    prof->hits_smpls_n = compact->hits_smpls_n;
+}
+
+// once the expanded samples have been dumped
+static void
+prof_compact_reset(Prof *prof)
+{
+    ProfCompact *compact = prof->compact;
+    compact->blocks_n = compact->marks_n = compact->longs_n = compact->hits_smpls_n = 0;
+    compact->block    = 0;
+}
+#endif // PROF_COMPACT
+
+// a sample index as it was while sampling (e.g. an open_record_smpl_tree_i kept in a side array), to its
+// record_smpl_tree index once expanded if compact. Compact order is sample order, so sorted indices stay sorted
+static inline ProfIdx
+prof_smpl_tree_i(Prof const *prof, ProfIdx smpl_i)
+{
+#if PROF_COMPACT
+    if (prof->compact && ~smpl_i)
+    {   return prof->compact->tree_i[smpl_i];   }
+#endif
+    (void)prof;
+    return smpl_i;
+}
+
+#if PROF_WAIT // BLOCKING CALLS
+// Time spent blocked on locks, condition variables, I/O and futexes, as spans under whatever scope is open.
+// Use the wrappers (prof_mutex_lock, prof_read... see BLOCKING CALL WRAPPERS) in place of the calls themselves.
+// Each call site is its own record, and each wait is tagged with what it waited on (the lock's address, the fd...)
+// in a sparse side array, so traces show it per wait and prof_dump_aggregate_file adds a table of the time waited
+// on each, split by call site: the serialization points.
+// Mutexes are tried first, and only sampled if that fails: uncontended locking isn't a wait.
+// NOTE: can't be used with PROF_FRAMES or PROF_TRIGGER, which drop samples while sampling
+#include <string.h>
+#include <stdlib.h>
+
+typedef enum ProfWaitKind {
+    PROF_WAIT_lock,
+    PROF_WAIT_cond,
+    PROF_WAIT_fd,
+    PROF_WAIT_futex,
+    PROF_WAIT_KINDS_N
+} ProfWaitKind;
+
+static char const *const prof_wait_kind_names[PROF_WAIT_KINDS_N] = {
+    "lock", "cond", "fd", "futex",
+};
+
+typedef struct ProfWaitSmpl {
+    ProfIdx   smpl_i; // as sampled, i.e. a compact index with PROF_COMPACT
+    uint32_t  kind;   // ProfWaitKind
+    uintptr_t obj;    // the lock, cond or futex address, or the fd
+} ProfWaitSmpl;
+
+typedef struct ProfWait {
+    ProfWaitSmpl *smpls; // in sample order
+    ProfIdx       smpls_n, smpls_m;
+} ProfWait;
+
+static void
+prof_wait_open(Prof *prof, ProfWait *wait)
+{
+    assert(! prof->frames && ! prof->trigger && "these modes drop samples while sampling");
+    memset(wait, 0, sizeof(*wait));
+    prof->wait = wait;
+}
+
+static void
+prof_wait_close(Prof *prof)
+{
+    ProfWait *wait = prof->wait;
+    if (wait)
+    {
+        if (wait->smpls)
+        {   prof->reallocate(prof->allocator, wait->smpls, 0);   }
+        memset(wait, 0, sizeof(*wait));
+        prof->wait = 0;
+    }
+}
+
+// tags the scope that was just started
+static inline void
+prof_wait_tag(Prof *prof, ProfWaitKind kind, uintptr_t obj)
+{
+    ProfWait *wait = prof->wait;
+    if (wait)
+    {
+        if (wait->smpls_n == wait->smpls_m)
+        {   wait->smpls = (ProfWaitSmpl *)prof_grow(prof, wait->smpls, &wait->smpls_m, sizeof(*wait->smpls));   }
+        ProfWaitSmpl wait_smpl; {
+            wait_smpl.smpl_i = prof->open_record_smpl_tree_i;
+            wait_smpl.kind   = kind;
+            wait_smpl.obj    = obj;
+        }
+        wait->smpls[wait->smpls_n++] = wait_smpl;
+    }
+}
+
+static inline ProfIdx
+prof_wait_tree_i(Prof const *prof, ProfIdx wait_smpl_i)
+{   return prof_smpl_tree_i(prof, prof->wait->smpls[wait_smpl_i].smpl_i);   }
+
+// 0 if the sample wasn't a wait
+static ProfWaitSmpl const *
+prof_wait_find(Prof const *prof, ProfIdx smpl_i)
+{
+    ProfIdx lo = 0, hi = prof->wait->smpls_n;
+    while (lo < hi)
+    {
+        ProfIdx mid = lo + (hi - lo) / 2;
+        if (prof_wait_tree_i(prof, mid) < smpl_i) {   lo = mid + 1;   }
+        else                                       {   hi = mid;       }
+    }
+    return (lo < prof->wait->smpls_n && prof_wait_tree_i(prof, lo) == smpl_i
+            ? &prof->wait->smpls[lo]
+            : 0);
+}
+
+typedef struct ProfWaitAgg {
+    uint32_t  kind;
+    uintptr_t obj;
+    ProfIdx   record_i;         // the call site, for per-site aggregates
+    ProfIdx   sites_i, sites_n; // for per-object aggregates
+    uint64_t  waits_n, cycles_n, cycles_max;
+} ProfWaitAgg;
+
+static int
+prof_wait_agg_cmp_obj(void const *a, void const *b)
+{
+    ProfWaitAgg const *a_agg = (ProfWaitAgg const *)a;
+    ProfWaitAgg const *b_agg = (ProfWaitAgg const *)b;
+    if (a_agg->kind != b_agg->kind) {   return (a_agg->kind > b_agg->kind) - (a_agg->kind < b_agg->kind);   }
+    if (a_agg->obj  != b_agg->obj)  {   return (a_agg->obj  > b_agg->obj)  - (a_agg->obj  < b_agg->obj);    }
+    return (a_agg->record_i > b_agg->record_i) - (a_agg->record_i < b_agg->record_i);
+}
+
+static int
+prof_wait_agg_cmp_cycles(void const *a, void const *b)
+{
+    uint64_t a_cycles = ((ProfWaitAgg const *)a)->cycles_n;
+    uint64_t b_cycles = ((ProfWaitAgg const *)b)->cycles_n;
+    return (a_cycles < b_cycles) - (a_cycles > b_cycles);
+}
+
+// what was waited on the most, and from where. Needs record_smpl_tree to be expanded if compact
+static void
+prof_wait_dump_contention(FILE *out, Prof *prof)
+{
+    ProfWait    *wait      = prof->wait;
+    double       ms        = (prof->freq != 0.0
+                              ? prof->freq / 1000.0
+                              : 1.0);
+    double       us        = ms / 1000.0;
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+    size_t       aggs_size = (wait->smpls_n ? wait->smpls_n : 1) * sizeof(ProfWaitAgg);
+    ProfWaitAgg *sites     = (ProfWaitAgg *)prof->reallocate(prof->allocator, 0, aggs_size);
+    ProfWaitAgg *objs      = (ProfWaitAgg *)prof->reallocate(prof->allocator, 0, aggs_size);
+    ProfIdx      sites_n   = 0, objs_n = 0;
+
+    for (ProfIdx wait_smpl_i = 0; wait_smpl_i < wait->smpls_n; ++wait_smpl_i)
+    {
+        ProfIdx tree_i = prof_wait_tree_i(prof, wait_smpl_i);
+        if (tree_i >= prof->record_smpl_tree_n || ! ~prof->record_smpl_tree[tree_i].cycles_end)
+        {   continue;   } // still waiting
+
+        ProfRecordSmpl smpl = prof->record_smpl_tree[tree_i];
+        ProfWaitAgg    site;
+        memset(&site, 0, sizeof(site)); {
+            site.kind       = wait->smpls[wait_smpl_i].kind;
+            site.obj        = wait->smpls[wait_smpl_i].obj;
+            site.record_i   = smpl.record_i;
+            site.waits_n    = 1;
+            site.cycles_n   = smpl.cycles_end - smpl.cycles_start;
+            site.cycles_max = site.cycles_n;
+        }
+        sites[sites_n++] = site;
+    }
+
+    // merge into one per object and call site, then total those per object
+    qsort(sites, sites_n, sizeof(*sites), prof_wait_agg_cmp_obj);
+    ProfIdx merged_n = 0;
+    for (ProfIdx site_i = 0; site_i < sites_n; ++site_i)
+    {
+        if (merged_n && ! prof_wait_agg_cmp_obj(&sites[merged_n - 1], &sites[site_i]))
+        {
+            ProfWaitAgg *merged = &sites[merged_n - 1];
+            merged->waits_n  += sites[site_i].waits_n;
+            merged->cycles_n += sites[site_i].cycles_n;
+            if (sites[site_i].cycles_max > merged->cycles_max)
+            {   merged->cycles_max = sites[site_i].cycles_max;   }
+        }
+        else
+        {   sites[merged_n++] = sites[site_i];   }
+    }
+    sites_n = merged_n;
+
+    for (ProfIdx site_i = 0; site_i < sites_n; ++site_i)
+    {
+        if (! objs_n || objs[objs_n - 1].kind != sites[site_i].kind || objs[objs_n - 1].obj != sites[site_i].obj)
+        {
+            objs[objs_n]         = sites[site_i];
+            objs[objs_n].sites_i = site_i;
+            objs[objs_n].sites_n = 1;
+            ++objs_n;
+        }
+        else
+        {
+            ProfWaitAgg *obj = &objs[objs_n - 1];
+            obj->sites_n    += 1;
+            obj->waits_n    += sites[site_i].waits_n;
+            obj->cycles_n   += sites[site_i].cycles_n;
+            if (sites[site_i].cycles_max > obj->cycles_max)
+            {   obj->cycles_max = sites[site_i].cycles_max;   }
+        }
+    }
+    for (ProfIdx obj_i = 0; obj_i < objs_n; ++obj_i)
+    {   qsort(&sites[objs[obj_i].sites_i], objs[obj_i].sites_n, sizeof(*sites), prof_wait_agg_cmp_cycles);   }
+    qsort(objs, objs_n, sizeof(*objs), prof_wait_agg_cmp_cycles);
+
+    fprintf(out, "\n%10s %12s %12s %12s  %s\n", "waits", "total ms", "us/wait", "max us", "waited on, then by call site");
+    for (ProfIdx obj_i = 0; obj_i < objs_n; ++obj_i)
+    {
+        ProfWaitAgg obj = objs[obj_i];
+        fprintf(out, "%10llu %12.3f %12.4f %12.4f  %s ",
+                (unsigned long long)obj.waits_n, obj.cycles_n / ms, obj.cycles_n / us / obj.waits_n, obj.cycles_max / us,
+                prof_wait_kind_names[obj.kind]);
+        if (obj.kind == PROF_WAIT_fd) {   fprintf(out, "%llu\n",   (unsigned long long)obj.obj);   }
+        else                          {   fprintf(out, "0x%llx\n", (unsigned long long)obj.obj);   }
+
+        for (ProfIdx site_i = obj.sites_i; site_i < obj.sites_i + obj.sites_n; ++site_i)
+        {
+            ProfWaitAgg site   = sites[site_i];
+            ProfRecord  record = prof->records[site.record_i];
+            fprintf(out, "%10llu %12.3f %12.4f %12.4f      %s (%s:%u)\n",
+                    (unsigned long long)site.waits_n, site.cycles_n / ms, site.cycles_n / us / site.waits_n,
+                    site.cycles_max / us, record.name, record.filename, record.line_num);
+        }
+    }
+
+    prof->reallocate(prof->allocator, sites, 0);
+    prof->reallocate(prof->allocator, objs,  0);
+}
+#endif // PROF_WAIT
+
+static inline ProfIdx
+prof_top_record_i(Prof *prof)
+{
+    // TODO: thread id...
+#if PROF_COMPACT
+    if (prof->compact)
+    {
+        ProfIdx smpl_i = prof->open_record_smpl_tree_i;
+        return (~smpl_i
+                ? prof->compact->blocks[smpl_i / PROF_COMPACT_BLOCK_N]->record_i[smpl_i % PROF_COMPACT_BLOCK_N]
+                : ~(ProfIdx) 0);
+    }
+#endif
+    ProfIdx result = ((prof->record_smpl_tree_n &&
+                       ~prof->open_record_smpl_tree_i)
+                      ? prof->record_smpl_tree[prof->open_record_smpl_tree_i].record_i
+                      : ~(ProfIdx) 0);
+    return result;
+}
+
+static inline ProfIdx
+prof_new_record(Prof *prof, char const *name, char const *filename, uint32_t line_num)
+{
+    if (prof->records_n == prof->records_m)
+    {   prof->records = (ProfRecord *)prof_grow(prof, prof->records, &prof->records_m, sizeof(*prof->records));   }
+
+    ProfRecord record;
+    memset(&record, 0, sizeof(record)); {
+        record.name     = name;
+        record.filename = filename;
+        record.line_num = line_num;
+    }
+    ProfIdx result        = prof->records_n++;
+    prof->records[result] = record;
+
+#if PROF_MMAP
+    if (prof->mmap)
+    {
+        prof->mmap->hdr->freq = prof->freq;
+        prof_mmap_add_record(prof->mmap, record, result);
+    }
+#endif
+#if PROF_SHM
+    if (prof->shm)
+    {
+        prof->shm->hdr->freq = prof->freq;
+        prof_shm_add_record(prof->shm, record, result);
+    }
+#endif
+
+    return result;
+}
+
+// checks if there's an existing record. If so, returns that index, otherwise creates a new one and returns the new index
+static inline ProfIdx
+prof_add_dyn_record(Prof *prof, char const *name, char const *filename, uint32_t line_num)
+{
+    ProfRecord record;
+    memset(&record, 0, sizeof(record)); {
+        record.name     = name;
+        record.filename = filename;
+        record.line_num = line_num;
+    }
+
+    ProfIdx result = prof_record_map_get(prof->dyn_records_i_map, record);
+    if (! ~ result)
+    {
+        result = prof_new_record(prof, name, filename, line_num);
+        prof_record_map_insert(prof->dyn_records_i_map, record, result);
+    }
+
+    return result;
+}
+
+#if PROF_ADDR // ADDRESS-KEYED RECORDS
+// Records keyed by nothing but a code address, for when even prof_add_dyn_record's hash of name, filename and
+// line is too much, or the strings shouldn't be in the binary at all. Registering one is a single pointer hash.
+// They're named "0x<address>", and dumps add a "prof_module" event for each loaded ELF object (its path,
+// build-id, executable range and load bias), so professor_symbolize can name them later. Traces from stripped
+// production binaries can then be symbolized on a machine that has the debug info.
+//
+//     prof_start_here(prof);           // a scope named after this line, once symbolized
+//     prof_start_addr(prof, fn);       // a scope named after whatever code is at fn
+//     ...
+//     prof_end(prof, ~(ProfIdx)0);
+// NOTE: ELF (Linux) only
+#include <string.h>
+#include <elf.h>
+
+// an address inside the call to this, in the caller's code. Not the return address itself, which can be on the
+// next line. Not inlined, or it would be the caller's caller
+__attribute__((noinline)) static void const *
+prof_here_addr(void)
+{   return (char const *)__builtin_return_address(0) - 1;   }
+
+static inline ProfIdx
+prof_add_addr_record(Prof *prof, void const *addr)
+{
+    ProfIdx result = prof_addr_map_get(prof->addr_records_i_map, addr);
+    if (! ~result)
+    {
+        if (! prof->reallocate)
+        {   prof->reallocate = prof_realloc;   }
+        size_t name_size = 2 + 2 * sizeof(addr) + 1;
+        char  *name      = (char *)prof->reallocate(prof->allocator, 0, name_size);
+        snprintf(name, name_size, "0x%llx", (unsigned long long)(uintptr_t)addr);
+
+        result = prof_new_record(prof, name, "", 0);
+        prof_addr_map_insert(prof->addr_records_i_map, addr, result);
+    }
+    return result;
+}
+
+typedef struct ProfAddrModule {
+    char      path[4096];
+    uintptr_t base, base_end; // the mapping of the start of the file, with the ELF headers
+    uintptr_t start, end;     // the executable mappings
+} ProfAddrModule;
+
+#if UINTPTR_MAX > 0xffffffffu
+typedef Elf64_Ehdr ProfElfEhdr;
+typedef Elf64_Phdr ProfElfPhdr;
+typedef Elf64_Nhdr ProfElfNhdr;
+#else
+typedef Elf32_Ehdr ProfElfEhdr;
+typedef Elf32_Phdr ProfElfPhdr;
+typedef Elf32_Nhdr ProfElfNhdr;
+#endif
+
+// finds the load bias and build-id from the ELF headers, which are still mapped
+static void
+prof_addr_dump_module(ProfWriter *w, Prof const *prof, ProfAddrModule const *module)
+{
+    if (! module->base || module->start >= module->end)
+    {   return;   }
+
+    uintptr_t          bias       = module->base;
+    uint8_t const     *build_id   = 0;
+    size_t             build_id_n = 0;
+    size_t             base_n     = module->base_end - module->base;
+    ProfElfEhdr const *ehdr       = (ProfElfEhdr const *)module->base;
+    if (base_n >= sizeof(*ehdr) && ! memcmp(ehdr->e_ident, ELFMAG, SELFMAG) &&
+        ehdr->e_phentsize == sizeof(ProfElfPhdr) &&
+        ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof(ProfElfPhdr) <= base_n)
+    {
+        ProfElfPhdr const *phdrs = (ProfElfPhdr const *)(module->base + ehdr->e_phoff);
+        for (int phdr_i = 0; phdr_i < ehdr->e_phnum; ++phdr_i)
+        {
+            if (phdrs[phdr_i].p_type == PT_LOAD && phdrs[phdr_i].p_offset == 0)
+            {   bias = module->base - (uintptr_t)phdrs[phdr_i].p_vaddr; break;   }
+        }
+
+        for (int phdr_i = 0; phdr_i < ehdr->e_phnum && ! build_id; ++phdr_i)
+        {
+            uintptr_t notes   = bias + (uintptr_t)phdrs[phdr_i].p_vaddr;
+            size_t    notes_n = (size_t)phdrs[phdr_i].p_memsz;
+            if (phdrs[phdr_i].p_type != PT_NOTE || notes < module->base || notes + notes_n > module->base_end)
+            {   continue;   }
+
+            for (size_t note_i = 0; note_i + sizeof(ProfElfNhdr) <= notes_n && ! build_id;)
+            {
+                ProfElfNhdr const *note   = (ProfElfNhdr const *)(notes + note_i);
+                char const        *name   = (char const *)(note + 1);
+                size_t             name_m = (note->n_namesz + 3) & ~(size_t)3;
+                if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && ! memcmp(name, "GNU", 4))
+                {
+                    build_id   = (uint8_t const *)(name + name_m);
+                    build_id_n = note->n_descsz;
+                }
+                note_i += sizeof(*note) + name_m + ((note->n_descsz + 3) & ~(size_t)3);
+            }
+        }
+    }
+
+    prof_writer_event(w);
+    prof_writer_put_lit(w, "\"name\":\"prof_module\", \"ph\":\"M\", \"pid\": ");
+    prof_writer_put_u64(w, prof->pid);
+    prof_writer_put_lit(w, ", \"args\": {\"start\":\"");
+    prof_writer_put_hex(w, module->start);
+    prof_writer_put_lit(w, "\", \"end\":\"");
+    prof_writer_put_hex(w, module->end);
+    prof_writer_put_lit(w, "\", \"bias\":\"");
+    prof_writer_put_hex(w, bias);
+    prof_writer_put_lit(w, "\", \"build_id\":\"");
+    for (size_t byte_i = 0; byte_i < build_id_n; ++byte_i)
+    {
+        char hex[2] = { "0123456789abcdef"[build_id[byte_i] >> 4], "0123456789abcdef"[build_id[byte_i] & 15] };
+        prof_writer_put(w, hex, 2);
+    }
+    prof_writer_put_lit(w, "\", \"path\":\"");
+    prof_writer_put_escaped(w, module->path);
+    prof_writer_put_lit(w, "\"}}");
+}
+
+// one event per file with executable mappings in /proc/self/maps
+// NOTE: written with every dump that has address-keyed records, as libraries may have been loaded since the last
+static void
+prof_addr_dump_modules(ProfWriter *w, Prof const *prof)
+{
+    FILE *maps = (prof->addr_records_i_map->n
+                  ? fopen("/proc/self/maps", "r")
+                  : 0);
+    if (! maps)
+    {   return;   }
+
+    ProfAddrModule module;
+    char           line[4096 + 128];
+    memset(&module, 0, sizeof(module));
+    while (fgets(line, sizeof(line), maps))
+    { // start-end perms offset dev inode path
+        unsigned long long start, end, offset;
+        char               perms[8];
+        int                path_i = 0;
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms, &offset, &path_i) < 4 || ! path_i)
+        {   continue;   }
+        char *path = line + path_i;
+        path[strcspn(path, "\n")] = 0;
+        if (path[0] != '/') // anonymous, [stack], [vdso]...
+        {   continue;   }
+
+        if (strcmp(path, module.path))
+        {
+            prof_addr_dump_module(w, prof, &module);
+            memset(&module, 0, sizeof(module));
+            snprintf(module.path, sizeof(module.path), "%s", path);
+            module.start = ~(uintptr_t)0;
+        }
+        if (offset == 0 && perms[0] == 'r' && ! module.base)
+        {
+            module.base     = (uintptr_t)start;
+            module.base_end = (uintptr_t)end;
+        }
+        if (perms[2] == 'x')
+        {
+            if (start < module.start) {   module.start = (uintptr_t)start;   }
+            if (end   > module.end)   {   module.end   = (uintptr_t)end;     }
+        }
+    }
+    prof_addr_dump_module(w, prof, &module);
+    fclose(maps);
+}
+#endif // PROF_ADDR
+
+#if PROF_INSTRUMENT // AUTOMATIC FUNCTION SCOPES
+// Defined in professor_instrument.c, which has the -finstrument-functions hooks
+#ifdef __cplusplus
+extern "C" {
+#endif
+void prof_instrument_thread(Prof *prof); // 0 to stop
+int  prof_instrument_include(void const *lo, void const *hi);
+int  prof_instrument_exclude(void const *lo, void const *hi);
+void prof_instrument_symbolize(Prof *prof);
+#ifdef __cplusplus
+}
+#endif
+#endif // PROF_INSTRUMENT
+
+#if PROF_REGISTRY // LINK-TIME RECORDS
+// Every call site's record is referenced from the prof_records linker section, so the whole record table
+// is known at link time. A site's index is just its offset in that section: no lazy-init check or atomics
+// on the hot path. Call prof_registry_init once at startup, before any other records are made.
+// NOTE: ELF (GCC/Clang) only. Each shared object has its own section, so give each its own Prof.
+#define PROF_REGISTRY_SECTION "prof_records"
+
+// pointers rather than the records themselves so the section stride can't be changed by alignment
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern ProfRecord const *const __start_prof_records[] __attribute__((weak));
+extern ProfRecord const *const __stop_prof_records[]  __attribute__((weak));
+#ifdef __cplusplus
+}
+#endif
+
+static void
+prof_registry_init(Prof *prof)
+{
+    assert(! prof->records_n && "registered records must come first so their indices match the section");
+    ProfIdx registry_n = (ProfIdx)(__stop_prof_records - __start_prof_records);
+
+    if (prof->records_m < registry_n)
+    {
+        if (! prof->reallocate)
+        {   prof->reallocate = prof_realloc;   }
+        prof->records_m = registry_n;
+        prof->records   = (ProfRecord *)prof->reallocate(prof->allocator, prof->records, registry_n * sizeof(*prof->records));
+    }
+
+    for (ProfIdx record_i = 0; record_i < registry_n; ++record_i)
+    {
+        ProfRecord record = *__start_prof_records[record_i];
+        prof_new_record(prof, record.name, record.filename, record.line_num);
+    }
+}
+#endif // PROF_REGISTRY
+
+static inline void
+prof_start_(Prof *prof, ProfIdx record_i)
+{
+    uint64_t cycles_start = __rdtsc();
+#if PROF_COMPACT
+    if (prof->compact)
+    {   prof_compact_start(prof, record_i, cycles_start); return;   }
+#endif
+    ProfIdx  parent_i = (~ prof->open_record_smpl_tree_i
+                         ? prof->open_record_smpl_tree_i
+                         : prof->record_smpl_tree_n);
+
+    if (prof->record_smpl_tree_n == prof->record_smpl_tree_m)
+    {   prof->record_smpl_tree = (ProfRecordSmpl *)prof_grow(prof, prof->record_smpl_tree, &prof->record_smpl_tree_m, sizeof(*prof->record_smpl_tree));   }
+
+    ProfRecordSmpl record_smpl; {
+        record_smpl.record_i     = record_i;
+        record_smpl.parent_i     = parent_i;
+        record_smpl.cycles_start = cycles_start;
+        record_smpl.cycles_end   = ~(uint64_t) 0;
+    };
+
+    prof->open_record_smpl_tree_i = prof->record_smpl_tree_n++;
+    prof->record_smpl_tree[prof->open_record_smpl_tree_i] = record_smpl;
+
+#if PROF_SHM
+    if (prof->shm)
+    {   prof_shm_push(prof->shm, record_i, cycles_start);   }
+#endif
+
+#if PROF_CPU_TIME
+    if (prof->cpu)
+    {   prof_cpu_start(prof, prof->open_record_smpl_tree_i);   }
+#endif
+
+#if PROF_PERF // last, so that as little of the profiler as possible is counted
+    if (prof->perf)
+    {   prof_perf_start(prof, prof->open_record_smpl_tree_i);   }
+#endif
+}
+
+static inline void
+prof_mark_(Prof *prof, ProfIdx record_i)
+{
+    uint64_t cycles = __rdtsc();
+#if PROF_COMPACT
+    if (prof->compact)
+    {   prof_compact_mark(prof, record_i, cycles); return;   }
+#endif
+    ProfIdx  parent_i = prof->open_record_smpl_tree_i;
+
+    if (prof->record_smpl_tree_n == prof->record_smpl_tree_m)
+    {   prof->record_smpl_tree = (ProfRecordSmpl *)prof_grow(prof, prof->record_smpl_tree, &prof->record_smpl_tree_m, sizeof(*prof->record_smpl_tree));   }
+
+    ProfRecordSmpl record_smpl; {
+        record_smpl.record_i     = record_i;
+        record_smpl.parent_i     = parent_i;
+        record_smpl.cycles_start = cycles;
+        record_smpl.cycles_end   = cycles;
+    };
+
+    prof->record_smpl_tree[prof->record_smpl_tree_n++] = record_smpl;
+
+#if PROF_SHM
+    if (prof->shm)
+    {   prof_shm_hit(prof->shm, record_i, 0, 1);   }
+#endif
+
+#if PROF_TRIGGER
+    if (prof->trigger)
+    {
+        prof_trigger_smpl(prof, record_smpl);
+        if (! ~parent_i) // nothing open to refer to it
+        {   prof->record_smpl_tree_n = prof->hits_smpls_n = 0;   }
+    }
+#endif
+}
+
+
+static inline void
+prof_ptr_realloc_(Prof *prof, ProfIdx record_i, void *addr, void *addr_p, size_t size)
+{
+    uint64_t cycles = __rdtsc();
+
+    if (prof->ptr_smpls_n == prof->ptr_smpls_m)
+    {   prof->ptr_smpls = (ProfPtrSmpl *)prof_grow(prof, prof->ptr_smpls, &prof->ptr_smpls_m, sizeof(*prof->ptr_smpls));   }
+
+    ProfPtrSmpl ptr_smpl;
+    memset(&ptr_smpl, 0, sizeof(ptr_smpl)); {
+        ptr_smpl.record_i = record_i;
+        ptr_smpl.smpl_i   = prof->open_record_smpl_tree_i;
+        ptr_smpl.addr     = (uintptr_t)addr;
+        ptr_smpl.addr_p   = (uintptr_t)addr_p; // if realloc'd
+        ptr_smpl.cycles   = cycles;
+        ptr_smpl.size     = size;   // if 0, was freed
+    }
+
+    prof->ptr_smpls[prof->ptr_smpls_n++] = ptr_smpl;
+}
+
+// Only samples if the value has changed since the last sample, and at most every every_n calls,
+// so counters in hot loops are mostly a store and a compare. prof_dump_timings_file samples
+// the latest value of any counter that changed since its last sample, so none are lost.
+static inline void
+prof_counter_(Prof *prof, ProfIdx record_i, double value, uint32_t every_n)
+{
+    if (record_i >= prof->counters_m)
+    {
+        ProfIdx counters_m = prof->counters_m;
+        while (record_i >= prof->counters_m)
+        {   prof->counters = (ProfCounter *)prof_grow(prof, prof->counters, &prof->counters_m, sizeof(*prof->counters));   }
+        memset(&prof->counters[counters_m], 0, (prof->counters_m - counters_m) * sizeof(*prof->counters));
+    }
+
+    ProfCounter *counter = &prof->counters[record_i];
+    counter->value = value;
+    if (++counter->calls_n >= every_n &&
+        (value != counter->sampled_value || ! counter->is_sampled))
+    {
+        if (prof->counter_smpls_n == prof->counter_smpls_m)
+        {   prof->counter_smpls = (ProfCounterSmpl *)prof_grow(prof, prof->counter_smpls, &prof->counter_smpls_m, sizeof(*prof->counter_smpls));   }
+
+        ProfCounterSmpl *smpl = &prof->counter_smpls[prof->counter_smpls_n++];
+        smpl->cycles   = __rdtsc();
+        smpl->value    = value;
+        smpl->record_i = record_i;
+
+        counter->sampled_value = value;
+        counter->is_sampled    = 1;
+        counter->calls_n       = 0;
+    }
+}
+
+#if 1 // ASYNC SPANS
+#include <string.h>
+// Spans that can begin and end on any thread, matched by a 64-bit id rather than by nesting, plus flows linking
+// related slices (e.g. a request handed from one thread to another). These are kept out of record_smpl_tree
+// in a fixed-size ring that any thread can append to; see prof_async_init.
+// NOTE: make the records up front (or use PROF_REGISTRY), as lazily making them isn't threadsafe
+typedef enum ProfAsyncPhase {
+    PROF_ASYNC_begin,
+    PROF_ASYNC_end,
+    PROF_FLOW_start,
+    PROF_FLOW_step,
+    PROF_FLOW_end,
+} ProfAsyncPhase;
+
+typedef struct ProfAsyncSmpl {
+    uint64_t id;
+    uint64_t cycles;
+    uint64_t tid;
+    ProfIdx  record_i;
+    uint32_t phase;
+    uint64_t seq; // ring index + 1, written last; anything else means it's being written or overwritten
+} ProfAsyncSmpl;
+
+#if defined(__GNUC__)
+# define prof_async_fetch_add(a, b) __atomic_fetch_add(a, b, __ATOMIC_RELAXED)
+# define prof_async_store(a, b)     __atomic_store_n(a, b, __ATOMIC_RELEASE)
+# define prof_async_load(a)         __atomic_load_n(a, __ATOMIC_ACQUIRE)
+# define prof_async_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+# define prof_async_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+# define prof_async_fetch_add(a, b) prof_atomic_fetch_add(a, b)
+# define prof_async_store(a, b)     (*(a) = (b))
+# define prof_async_load(a)         (*(a))
+# define prof_async_fence_release()
+# define prof_async_fence_acquire()
+#endif
+
+// capacity is rounded up to a power of 2. Call before any threads use the async API.
+static void
+prof_async_init(Prof *prof, uint64_t capacity)
+{
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+
+    uint64_t m = capacity ? capacity : 1 << 16;
+    --m, m|=m>>1, m|=m>>2, m|=m>>4, m|=m>>8, m|=m>>16, m|=m>>32, ++m; // ceiling pow 2
+
+    prof->async_smpls = (ProfAsyncSmpl *)prof->reallocate(prof->allocator, prof->async_smpls, m * sizeof(*prof->async_smpls));
+    memset(prof->async_smpls, 0, m * sizeof(*prof->async_smpls));
+    prof->async_smpls_m      = m;
+    prof->async_smpls_n      = 0;
+    prof->async_smpls_dumped = 0;
+}
+
+static inline void
+prof_async_(Prof *prof, ProfIdx record_i, uint64_t id, ProfAsyncPhase phase)
+{
+    uint64_t cycles = __rdtsc();
+    uint64_t smpl_i = prof_async_fetch_add(&prof->async_smpls_n, 1);
+    ProfAsyncSmpl *smpl = &prof->async_smpls[smpl_i & (prof->async_smpls_m - 1)];
+
+    prof_async_store(&smpl->seq, 0);
+    prof_async_fence_release(); // NOTE: so a reader that sees the new fields also sees seq cleared
+    smpl->id       = id;
+    smpl->cycles   = cycles;
+    smpl->tid      = prof_thread_id_cached();
+    smpl->record_i = record_i;
+    smpl->phase    = phase;
+    prof_async_store(&smpl->seq, smpl_i + 1);
+}
+#endif // ASYNC SPANS
+
+#ifdef  PROF_PRINT_SCOPE
+static inline void
+prof_print_scope(Prof const *prof)
+{
+    ProfIdx smpl_i = prof->open_record_smpl_tree_i;
+    if (~smpl_i)
+    {
+        ProfRecordSmpl const *smpl_tree = prof->record_smpl_tree;
+        ProfRecord            record    = prof->records[smpl_tree[smpl_i].record_i];
+
+        while (smpl_i != smpl_tree[smpl_i].parent_i)
+        {
+            fputs("  ", stdout);
+            smpl_i = smpl_tree[smpl_i].parent_i;
+        }
+
+        printf("%s (%s : %u)\n", record.name, record.filename, record.line_num);
+    }
+}
+
+#else //PROF_PRINT_SCOPE
+#define prof_print_scope(...)
+#endif//PROF_PRINT_SCOPE
+
+#if PROFESSOR_DISABLE
+# define prof_start(prof, name)
+# define prof_mark(prof, name)
+# define prof_ptr_realloc(prof, name, addr, addr_p, size)
+# define prof_ptr_alloc(prof, name, ptr, size)
+# define prof_ptr_free( prof, name, ptr)
+# define prof_scope(prof, name)
+# define prof_scope_n(prof, name, n)
+# define prof_counter(prof, name, value)
+# define prof_counter_every(prof, name, value, every_n)
+# define prof_async_begin(prof, name, id)
+# define prof_async_end(  prof, name, id)
+# define prof_flow_start( prof, name, id)
+# define prof_flow_step(  prof, name, id)
+# define prof_flow_end(   prof, name, id)
+# define prof_start_addr(prof, addr)
+# define prof_mark_addr( prof, addr)
+# define prof_start_here(prof)
+# define prof_mark_here( prof)
+
+# define prof_start_fn(prof)
+# define prof_end_n_fn(prof, n)
+# define prof_end_fn(prof)
+# define prof_end_unchecked(...)
+# define prof_end_n(...)
+# define prof_end(...)
+
+#else // PROFESSOR_DISABLE
+# define PROF_CAT1(a,b) a ## b
+# define PROF_CAT2(a,b) PROF_CAT1(a,b)
+# define PROF_CAT(a,b)  PROF_CAT2(a,b)
+# define prof_static_local_record_i_ PROF_CAT(prof_static_local_record_i_, __LINE__)
+# define prof_scope_once PROF_CAT(prof_scope_once, __LINE__)
+
+# if PROF_REGISTRY
+# define prof_static_local_record_ PROF_CAT(prof_static_local_record_, __LINE__)
+# define prof_static_local_record_ptr_ PROF_CAT(prof_static_local_record_ptr_, __LINE__)
+# define PROF_NEW_RECORD(prof, name) \
+    static ProfRecord const prof_static_local_record_ = { name, __FILE__, __LINE__ }; \
+    static ProfRecord const *const prof_static_local_record_ptr_ \
+        __attribute__((section(PROF_REGISTRY_SECTION), used)) = &prof_static_local_record_; \
+    ProfIdx const prof_static_local_record_i_ = (ProfIdx)(&prof_static_local_record_ptr_ - __start_prof_records); \
+    (void)(prof);
+
+# else // PROF_REGISTRY
+# define PROF_NEW_RECORD(prof, name) \
+    static ProfIdx prof_static_local_record_i_ = ~(ProfIdx) 0; \
+    if (! ~prof_static_local_record_i_) /* TODO: atomic */ \
+    {   prof_static_local_record_i_ = prof_new_record(prof, name, __FILE__, __LINE__);   } \
+
+# endif // PROF_REGISTRY
+
+# define prof_start(prof, name) \
+    do { \
+        PROF_NEW_RECORD(prof, name) \
+        prof_start_(prof, prof_static_local_record_i_); \
+        prof_print_scope(prof); \
+        /* __itt_task_begin(0, __itt_null, __itt_null, __itt_string_handle_createA(name));\ */ \
+    } while (0)
+
+# define prof_mark(prof, name) \
+    do { \
+        PROF_NEW_RECORD(prof, name) \
+        prof_mark_(prof, prof_static_local_record_i_); \
+        prof_print_scope(prof); \
+    } while (0)
+
+# define prof_ptr_realloc(prof, name, addr, addr_p, size) \
+    do { \
+        PROF_NEW_RECORD(prof, name) \
+        prof_ptr_realloc_(prof, prof_static_local_record_i_, (void *)(addr), (void *)(addr_p), size); \
+    } while (0)
+
+# define prof_ptr_alloc(prof, name, ptr, size) prof_ptr_realloc(prof, name, ptr, 0, size)
+# define prof_ptr_free( prof, name, ptr)       prof_ptr_realloc(prof, name, ptr, 0, 0)
+
+
+# define prof_counter_every(prof, name, value, every_n) \
+    do { \
+        PROF_NEW_RECORD(prof, name) \
+        prof_counter_(prof, prof_static_local_record_i_, (double)(value), every_n); \
+    } while (0)
+# define prof_counter(prof, name, value) prof_counter_every(prof, name, value, 1)
+
+# define prof_async(prof, name, id, phase) \
+    do { \
+        PROF_NEW_RECORD(prof, name) \
+        prof_async_(prof, prof_static_local_record_i_, id, phase); \
+    } while (0)
+
+# define prof_async_begin(prof, name, id) prof_async(prof, name, id, PROF_ASYNC_begin)
+# define prof_async_end(  prof, name, id) prof_async(prof, name, id, PROF_ASYNC_end)
+// flows connect the enclosing slices (prof_start/prof_end scopes) on each thread they pass through
+# define prof_flow_start( prof, name, id) prof_async(prof, name, id, PROF_FLOW_start)
+# define prof_flow_step(  prof, name, id) prof_async(prof, name, id, PROF_FLOW_step)
+# define prof_flow_end(   prof, name, id) prof_async(prof, name, id, PROF_FLOW_end)
+
+# if PROF_ADDR
+# define prof_start_addr(prof, addr) prof_start_(prof, prof_add_addr_record(prof, addr))
+# define prof_mark_addr( prof, addr) prof_mark_(prof, prof_add_addr_record(prof, addr))
+# define prof_start_here(prof)       prof_start_addr(prof, prof_here_addr())
+# define prof_mark_here( prof)       prof_mark_addr(prof, prof_here_addr())
+# endif // PROF_ADDR
+
+// NOTE: can't nest without braces
+# define prof_scope(prof, name) prof_scope_n(prof, name, 1)
+# define prof_scope_n(prof, name, n) prof_start(prof, name); \
+    for (int prof_scope_once = 0; prof_scope_once++ == 0; prof_end_n_unchecked(prof, n))
+# define prof_exit_scope continue
 
 // returns the index of the record referenced, so you can double check this is correct
 static inline ProfIdx
-prof_end_n_unchecked(Prof *prof, uint32_t hits_n)
-{   (void)hits_n; // TODO: incorporate this
-    /* __itt_task_end(0); */
-    assert(prof->record_smpl_tree   &&
-           prof->record_smpl_tree_n &&
-           "no record samples taken at all - nothing to close");
-    assert(~prof->open_record_smpl_tree_i &&
-           "no open prof records - you've already closed them all. Mismatched start and end records?");
+prof_end_n_unchecked(Prof *prof, uint32_t hits_n)
+{
+    /* __itt_task_end(0); */
+#if PROF_COMPACT
+    if (prof->compact)
+    {   return prof_compact_end(prof, hits_n, __rdtsc());   }
+#endif
+    assert(prof->record_smpl_tree   &&
+           prof->record_smpl_tree_n &&
+           "no record samples taken at all - nothing to close");
+    assert(~prof->open_record_smpl_tree_i &&
+           "no open prof records - you've already closed them all. Mismatched start and end records?");
+
+#if PROF_PERF // first, so that as little of the profiler as possible is counted
+    if (prof->perf)
+    {   prof_perf_end(prof, prof->open_record_smpl_tree_i);   }
+#endif
+
+#if PROF_CPU_TIME
+    if (prof->cpu)
+    {   prof_cpu_end(prof, prof->open_record_smpl_tree_i);   }
+#endif
+
+    ProfRecordSmpl *record_smpl      = &prof->record_smpl_tree[prof->open_record_smpl_tree_i];
+    uint64_t        cycles_end       = __rdtsc();
+    /* uint64_t        hits_n__cycles_n = (uint64_t)cycles_n | ((uint64_t)hits_n << 32); */
+
+    record_smpl->cycles_end = cycles_end;
+    if (hits_n != 1)
+    {
+        if (prof->hits_smpls_n == prof->hits_smpls_m)
+        {   prof->hits_smpls = (ProfHitsSmpl *)prof_grow(prof, prof->hits_smpls, &prof->hits_smpls_m, sizeof(*prof->hits_smpls));   }
+        ProfHitsSmpl hits_smpl; {
+            hits_smpl.smpl_i = prof->open_record_smpl_tree_i;
+            hits_smpl.hits_n = hits_n;
+        }
+        prof->hits_smpls[prof->hits_smpls_n++] = hits_smpl;
+    }
+    /* prof_atomic_add(&prof->records[record_smpl->record_i].hits_n__cycles_n, hits_n__cycles_n); // TODO: this could be done after the fact */
+
+#if PROF_SHM
+    if (prof->shm)
+    {
+        uint64_t cycles_n = cycles_end - record_smpl->cycles_start;
+        prof_shm_pop(prof->shm, record_smpl->record_i, cycles_n, hits_n);
+    }
+#endif
+
+    int is_tree_root = prof->open_record_smpl_tree_i == record_smpl->parent_i;
+    prof->open_record_smpl_tree_i = (! is_tree_root
+                                     ? record_smpl->parent_i
+                                     : ~(ProfIdx) 0);
+
+#if PROF_TRIGGER
+    if (prof->trigger)
+    {
+        prof_trigger_smpl(prof, *record_smpl);
+        if (is_tree_root) // the samples are all in the ring now
+        {   prof->record_smpl_tree_n = prof->hits_smpls_n = 0;   }
+    }
+#endif
+
+    return record_smpl->record_i;
+}
+
+static inline ProfIdx
+prof_end_n(Prof *prof, ProfIdx expected_record_i, uint32_t hits_n)
+{
+    ProfIdx actual_record_i = prof_end_n_unchecked(prof, hits_n);
+    assert((!~expected_record_i || // if you don't want to check here
+            actual_record_i == expected_record_i) && "prof start and end don't seem to match");
+    return actual_record_i;
+}
+
+static inline ProfIdx
+prof_end(Prof *prof, ProfIdx expected_record_i)
+{   return prof_end_n(prof, expected_record_i, 1);   }
+
+static inline ProfIdx
+prof_end_unchecked(Prof *prof)
+{   return prof_end_n_unchecked(prof, 1);   }
+
+# define prof_start_fn(prof)    prof_start(prof, __func__); ProfIdx prof_fn_local_record_i = prof_top_record_i(prof)
+# define prof_end_n_fn(prof, n) prof_end_n(prof, prof_fn_local_record_i, n)
+# define prof_end_fn(prof)      prof_end_n_fn(prof, 1)
+#endif // PROFESSOR_DISABLE
+
+#if PROF_WAIT // BLOCKING CALL WRAPPERS
+// Drop-in for the calls they wrap, with the prof first:
+//     prof_mutex_lock(prof, &mutex);   prof_cond_wait(prof, &cond, &mutex);   n = prof_read(prof, fd, buf, size);
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if PROFESSOR_DISABLE
+# define prof_mutex_lock(prof, mutex)                    pthread_mutex_lock(mutex)
+# define prof_cond_wait(prof, cond, mutex)               pthread_cond_wait(cond, mutex)
+# define prof_cond_timedwait(prof, cond, mutex, abstime) pthread_cond_timedwait(cond, mutex, abstime)
+# define prof_read(prof, fd, buf, n)                     read(fd, buf, n)
+# define prof_write(prof, fd, buf, n)                    write(fd, buf, n)
+# define prof_poll(prof, fds, fds_n, timeout_ms)         poll(fds, fds_n, timeout_ms)
+# define prof_futex(prof, uaddr, op, val, timeout)       syscall(SYS_futex, uaddr, op, val, timeout, 0, 0)
+
+#else // PROFESSOR_DISABLE
+// the callers look at errno after the wrapped call, so ending the sample mustn't change it
+static inline void
+prof_wait_end_(Prof *prof)
+{
+    int saved_errno = errno;
+    prof_end_n_unchecked(prof, 1);
+    errno = saved_errno;
+}
+
+static inline int
+prof_mutex_lock_(Prof *prof, ProfIdx record_i, pthread_mutex_t *mutex)
+{
+    int result = pthread_mutex_trylock(mutex);
+    if (result == EBUSY)
+    {
+        prof_start_(prof, record_i);
+        prof_wait_tag(prof, PROF_WAIT_lock, (uintptr_t)mutex);
+        result = pthread_mutex_lock(mutex);
+        prof_wait_end_(prof);
+    }
+    return result;
+}
+
+static inline int
+prof_cond_timedwait_(Prof *prof, ProfIdx record_i, pthread_cond_t *cond, pthread_mutex_t *mutex,
+                     struct timespec const *abstime) // 0 to wait indefinitely
+{
+    prof_start_(prof, record_i);
+    prof_wait_tag(prof, PROF_WAIT_cond, (uintptr_t)cond);
+    int result = (abstime
+                  ? pthread_cond_timedwait(cond, mutex, abstime)
+                  : pthread_cond_wait(cond, mutex));
+    prof_wait_end_(prof);
+    return result;
+}
+
+static inline ssize_t
+prof_read_write_(Prof *prof, ProfIdx record_i, int fd, void *buf, size_t n, int is_write)
+{
+    prof_start_(prof, record_i);
+    prof_wait_tag(prof, PROF_WAIT_fd, (uintptr_t)fd);
+    ssize_t result = (is_write
+                      ? write(fd, buf, n)
+                      : read(fd, buf, n));
+    prof_wait_end_(prof);
+    return result;
+}
+
+// tagged with the first fd
+static inline int
+prof_poll_(Prof *prof, ProfIdx record_i, struct pollfd *fds, nfds_t fds_n, int timeout_ms)
+{
+    prof_start_(prof, record_i);
+    if (fds_n)
+    {   prof_wait_tag(prof, PROF_WAIT_fd, (uintptr_t)fds[0].fd);   }
+    int result = poll(fds, fds_n, timeout_ms);
+    prof_wait_end_(prof);
+    return result;
+}
+
+static inline long
+prof_futex_(Prof *prof, ProfIdx record_i, uint32_t *uaddr, int op, uint32_t val, struct timespec const *timeout)
+{
+    prof_start_(prof, record_i);
+    prof_wait_tag(prof, PROF_WAIT_futex, (uintptr_t)uaddr);
+    long result = syscall(SYS_futex, uaddr, op, val, timeout, 0, 0);
+    prof_wait_end_(prof);
+    return result;
+}
+
+// NOTE: statement expressions, so that each call site gets its own record and they can still return a value
+# define prof_mutex_lock(prof, mutex) \
+    ({ PROF_NEW_RECORD(prof, "pthread_mutex_lock") prof_mutex_lock_(prof, prof_static_local_record_i_, mutex); })
+# define prof_cond_wait(prof, cond, mutex) \
+    ({ PROF_NEW_RECORD(prof, "pthread_cond_wait") prof_cond_timedwait_(prof, prof_static_local_record_i_, cond, mutex, 0); })
+# define prof_cond_timedwait(prof, cond, mutex, abstime) \
+    ({ PROF_NEW_RECORD(prof, "pthread_cond_timedwait") prof_cond_timedwait_(prof, prof_static_local_record_i_, cond, mutex, abstime); })
+# define prof_read(prof, fd, buf, n) \
+    ({ PROF_NEW_RECORD(prof, "read") prof_read_write_(prof, prof_static_local_record_i_, fd, buf, n, 0); })
+# define prof_write(prof, fd, buf, n) \
+    ({ PROF_NEW_RECORD(prof, "write") prof_read_write_(prof, prof_static_local_record_i_, fd, (void *)(buf), n, 1); })
+# define prof_poll(prof, fds, fds_n, timeout_ms) \
+    ({ PROF_NEW_RECORD(prof, "poll") prof_poll_(prof, prof_static_local_record_i_, fds, fds_n, timeout_ms); })
+# define prof_futex(prof, uaddr, op, val, timeout) \
+    ({ PROF_NEW_RECORD(prof, "futex") prof_futex_(prof, prof_static_local_record_i_, uaddr, op, val, timeout); })
+#endif // PROFESSOR_DISABLE
+#endif // PROF_WAIT
+
+#if defined(__cplusplus) // C++ SCOPE GUARDS
+// Scopes that close however they're left: early returns, exceptions, breaks...
+//
+//     prof_guard(prof, "name");                 // closes at the end of the enclosing block
+//     prof_guard_fn(prof);                      // named after the enclosing function
+//     prof_guard_n(prof, "name", n);            // counts as n hits
+//     prof_guard_cat(Category, prof, "name");   // compiles to nothing if the category is disabled
+//
+// Categories are any type, enabled by default. To disable one:
+//     template <> struct ProfCategoryEnabled<Category> { static constexpr bool value = false; };
+//
+// Record descriptors are constexpr, built from std::source_location where available (C++20),
+// otherwise from __FILE__/__LINE__/__func__.
+#if defined(__has_include)
+# if __cplusplus >= 202002L && __has_include(<source_location>)
+#  include <source_location>
+#  define PROF_HAS_SOURCE_LOCATION 1
+# endif
+#endif
+
+struct ProfSite {
+    char const *name;
+    char const *filename;
+    uint32_t    line_num;
+
+#if PROF_HAS_SOURCE_LOCATION
+    static constexpr ProfSite
+    here(char const *name = nullptr, std::source_location loc = std::source_location::current())
+    {   return ProfSite{ name ? name : loc.function_name(), loc.file_name(), (uint32_t)loc.line() };   }
+#endif
+};
+
+#if PROF_HAS_SOURCE_LOCATION
+# define PROF_SITE(name) ProfSite::here(name)
+#else
+# define PROF_SITE(name) ProfSite{ (name) ? (name) : __func__, __FILE__, __LINE__ }
+#endif
+
+struct ProfDefaultCategory {};
+
+template <typename Category>
+struct ProfCategoryEnabled {
+#if PROFESSOR_DISABLE
+    static constexpr bool value = false;
+#else
+    static constexpr bool value = true;
+#endif
+};
+
+template <typename Category = ProfDefaultCategory, bool Enabled = ProfCategoryEnabled<Category>::value>
+class ProfScopeGuard;
+
+template <typename Category>
+class ProfScopeGuard<Category, false> {
+public:
+    ProfScopeGuard(Prof *, ProfSite const &, ProfIdx &, uint32_t = 1) {}
+    ProfScopeGuard(Prof *, ProfIdx, uint32_t = 1) {}
+    void set_hits(uint32_t) {}
+};
+
+#if ! PROFESSOR_DISABLE
+template <typename Category>
+class ProfScopeGuard<Category, true> {
+    Prof    *prof;
+    uint32_t hits_n;
+
+public:
+    // lazily registered on the first hit, like PROF_NEW_RECORD
+    ProfScopeGuard(Prof *prof_, ProfSite const &site, ProfIdx &site_record_i, uint32_t hits_n_ = 1)
+        : prof(prof_), hits_n(hits_n_)
+    {
+        if (! ~site_record_i)
+        {   site_record_i = prof_new_record(prof, site.name, site.filename, site.line_num);   }
+        prof_start_(prof, site_record_i);
+    }
+
+    // already registered, e.g. with PROF_REGISTRY
+    ProfScopeGuard(Prof *prof_, ProfIdx record_i, uint32_t hits_n_ = 1)
+        : prof(prof_), hits_n(hits_n_)
+    {   prof_start_(prof, record_i);   }
+
+    ~ProfScopeGuard()
+    {   prof_end_n_unchecked(prof, hits_n);   }
+
+    // e.g. once the number of iterations is known
+    void set_hits(uint32_t hits_n_) {   hits_n = hits_n_;   }
+
+    ProfScopeGuard(ProfScopeGuard const &)            = delete;
+    ProfScopeGuard &operator=(ProfScopeGuard const &) = delete;
+};
+#endif // ! PROFESSOR_DISABLE
+
+# define prof_static_local_site_ PROF_CAT(prof_static_local_site_, __LINE__)
+# define prof_guard_local_       PROF_CAT(prof_guard_local_, __LINE__)
+
+# if PROFESSOR_DISABLE
+#  define prof_guard_n_cat(category, prof, record_name, n)
+
+# elif PROF_REGISTRY
+// The record is made in a function of a type local to the call site, which is only called (so only emitted,
+// and only in the registry) if the category is enabled
+template <typename Site, bool Enabled = true>
+struct ProfRegistrySite {
+    static ProfIdx record_i() {   return Site::record_i();   }
+};
+
+template <typename Site>
+struct ProfRegistrySite<Site, false> {
+    static ProfIdx record_i() {   return ~(ProfIdx)0;   }
+};
+
+#  define prof_static_local_site_type_ PROF_CAT(prof_static_local_site_type_, __LINE__)
+#  define prof_guard_n_cat(category, prof, record_name, n) \
+    static constexpr ProfSite prof_static_local_site_ = PROF_SITE(record_name); \
+    struct prof_static_local_site_type_ { \
+        static ProfIdx record_i() \
+        { \
+            static ProfRecord const prof_static_local_record_ = { \
+                prof_static_local_site_.name, prof_static_local_site_.filename, prof_static_local_site_.line_num }; \
+            static ProfRecord const *const prof_static_local_record_ptr_ \
+                __attribute__((section(PROF_REGISTRY_SECTION), used)) = &prof_static_local_record_; \
+            return (ProfIdx)(&prof_static_local_record_ptr_ - __start_prof_records); \
+        } \
+    }; \
+    ProfScopeGuard<category> prof_guard_local_(prof, \
+        ProfRegistrySite<prof_static_local_site_type_, ProfCategoryEnabled<category>::value>::record_i(), n)
+
+# else
+#  define prof_guard_n_cat(category, prof, record_name, n) \
+    static constexpr ProfSite prof_static_local_site_ = PROF_SITE(record_name); \
+    static ProfIdx prof_static_local_record_i_ = ~(ProfIdx) 0; \
+    ProfScopeGuard<category> prof_guard_local_(prof, prof_static_local_site_, prof_static_local_record_i_, n)
+# endif
+
+# define prof_guard_cat(category, prof, record_name) prof_guard_n_cat(category, prof, record_name, 1)
+# define prof_guard_n(prof, record_name, n)          prof_guard_n_cat(ProfDefaultCategory, prof, record_name, n)
+# define prof_guard(prof, record_name)               prof_guard_n_cat(ProfDefaultCategory, prof, record_name, 1)
+# define prof_guard_fn(prof)                         prof_guard_n_cat(ProfDefaultCategory, prof, nullptr, 1)
+#endif // __cplusplus
+
+#if 1 // OUTPUT
+
+/* static inline void */
+/* prof_record_read_clear(Prof *prof, ProfIdx record_i, uint32_t *hits_n, uint32_t *cycles_n) */
+/* { */
+/*     uint64_t hits_n__cycles_n = prof->records[record_i].hits_n__cycles_n; */
+/*     if (hits_n)   { *hits_n   = (uint32_t)(hits_n__cycles_n >> 32); } */
+/*     if (cycles_n) { *cycles_n = (uint32_t)(hits_n__cycles_n & 0xFFFFFFFF); } */
+/* } */
+
+static void
+prof_dump_still_open(FILE *out, Prof const *prof)
+{
+    for (ProfIdx top_i = prof->open_record_smpl_tree_i;
+         ~top_i;
+         top_i = prof->record_smpl_tree[top_i].parent_i)
+    {
+        ProfRecordSmpl smpl = prof->record_smpl_tree[top_i];
+        ProfRecord     record = prof->records[smpl.record_i];
+        fprintf(out, "sample: %d, record[%d]: %s (%s[%u])\n",
+                top_i, smpl.record_i,
+                record.name,
+                record.filename,
+                record.line_num);
+
+        if (top_i == prof->record_smpl_tree[top_i].parent_i)
+        {   break;   }
+    }
+    fputc('\n', out);
+}
+
+static double
+prof_sqrt(double x)
+{
+    double result = (x > 1.0 ? x : 1.0);
+    for (int iter_i = 0; iter_i < 64; ++iter_i)
+    {   result = 0.5 * (result + x / result);   } // NOTE: Newton's method, so libm isn't needed
+    return (x > 0.0 ? result : 0.0);
+}
+
+static int
+prof_hits_smpl_cmp(void const *a, void const *b)
+{
+    ProfIdx a_i = ((ProfHitsSmpl const *)a)->smpl_i;
+    ProfIdx b_i = ((ProfHitsSmpl const *)b)->smpl_i;
+    return (a_i > b_i) - (a_i < b_i);
+}
+
+// Sorts hits_smpls into sample order, so they can be walked alongside record_smpl_tree with prof_smpl_hits_n.
+// NOTE: for output only; later prof_end_n calls will append out of order again
+static void
+prof_sort_hits_smpls(Prof *prof)
+{
+    if (prof->hits_smpls_n) // NOTE: hits_smpls is null until a scope has hits_n != 1, which qsort mustn't be given
+    {   qsort(prof->hits_smpls, prof->hits_smpls_n, sizeof(*prof->hits_smpls), prof_hits_smpl_cmp);   }
+}
+
+// call with increasing smpl_i, after prof_sort_hits_smpls
+static inline uint32_t
+prof_smpl_hits_n(Prof const *prof, ProfIdx smpl_i, ProfIdx *hits_smpl_i)
+{
+    uint32_t result = 1;
+    while (*hits_smpl_i < prof->hits_smpls_n && prof->hits_smpls[*hits_smpl_i].smpl_i < smpl_i)
+    {   ++*hits_smpl_i;   }
+    if (*hits_smpl_i < prof->hits_smpls_n && prof->hits_smpls[*hits_smpl_i].smpl_i == smpl_i)
+    {   result = prof->hits_smpls[*hits_smpl_i].hits_n;   }
+    return result;
+}
+
+typedef struct ProfRecordAgg {
+    uint64_t smpls_n;
+    uint64_t hits_n;
+    uint64_t cycles_n;
+    double   hit_cycles_mean, hit_cycles_m2; // per hit, weighted by each sample's hits (West's algorithm)
+    double   hit_cycles_min,  hit_cycles_max;
+} ProfRecordAgg;
+
+// Per-record totals of the samples so far (call before prof_dump_timings_file, which clears them).
+// A sample with n hits counts as n hits of its duration / n, so the per-hit spread only reflects
+// the differences between samples, not those between the hits of a single sample.
+static void
+prof_dump_aggregate_file(FILE *out, Prof *prof)
+{
+    double ms = (prof->freq != 0.0
+                 ? prof->freq / 1000.0
+                 : 1.0);
+    double us = ms / 1000.0;
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+    ProfRecordAgg *aggs = (ProfRecordAgg *)prof->reallocate(prof->allocator, 0, (prof->records_n ? prof->records_n : 1) * sizeof(*aggs));
+    memset(aggs, 0, prof->records_n * sizeof(*aggs));
+
+#if PROF_COMPACT
+    if (prof->compact)
+    {   prof_compact_expand(prof);   }
+#endif
+    prof_sort_hits_smpls(prof);
+    ProfIdx hits_smpl_i = 0;
+    for (ProfIdx smpl_i = 0; smpl_i < prof->record_smpl_tree_n; ++smpl_i)
+    {
+        ProfRecordSmpl smpl   = prof->record_smpl_tree[smpl_i];
+        uint32_t       hits_n = prof_smpl_hits_n(prof, smpl_i, &hits_smpl_i);
+        ProfRecordAgg *agg    = &aggs[smpl.record_i];
+        if (! ~smpl.cycles_end)
+        {   continue;   } // still open
+
+        uint64_t cycles = smpl.cycles_end - smpl.cycles_start;
+        agg->smpls_n  += 1;
+        agg->hits_n   += hits_n;
+        agg->cycles_n += cycles;
+        if (hits_n)
+        {
+            double hit_cycles = (double)cycles / hits_n;
+            double mean_prev  = agg->hit_cycles_mean;
+            agg->hit_cycles_mean += (hits_n / (double)agg->hits_n) * (hit_cycles - mean_prev);
+            agg->hit_cycles_m2   += hits_n * (hit_cycles - mean_prev) * (hit_cycles - agg->hit_cycles_mean);
+            if (agg->smpls_n == 1 || hit_cycles < agg->hit_cycles_min) {   agg->hit_cycles_min = hit_cycles;   }
+            if (agg->smpls_n == 1 || hit_cycles > agg->hit_cycles_max) {   agg->hit_cycles_max = hit_cycles;   }
+        }
+    }
+
+    fprintf(out, "%10s %12s %12s %12s %12s %12s %12s  %s\n",
+            "samples", "hits", "total ms", "us/hit", "stddev us", "min us/hit", "max us/hit", "record");
+    for (ProfIdx record_i = 0; record_i < prof->records_n; ++record_i)
+    {
+        ProfRecordAgg agg = aggs[record_i];
+        if (agg.smpls_n)
+        {
+            fprintf(out, "%10llu %12llu %12.3f %12.4f %12.4f %12.4f %12.4f  %s (%s:%u)\n",
+                    (unsigned long long)agg.smpls_n, (unsigned long long)agg.hits_n, agg.cycles_n / ms,
+                    agg.hit_cycles_mean / us,
+                    prof_sqrt(agg.hits_n ? agg.hit_cycles_m2 / (double)agg.hits_n : 0.0) / us,
+                    agg.hit_cycles_min / us, agg.hit_cycles_max / us,
+                    prof->records[record_i].name, prof->records[record_i].filename, prof->records[record_i].line_num);
+        }
+    }
+#if PROF_WAIT
+    if (prof->wait && prof->wait->smpls_n)
+    {   prof_wait_dump_contention(out, prof);   }
+#endif
+    prof->reallocate(prof->allocator, aggs, 0);
+}
+
+#define MAP_INVALID_VAL (~(ProfIdx) 0)
+#define MAP_HASH_KEY(key) prof_hash_addr((void const *)(key))
+#define MAP_TYPES (ProfPtrMap, prof_ptr_map, uintptr_t, ProfIdx)
+#include "hash.h"
+
+typedef struct ProfAllocAgg {
+    uint64_t allocs_n;   // reallocs count as allocations
+    uint64_t frees_n;
+    uint64_t bytes;      // allocated
+    int64_t  live_bytes; // allocated in the scope and not freed yet
+    int64_t  peak_live_bytes;
+} ProfAllocAgg;
+
+typedef struct ProfAllocRecordAgg {
+    ProfIdx      record_i; // ~0 for allocations outside any scope
+    ProfIdx      smpls_n;
+    ProfAllocAgg incl;     // summed over the record's samples, so recursive records count nested allocations again
+    ProfAllocAgg self;     // from directly inside the record's samples
+} ProfAllocRecordAgg;
+
+static int
+prof_alloc_record_agg_cmp(void const *a, void const *b)
+{
+    uint64_t a_bytes = ((ProfAllocRecordAgg const *)a)->incl.bytes;
+    uint64_t b_bytes = ((ProfAllocRecordAgg const *)b)->incl.bytes;
+    return (a_bytes < b_bytes) - (a_bytes > b_bytes);
+}
+
+static inline ProfIdx
+prof_smpl_parent_i(Prof const *prof, ProfIdx smpl_i)
+{
+    ProfIdx parent_i = prof->record_smpl_tree[smpl_i].parent_i;
+    return (parent_i != smpl_i
+            ? parent_i
+            : ~(ProfIdx)0);
+}
+
+// Allocations (prof_ptr_alloc/realloc/free) per scope, counted inclusively up the tree of scopes open at the time,
+// then totalled per record: how many and how many bytes, and the peak of the bytes allocated within the scope that
+// were still live. Sorted by inclusive bytes.
+// Call before prof_dump_timings_file, which clears the samples.
+// NOTE: frees of blocks allocated before the last dump are counted, but don't lower any scope's live bytes
+static void
+prof_dump_alloc_file(FILE *out, Prof *prof)
+{
+#if PROF_COMPACT
+    if (prof->compact)
+    {   prof_compact_expand(prof);   }
+#endif
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+
+    ProfIdx       tree_n = prof->record_smpl_tree_n;
+    ProfAllocAgg *scopes = (ProfAllocAgg *)prof->reallocate(prof->allocator, 0, (tree_n + 1) * sizeof(*scopes));
+    ProfAllocAgg *selfs  = (ProfAllocAgg *)prof->reallocate(prof->allocator, 0, (tree_n + 1) * sizeof(*selfs));
+    memset(scopes, 0, (tree_n + 1) * sizeof(*scopes)); // scopes[tree_n] is outside any scope
+    memset(selfs,  0, (tree_n + 1) * sizeof(*selfs));
+    ProfPtrMap live[1]; // address -> the ptr_smpls index that allocated it
+    memset(live, 0, sizeof(live));
+
+    for (ProfIdx ptr_smpl_i = 0; ptr_smpl_i < prof->ptr_smpls_n; ++ptr_smpl_i)
+    {
+        ProfPtrSmpl ptr_smpl = prof->ptr_smpls[ptr_smpl_i];
+        ProfIdx     smpl_i   = prof_smpl_tree_i(prof, ptr_smpl.smpl_i);
+        if (smpl_i >= tree_n)
+        {   smpl_i = ~(ProfIdx)0;   }
+
+        if (! ptr_smpl.size || ptr_smpl.addr_p)
+        { // a free, or a realloc freeing its old block
+            ProfIdx alloc_i = prof_ptr_map_remove(live, (ptr_smpl.size ? ptr_smpl.addr_p : ptr_smpl.addr));
+            if (~alloc_i)
+            {
+                ProfPtrSmpl alloc = prof->ptr_smpls[alloc_i];
+                ProfIdx     alloc_smpl_i = prof_smpl_tree_i(prof, alloc.smpl_i);
+                if (alloc_smpl_i >= tree_n)
+                {   alloc_smpl_i = ~(ProfIdx)0;   }
+                selfs[~alloc_smpl_i ? alloc_smpl_i : tree_n].live_bytes -= (int64_t)alloc.size;
+                for (ProfIdx scope_i = alloc_smpl_i; ~scope_i; scope_i = prof_smpl_parent_i(prof, scope_i))
+                {   scopes[scope_i].live_bytes -= (int64_t)alloc.size;   }
+                if (! ~alloc_smpl_i)
+                {   scopes[tree_n].live_bytes -= (int64_t)alloc.size;   }
+            }
+
+            if (! ptr_smpl.size)
+            {
+                selfs[~smpl_i ? smpl_i : tree_n].frees_n += 1;
+                for (ProfIdx scope_i = smpl_i; ~scope_i; scope_i = prof_smpl_parent_i(prof, scope_i))
+                {   scopes[scope_i].frees_n += 1;   }
+                if (! ~smpl_i)
+                {   scopes[tree_n].frees_n += 1;   }
+            }
+        }
+
+        if (ptr_smpl.size)
+        {
+            ProfAllocAgg *self = &selfs[~smpl_i ? smpl_i : tree_n];
+            self->allocs_n   += 1;
+            self->bytes      += ptr_smpl.size;
+            self->live_bytes += (int64_t)ptr_smpl.size;
+            if (self->live_bytes > self->peak_live_bytes)
+            {   self->peak_live_bytes = self->live_bytes;   }
+
+            for (ProfIdx scope_i = (~smpl_i ? smpl_i : tree_n); ~scope_i;
+                 scope_i = (scope_i != tree_n ? prof_smpl_parent_i(prof, scope_i) : ~(ProfIdx)0))
+            {
+                ProfAllocAgg *scope = &scopes[scope_i];
+                scope->allocs_n   += 1;
+                scope->bytes      += ptr_smpl.size;
+                scope->live_bytes += (int64_t)ptr_smpl.size;
+                if (scope->live_bytes > scope->peak_live_bytes)
+                {   scope->peak_live_bytes = scope->live_bytes;   }
+            }
+            prof_ptr_map_set(live, ptr_smpl.addr, ptr_smpl_i);
+        }
+    }
+
+    // per record, plus one for outside any scope
+    ProfIdx             aggs_n = prof->records_n + 1;
+    ProfAllocRecordAgg *aggs   = (ProfAllocRecordAgg *)prof->reallocate(prof->allocator, 0, aggs_n * sizeof(*aggs));
+    memset(aggs, 0, aggs_n * sizeof(*aggs));
+    for (ProfIdx agg_i = 0; agg_i < aggs_n; ++agg_i)
+    {   aggs[agg_i].record_i = (agg_i < prof->records_n ? agg_i : ~(ProfIdx)0);   }
+    for (ProfIdx scope_i = 0; scope_i <= tree_n; ++scope_i)
+    {
+        ProfAllocAgg scope = scopes[scope_i];
+        ProfAllocAgg self  = selfs[scope_i];
+        if (! scope.allocs_n && ! scope.frees_n)
+        {   continue;   }
+
+        ProfAllocRecordAgg *agg = &aggs[scope_i < tree_n ? prof->record_smpl_tree[scope_i].record_i : prof->records_n];
+        agg->smpls_n       += 1;
+        agg->incl.allocs_n += scope.allocs_n;
+        agg->incl.frees_n  += scope.frees_n;
+        agg->incl.bytes    += scope.bytes;
+        agg->self.allocs_n += self.allocs_n;
+        agg->self.frees_n  += self.frees_n;
+        agg->self.bytes    += self.bytes;
+        if (scope.peak_live_bytes > agg->incl.peak_live_bytes) {   agg->incl.peak_live_bytes = scope.peak_live_bytes;   }
+        if (self.peak_live_bytes  > agg->self.peak_live_bytes) {   agg->self.peak_live_bytes = self.peak_live_bytes;    }
+    }
+    qsort(aggs, aggs_n, sizeof(*aggs), prof_alloc_record_agg_cmp);
+
+    fprintf(out, "%10s %12s %14s %14s %12s %14s  %s\n",
+            "samples", "allocs", "bytes", "peak live", "self allocs", "self bytes", "record");
+    for (ProfIdx agg_i = 0; agg_i < aggs_n; ++agg_i)
+    {
+        ProfAllocRecordAgg agg = aggs[agg_i];
+        if (! agg.smpls_n)
+        {   continue;   }
+        fprintf(out, "%10llu %12llu %14llu %14lld %12llu %14llu  ",
+                (unsigned long long)agg.smpls_n, (unsigned long long)agg.incl.allocs_n,
+                (unsigned long long)agg.incl.bytes, (long long)agg.incl.peak_live_bytes,
+                (unsigned long long)agg.self.allocs_n, (unsigned long long)agg.self.bytes);
+        if (~agg.record_i)
+        {
+            ProfRecord record = prof->records[agg.record_i];
+            fprintf(out, "%s (%s:%u)\n", record.name, record.filename, record.line_num);
+        }
+        else
+        {   fprintf(out, "(outside any scope)\n");   }
+    }
+
+    prof_ptr_map_free(live);
+    prof->reallocate(prof->allocator, aggs,   0);
+    prof->reallocate(prof->allocator, selfs,  0);
+    prof->reallocate(prof->allocator, scopes, 0);
+}
+
+// writes the pointer samples in the PROF_BIN_PTR layout, in the order they were taken
+// Call before prof_dump_timings_file, which clears them. Returns non-zero on success.
+static int
+prof_dump_ptrs_file(FILE *out, Prof const *prof)
+{
+    ProfBinPtrHeader hdr; {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, PROF_BIN_PTR_MAGIC, sizeof(PROF_BIN_PTR_MAGIC));
+        hdr.version      = PROF_BIN_PTR_VERSION;
+        hdr.header_size  = sizeof(hdr);
+        hdr.freq         = prof->freq;
+        hdr.smpls_offset = sizeof(hdr);
+        hdr.smpls_n      = prof->ptr_smpls_n;
+        hdr.pid          = prof->pid;
+    }
+    int result = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+
+    ProfBinPtrSmpl buf[256];
+    for (ProfIdx ptr_smpl_i = 0; ptr_smpl_i < prof->ptr_smpls_n && result; ptr_smpl_i += 256)
+    {
+        ProfIdx buf_n = prof->ptr_smpls_n - ptr_smpl_i;
+        if (buf_n > 256)
+        {   buf_n = 256;   }
+        for (ProfIdx buf_i = 0; buf_i < buf_n; ++buf_i)
+        {
+            ProfPtrSmpl ptr_smpl = prof->ptr_smpls[ptr_smpl_i + buf_i];
+            ProfBinPtrSmpl *bin = &buf[buf_i];
+            bin->addr     = ptr_smpl.addr;
+            bin->addr_p   = ptr_smpl.addr_p;
+            bin->cycles   = ptr_smpl.cycles;
+            bin->size     = ptr_smpl.size;
+            bin->record_i = ptr_smpl.record_i;
+            bin->pad      = 0;
+        }
+        result = fwrite(buf, sizeof(*buf), buf_n, out) == buf_n;
+    }
+    return result;
+}
+
+// writes `, "args": {...}` with whatever extra data the enabled modes have for this sample, if any
+static void
+prof_dump_smpl_args(ProfWriter *w, Prof const *prof, ProfIdx smpl_i, uint32_t hits_n)
+{
+    int            has_args = 0;
+    ProfRecordSmpl smpl     = prof->record_smpl_tree[smpl_i];
+    double         wall_ms  = (double)(smpl.cycles_end - smpl.cycles_start) * w->ts_scale / 1000000.0;
+    (void)wall_ms;
+#define prof_dump_arg(w, key) \
+    ((has_args ? prof_writer_put_lit(w, ", \"" key "\": ") : prof_writer_put_lit(w, ", \"args\": {\"" key "\": ")), has_args = 1)
+
+    if (hits_n != 1)
+    {
+        prof_dump_arg(w, "hits");
+        prof_writer_put_u64(w, hits_n);
+        if (hits_n)
+        {
+            prof_dump_arg(w, "ms_per_hit");
+            prof_writer_put_f64(w, wall_ms / hits_n);
+        }
+    }
+
+#if PROF_PERF
+    if (prof->perf && smpl_i < prof->perf->smpls_m)
+    {
+        ProfPerfSmpl perf_smpl = prof->perf->smpls[smpl_i];
+        for (int counter_i = 0; counter_i < PROF_PERF_COUNTERS_N; ++counter_i)
+        {
+            if (has_args) {   prof_writer_put_lit(w, ", \"");             }
+            else          {   prof_writer_put_lit(w, ", \"args\": {\"");   }
+            prof_writer_put(w, prof_perf_counter_names[counter_i], strlen(prof_perf_counter_names[counter_i]));
+            prof_writer_put_lit(w, "\": ");
+            prof_writer_put_u64(w, perf_smpl.counts[counter_i]);
+            has_args = 1;
+        }
+        prof_dump_arg(w, "ipc");
+        prof_writer_put_lf(w, (perf_smpl.counts[PROF_PERF_cycles]
+                               ? (double)perf_smpl.counts[PROF_PERF_instructions] / perf_smpl.counts[PROF_PERF_cycles]
+                               : 0.0));
+    }
+#endif
+
+#if PROF_CPU_TIME
+    if (prof->cpu && smpl_i < prof->cpu->smpls_m)
+    {
+        ProfCpuSmpl cpu_smpl = prof->cpu->smpls[smpl_i];
+        double      cpu_ms   = cpu_smpl.cpu_ns / 1000000.0;
+        prof_dump_arg(w, "cpu_ms");
+        prof_writer_put_lf(w, cpu_ms);
+        prof_dump_arg(w, "off_cpu_ms");
+        prof_writer_put_lf(w, (wall_ms > cpu_ms ? wall_ms - cpu_ms : 0.0));
+        prof_dump_arg(w, "cpu");
+        prof_writer_put_u64(w, cpu_smpl.cpu_start);
+        if (cpu_smpl.cpu_end != cpu_smpl.cpu_start)
+        {
+            prof_dump_arg(w, "migrated_to_cpu");
+            prof_writer_put_u64(w, cpu_smpl.cpu_end);
+        }
+    }
+#endif
+
+#if PROF_WAIT
+    ProfWaitSmpl const *wait_smpl = (prof->wait
+                                     ? prof_wait_find(prof, smpl_i)
+                                     : 0);
+    if (wait_smpl)
+    {
+        char const *kind_name = prof_wait_kind_names[wait_smpl->kind];
+        if (has_args) {   prof_writer_put_lit(w, ", \"");             }
+        else          {   prof_writer_put_lit(w, ", \"args\": {\"");   }
+        prof_writer_put(w, kind_name, strlen(kind_name));
+        prof_writer_put_lit(w, "\": ");
+        if (wait_smpl->kind == PROF_WAIT_fd)
+        {   prof_writer_put_u64(w, wait_smpl->obj);   }
+        else
+        {
+            prof_writer_put_lit(w, "\"");
+            prof_writer_put_hex(w, wait_smpl->obj);
+            prof_writer_put_lit(w, "\"");
+        }
+        has_args = 1;
+    }
+#endif
+
+#undef prof_dump_arg
+    if (has_args)
+    {   prof_writer_put_lit(w, "}");   }
+}
+
+// lazily made, and kept between dumps so the buffer and escaped names are reused
+static ProfWriter *
+prof_dump_writer(Prof *prof, FILE *out)
+{
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+    if (! prof->writer)
+    {
+        prof->writer = (ProfWriter *)prof->reallocate(prof->allocator, 0, sizeof(*prof->writer));
+        prof_writer_init(prof->writer, out, prof->freq, prof->reallocate, prof->allocator);
+        prof->writer->events_n = 1; // assume a file passed in already has events
+    }
+
+    ProfWriter *w = prof->writer;
+    prof_writer_set_freq(w, prof->freq);
+    w->is_new_dump = 1;
+    if (w->out != out)
+    {
+        w->out      = out;
+        w->events_n = 1;
+    }
+    return w;
+}
+
+static void
+prof_dump_close(Prof *prof)
+{
+    if (prof->writer)
+    {
+        prof_writer_close(prof->writer);
+        prof->reallocate(prof->allocator, prof->writer, 0);
+        prof->writer = 0;
+    }
+}
+
+// the first hits sample at or after smpl_i, for starting prof_smpl_hits_n partway through the samples
+static ProfIdx
+prof_hits_smpls_lower_bound(Prof const *prof, ProfIdx smpl_i)
+{
+    ProfIdx lo = 0, hi = prof->hits_smpls_n;
+    while (lo < hi)
+    {
+        ProfIdx mid = lo + (hi - lo) / 2;
+        if (prof->hits_smpls[mid].smpl_i < smpl_i) {   lo = mid + 1;   }
+        else                                        {   hi = mid;       }
+    }
+    return lo;
+}
+
+static void
+prof_dump_process_name(ProfWriter *w, Prof const *prof)
+{
+    prof_writer_event(w);
+    prof_writer_put_lit(w, "\"name\":\"process_name\", \"ph\":\"M\", \"pid\": ");
+    prof_writer_put_u64(w, prof->pid);
+    prof_writer_put_lit(w, ", \"args\": {\"name\":\"pid ");
+    prof_writer_put_u64(w, prof->pid);
+    prof_writer_put_lit(w, " (fork generation ");
+    prof_writer_put_u64(w, prof->fork_gen);
+    prof_writer_put_lit(w, ")\"}}");
+}
+
+// samples [smpl_first, smpl_end); names is a writer that has cached prof's record names, and can be w.
+// hits_smpls must be sorted
+static void
+prof_dump_smpls(ProfWriter *w, ProfWriter const *names, Prof const *prof, ProfIdx smpl_first, ProfIdx smpl_end)
+{
+    ProfIdx         hits_smpl_i      = prof_hits_smpls_lower_bound(prof, smpl_first);
+    ProfRecordSmpl *record_smpl_tree = prof->record_smpl_tree;
+    for (ProfIdx record_smpl_tree_i = smpl_first; record_smpl_tree_i < smpl_end; ++record_smpl_tree_i)
+    {
+        // TODO: units
+        ProfRecordSmpl record_smpl = record_smpl_tree[record_smpl_tree_i];
+        prof_writer_event(w);
+        prof_writer_put_lit(w, "\"name\":\"");
+        prof_writer_put_cached_name(w, names, record_smpl.record_i);
+
+        // TODO: should these just be in separate arrays?
+        if (record_smpl.cycles_start != record_smpl.cycles_end)
+        { // normal record
+            prof_writer_put_lit(w, "\", \"ph\":\"X\", \"ts\": ");
+            prof_writer_put_cycles(w, record_smpl.cycles_start);
+            prof_writer_put_lit(w, ", \"dur\": ");
+            prof_writer_put_cycles(w, record_smpl.cycles_end - record_smpl.cycles_start);
+            prof_writer_put_lit(w, ", ");
+            prof_writer_put_pid_tid(w, prof->pid, prof->tid);
+            prof_dump_smpl_args(w, prof, record_smpl_tree_i, prof_smpl_hits_n(prof, record_smpl_tree_i, &hits_smpl_i));
+            prof_writer_put_lit(w, "}");
+        }
+
+        else
+        { // mark
+            prof_writer_put_lit(w, "\", \"ph\":\"i\", \"ts\": ");
+            prof_writer_put_cycles(w, record_smpl.cycles_start);
+            prof_writer_put_lit(w, ", ");
+            prof_writer_put_pid_tid(w, prof->pid, prof->tid);
+            prof_writer_put_lit(w, "}");
+        }
+    }
+}
+
+static void
+prof_dump_counters(ProfWriter *w, ProfWriter const *names, Prof *prof)
+{
+    for (ProfIdx counter_i = 0; counter_i < prof->counters_m; ++counter_i)
+    { // changes that were skipped by every_n
+        ProfCounter counter = prof->counters[counter_i];
+        if (counter.calls_n && (counter.value != counter.sampled_value || ! counter.is_sampled))
+        {   prof_counter_(prof, counter_i, counter.value, 0);   }
+    }
+
+    for (ProfIdx smpl_i = 0; smpl_i < prof->counter_smpls_n; ++smpl_i)
+    {
+        ProfCounterSmpl smpl = prof->counter_smpls[smpl_i];
+        prof_writer_event(w);
+        prof_writer_put_lit(w, "\"name\":\"");
+        prof_writer_put_cached_name(w, names, smpl.record_i);
+        prof_writer_put_lit(w, "\", \"ph\":\"C\", \"ts\": ");
+        prof_writer_put_cycles(w, smpl.cycles);
+        prof_writer_put_lit(w, ", ");
+        prof_writer_put_pid_tid(w, prof->pid, prof->tid);
+        prof_writer_put_lit(w, ", \"args\": {\"value\": ");
+        prof_writer_put_f64(w, smpl.value);
+        prof_writer_put_lit(w, "}}");
+    }
+    prof->counter_smpls_n = 0;
+}
+
+// async spans and flows since the last dump
+static void
+prof_dump_async(ProfWriter *w, ProfWriter const *names, Prof *prof)
+{
+    if (prof->async_smpls)
+    {
+        static char const phases[] = { 'b', 'e', 's', 't', 'f' };
+        static char const hex[]    = "0123456789abcdef";
+        uint64_t async_smpls_n = prof_async_load(&prof->async_smpls_n);
+        uint64_t async_smpl_i  = prof->async_smpls_dumped;
+        if (async_smpls_n - async_smpl_i > prof->async_smpls_m)
+        {   async_smpl_i = async_smpls_n - prof->async_smpls_m;   } // the rest have been overwritten
+
+        for (; async_smpl_i < async_smpls_n; ++async_smpl_i)
+        {
+            ProfAsyncSmpl *slot = &prof->async_smpls[async_smpl_i & (prof->async_smpls_m - 1)];
+            uint64_t       seq  = prof_async_load(&slot->seq);
+            ProfAsyncSmpl  smpl = *slot;
+            prof_async_fence_acquire(); // NOTE: so the copy is read before seq is checked again
+            if (seq != async_smpl_i + 1 || prof_async_load(&slot->seq) != seq)
+            {   continue;   } // still being written, or overwritten since
+
+            prof_writer_event(w);
+            prof_writer_put_lit(w, "\"name\":\"");
+            prof_writer_put_cached_name(w, names, smpl.record_i);
+            if (smpl.phase <= PROF_ASYNC_end) {   prof_writer_put_lit(w, "\", \"cat\":\"async\", \"ph\":\"");   }
+            else                              {   prof_writer_put_lit(w, "\", \"cat\":\"flow\", \"ph\":\"");    }
+            prof_writer_put(w, &phases[smpl.phase], 1);
+            prof_writer_put_lit(w, "\", \"id\":\"0x");
+            { // hex without leading zeros
+                char    *dst      = prof_writer_reserve(w, 16);
+                int      digits_n = 1;
+                while (digits_n < 16 && (smpl.id >> (4 * digits_n)))
+                {   ++digits_n;   }
+                for (int digit_i = 0; digit_i < digits_n; ++digit_i)
+                {   dst[digit_i] = hex[(smpl.id >> (4 * (digits_n - 1 - digit_i))) & 0xF];   }
+                w->buf_n += digits_n;
+            }
+            prof_writer_put_lit(w, "\", \"ts\": ");
+            prof_writer_put_cycles(w, smpl.cycles);
+            prof_writer_put_lit(w, ", ");
+            prof_writer_put_pid_tid(w, prof->pid, smpl.tid);
+            if (smpl.phase == PROF_FLOW_end)
+            {   prof_writer_put_lit(w, ", \"bp\":\"e\"");   }
+            prof_writer_put_lit(w, "}");
+        }
+        prof->async_smpls_dumped = async_smpls_n;
+    }
+}
+
+// once the samples have been written out
+static void
+prof_dump_reset(Prof *prof)
+{
+#if PROF_COMPACT
+    if (prof->compact)
+    {   prof_compact_reset(prof);   }
+#endif
+#if PROF_MMAP
+    if (prof->mmap) // the file is read until the first zeroed sample
+    {   memset(prof->record_smpl_tree, 0, prof->record_smpl_tree_n * sizeof(*prof->record_smpl_tree));   }
+#endif
+#if PROF_WAIT
+    if (prof->wait)
+    {   prof->wait->smpls_n = 0;   }
+#endif
+    prof->record_smpl_tree_n = 0;
+    prof->hits_smpls_n       = 0;
+    prof->ptr_smpls_n        = 0; // they refer to the samples
+}
+
+// *out can be NULL the first time to init, otherwise ensure there's a '[' at the beginning of the file
+static void
+prof_dump_timings_file(FILE **out, char const *filename, Prof *prof)
+{
+    ProfWriter *w;
+    if (! *out)
+    {
+        *out = fopen(filename, "w");
+        assert(*out);
+        w = prof_dump_writer(prof, *out);
+        w->events_n = 0;
+        prof_writer_put_lit(w, "[\n");
+        prof_dump_process_name(w, prof);
+    }
+    else
+    {   w = prof_dump_writer(prof, *out);   }
+#if PROF_ADDR
+    prof_addr_dump_modules(w, prof);
+#endif
+
+#if PROF_COMPACT
+    if (prof->compact)
+    {   prof_compact_expand(prof);   }
+#endif
+    prof_sort_hits_smpls(prof);
+    prof_writer_cache_names(w, prof);
+    prof_dump_smpls(w, w, prof, 0, prof->record_smpl_tree_n);
+    prof_dump_counters(w, w, prof);
+    prof_dump_async(w, w, prof);
+
+#if 0 // MEMORY sampling
+    fprintf(out, ",\n\n");
+
+    ProfPtrSmpl *ptr_smpls   = prof->ptr_smpls;
+    size_t       ptr_smpls_n = prof->ptr_smpls_n;
+
+    ProfPtrSmpl **opens = 0;
+    ProfIdx open_n = 0, open_m = 0;
+
+    { // introduce all data series
+        fprintf(out, "    {"
+                "\"name\":\"memory\", "
+                "\"ph\":\"C\", "
+                "\"ts\": %lf, "
+                "\"args\": {"
+                , ptr_smpls[0].cycles / ms
+        );
+
+        for (size_t ptr_smpls_i = 0; ptr_smpls_i < ptr_smpls_n; ++ptr_smpls_i)
+        {
+            if (ptr_smpls_i > 0)
+            {   fputs(",", out);   }
+            fprintf(out, "\"0x%08llx\": 0", ptr_smpls[ptr_smpls_i].addr);
+        }
+
+        fprintf(out,
+                "}, "
+                "\"pid\": 0, "
+                "\"tid\": 0"
+                "}");
+
+        fputs(",\n\n", out);
+    }
+
+    for (size_t ptr_smpls_i = 0; 0 && ptr_smpls_i < ptr_smpls_n; ++ptr_smpls_i)
+    { // memory count
+        ProfPtrSmpl ptr_smpl = ptr_smpls[ptr_smpls_i];
+        ProfRecord  record   = records[ptr_smpl.record_i];
+
+        { // update open array
+            if (ptr_smpl.size > 0)
+            { // some mem was (re)alloc'd
+                if (ptr_smpl.addr_p) // realloc
+                { // replace open ptr with this one
+                    ProfIdx already_open_i = ~(ProfIdx)0;
+                    for (ProfIdx open_i = 0; open_i < open_n; ++open_i)
+                    { // check if this pointer has been alloc'd but not freed
+                        ProfPtrSmpl *open = opens[open_i];
+
+                        assert((ptr_smpl.addr == ptr_smpl.addr_p || // realloc'ing in place
+                                ptr_smpl.addr != open->addr)
+                               && "the same address cannot be opened multiple times");
+
+                        if (open->addr == ptr_smpl.addr_p)
+                        {   already_open_i = open_i; break;   }
+                    }
+                    assert(~already_open_i && "there must be a pointer to replace");
+                    opens[already_open_i] = &ptr_smpls[ptr_smpls_i];
+                }
+
+                else // straight alloc
+                { // append current smpl to open list
+                    if (open_n == open_m)
+                    {   opens = (ProfPtrSmpl **)prof_grow(prof, opens, &open_m, sizeof(*opens));   }
+                    ptr_smpls = prof->ptr_smpls; // the allocation from prof_grow may have moved the array
+
+                    opens[open_n++] = &ptr_smpls[ptr_smpls_i];
+                }
+            }
+
+            else // free
+            { // endswap remove open smpl
+                ProfIdx already_open_i = ~(ProfIdx)0;
+                for (ProfIdx open_i = 0; open_i < open_n; ++open_i)
+                { // check if this pointer has been alloc'd but not freed
+                    ProfPtrSmpl *open = opens[open_i];
+                    if (open->addr == ptr_smpl.addr)
+                    {   already_open_i = open_i; break;   }
+                }
+                assert(~already_open_i && "there must be a pointer to remove");
+                opens[already_open_i] = opens[--open_n];
+            }
+        }
+
+        if (ptr_smpls_i > 0)
+        {   fputs(",\n", out);   }
+
+        fprintf(out, "    {"
+                "\"name\":\"memory\", "
+                "\"ph\":\"C\", "
+                "\"ts\": %lf, "
+                "\"args\": {"
+                , ptr_smpl.cycles / ms
+        );
+
+        for (size_t open_i = 0; open_i < open_n; ++open_i)
+        {
+            ProfPtrSmpl open = *opens[open_i];
+
+            if (open_i > 0)
+            {   fputs(",", out);   }
+
+            fprintf(out, "\"0x%08llx\": %llu", open.addr, open.size);
+        }
+
+        fprintf(out,
+                "}, "
+                "\"pid\": 0, "
+                "\"tid\": 0"
+                "}");
+    }
+
+    { // continue still open memory to last profiling time
+        uint64_t final_cycles = 0;
+        for (ProfIdx smpl_i = 0; smpl_i < record_smpl_tree_n; ++ smpl_i)
+        { // find last profiling time
+            uint64_t smpl_cycles = record_smpl_tree[smpl_i].cycles_end;
+            if (smpl_cycles > final_cycles)
+            {   final_cycles = smpl_cycles;   } // NOTE: there's a slight discrepancy here, I think due to rounding from "dur" = begin + (end-begin)
+        }
+
+        fprintf(out, ",\n    {"
+                "\"name\":\"memory\", "
+                "\"ph\":\"C\", "
+                "\"ts\": %lf, "
+                "\"args\": {"
+                , final_cycles / ms
+        );
+
+        for (ProfIdx open_i = 0; open_i < open_n; ++open_i)
+        {
+            ProfPtrSmpl open = *opens[open_i];
+
+            if (open_i > 0)
+            {   fputs(",", out);   }
+
+            fprintf(out, "\"0x%08llx\": %llu", open.addr, open.size);
+        }
+
+        fprintf(out,
+                "}, "
+                "\"pid\": 0, "
+                "\"tid\": 0"
+                "}");
+    }
+#endif
+
+    prof_writer_flush(w);
+    fflush(*out);
+    prof_dump_reset(prof);
+}
+#endif // OUTPUT
+
+#if PROF_STREAM // SOCKET STREAMING
+// Ships samples over a Unix datagram socket to a collector process (see professor_collector.c) instead of
+// formatting and writing them here. Call prof_stream_flush wherever you'd call prof_dump_timings_file: the samples,
+// hits and any records not sent yet go out as datagrams of at most PROF_STREAM_BATCH_SIZE bytes, then are cleared.
+// Sends never block: if the collector isn't there or isn't keeping up, the rest of the flush is dropped and counted.
+// The collector throws away flushes that didn't arrive whole.
+// NOTE: Linux queues only net.unix.max_dgram_qlen (default 10) datagrams per socket, so with big flushes it may be
+// worth raising, or flushing more often
+// NOTE: only the scope samples are sent: no counters, async spans, pointer samples or per-mode args
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PROF_STREAM_MAGIC   "PROFSTR"
+#define PROF_STREAM_VERSION 1
+
+#ifndef  PROF_STREAM_BATCH_SIZE
+# define PROF_STREAM_BATCH_SIZE (32 << 10)
+#endif //PROF_STREAM_BATCH_SIZE
+
+typedef enum ProfStreamKind {
+    PROF_STREAM_records, // items: ProfStreamRecord, each followed by its name and filename (not 0-terminated)
+    PROF_STREAM_smpls,   // items: ProfRecordSmpl, indices relative to the flush
+    PROF_STREAM_hits,    // items: ProfHitsSmpl
+    PROF_STREAM_end,     // no items; batch_i is how many batches the flush had before this
+} ProfStreamKind;
+
+typedef struct ProfStreamBatch {
+    char     magic[8];
+    uint16_t version;
+    uint16_t kind;
+    uint32_t header_size;
+    uint64_t pid, tid;
+    double   freq;
+    uint64_t flush_i;
+    uint32_t batch_i;   // within the flush
+    uint32_t first_i;   // the record/sample index of the first item
+    uint32_t items_n;
+    uint32_t pad;
+    uint64_t dropped_n; // flushes the sender has dropped so far
+} ProfStreamBatch;
+
+typedef struct ProfStreamRecord {
+    uint32_t line_num;
+    uint16_t name_n;
+    uint16_t filename_n;
+} ProfStreamRecord;
+
+typedef struct ProfStream {
+    int                fd;
+    struct sockaddr_un addr;
+    ProfIdx            records_sent_n; // the collector knows the records before this
+    uint64_t           flush_i;
+    uint64_t           flushes_dropped_n;
+    uint64_t           batches_dropped_n;
+    uint64_t           smpls_dropped_n;
+    union { ProfStreamBatch hdr; char bytes[PROF_STREAM_BATCH_SIZE]; } buf;
+} ProfStream;
+
+// path is the collector's socket; it doesn't have to be there yet. returns non-zero on success
+static int
+prof_stream_open(Prof *prof, ProfStream *stream, char const *path)
+{
+    memset(stream, 0, sizeof(*stream));
+    if (strlen(path) >= sizeof(stream->addr.sun_path))
+    {   return 0;   }
+    stream->addr.sun_family = AF_UNIX;
+    strcpy(stream->addr.sun_path, path);
+
+    stream->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (stream->fd < 0)
+    {   return 0;   }
+
+    int sndbuf = 4 * PROF_STREAM_BATCH_SIZE;
+    setsockopt(stream->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    prof->stream = stream;
+    return 1;
+}
+
+static void
+prof_stream_close(Prof *prof)
+{
+    ProfStream *stream = prof->stream;
+    if (stream)
+    {
+        close(stream->fd);
+        prof->stream = 0;
+    }
+}
+
+// returns non-zero if the batch went out whole
+static int
+prof_stream_send(Prof const *prof, ProfStream *stream, ProfStreamKind kind, uint32_t batch_i,
+                 uint32_t first_i, uint32_t items_n, size_t size)
+{
+    ProfStreamBatch *hdr = &stream->buf.hdr;
+    memcpy(hdr->magic, PROF_STREAM_MAGIC, sizeof(PROF_STREAM_MAGIC));
+    hdr->version     = PROF_STREAM_VERSION;
+    hdr->kind        = (uint16_t)kind;
+    hdr->header_size = sizeof(*hdr);
+    hdr->pid         = prof->pid;
+    hdr->tid         = prof->tid;
+    hdr->freq        = prof->freq;
+    hdr->flush_i     = stream->flush_i;
+    hdr->batch_i     = batch_i;
+    hdr->first_i     = first_i;
+    hdr->items_n     = items_n;
+    hdr->pad         = 0;
+    hdr->dropped_n   = stream->flushes_dropped_n;
+
+    ssize_t sent_n;
+    do {
+        sent_n = sendto(stream->fd, stream->buf.bytes, size, MSG_DONTWAIT,
+                        (struct sockaddr const *)&stream->addr, sizeof(stream->addr));
+    } while (sent_n < 0 && errno == EINTR);
+    return sent_n == (ssize_t)size;
+}
+
+// sends the samples taken since the last flush and clears them, like prof_dump_timings_file
+// returns non-zero if the whole flush was sent
+static int
+prof_stream_flush(Prof *prof)
+{
+    ProfStream *stream = prof->stream;
+#if PROF_COMPACT
+    if (prof->compact)
+    {   prof_compact_expand(prof);   }
+#endif
+    prof_sort_hits_smpls(prof);
+
+    size_t const hdr_size  = sizeof(ProfStreamBatch);
+    uint32_t     batch_i   = 0;
+    int          ok        = 1;
+    uint32_t     batches_n = 0; // that would have been sent
+    uint32_t     sent_n    = 0;
+
+    { // records first, so the collector can name the samples
+        ProfIdx record_i = stream->records_sent_n;
+        while (record_i < prof->records_n && ok)
+        {
+            ProfIdx first_i = record_i;
+            size_t  size    = hdr_size;
+            for (; record_i < prof->records_n; ++record_i)
+            {
+                ProfRecord  record     = prof->records[record_i];
+                size_t      name_n     = (record.name     ? strlen(record.name)     : 0);
+                size_t      filename_n = (record.filename ? strlen(record.filename) : 0);
+                if (name_n     > 1024) {   name_n     = 1024;   }
+                if (filename_n > 1024) {   filename_n = 1024;   }
+                if (size + sizeof(ProfStreamRecord) + name_n + filename_n > PROF_STREAM_BATCH_SIZE)
+                {   break;   }
+
+                ProfStreamRecord stream_record; {
+                    stream_record.line_num   = record.line_num;
+                    stream_record.name_n     = (uint16_t)name_n;
+                    stream_record.filename_n = (uint16_t)filename_n;
+                }
+                memcpy(stream->buf.bytes + size, &stream_record, sizeof(stream_record)); size += sizeof(stream_record);
+                memcpy(stream->buf.bytes + size, record.name,     name_n);               size += name_n;
+                memcpy(stream->buf.bytes + size, record.filename, filename_n);           size += filename_n;
+            }
+            ++batches_n;
+            ok = prof_stream_send(prof, stream, PROF_STREAM_records, batch_i++, first_i, record_i - first_i, size);
+            if (ok)
+            {   stream->records_sent_n = record_i; ++sent_n;   }
+        }
+    }
+
+#define prof_stream_send_array(KIND, ARRAY, ARRAY_N) do { \
+        ProfIdx per_batch_n = (ProfIdx)((PROF_STREAM_BATCH_SIZE - hdr_size) / sizeof(*(ARRAY))); \
+        for (ProfIdx first_i = 0; first_i < (ARRAY_N); first_i += per_batch_n) \
+        { \
+            ProfIdx items_n = (ARRAY_N) - first_i; \
+            if (items_n > per_batch_n) {   items_n = per_batch_n;   } \
+            ++batches_n; \
+            if (ok) \
+            { \
+                memcpy(stream->buf.bytes + hdr_size, &(ARRAY)[first_i], items_n * sizeof(*(ARRAY))); \
+                ok = prof_stream_send(prof, stream, KIND, batch_i++, first_i, items_n, \
+                                      hdr_size + items_n * sizeof(*(ARRAY))); \
+                sent_n += (uint32_t)ok; \
+            } \
+        } \
+    } while (0)
+
+    prof_stream_send_array(PROF_STREAM_smpls, prof->record_smpl_tree, prof->record_smpl_tree_n);
+    prof_stream_send_array(PROF_STREAM_hits,  prof->hits_smpls,       prof->hits_smpls_n);
+#undef prof_stream_send_array
+
+    ++batches_n;
+    if (ok)
+    {   ok = prof_stream_send(prof, stream, PROF_STREAM_end, batch_i, 0, 0, hdr_size);   }
+
+    if (! ok)
+    {
+        stream->records_sent_n     = 0; // NOTE: the collector may not have them, e.g. if it wasn't up yet, so all go again
+        stream->flushes_dropped_n += 1;
+        stream->batches_dropped_n += batches_n - sent_n;
+        stream->smpls_dropped_n   += prof->record_smpl_tree_n;
+    }
+    stream->flush_i += 1;
+    prof_dump_reset(prof);
+    return ok;
+}
+#endif // PROF_STREAM
+
+#if PROF_PARALLEL_DUMP // PARALLEL DUMP
+// Dumps the samples of several Profs (e.g. one per thread) at once, formatted by a pool of threads.
+// The samples are split into chunks; each worker formats a chunk into its own buffer, then waits
+// for its turn to write it, so the file is in the same order as serial dumps of each Prof would be.
+// NOTE: the Profs must not be taking samples during the dump, e.g. at shutdown
+#include <pthread.h>
+
+#ifndef  PROF_DUMP_CHUNK_SMPLS
+# define PROF_DUMP_CHUNK_SMPLS (1 << 14)
+#endif //PROF_DUMP_CHUNK_SMPLS
+
+typedef struct ProfDumpChunk {
+    ProfIdx prof_i;
+    ProfIdx smpl_first, smpl_end;
+} ProfDumpChunk;
+
+typedef struct ProfDumpPool {
+    Prof *const   *profs;
+    ProfDumpChunk *chunks;
+    size_t         chunks_n;
+    size_t         format_chunk_i; // the next chunk to be formatted
+    size_t         write_chunk_i;  // the next chunk to be written
+    int            is_new_dump;    // for the first event of the first chunk
+    FILE          *out;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t  cond;
+} ProfDumpPool;
+
+static void *
+prof_dump_worker(void *arg)
+{
+    ProfDumpPool *pool = (ProfDumpPool *)arg;
+    ProfWriter    w[1];
+    prof_writer_init(w, 0, 0.0, pool->profs[0]->reallocate, pool->profs[0]->allocator); // grows rather than flushing
+    w->events_n = 1; // the header has been written
+
+    pthread_mutex_lock(&pool->mtx);
+    while (pool->format_chunk_i < pool->chunks_n)
+    {
+        size_t        chunk_i = pool->format_chunk_i++;
+        ProfDumpChunk chunk   = pool->chunks[chunk_i];
+        pthread_mutex_unlock(&pool->mtx);
+
+        Prof const *prof = pool->profs[chunk.prof_i];
+        prof_writer_set_freq(w, prof->freq);
+        w->is_new_dump = (chunk_i == 0 && pool->is_new_dump);
+        prof_dump_smpls(w, prof->writer, prof, chunk.smpl_first, chunk.smpl_end);
+
+        pthread_mutex_lock(&pool->mtx);
+        while (pool->write_chunk_i != chunk_i)
+        {   pthread_cond_wait(&pool->cond, &pool->mtx);   }
+        pthread_mutex_unlock(&pool->mtx);
+
+        w->out = pool->out; // only this worker writes until write_chunk_i moves on
+        prof_writer_flush(w);
+        w->out = 0;
+
+        pthread_mutex_lock(&pool->mtx);
+        ++pool->write_chunk_i;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mtx);
+
+    prof_writer_close(w);
+    return 0;
+}
+
+static void
+prof_dump_thread_name(ProfWriter *w, Prof const *prof)
+{
+    prof_writer_event(w);
+    prof_writer_put_lit(w, "\"name\":\"thread_name\", \"ph\":\"M\", ");
+    prof_writer_put_pid_tid(w, prof->pid, prof->tid);
+    prof_writer_put_lit(w, ", \"args\": {\"name\":\"tid ");
+    prof_writer_put_u64(w, prof->tid);
+    prof_writer_put_lit(w, "\"}}");
+}
+
+// like prof_dump_timings_file, for profs_n Profs with workers_n threads (including this one).
+// Each Prof keeps its own pid/tid track, and new files get process and thread name events for them
+static void
+prof_dump_timings_file_parallel(FILE **out, char const *filename, Prof *const *profs, ProfIdx profs_n, int workers_n)
+{
+    assert(profs_n > 0);
+    Prof       *prof_0 = profs[0];
+    ProfWriter *w;
+    if (! *out)
+    {
+        *out = fopen(filename, "w");
+        assert(*out);
+        w = prof_dump_writer(prof_0, *out);
+        w->events_n = 0;
+        prof_writer_put_lit(w, "[\n");
+        for (ProfIdx prof_i = 0; prof_i < profs_n; ++prof_i)
+        {
+            int is_new_pid = 1;
+            for (ProfIdx prev_i = 0; prev_i < prof_i; ++prev_i)
+            {   is_new_pid &= (profs[prev_i]->pid != profs[prof_i]->pid);   }
+            if (is_new_pid)
+            {   prof_dump_process_name(w, profs[prof_i]);   }
+            prof_dump_thread_name(w, profs[prof_i]);
+        }
+    }
+    else
+    {   w = prof_dump_writer(prof_0, *out);   }
+#if PROF_ADDR
+    for (ProfIdx prof_i = 0; prof_i < profs_n; ++prof_i)
+    {
+        if (profs[prof_i]->addr_records_i_map->n) // NOTE: assumes the Profs are all in this process
+        {   prof_addr_dump_modules(w, profs[prof_i]); break;   }
+    }
+#endif
+
+    ProfDumpPool pool[1];
+    memset(pool, 0, sizeof(*pool));
+    for (ProfIdx prof_i = 0; prof_i < profs_n; ++prof_i)
+    { // everything the workers share is made ready up front, and only read from then on
+        Prof *prof = profs[prof_i];
+        if (prof != prof_0)
+        {   prof_dump_writer(prof, *out);   } // for its name cache
+#if PROF_COMPACT
+        if (prof->compact)
+        {   prof_compact_expand(prof);   }
+#endif
+        prof_sort_hits_smpls(prof);
+        prof_writer_cache_names(prof->writer, prof);
+        pool->chunks_n += (prof->record_smpl_tree_n + PROF_DUMP_CHUNK_SMPLS - 1) / PROF_DUMP_CHUNK_SMPLS;
+    }
+
+    pool->profs       = profs;
+    pool->out         = *out;
+    pool->is_new_dump = w->is_new_dump;
+    pool->chunks      = (ProfDumpChunk *)prof_0->reallocate(prof_0->allocator, 0, (pool->chunks_n + 1) * sizeof(*pool->chunks));
+    {
+        size_t chunk_i = 0;
+        for (ProfIdx prof_i = 0; prof_i < profs_n; ++prof_i)
+        {
+            for (ProfIdx smpl_i = 0; smpl_i < profs[prof_i]->record_smpl_tree_n; smpl_i += PROF_DUMP_CHUNK_SMPLS)
+            {
+                ProfDumpChunk *chunk = &pool->chunks[chunk_i++];
+                chunk->prof_i     = prof_i;
+                chunk->smpl_first = smpl_i;
+                chunk->smpl_end   = (profs[prof_i]->record_smpl_tree_n - smpl_i > PROF_DUMP_CHUNK_SMPLS
+                                     ? smpl_i + PROF_DUMP_CHUNK_SMPLS
+                                     : profs[prof_i]->record_smpl_tree_n);
+            }
+        }
+    }
+    if (pool->chunks_n)
+    {   w->is_new_dump = 0;   }
+    prof_writer_flush(w); // the header goes before any chunk
+
+    if (workers_n < 1)
+    {   workers_n = 1;   }
+    if ((size_t)workers_n > pool->chunks_n)
+    {   workers_n = pool->chunks_n ? (int)pool->chunks_n : 1;   }
+
+    pthread_mutex_init(&pool->mtx, 0);
+    pthread_cond_init(&pool->cond, 0);
+    pthread_t *workers   = (pthread_t *)prof_0->reallocate(prof_0->allocator, 0, workers_n * sizeof(*workers));
+    int        started_n = 0;
+    for (int worker_i = 1; worker_i < workers_n; ++worker_i)
+    {
+        if (pthread_create(&workers[started_n], 0, prof_dump_worker, pool) == 0)
+        {   ++started_n;   } // NOTE: if threads can't be made, the rest of the work falls to this one
+    }
+    prof_dump_worker(pool);
+    for (int worker_i = 0; worker_i < started_n; ++worker_i)
+    {   pthread_join(workers[worker_i], 0);   }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mtx);
+    prof_0->reallocate(prof_0->allocator, workers,      0);
+    prof_0->reallocate(prof_0->allocator, pool->chunks, 0);
+
+    for (ProfIdx prof_i = 0; prof_i < profs_n; ++prof_i)
+    {
+        Prof *prof = profs[prof_i];
+        prof_writer_set_freq(w, prof->freq);
+        prof_dump_counters(w, prof->writer, prof);
+        prof_dump_async(w, prof->writer, prof);
+    }
+    prof_writer_flush(w);
+    fflush(*out);
+
+    for (ProfIdx prof_i = 0; prof_i < profs_n; ++prof_i)
+    {   prof_dump_reset(profs[prof_i]);   }
+}
+#endif // PROF_PARALLEL_DUMP
+
+#if PROF_FRAMES // N SLOWEST FRAMES
+// For frame/request-oriented programs: wrap each frame in prof_frame_begin/prof_frame_end and only the N slowest
+// frames keep their full sample trees. Every frame adds to the duration stats and the per-record summaries, then
+// its samples are dropped from record_smpl_tree, so memory stays bounded however long the program runs.
+//
+// ProfFrames frames;
+// prof_frames_open(prof, &frames, 8);
+// for (;;) { prof_frame_begin(prof); ...; prof_frame_end(prof); }
+// prof_frames_dump(&out, "slowest.json", prof); prof_frames_print(stdout, prof);
+//
+// NOTE: the kept frames are the samples only; PROF_PERF/PROF_CPU_TIME args aren't kept with them
+#include <string.h>
+
+#ifndef  PROF_FRAMES_HIST_SUB_BITS
+# define PROF_FRAMES_HIST_SUB_BITS 3 // 8 buckets per power of 2, so percentiles are within 12.5%
+#endif //PROF_FRAMES_HIST_SUB_BITS
+#define PROF_FRAMES_HIST_SUB_N (1 << PROF_FRAMES_HIST_SUB_BITS)
+#define PROF_FRAMES_HIST_N     (64 * PROF_FRAMES_HIST_SUB_N)
+
+typedef struct ProfFrame {
+    uint64_t        frame_i;
+    uint64_t        cycles_start, cycles_end;
+    ProfRecordSmpl *smpls; // the frame's record_smpl_tree, with parent_i relative to the frame
+    ProfIdx         smpls_n, smpls_m;
+    ProfHitsSmpl   *hits_smpls; // with smpl_i relative to the frame
+    ProfIdx         hits_smpls_n, hits_smpls_m;
+} ProfFrame;
+
+typedef struct ProfFrameRecordAgg { // parallel with records
+    uint64_t hits_n;
+    uint64_t cycles_n;   // inclusive
+    uint64_t cycles_max; // of a single hit
+} ProfFrameRecordAgg;
+
+typedef struct ProfFrames {
+    ProfFrame *slowest; // min-heap on duration, so the fastest of the kept frames is the one replaced
+    ProfIdx    slowest_n, slowest_m;
+
+    uint64_t   frames_n;
+    ProfIdx    frame_smpl_i;    // where the current frame's samples start in record_smpl_tree
+    uint64_t   frame_cycles_start;
+    uint64_t   cycles_min, cycles_max;
+    double     cycles_mean, cycles_m2; // running mean and sum of squared differences (Welford)
+    uint64_t   hist[PROF_FRAMES_HIST_N]; // log-linear histogram of frame durations
+
+    ProfFrameRecordAgg *record_aggs;
+    ProfIdx             record_aggs_m;
+
+    ProfWriter writer; // separate from prof->writer as frames go to their own file
+} ProfFrames;
+
+static inline ProfIdx
+prof_frames_hist_i(uint64_t cycles)
+{
+    ProfIdx result = (ProfIdx)cycles;
+    if (cycles >= PROF_FRAMES_HIST_SUB_N)
+    {
+        ProfIdx msb = PROF_FRAMES_HIST_SUB_BITS;
+        while (cycles >> (msb + 1))
+        {   ++msb;   }
+        ProfIdx sub = (ProfIdx)(cycles >> (msb - PROF_FRAMES_HIST_SUB_BITS)) & (PROF_FRAMES_HIST_SUB_N - 1);
+        result = (msb - PROF_FRAMES_HIST_SUB_BITS + 1) * PROF_FRAMES_HIST_SUB_N + sub;
+    }
+    return result;
+}
 
-    ProfRecordSmpl *record_smpl      = &prof->record_smpl_tree[prof->open_record_smpl_tree_i];
-    uint64_t        cycles_end       = __rdtsc();
-    uint64_t        cycles_n         = cycles_end - record_smpl->cycles_start;
-    /* uint64_t        hits_n__cycles_n = (uint64_t)cycles_n | ((uint64_t)hits_n << 32); */
+// the lowest duration that lands in the bucket
+static inline uint64_t
+prof_frames_hist_cycles(ProfIdx hist_i)
+{
+    uint64_t result = hist_i;
+    if (hist_i >= PROF_FRAMES_HIST_SUB_N)
+    {
+        ProfIdx msb = hist_i / PROF_FRAMES_HIST_SUB_N + PROF_FRAMES_HIST_SUB_BITS - 1;
+        ProfIdx sub = hist_i % PROF_FRAMES_HIST_SUB_N;
+        result = (uint64_t)(PROF_FRAMES_HIST_SUB_N + sub) << (msb - PROF_FRAMES_HIST_SUB_BITS);
+    }
+    return result;
+}
 
-    record_smpl->cycles_end = cycles_end;
-    /* prof_atomic_add(&prof->records[record_smpl->record_i].hits_n__cycles_n, hits_n__cycles_n); // TODO: this could be done after the fact */
+static uint64_t
+prof_frames_percentile(ProfFrames const *frames, double percentile)
+{
+    uint64_t result = 0;
+    uint64_t rank   = (uint64_t)(percentile / 100.0 * (double)frames->frames_n);
+    uint64_t seen_n = 0;
+    for (ProfIdx hist_i = 0; hist_i < PROF_FRAMES_HIST_N; ++hist_i)
+    {
+        seen_n += frames->hist[hist_i];
+        if (seen_n > rank)
+        {   result = prof_frames_hist_cycles(hist_i); break;   }
+    }
+    if (result > frames->cycles_max) {   result = frames->cycles_max;   }
+    if (result < frames->cycles_min) {   result = frames->cycles_min;   }
+    return result;
+}
+
+static inline uint64_t
+prof_frame_cycles(ProfFrame const *frame)
+{   return frame->cycles_end - frame->cycles_start;   }
+
+static void
+prof_frames_sift_down(ProfFrames *frames, ProfIdx heap_i)
+{
+    ProfFrame *heap = frames->slowest;
+    for (;;)
+    {
+        ProfIdx min_i   = heap_i;
+        ProfIdx child_i = 2 * heap_i + 1;
+        if (child_i < frames->slowest_n     && prof_frame_cycles(&heap[child_i])     < prof_frame_cycles(&heap[min_i])) {   min_i = child_i;     }
+        if (child_i + 1 < frames->slowest_n && prof_frame_cycles(&heap[child_i + 1]) < prof_frame_cycles(&heap[min_i])) {   min_i = child_i + 1; }
+        if (min_i == heap_i)
+        {   break;   }
+
+        ProfFrame tmp = heap[heap_i];
+        heap[heap_i]  = heap[min_i];
+        heap[min_i]   = tmp;
+        heap_i        = min_i;
+    }
+}
+
+static void
+prof_frames_sift_up(ProfFrames *frames, ProfIdx heap_i)
+{
+    ProfFrame *heap = frames->slowest;
+    while (heap_i > 0)
+    {
+        ProfIdx parent_i = (heap_i - 1) / 2;
+        if (prof_frame_cycles(&heap[parent_i]) <= prof_frame_cycles(&heap[heap_i]))
+        {   break;   }
+
+        ProfFrame tmp  = heap[heap_i];
+        heap[heap_i]   = heap[parent_i];
+        heap[parent_i] = tmp;
+        heap_i         = parent_i;
+    }
+}
+
+static void
+prof_frames_open(Prof *prof, ProfFrames *frames, ProfIdx keep_n)
+{
+    if (! prof->reallocate)
+    {   prof->reallocate = prof_realloc;   }
+
+    memset(frames, 0, sizeof(*frames));
+    frames->slowest_m  = keep_n;
+    frames->slowest    = (ProfFrame *)prof->reallocate(prof->allocator, 0, (keep_n ? keep_n : 1) * sizeof(*frames->slowest));
+    frames->cycles_min = ~(uint64_t)0;
+    prof->frames       = frames;
+}
+
+static inline void
+prof_frame_begin(Prof *prof)
+{
+    ProfFrames *frames = prof->frames;
+    frames->frame_smpl_i       = prof->record_smpl_tree_n;
+    frames->frame_cycles_start = __rdtsc();
+}
+
+// returns the frame's duration in cycles
+static uint64_t
+prof_frame_end(Prof *prof)
+{
+    uint64_t        cycles_end = __rdtsc();
+    ProfFrames     *frames     = prof->frames;
+    ProfIdx         smpl_i     = frames->frame_smpl_i;
+    ProfIdx         smpls_n    = prof->record_smpl_tree_n - smpl_i;
+    ProfRecordSmpl *smpls      = prof->record_smpl_tree + smpl_i;
+    uint64_t        cycles     = cycles_end - frames->frame_cycles_start;
+    assert((! ~prof->open_record_smpl_tree_i || prof->open_record_smpl_tree_i < smpl_i) &&
+           "scopes opened in the frame must be closed before it ends");
+
+    // only samples in the frame can have been closed during it, so their hits are all at the end
+    ProfIdx hits_smpls_i = prof->hits_smpls_n;
+    while (hits_smpls_i && prof->hits_smpls[hits_smpls_i - 1].smpl_i >= smpl_i)
+    {   --hits_smpls_i;   }
+    ProfIdx hits_smpls_n = prof->hits_smpls_n - hits_smpls_i;
+
+    { // duration stats
+        uint64_t frames_n = ++frames->frames_n;
+        double   delta    = (double)cycles - frames->cycles_mean;
+        frames->cycles_mean += delta / (double)frames_n;
+        frames->cycles_m2   += delta * ((double)cycles - frames->cycles_mean);
+        if (cycles < frames->cycles_min) {   frames->cycles_min = cycles;   }
+        if (cycles > frames->cycles_max) {   frames->cycles_max = cycles;   }
+        ++frames->hist[prof_frames_hist_i(cycles)];
+    }
+
+    { // per-record summaries
+        while (prof->records_n > frames->record_aggs_m)
+        {
+            ProfIdx record_aggs_m = frames->record_aggs_m;
+            frames->record_aggs = (ProfFrameRecordAgg *)prof_grow(prof, frames->record_aggs, &frames->record_aggs_m, sizeof(*frames->record_aggs));
+            memset(frames->record_aggs + record_aggs_m, 0, (frames->record_aggs_m - record_aggs_m) * sizeof(*frames->record_aggs));
+        }
+
+        for (ProfIdx frame_smpl_i = 0; frame_smpl_i < smpls_n; ++frame_smpl_i)
+        {
+            ProfRecordSmpl      smpl        = smpls[frame_smpl_i];
+            ProfFrameRecordAgg *agg         = &frames->record_aggs[smpl.record_i];
+            uint64_t            smpl_cycles = smpl.cycles_end - smpl.cycles_start;
+            agg->hits_n   += 1;
+            agg->cycles_n += smpl_cycles;
+            if (smpl_cycles > agg->cycles_max)
+            {   agg->cycles_max = smpl_cycles;   }
+        }
+
+        for (ProfIdx hits_smpl_i = hits_smpls_i; hits_smpl_i < prof->hits_smpls_n; ++hits_smpl_i)
+        {
+            ProfHitsSmpl hits_smpl = prof->hits_smpls[hits_smpl_i];
+            frames->record_aggs[prof->record_smpl_tree[hits_smpl.smpl_i].record_i].hits_n += (uint64_t)hits_smpl.hits_n - 1;
+        }
+    }
+
+    if (frames->slowest_m)
+    { // keep the frame if it's one of the slowest so far, reusing the buffer of the frame it displaces
+        ProfFrame *frame = 0;
+        if (frames->slowest_n < frames->slowest_m)
+        {
+            frame = &frames->slowest[frames->slowest_n++];
+            memset(frame, 0, sizeof(*frame));
+        }
+        else if (cycles > prof_frame_cycles(&frames->slowest[0]))
+        {   frame = &frames->slowest[0];   }
+
+        if (frame)
+        {
+            while (smpls_n > frame->smpls_m)
+            {   frame->smpls = (ProfRecordSmpl *)prof_grow(prof, frame->smpls, &frame->smpls_m, sizeof(*frame->smpls));   }
+
+            for (ProfIdx frame_smpl_i = 0; frame_smpl_i < smpls_n; ++frame_smpl_i)
+            {
+                ProfRecordSmpl smpl = smpls[frame_smpl_i];
+                smpl.parent_i = (smpl.parent_i >= smpl_i
+                                 ? smpl.parent_i - smpl_i
+                                 : frame_smpl_i); // parent is outside the frame: make it a root
+                frame->smpls[frame_smpl_i] = smpl;
+            }
+            frame->smpls_n      = smpls_n;
+
+            while (hits_smpls_n > frame->hits_smpls_m)
+            {   frame->hits_smpls = (ProfHitsSmpl *)prof_grow(prof, frame->hits_smpls, &frame->hits_smpls_m, sizeof(*frame->hits_smpls));   }
+            for (ProfIdx hits_smpl_i = 0; hits_smpl_i < hits_smpls_n; ++hits_smpl_i)
+            {
+                ProfHitsSmpl hits_smpl = prof->hits_smpls[hits_smpls_i + hits_smpl_i];
+                hits_smpl.smpl_i -= smpl_i;
+                frame->hits_smpls[hits_smpl_i] = hits_smpl;
+            }
+            if (hits_smpls_n)
+            {   qsort(frame->hits_smpls, hits_smpls_n, sizeof(*frame->hits_smpls), prof_hits_smpl_cmp);   }
+            frame->hits_smpls_n = hits_smpls_n;
+            frame->frame_i      = frames->frames_n - 1;
+            frame->cycles_start = frames->frame_cycles_start;
+            frame->cycles_end   = cycles_end;
+
+            if (frame == &frames->slowest[0])
+            {   prof_frames_sift_down(frames, 0);   }
+            else
+            {   prof_frames_sift_up(frames, (ProfIdx)(frame - frames->slowest));   }
+        }
+    }
+
+#if PROF_MMAP
+    if (prof->mmap) // the file is read until the first zeroed sample
+    {   memset(smpls, 0, smpls_n * sizeof(*smpls));   }
+#endif
+    prof->record_smpl_tree_n   = smpl_i;
+    prof->hits_smpls_n         = hits_smpls_i;
+    frames->frame_smpl_i       = smpl_i;
+    frames->frame_cycles_start = cycles_end;
+    return cycles;
+}
+
+// Dumps the kept frames in the same format as prof_dump_timings_file, each under a "frame N" slice
+// and at its original time
+static void
+prof_frames_dump(FILE **out, char const *filename, Prof *prof)
+{
+    ProfFrames *frames = prof->frames;
+    ProfWriter *w      = &frames->writer;
+    if (! w->buf)
+    {
+        prof_writer_init(w, *out, prof->freq, prof->reallocate, prof->allocator);
+        w->events_n = 1; // assume a file passed in already has events
+    }
+    w->is_new_dump = 1;
+
+    if (! *out)
+    {
+        *out = fopen(filename, "w");
+        assert(*out);
+        w->out      = *out;
+        w->events_n = 0;
+        prof_writer_put_lit(w, "[\n");
+    }
+    else if (w->out != *out)
+    {
+        w->out      = *out;
+        w->events_n = 1;
+    }
+#if PROF_ADDR
+    prof_addr_dump_modules(w, prof);
+#endif
+
+    for (ProfIdx slowest_i = 0; slowest_i < frames->slowest_n; ++slowest_i)
+    {
+        ProfFrame *frame = &frames->slowest[slowest_i];
+        prof_writer_event(w);
+        prof_writer_put_lit(w, "\"name\":\"frame ");
+        prof_writer_put_u64(w, frame->frame_i);
+        prof_writer_put_lit(w, "\", \"ph\":\"X\", \"ts\": ");
+        prof_writer_put_cycles(w, frame->cycles_start);
+        prof_writer_put_lit(w, ", \"dur\": ");
+        prof_writer_put_cycles(w, prof_frame_cycles(frame));
+        prof_writer_put_lit(w, ", ");
+        prof_writer_put_pid_tid(w, prof->pid, prof->tid);
+        prof_writer_put_lit(w, ", \"args\": {\"frame\": ");
+        prof_writer_put_u64(w, frame->frame_i);
+        prof_writer_put_lit(w, "}}");
+
+        ProfIdx hits_smpl_i = 0;
+        for (ProfIdx smpl_i = 0; smpl_i < frame->smpls_n; ++smpl_i)
+        {
+            ProfRecordSmpl smpl = frame->smpls[smpl_i];
+            prof_writer_event(w);
+            prof_writer_put_lit(w, "\"name\":\"");
+            prof_writer_put_name(w, prof, smpl.record_i);
+            if (smpl.cycles_start != smpl.cycles_end)
+            {
+                uint32_t hits_n = 1;
+                if (hits_smpl_i < frame->hits_smpls_n && frame->hits_smpls[hits_smpl_i].smpl_i == smpl_i)
+                {   hits_n = frame->hits_smpls[hits_smpl_i++].hits_n;   }
+
+                prof_writer_put_lit(w, "\", \"ph\":\"X\", \"ts\": ");
+                prof_writer_put_cycles(w, smpl.cycles_start);
+                prof_writer_put_lit(w, ", \"dur\": ");
+                prof_writer_put_cycles(w, smpl.cycles_end - smpl.cycles_start);
+                prof_writer_put_lit(w, ", ");
+                prof_writer_put_pid_tid(w, prof->pid, prof->tid);
+                if (hits_n != 1)
+                {
+                    prof_writer_put_lit(w, ", \"args\": {\"hits\": ");
+                    prof_writer_put_u64(w, hits_n);
+                    prof_writer_put_lit(w, "}");
+                }
+                prof_writer_put_lit(w, "}");
+            }
+            else
+            {
+                prof_writer_put_lit(w, "\", \"ph\":\"i\", \"ts\": ");
+                prof_writer_put_cycles(w, smpl.cycles_start);
+                prof_writer_put_lit(w, ", ");
+                prof_writer_put_pid_tid(w, prof->pid, prof->tid);
+                prof_writer_put_lit(w, "}");
+            }
+        }
+    }
+    prof_writer_flush(w);
+    fflush(*out);
+}
+
+// prints the duration stats over all frames, then the per-record summaries
+static void
+prof_frames_print(FILE *out, Prof const *prof)
+{
+    ProfFrames const *frames = prof->frames;
+    double            ms     = (prof->freq != 0.0
+                                ? prof->freq / 1000.0
+                                : 1.0);
+    if (! frames->frames_n)
+    {   fprintf(out, "no frames\n"); return;   }
+
+    double variance = (frames->frames_n > 1
+                       ? frames->cycles_m2 / (double)(frames->frames_n - 1)
+                       : 0.0);
+    double stddev = prof_sqrt(variance);
+
+    fprintf(out, "%llu frames (%u kept): mean %.3f ms, stddev %.3f ms, min %.3f ms, "
+            "p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            (unsigned long long)frames->frames_n, frames->slowest_n,
+            frames->cycles_mean / ms, stddev / ms, frames->cycles_min / ms,
+            prof_frames_percentile(frames, 50.0) / ms,
+            prof_frames_percentile(frames, 90.0) / ms,
+            prof_frames_percentile(frames, 99.0) / ms,
+            frames->cycles_max / ms);
+
+    fprintf(out, "%12s %12s %14s %12s  %s\n", "hits", "total ms", "ms per frame", "max ms", "record");
+    for (ProfIdx record_i = 0; record_i < frames->record_aggs_m && record_i < prof->records_n; ++record_i)
+    {
+        ProfFrameRecordAgg agg = frames->record_aggs[record_i];
+        if (agg.hits_n)
+        {
+            fprintf(out, "%12llu %12.3f %14.4f %12.4f  %s\n",
+                    (unsigned long long)agg.hits_n, agg.cycles_n / ms,
+                    agg.cycles_n / ms / (double)frames->frames_n, agg.cycles_max / ms,
+                    prof->records[record_i].name);
+        }
+    }
+}
+
+static void
+prof_frames_close(Prof *prof)
+{
+    ProfFrames *frames = prof->frames;
+    if (frames)
+    {
+        for (ProfIdx slowest_i = 0; slowest_i < frames->slowest_n; ++slowest_i)
+        {
+            prof->reallocate(prof->allocator, frames->slowest[slowest_i].smpls,      0);
+            prof->reallocate(prof->allocator, frames->slowest[slowest_i].hits_smpls, 0);
+        }
+        prof->reallocate(prof->allocator, frames->slowest,     0);
+        prof->reallocate(prof->allocator, frames->record_aggs, 0);
+        if (frames->writer.buf)
+        {   prof_writer_close(&frames->writer);   }
+        memset(frames, 0, sizeof(*frames));
+        prof->frames = 0;
+    }
+}
+#endif // PROF_FRAMES
+
+#if PROF_SIGNAL // FATAL SIGNALS
+// On SIGSEGV, SIGABRT, SIGBUS or SIGTERM, writes the open scopes of every registered Prof (one per thread)
+// as text, then the samples that haven't been dumped yet in the binary capture format (see professor_recover.c).
+// Only write() and friends are used, so this is safe to do from inside the handler.
+//
+// prof_signal_install(2, "crash");  // once, from anywhere
+// prof_signal_register(prof);       // from each thread, with that thread's Prof
+// prof_signal_unregister(prof);     // before the thread exits, or its Prof is freed
+//
+// NOTE: the state is static, so install and register from the same translation unit
+#include <signal.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef  PROF_SIGNAL_THREADS_MAX
+# define PROF_SIGNAL_THREADS_MAX 64
+#endif //PROF_SIGNAL_THREADS_MAX
+
+// threads register concurrently, and the handler can run at any point of that
+#define prof_signal_cas(a, expected, desired) \
+    __atomic_compare_exchange_n(a, expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define prof_signal_store(a, b) __atomic_store_n(a, b, __ATOMIC_RELEASE)
+#define prof_signal_load(a)     __atomic_load_n(a, __ATOMIC_ACQUIRE)
+
+typedef struct ProfSignalThread {
+    Prof    *prof;    // set last, once tid is valid; 0 if the slot is free or still being filled in
+    uint64_t tid;
+    uint32_t is_used; // claimed by a thread, whether or not prof is set yet
+} ProfSignalThread;
+
+static struct {
+    ProfSignalThread threads[PROF_SIGNAL_THREADS_MAX];
+    ProfIdx          threads_n; // the most slots that have been used at once, so the handler can stop there
+
+    int  report_fd;
+    char bin_prefix[256]; // binary captures go to <bin_prefix>.<tid>.bin; none if empty
+    volatile sig_atomic_t in_handler;
+
+    struct sigaction prev_actions[4];
+} prof_signal_state;
+
+static int const prof_signal_sigs[4] = { SIGSEGV, SIGABRT, SIGBUS, SIGTERM };
 
-    int is_tree_root = prof->open_record_smpl_tree_i == record_smpl->parent_i;
-    prof->open_record_smpl_tree_i = (! is_tree_root
-                                     ? record_smpl->parent_i
-                                     : ~(ProfIdx) 0);
+typedef struct ProfSignalOut {
+    int    fd;
+    size_t buf_n;
+    char   buf[512];
+} ProfSignalOut;
 
-    return record_smpl->record_i;
+static void
+prof_signal_flush(ProfSignalOut *out)
+{
+    for (size_t written_n = 0; written_n < out->buf_n;)
+    {
+        ssize_t n = write(out->fd, out->buf + written_n, out->buf_n - written_n);
+        if (n <= 0)
+        {   break;   }
+        written_n += (size_t)n;
+    }
+    out->buf_n = 0;
 }
 
-static inline ProfIdx
-prof_end_n(Prof *prof, ProfIdx expected_record_i, uint32_t hits_n)
+static void
+prof_signal_put(ProfSignalOut *out, void const *data, size_t size)
 {
-    ProfIdx actual_record_i = prof_end_n_unchecked(prof, hits_n);
-    assert((!~expected_record_i || // if you don't want to check here
-            actual_record_i == expected_record_i) && "prof start and end don't seem to match");
-    return actual_record_i;
+    char const *bytes = (char const *)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (out->buf_n == sizeof(out->buf))
+        {   prof_signal_flush(out);   }
+        out->buf[out->buf_n++] = bytes[i];
+    }
 }
 
-static inline ProfIdx
-prof_end(Prof *prof, ProfIdx expected_record_i)
-{   return prof_end_n(prof, expected_record_i, 1);   }
-
-static inline ProfIdx
-prof_end_unchecked(Prof *prof)
-{   return prof_end_n_unchecked(prof, 1);   }
-
-# define prof_start_fn(prof)    prof_start(prof, __func__); ProfIdx prof_fn_local_record_i = prof_top_record_i(prof)
-# define prof_end_n_fn(prof, n) prof_end_n(prof, prof_fn_local_record_i, n)
-# define prof_end_fn(prof)      prof_end_n_fn(prof, 1)
-#endif // PROFESSOR_DISABLE
+static size_t
+prof_signal_strlen(char const *str)
+{
+    size_t result = 0;
+    if (str)
+    {   while (str[result]) {   ++result;   }   }
+    return result;
+}
 
-#if 1 // OUTPUT
+static void
+prof_signal_put_str(ProfSignalOut *out, char const *str)
+{   prof_signal_put(out, str ? str : "(null)", str ? prof_signal_strlen(str) : 6);   }
 
-/* static inline void */
-/* prof_record_read_clear(Prof *prof, ProfIdx record_i, uint32_t *hits_n, uint32_t *cycles_n) */
-/* { */
-/*     uint64_t hits_n__cycles_n = prof->records[record_i].hits_n__cycles_n; */
-/*     if (hits_n)   { *hits_n   = (uint32_t)(hits_n__cycles_n >> 32); } */
-/*     if (cycles_n) { *cycles_n = (uint32_t)(hits_n__cycles_n & 0xFFFFFFFF); } */
-/* } */
+static void
+prof_signal_put_u64(ProfSignalOut *out, uint64_t val)
+{
+    char  digits[20];
+    char *digit = digits + sizeof(digits);
+    do { *--digit = (char)('0' + val % 10); val /= 10; } while (val);
+    prof_signal_put(out, digit, (size_t)(digits + sizeof(digits) - digit));
+}
 
+// same format as prof_dump_still_open
 static void
-prof_dump_still_open(FILE *out, Prof const *prof)
+prof_signal_write_still_open(ProfSignalOut *out, Prof const *prof)
 {
+    ProfIdx depth_n = 0;
     for (ProfIdx top_i = prof->open_record_smpl_tree_i;
-         ~top_i;
+         ~top_i && top_i < prof->record_smpl_tree_n && depth_n++ < prof->record_smpl_tree_n;
          top_i = prof->record_smpl_tree[top_i].parent_i)
     {
         ProfRecordSmpl smpl = prof->record_smpl_tree[top_i];
-        ProfRecord     record = prof->records[smpl.record_i];
-        fprintf(out, "sample: %d, record[%d]: %s (%s[%u])\n",
-                top_i, smpl.record_i,
-                record.name,
-                record.filename,
-                record.line_num);
+        prof_signal_put_str(out, "sample: ");   prof_signal_put_u64(out, top_i);
+        prof_signal_put_str(out, ", record[");  prof_signal_put_u64(out, smpl.record_i);
+        prof_signal_put_str(out, "]");
+        if (smpl.record_i < prof->records_n)
+        {
+            ProfRecord record = prof->records[smpl.record_i];
+            prof_signal_put_str(out, ": ");   prof_signal_put_str(out, record.name);
+            prof_signal_put_str(out, " (");   prof_signal_put_str(out, record.filename);
+            prof_signal_put_str(out, "[");    prof_signal_put_u64(out, record.line_num);
+            prof_signal_put_str(out, "])");
+        }
+        prof_signal_put_str(out, "\n");
 
-        if (top_i == prof->record_smpl_tree[top_i].parent_i)
+        if (top_i == smpl.parent_i)
         {   break;   }
     }
-    fputc('\n', out);
+    prof_signal_put_str(out, "\n");
 }
 
-// *out can be NULL the first time to init, otherwise ensure there's a '[' at the beginning of the file
+// the samples not yet dumped, in the same layout as a PROF_MMAP file
 static void
-prof_dump_timings_file(FILE **out, char const *filename, Prof *prof)
+prof_signal_write_bin(ProfSignalOut *out, Prof const *prof)
 {
-    double ms = (prof->freq != 0.0
-                 ? prof->freq / 1000.0
-                 : 1.0);
-    ProfRecord *records   = prof->records;
-
-    if (! *out)
+    ProfIdx records_n = prof->records_n;
+    size_t  strings_n = 0;
+    for (ProfIdx record_i = 0; record_i < records_n; ++record_i)
     {
-        *out = fopen(filename, "w");
-        assert(*out);
-        fputs("[\n", *out);
+        strings_n += prof_signal_strlen(prof->records[record_i].name)     + 1;
+        strings_n += prof_signal_strlen(prof->records[record_i].filename) + 1;
     }
-    else
-    {   fputs(",\n\n", *out);   }
-
-    ProfRecordSmpl *record_smpl_tree   = prof->record_smpl_tree;
-    size_t          record_smpl_tree_n = prof->record_smpl_tree_n;
-    for (size_t record_smpl_tree_i = 0; record_smpl_tree_i < record_smpl_tree_n; ++record_smpl_tree_i)
-    {
-        // TODO: units
-        ProfRecordSmpl record_smpl = record_smpl_tree[record_smpl_tree_i];
-        ProfRecord     record      = records[record_smpl.record_i];
-        if (record_smpl_tree_i > 0)
-        {   fprintf(*out, ",\n");   }
 
-        // TODO: should these just be in separate arrays?
-        if (record_smpl.cycles_start != record_smpl.cycles_end)
-        { // normal record
-            fprintf(*out, "    {"
-                    "\"name\":\"%s\", "
-                    "\"ph\":\"X\", "
-                    "\"ts\": %lf, "
-                    "\"dur\": %lf, "
-                    "\"pid\": 0, "
-                    "\"tid\": 0"
-                    "}",
-                    /* record.filename, */
-                    record.name,
-                    record_smpl.cycles_start / ms,
-                    (record_smpl.cycles_end - record_smpl.cycles_start) / ms
-            );
-        }
+    ProfBinHeader hdr; {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, PROF_BIN_MAGIC, sizeof(PROF_BIN_MAGIC));
+        hdr.version        = PROF_BIN_VERSION;
+        hdr.header_size    = sizeof(hdr);
+        hdr.freq           = prof->freq;
+        hdr.records_offset = sizeof(hdr);
+        hdr.records_n      = hdr.records_m = records_n;
+        hdr.strings_offset = hdr.records_offset + (uint64_t)records_n * sizeof(ProfBinRecord);
+        hdr.strings_n      = hdr.strings_m = (ProfIdx)strings_n;
+        hdr.smpls_offset   = hdr.strings_offset + strings_n;
+        hdr.smpls_n        = hdr.smpls_m = prof->record_smpl_tree_n;
+        hdr.open_record_smpl_tree_i = prof->open_record_smpl_tree_i;
+        hdr.pid            = prof->pid;
+        hdr.fork_gen       = prof->fork_gen;
+    }
+    prof_signal_put(out, &hdr, sizeof(hdr));
 
-        else
-        { // mark
-            fprintf(*out, "    {"
-                    "\"name\":\"%s\", "
-                    "\"ph\":\"i\", "
-                    "\"ts\": %lf, "
-                    "\"pid\": 0, "
-                    "\"tid\": 0"
-                    "}",
-                    /* record.filename, */
-                    record.name,
-                    record_smpl.cycles_start / ms
-            );
+    uint32_t string_offset = 0;
+    for (ProfIdx record_i = 0; record_i < records_n; ++record_i)
+    {
+        ProfRecord    record = prof->records[record_i];
+        ProfBinRecord bin_record; {
+            bin_record.name_offset     = string_offset;
+            string_offset             += (uint32_t)prof_signal_strlen(record.name) + 1;
+            bin_record.filename_offset = string_offset;
+            string_offset             += (uint32_t)prof_signal_strlen(record.filename) + 1;
+            bin_record.line_num        = record.line_num;
         }
+        prof_signal_put(out, &bin_record, sizeof(bin_record));
     }
 
-#if 0 // MEMORY sampling
-    fprintf(out, ",\n\n");
-
-    ProfPtrSmpl *ptr_smpls   = prof->ptr_smpls;
-    size_t       ptr_smpls_n = prof->ptr_smpls_n;
+    for (ProfIdx record_i = 0; record_i < records_n; ++record_i)
+    {
+        ProfRecord record = prof->records[record_i];
+        prof_signal_put(out, record.name     ? record.name     : "", prof_signal_strlen(record.name)     + 1);
+        prof_signal_put(out, record.filename ? record.filename : "", prof_signal_strlen(record.filename) + 1);
+    }
 
-    ProfPtrSmpl **opens = 0;
-    ProfIdx open_n = 0, open_m = 0;
+    prof_signal_flush(out);
+    // samples are written directly rather than copied through the buffer
+    for (size_t written_n = 0, size = prof->record_smpl_tree_n * sizeof(ProfRecordSmpl); written_n < size;)
+    {
+        ssize_t n = write(out->fd, (char const *)prof->record_smpl_tree + written_n, size - written_n);
+        if (n <= 0)
+        {   break;   }
+        written_n += (size_t)n;
+    }
+}
 
-    { // introduce all data series
-        fprintf(out, "    {"
-                "\"name\":\"memory\", "
-                "\"ph\":\"C\", "
-                "\"ts\": %lf, "
-                "\"args\": {"
-                , ptr_smpls[0].cycles / ms
-        );
+// can also be called directly, e.g. from a watchdog that suspects a hang
+static void
+prof_signal_dump(int sig)
+{
+    ProfSignalOut out[1];
+    out->fd    = prof_signal_state.report_fd;
+    out->buf_n = 0;
 
-        for (size_t ptr_smpls_i = 0; ptr_smpls_i < ptr_smpls_n; ++ptr_smpls_i)
-        {
-            if (ptr_smpls_i > 0)
-            {   fputs(",", out);   }
-            fprintf(out, "\"0x%08llx\": 0", ptr_smpls[ptr_smpls_i].addr);
-        }
+    prof_signal_put_str(out, "professor: caught signal ");
+    prof_signal_put_u64(out, (uint64_t)sig);
+    prof_signal_put_str(out, "\n");
 
-        fprintf(out,
-                "}, "
-                "\"pid\": 0, "
-                "\"tid\": 0"
-                "}");
+    ProfIdx threads_n = prof_signal_load(&prof_signal_state.threads_n);
+    for (ProfIdx thread_i = 0; thread_i < threads_n && thread_i < PROF_SIGNAL_THREADS_MAX; ++thread_i)
+    {
+        Prof const *prof = prof_signal_load(&prof_signal_state.threads[thread_i].prof);
+        if (! prof)
+        {   continue;   }
+        uint64_t tid = prof_signal_state.threads[thread_i].tid;
 
-        fputs(",\n\n", out);
-    }
+        prof_signal_put_str(out, "thread ");
+        prof_signal_put_u64(out, tid);
+        prof_signal_put_str(out, ": ");
+        prof_signal_put_u64(out, prof->record_smpl_tree_n);
+        prof_signal_put_str(out, " samples not yet dumped, open scopes:\n");
+        prof_signal_write_still_open(out, prof);
+        prof_signal_flush(out);
 
-    for (size_t ptr_smpls_i = 0; 0 && ptr_smpls_i < ptr_smpls_n; ++ptr_smpls_i)
-    { // memory count
-        ProfPtrSmpl ptr_smpl = ptr_smpls[ptr_smpls_i];
-        ProfRecord  record   = records[ptr_smpl.record_i];
+#if PROF_MMAP
+        if (prof->mmap)
+        { // samples are already in the file, it just needs finishing off
+            prof->mmap->hdr->smpls_n = prof->record_smpl_tree_n;
+            prof->mmap->hdr->open_record_smpl_tree_i = prof->open_record_smpl_tree_i;
+            continue;
+        }
+#endif
 
-        { // update open array
-            if (ptr_smpl.size > 0)
-            { // some mem was (re)alloc'd
-                if (ptr_smpl.addr_p) // realloc
-                { // replace open ptr with this one
-                    ProfIdx already_open_i = ~(ProfIdx)0;
-                    for (ProfIdx open_i = 0; open_i < open_n; ++open_i)
-                    { // check if this pointer has been alloc'd but not freed
-                        ProfPtrSmpl *open = opens[open_i];
+        if (prof_signal_state.bin_prefix[0] && prof->record_smpl_tree_n)
+        {
+            char filename[sizeof(prof_signal_state.bin_prefix) + 32];
+            ProfSignalOut name_out[1];
+            name_out->buf_n = 0;
+            prof_signal_put_str(name_out, prof_signal_state.bin_prefix);
+            prof_signal_put_str(name_out, ".");
+            prof_signal_put_u64(name_out, tid);
+            prof_signal_put(name_out, ".bin", sizeof(".bin"));
+            memcpy(filename, name_out->buf, name_out->buf_n);
 
-                        assert((ptr_smpl.addr == ptr_smpl.addr_p || // realloc'ing in place
-                                ptr_smpl.addr != open->addr)
-                               && "the same address cannot be opened multiple times");
+            ProfSignalOut bin_out[1];
+            bin_out->buf_n = 0;
+            bin_out->fd    = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (bin_out->fd >= 0)
+            {
+                prof_signal_write_bin(bin_out, prof);
+                close(bin_out->fd);
 
-                        if (open->addr == ptr_smpl.addr_p)
-                        {   already_open_i = open_i; break;   }
-                    }
-                    assert(~already_open_i && "there must be a pointer to replace");
-                    opens[already_open_i] = &ptr_smpls[ptr_smpls_i];
-                }
+                prof_signal_put_str(out, "samples written to ");
+                prof_signal_put_str(out, filename);
+                prof_signal_put_str(out, "\n\n");
+                prof_signal_flush(out);
+            }
+        }
+    }
+}
 
-                else // straight alloc
-                { // append current smpl to open list
-                    if (open_n == open_m)
-                    {   opens = (ProfPtrSmpl **)prof_grow(prof, opens, &open_m, sizeof(*opens));   }
-                    ptr_smpls = prof->ptr_smpls; // the allocation from prof_grow may have moved the array
+static void
+prof_signal_handler(int sig)
+{
+    if (! prof_signal_state.in_handler)
+    { // don't recurse if dumping is what crashed
+        prof_signal_state.in_handler = 1;
+        prof_signal_dump(sig);
+    }
 
-                    opens[open_n++] = &ptr_smpls[ptr_smpls_i];
-                }
-            }
+    for (int sig_i = 0; sig_i < 4; ++sig_i)
+    { // let the previous handler/default action take over
+        if (prof_signal_sigs[sig_i] == sig)
+        {   sigaction(sig, &prof_signal_state.prev_actions[sig_i], 0);   }
+    }
+    raise(sig);
+}
 
-            else // free
-            { // endswap remove open smpl
-                ProfIdx already_open_i = ~(ProfIdx)0;
-                for (ProfIdx open_i = 0; open_i < open_n; ++open_i)
-                { // check if this pointer has been alloc'd but not freed
-                    ProfPtrSmpl *open = opens[open_i];
-                    if (open->addr == ptr_smpl.addr)
-                    {   already_open_i = open_i; break;   }
-                }
-                assert(~already_open_i && "there must be a pointer to remove");
-                opens[already_open_i] = opens[--open_n];
-            }
-        }
+// report_fd is usually 2 (stderr); bin_prefix can be NULL to skip writing binary captures.
+// returns non-zero on success
+static int
+prof_signal_install(int report_fd, char const *bin_prefix)
+{
+    prof_signal_state.report_fd = report_fd;
+    prof_signal_state.bin_prefix[0] = 0;
+    if (bin_prefix)
+    {
+        strncpy(prof_signal_state.bin_prefix, bin_prefix, sizeof(prof_signal_state.bin_prefix) - 1);
+        prof_signal_state.bin_prefix[sizeof(prof_signal_state.bin_prefix) - 1] = 0;
+    }
 
-        if (ptr_smpls_i > 0)
-        {   fputs(",\n", out);   }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = prof_signal_handler;
+    action.sa_flags   = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
 
-        fprintf(out, "    {"
-                "\"name\":\"memory\", "
-                "\"ph\":\"C\", "
-                "\"ts\": %lf, "
-                "\"args\": {"
-                , ptr_smpl.cycles / ms
-        );
+    int result = 1;
+    for (int sig_i = 0; sig_i < 4; ++sig_i)
+    {   result &= ! sigaction(prof_signal_sigs[sig_i], &action, &prof_signal_state.prev_actions[sig_i]);   }
+    return result;
+}
 
-        for (size_t open_i = 0; open_i < open_n; ++open_i)
+// call from the thread that owns prof. returns 0 if PROF_SIGNAL_THREADS_MAX threads are already registered
+static int
+prof_signal_register(Prof *prof)
+{
+#if PROF_COMPACT
+    assert(! prof->compact && "the handler reads record_smpl_tree, which compact mode doesn't fill");
+#endif
+    int result = 0;
+    for (ProfIdx thread_i = 0; thread_i < PROF_SIGNAL_THREADS_MAX && ! result; ++thread_i)
+    {
+        ProfSignalThread *thread  = &prof_signal_state.threads[thread_i];
+        uint32_t          is_used = 0;
+        if (prof_signal_cas(&thread->is_used, &is_used, 1))
         {
-            ProfPtrSmpl open = *opens[open_i];
+            thread->tid = prof_thread_id();
+            prof_signal_store(&thread->prof, prof);
 
-            if (open_i > 0)
-            {   fputs(",", out);   }
-
-            fprintf(out, "\"0x%08llx\": %llu", open.addr, open.size);
+            ProfIdx threads_n = prof_signal_load(&prof_signal_state.threads_n);
+            while (threads_n <= thread_i &&
+                   ! prof_signal_cas(&prof_signal_state.threads_n, &threads_n, thread_i + 1))
+            {   /* another thread raised it first; threads_n now has its value */   }
+            result = 1;
         }
-
-        fprintf(out,
-                "}, "
-                "\"pid\": 0, "
-                "\"tid\": 0"
-                "}");
     }
+    return result;
+}
 
-    { // continue still open memory to last profiling time
-        uint64_t final_cycles = 0;
-        for (ProfIdx smpl_i = 0; smpl_i < record_smpl_tree_n; ++ smpl_i)
-        { // find last profiling time
-            uint64_t smpl_cycles = record_smpl_tree[smpl_i].cycles_end;
-            if (smpl_cycles > final_cycles)
-            {   final_cycles = smpl_cycles;   } // NOTE: there's a slight discrepancy here, I think due to rounding from "dur" = begin + (end-begin)
+// frees prof's slot for another thread.
+// NOTE: a signal handled on another thread at the same time can still be reading prof
+static void
+prof_signal_unregister(Prof *prof)
+{
+    ProfIdx threads_n = prof_signal_load(&prof_signal_state.threads_n);
+    for (ProfIdx thread_i = 0; thread_i < threads_n && thread_i < PROF_SIGNAL_THREADS_MAX; ++thread_i)
+    {
+        ProfSignalThread *thread = &prof_signal_state.threads[thread_i];
+        if (prof_signal_load(&thread->prof) == prof)
+        {
+            prof_signal_store(&thread->prof, (Prof *)0);
+            prof_signal_store(&thread->is_used, 0);
+            break;
         }
+    }
+}
+#endif // PROF_SIGNAL
 
-        fprintf(out, ",\n    {"
-                "\"name\":\"memory\", "
-                "\"ph\":\"C\", "
-                "\"ts\": %lf, "
-                "\"args\": {"
-                , final_cycles / ms
-        );
+#if 1 // FORK
+// Call in the child after fork() (e.g. from a pthread_atfork child handler).
+// Samples taken before the fork belong to the parent's trace, so only the scopes that are still open are kept,
+// along with what the modes record for them.
+// NOTE: PROF_MMAP and PROF_SHM mappings are shared with the parent, and PROF_PERF counters count
+// the parent's thread; reopen them in the child
+static void
+prof_after_fork(Prof *prof)
+{
+#if PROF_COMPACT
+    assert(! prof->compact && "compact samples can't be trimmed in place; close compact mode before forking");
+#endif
+    prof->pid = (uint64_t)prof_getpid();
+    ++prof->fork_gen;
+#if ! WIN32
+    prof_thread_id_cache = 0;
+#endif
 
-        for (ProfIdx open_i = 0; open_i < open_n; ++open_i)
+    // every open sample is on the open chain, and they're in tree order, outermost first,
+    // so they can be moved down to the front without overwriting any still to be moved.
+    // The per-sample arrays are in the same order, so they're trimmed in the same pass
+    ProfIdx open_n = 0;
+#if PROF_WAIT
+    ProfIdx wait_smpl_i = 0, wait_kept_n = 0;
+#endif
+#if PROF_FRAMES
+    ProfIdx frame_smpl_i = 0;
+#endif
+    for (ProfIdx smpl_i = 0; smpl_i < prof->record_smpl_tree_n; ++smpl_i)
+    {
+        ProfRecordSmpl smpl    = prof->record_smpl_tree[smpl_i];
+        int            is_open = ! ~smpl.cycles_end;
+#if PROF_WAIT
+        for (ProfWait *wait = prof->wait; wait && wait_smpl_i < wait->smpls_n && wait->smpls[wait_smpl_i].smpl_i <= smpl_i; ++wait_smpl_i)
         {
-            ProfPtrSmpl open = *opens[open_i];
-
-            if (open_i > 0)
-            {   fputs(",", out);   }
-
-            fprintf(out, "\"0x%08llx\": %llu", open.addr, open.size);
+            if (is_open && wait->smpls[wait_smpl_i].smpl_i == smpl_i)
+            { // e.g. a lock held across the fork
+                ProfWaitSmpl wait_smpl = wait->smpls[wait_smpl_i];
+                wait_smpl.smpl_i = open_n;
+                wait->smpls[wait_kept_n++] = wait_smpl;
+            }
+        }
+#endif
+        if (is_open)
+        {
+            smpl.parent_i = (open_n ? open_n - 1 : 0);
+            prof->record_smpl_tree[open_n] = smpl;
+#if PROF_PERF
+            if (prof->perf)
+            {   prof->perf->smpls[open_n] = prof->perf->smpls[smpl_i];   }
+#endif
+#if PROF_CPU_TIME
+            if (prof->cpu)
+            {   prof->cpu->smpls[open_n] = prof->cpu->smpls[smpl_i];   }
+#endif
+#if PROF_FRAMES
+            if (prof->frames && smpl_i < prof->frames->frame_smpl_i)
+            {   ++frame_smpl_i;   }
+#endif
+            ++open_n;
         }
-
-        fprintf(out,
-                "}, "
-                "\"pid\": 0, "
-                "\"tid\": 0"
-                "}");
     }
+#if PROF_WAIT
+    if (prof->wait)
+    {   prof->wait->smpls_n = wait_kept_n;   }
+#endif
+#if PROF_FRAMES
+    if (prof->frames)
+    {   prof->frames->frame_smpl_i = frame_smpl_i;   }
 #endif
 
-    fflush(*out);
-
-    prof->record_smpl_tree_n = 0;
+    prof->record_smpl_tree_n      = open_n;
+    prof->open_record_smpl_tree_i = (open_n ? open_n - 1 : ~(ProfIdx)0);
+    prof->hits_smpls_n            = 0; // only closed samples have hits
+    prof->ptr_smpls_n             = 0; // they were the parent's allocations
 }
-#endif // OUTPUT
+#endif // FORK
 
 #if 1 // INVARIANTS
 
@@ -0,0 +1,901 @@
+// professor_analyze.c - query captures too big for a trace viewer, from the command line
+// Reads a binary capture (PROF_MMAP, crash dumps) or a trace written by prof_dump_timings_file (compressed or not),
+// and the first time, writes an index next to it: per thread, the samples sorted by start time, with their parent
+// links and an implicit balanced tree over each thread's samples holding the latest end in each subtree. That's
+// enough to find the samples overlapping any window in O(log n + k) without reading the rest. Later runs just map
+// the index, until the capture changes.
+// Binary captures keep their samples' parent links. Traces don't have them, so parents are found from how each
+// thread's slices nest. Marks aren't indexed.
+//
+// Times are in ms from the start of the capture. Queries:
+//   top              records by self time within the window
+//   find NAME        every sample of NAME (at least -over ms long, if given) with its stack
+//   percentiles      per record sample durations: count, mean, p50, p90, p99 and max, for samples in the window
+//
+// usage: professor_analyze capture [-from ms] [-to ms] [-tid tid] [-n rows] [-over ms] [-index path] [-reindex]
+//                                  top | find NAME | percentiles
+#define _CRT_SECURE_NO_WARNINGS
+#include "professor.h" // ProfBinHeader, prof_lz_fopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AN_IDX_MAGIC   "PROFIDX"
+#define AN_IDX_VERSION 1
+#define AN_STACK_MAX   256
+
+typedef struct AnRecord {
+    uint32_t name_offset;     // into strings
+    uint32_t filename_offset;
+    uint32_t line_num;
+    uint32_t pad;
+} AnRecord;
+
+typedef struct AnThread {
+    uint64_t pid, tid;
+    uint64_t first_i, smpls_n; // its samples, sorted by start
+} AnThread;
+
+typedef struct AnSmpl {
+    uint64_t start_ns, end_ns; // from the start of the capture
+    uint32_t record_i;
+    uint32_t parent_i;         // ~0 if the outermost, otherwise an index into the same thread's samples
+} AnSmpl;
+
+// Layout: AnIdxHeader | AnRecord[records_n] | char strings[strings_n] | AnThread[threads_n] | AnSmpl[smpls_n]
+//         | uint64_t max_ends[smpls_n]
+// max_ends[mid] is the latest end among samples [lo, hi) of a thread, where mid = lo + (hi - lo) / 2 is the root
+// of that range: the whole thread's samples, then the halves either side of mid, and so on.
+typedef struct AnIdxHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t capture_size;  // to tell if the capture changed since
+    int64_t  capture_mtime;
+    uint64_t span_ns;       // from the first start to the last end
+    uint64_t records_n, records_offset;
+    uint64_t strings_n, strings_offset;
+    uint64_t threads_n, threads_offset;
+    uint64_t smpls_n,   smpls_offset;
+    uint64_t max_ends_offset;
+} AnIdxHeader;
+
+typedef struct AnIdx {
+    AnIdxHeader const *hdr;
+    size_t             size;
+    AnRecord const    *records;
+    char const        *strings;
+    AnThread const    *threads;
+    AnSmpl const      *smpls;
+    uint64_t const    *max_ends;
+} AnIdx;
+
+////////////////////////////////////////////////////////////////
+// BUILDING
+typedef struct AnBuildSmpl {
+    AnSmpl   smpl;
+    uint32_t thread_i;
+    uint32_t in_i;     // the order it was read in, which parent_i refers to until sorted
+} AnBuildSmpl;
+
+typedef struct AnBuildThread {
+    AnThread  thread;
+    uint32_t *opens;   // the samples that may have samples nested in them (traces only)
+    size_t    opens_n, opens_m;
+} AnBuildThread;
+
+typedef struct AnBuild {
+    AnRecord      *records;
+    uint32_t       records_n, records_m;
+    char          *strings;
+    size_t         strings_n, strings_m;
+    AnBuildThread *threads;
+    uint32_t       threads_n, threads_m;
+    AnBuildSmpl   *smpls;
+    size_t         smpls_n, smpls_m;
+    uint64_t       start_ns; // the earliest start, which times are made relative to
+} AnBuild;
+
+static uint64_t
+an_hash_str(char const *str)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (; *str; ++str)
+    {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// names are keyed by their offset into the build's strings, which move as they grow
+static AnBuild *an_build_for_map; // NOTE: the map's hash and equality have no context parameter
+
+#define MAP_INVALID_VAL (~(uint32_t) 0)
+#define MAP_HASH_KEY(key) an_hash_str(an_build_for_map->strings + (key))
+#define MAP_KEY_EQ(a, b) (! strcmp(an_build_for_map->strings + (a), an_build_for_map->strings + (b)))
+#define MAP_TYPES (AnNameMap, an_name_map, uint32_t, uint32_t)
+#include "hash.h"
+
+static uint32_t
+an_add_string(AnBuild *build, char const *str, size_t len)
+{
+    while (build->strings_n + len + 1 > build->strings_m)
+    {
+        build->strings_m = build->strings_m ? build->strings_m * 2 : 1 << 16;
+        build->strings   = (char *)realloc(build->strings, build->strings_m);
+    }
+    uint32_t result = (uint32_t)build->strings_n;
+    memcpy(build->strings + build->strings_n, str, len);
+    build->strings[build->strings_n + len] = 0;
+    build->strings_n += len + 1;
+    return result;
+}
+
+static uint32_t
+an_add_record(AnBuild *build, char const *name, size_t name_len, char const *filename, uint32_t line_num)
+{
+    if (build->records_n == build->records_m)
+    {
+        build->records_m = build->records_m ? build->records_m * 2 : 256;
+        build->records   = (AnRecord *)realloc(build->records, build->records_m * sizeof(*build->records));
+    }
+    AnRecord *record = &build->records[build->records_n];
+    record->name_offset     = an_add_string(build, name, name_len);
+    record->filename_offset = an_add_string(build, filename, strlen(filename));
+    record->line_num        = line_num;
+    record->pad             = 0;
+    return build->records_n++;
+}
+
+static uint32_t
+an_thread_i(AnBuild *build, uint64_t pid, uint64_t tid)
+{
+    for (uint32_t thread_i = 0; thread_i < build->threads_n; ++thread_i)
+    {
+        if (build->threads[thread_i].thread.pid == pid && build->threads[thread_i].thread.tid == tid)
+        {   return thread_i;   }
+    }
+    if (build->threads_n == build->threads_m)
+    {
+        build->threads_m = build->threads_m ? build->threads_m * 2 : 16;
+        build->threads   = (AnBuildThread *)realloc(build->threads, build->threads_m * sizeof(*build->threads));
+    }
+    AnBuildThread *thread = &build->threads[build->threads_n];
+    memset(thread, 0, sizeof(*thread));
+    thread->thread.pid = pid;
+    thread->thread.tid = tid;
+    return build->threads_n++;
+}
+
+static AnBuildSmpl *
+an_add_smpl(AnBuild *build, uint32_t thread_i, uint32_t record_i, uint64_t start_ns, uint64_t end_ns)
+{
+    if (build->smpls_n == build->smpls_m)
+    {
+        build->smpls_m = build->smpls_m ? build->smpls_m * 2 : 1 << 16;
+        build->smpls   = (AnBuildSmpl *)realloc(build->smpls, build->smpls_m * sizeof(*build->smpls));
+    }
+    AnBuildSmpl *result = &build->smpls[build->smpls_n];
+    result->smpl.start_ns = start_ns;
+    result->smpl.end_ns   = end_ns;
+    result->smpl.record_i = record_i;
+    result->smpl.parent_i = ~(uint32_t)0;
+    result->thread_i      = thread_i;
+    result->in_i          = (uint32_t)build->smpls_n++;
+    if (start_ns < build->start_ns)
+    {   build->start_ns = start_ns;   }
+    return result;
+}
+
+// a PROFBIN capture, the same as professor_recover reads: samples up to the first unwritten one, and still-open
+// scopes closed at the last time seen
+static int
+an_read_bin(AnBuild *build, char const *data, size_t size)
+{
+    ProfBinHeader const *hdr = (ProfBinHeader const *)data;
+    if (size < sizeof(*hdr) || hdr->smpls_offset > size || hdr->records_offset > size || hdr->strings_offset > size)
+    {   return 0;   }
+
+    double ns_per_cycle = (hdr->freq != 0.0 ? 1e9 / hdr->freq : 1.0);
+    if (hdr->freq == 0.0)
+    {   fprintf(stderr, "the capture has no frequency: times are in cycles\n");   }
+
+    ProfIdx smpls_m = hdr->smpls_m;
+    if (hdr->smpls_offset + (uint64_t)smpls_m * sizeof(ProfRecordSmpl) > size)
+    {   smpls_m = (ProfIdx)((size - hdr->smpls_offset) / sizeof(ProfRecordSmpl));   }
+    ProfRecordSmpl const *smpls   = (ProfRecordSmpl const *)(data + hdr->smpls_offset);
+    ProfIdx               smpls_n = hdr->smpls_n;
+    if (! smpls_n || smpls_n > smpls_m)
+    {
+        for (smpls_n = 0; smpls_n < smpls_m && smpls[smpls_n].cycles_start; ++smpls_n)
+        {   /* find the first unwritten sample */   }
+    }
+
+    ProfIdx  records_n   = hdr->records_n;
+    uint64_t last_cycles = 0;
+    for (ProfIdx smpl_i = 0; smpl_i < smpls_n; ++smpl_i)
+    {
+        ProfRecordSmpl smpl = smpls[smpl_i];
+        if (smpl.record_i >= records_n)                         {   records_n   = smpl.record_i + 1;   }
+        if (smpl.cycles_start > last_cycles)                    {   last_cycles = smpl.cycles_start;   }
+        if (~smpl.cycles_end && smpl.cycles_end > last_cycles) {   last_cycles = smpl.cycles_end;     }
+    }
+
+    ProfBinRecord const *bin_records = (ProfBinRecord const *)(data + hdr->records_offset);
+    char const          *strings     = data + hdr->strings_offset;
+    size_t               strings_n   = (hdr->strings_offset + hdr->strings_n <= size ? hdr->strings_n : 0);
+    for (ProfIdx record_i = 0; record_i < records_n; ++record_i)
+    {
+        char const *name     = "(unknown)";
+        char const *filename = "(unknown)";
+        uint32_t    line_num = 0;
+        if (record_i < hdr->records_n &&
+            hdr->records_offset + (record_i + 1) * sizeof(*bin_records) <= size)
+        {
+            ProfBinRecord bin_record = bin_records[record_i];
+            if (bin_record.name_offset < strings_n && memchr(strings + bin_record.name_offset, 0, strings_n - bin_record.name_offset))
+            {   name = strings + bin_record.name_offset;   }
+            if (bin_record.filename_offset < strings_n && memchr(strings + bin_record.filename_offset, 0, strings_n - bin_record.filename_offset))
+            {   filename = strings + bin_record.filename_offset;   }
+            line_num = bin_record.line_num;
+        }
+        an_add_record(build, name, strlen(name), filename, line_num);
+    }
+
+    uint32_t  thread_i = an_thread_i(build, hdr->pid, 0);
+    uint32_t *in_is    = (uint32_t *)malloc((smpls_n ? smpls_n : 1) * sizeof(*in_is)); // capture -> build index
+    for (ProfIdx smpl_i = 0; smpl_i < smpls_n; ++smpl_i)
+    {
+        ProfRecordSmpl smpl = smpls[smpl_i];
+        in_is[smpl_i] = ~(uint32_t)0;
+        if (smpl.cycles_start == smpl.cycles_end)
+        {   continue;   } // a mark
+
+        uint64_t cycles_end = (~smpl.cycles_end
+                               ? smpl.cycles_end
+                               : (last_cycles > smpl.cycles_start ? last_cycles : smpl.cycles_start + 1));
+        AnBuildSmpl *build_smpl = an_add_smpl(build, thread_i, smpl.record_i,
+                                              (uint64_t)((double)smpl.cycles_start * ns_per_cycle),
+                                              (uint64_t)((double)cycles_end        * ns_per_cycle));
+        if (smpl.parent_i != smpl_i && smpl.parent_i < smpl_i) // parents come first
+        {   build_smpl->smpl.parent_i = in_is[smpl.parent_i];   }
+        in_is[smpl_i] = build_smpl->in_i;
+    }
+    free(in_is);
+    return 1;
+}
+
+// finds `"key":` and returns what follows it, skipping spaces
+static char const *
+an_field(char const *line, char const *key)
+{
+    char const *result = strstr(line, key);
+    if (result)
+    {
+        result += strlen(key);
+        while (*result == ' ')
+        {   ++result;   }
+    }
+    return result;
+}
+
+static void
+an_read_trace_event(AnBuild *build, AnNameMap *names, char const *line)
+{
+    char const *ph   = an_field(line, "\"ph\":");
+    char const *name = an_field(line, "\"name\":");
+    char const *ts   = an_field(line, "\"ts\":");
+    char const *dur  = an_field(line, "\"dur\":");
+    if (! ph || ! name || ! ts || ! dur || *name != '"' || ph[0] != '"' || ph[1] != 'X')
+    {   return;   } // metadata, marks, counters, async...
+
+    char   name_buf[1024]; // names are JSON-escaped in the trace
+    size_t name_n = 0;
+    for (++name; *name != '"'; ++name)
+    {
+        char c = *name;
+        if (! c)
+        {   return;   }
+        if (c == '\\')
+        {
+            c = *++name;
+            if      (c == 'n') {   c = '\n';   }
+            else if (c == 't') {   c = '\t';   }
+            else if (c == 'r') {   c = '\r';   }
+            else if (c == 'u' && name[1] && name[2] && name[3] && name[4])
+            { // only control characters are written this way
+                char hex[3] = { name[3], name[4], 0 };
+                c     = (char)strtol(hex, 0, 16);
+                name += 4;
+            }
+            else if (! c)
+            {   return;   }
+        }
+        if (name_n < sizeof(name_buf) - 1)
+        {   name_buf[name_n++] = c;   }
+    }
+    name_buf[name_n] = 0;
+
+    // look the name up by adding it to the strings, and taking it back off if it's known
+    size_t   strings_n   = build->strings_n;
+    uint32_t name_offset = an_add_string(build, name_buf, name_n);
+    uint32_t record_i    = an_name_map_get(names, name_offset);
+    build->strings_n = strings_n;
+    if (! ~record_i)
+    {
+        record_i = an_add_record(build, name_buf, name_n, "", 0);
+        an_name_map_insert(names, build->records[record_i].name_offset, record_i);
+    }
+
+    char const *pid = an_field(line, "\"pid\":");
+    char const *tid = an_field(line, "\"tid\":");
+    double      ms  = strtod(ts, 0);
+    uint64_t    start_ns = (uint64_t)(ms * 1e6 + 0.5);
+    uint64_t    end_ns   = (uint64_t)((ms + strtod(dur, 0)) * 1e6 + 0.5);
+    uint32_t    thread_i = an_thread_i(build, pid ? strtoull(pid, 0, 10) : 0, tid ? strtoull(tid, 0, 10) : 0);
+    AnBuildThread *thread = &build->threads[thread_i];
+
+    // slices on a thread are in start order, and nested ones are within their parents
+    uint64_t const eps = 1; // the trace's rounding
+    while (thread->opens_n && build->smpls[thread->opens[thread->opens_n - 1]].smpl.end_ns + eps < end_ns)
+    {   --thread->opens_n;   }
+
+    AnBuildSmpl *smpl = an_add_smpl(build, thread_i, record_i, start_ns, end_ns);
+    if (thread->opens_n)
+    {   smpl->smpl.parent_i = thread->opens[thread->opens_n - 1];   }
+
+    if (thread->opens_n == thread->opens_m)
+    {
+        thread->opens_m = thread->opens_m ? thread->opens_m * 2 : 64;
+        thread->opens   = (uint32_t *)realloc(thread->opens, thread->opens_m * sizeof(*thread->opens));
+    }
+    thread->opens[thread->opens_n++] = smpl->in_i;
+}
+
+static void
+an_read_trace(AnBuild *build, char const *data, size_t size)
+{
+    AnNameMap names[1] = {{0}};
+    an_build_for_map = build;
+
+    char  *line   = 0;
+    size_t line_m = 0;
+    for (size_t line_start = 0; line_start < size;)
+    {
+        char const *line_end = (char const *)memchr(data + line_start, '\n', size - line_start);
+        size_t      line_n   = (line_end ? (size_t)(line_end - data) : size) - line_start;
+        if (line_n + 1 > line_m)
+        {
+            line_m = 2 * (line_n + 1);
+            line   = (char *)realloc(line, line_m);
+        }
+        memcpy(line, data + line_start, line_n); // NOTE: the mapping isn't 0-terminated
+        line[line_n] = 0;
+        if (memchr(line, '{', line_n))
+        {   an_read_trace_event(build, names, line);   }
+        line_start += line_n + 1;
+    }
+
+    free(line);
+    an_name_map_free(names);
+}
+
+static AnBuildSmpl const *an_sort_smpls; // NOTE: qsort has no context parameter
+
+// by thread, then start; enclosing samples before the ones they enclose
+static int
+an_cmp_smpls(void const *a_, void const *b_)
+{
+    AnBuildSmpl const *a = &an_sort_smpls[*(uint32_t const *)a_];
+    AnBuildSmpl const *b = &an_sort_smpls[*(uint32_t const *)b_];
+    if (a->thread_i       != b->thread_i)       {   return a->thread_i < b->thread_i ? -1 : 1;               }
+    if (a->smpl.start_ns  != b->smpl.start_ns)  {   return a->smpl.start_ns < b->smpl.start_ns ? -1 : 1;     }
+    if (a->smpl.end_ns    != b->smpl.end_ns)    {   return a->smpl.end_ns > b->smpl.end_ns ? -1 : 1;         }
+    return (a->in_i < b->in_i ? -1 : a->in_i > b->in_i);
+}
+
+// the latest end among smpls [lo, hi), stored at the range's middle
+static uint64_t
+an_build_max_ends(AnSmpl const *smpls, uint64_t *max_ends, uint64_t lo, uint64_t hi)
+{
+    if (lo >= hi)
+    {   return 0;   }
+    uint64_t mid    = lo + (hi - lo) / 2;
+    uint64_t result = smpls[mid].end_ns;
+    uint64_t left   = an_build_max_ends(smpls, max_ends, lo, mid);
+    uint64_t right  = an_build_max_ends(smpls, max_ends, mid + 1, hi);
+    if (left  > result) {   result = left;    }
+    if (right > result) {   result = right;   }
+    max_ends[mid] = result;
+    return result;
+}
+
+// returns non-zero on success
+static int
+an_write_index(AnBuild *build, char const *index_filename, struct stat const *capture_st)
+{
+    size_t    smpls_n = build->smpls_n;
+    uint32_t *order   = (uint32_t *)malloc((smpls_n ? smpls_n : 1) * sizeof(*order));   // sorted -> read order
+    uint32_t *ranks   = (uint32_t *)malloc((smpls_n ? smpls_n : 1) * sizeof(*ranks));   // read order -> sorted
+    AnSmpl   *smpls   = (AnSmpl *)malloc((smpls_n ? smpls_n : 1) * sizeof(*smpls));
+    uint64_t *max_ends = (uint64_t *)malloc((smpls_n ? smpls_n : 1) * sizeof(*max_ends));
+    for (size_t smpl_i = 0; smpl_i < smpls_n; ++smpl_i)
+    {   order[smpl_i] = (uint32_t)smpl_i;   }
+    an_sort_smpls = build->smpls;
+    qsort(order, smpls_n, sizeof(*order), an_cmp_smpls);
+    for (size_t smpl_i = 0; smpl_i < smpls_n; ++smpl_i)
+    {   ranks[order[smpl_i]] = (uint32_t)smpl_i;   }
+
+    uint64_t span_ns = 0;
+    for (size_t smpl_i = 0; smpl_i < smpls_n; ++smpl_i)
+    {
+        AnBuildSmpl build_smpl = build->smpls[order[smpl_i]];
+        AnThread   *thread     = &build->threads[build_smpl.thread_i].thread;
+        if (! thread->smpls_n)
+        {   thread->first_i = smpl_i;   }
+        ++thread->smpls_n;
+
+        AnSmpl smpl = build_smpl.smpl;
+        smpl.start_ns -= build->start_ns;
+        smpl.end_ns   -= build->start_ns;
+        smpl.parent_i  = (~smpl.parent_i
+                          ? ranks[smpl.parent_i] - (uint32_t)thread->first_i
+                          : ~(uint32_t)0);
+        smpls[smpl_i] = smpl;
+        if (smpl.end_ns > span_ns)
+        {   span_ns = smpl.end_ns;   }
+    }
+    AnThread *threads = (AnThread *)malloc((build->threads_n ? build->threads_n : 1) * sizeof(*threads));
+    for (uint32_t thread_i = 0; thread_i < build->threads_n; ++thread_i)
+    {
+        threads[thread_i] = build->threads[thread_i].thread;
+        an_build_max_ends(smpls + threads[thread_i].first_i, max_ends + threads[thread_i].first_i,
+                          0, threads[thread_i].smpls_n);
+    }
+
+    AnIdxHeader hdr; {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, AN_IDX_MAGIC, sizeof(AN_IDX_MAGIC));
+        hdr.version         = AN_IDX_VERSION;
+        hdr.header_size     = sizeof(hdr);
+        hdr.capture_size    = (uint64_t)capture_st->st_size;
+        hdr.capture_mtime   = (int64_t)capture_st->st_mtime;
+        hdr.span_ns         = span_ns;
+        hdr.records_n       = build->records_n;
+        hdr.records_offset  = sizeof(hdr);
+        hdr.strings_n       = build->strings_n;
+        hdr.strings_offset  = hdr.records_offset + hdr.records_n * sizeof(AnRecord);
+        hdr.threads_n       = build->threads_n;
+        hdr.threads_offset  = (hdr.strings_offset + hdr.strings_n + 7) & ~(uint64_t)7;
+        hdr.smpls_n         = smpls_n;
+        hdr.smpls_offset    = hdr.threads_offset + hdr.threads_n * sizeof(AnThread);
+        hdr.max_ends_offset = hdr.smpls_offset + hdr.smpls_n * sizeof(AnSmpl);
+    }
+
+    FILE *out    = fopen(index_filename, "wb");
+    int   result = out != 0;
+    if (out)
+    {
+        static char const zeros[8] = {0};
+        result = (fwrite(&hdr, sizeof(hdr), 1, out) == 1 &&
+                  fwrite(build->records, sizeof(AnRecord), build->records_n, out) == build->records_n &&
+                  fwrite(build->strings, 1, build->strings_n, out) == build->strings_n &&
+                  fwrite(zeros, 1, hdr.threads_offset - (hdr.strings_offset + hdr.strings_n), out) ==
+                      hdr.threads_offset - (hdr.strings_offset + hdr.strings_n) &&
+                  fwrite(threads, sizeof(*threads), build->threads_n, out) == build->threads_n &&
+                  fwrite(smpls, sizeof(*smpls), smpls_n, out) == smpls_n &&
+                  fwrite(max_ends, sizeof(*max_ends), smpls_n, out) == smpls_n);
+        result = (fclose(out) == 0) && result;
+    }
+
+    free(threads);
+    free(max_ends);
+    free(smpls);
+    free(ranks);
+    free(order);
+    return result;
+}
+
+// returns non-zero if the index was built
+static int
+an_build_index(char const *capture_filename, char const *index_filename)
+{
+    FILE *capture = prof_lz_fopen(capture_filename); // NOTE: a compressed trace comes back as a temporary file
+    struct stat capture_st, data_st;
+    if (! capture || stat(capture_filename, &capture_st) || fstat(fileno(capture), &data_st))
+    {   fprintf(stderr, "could not read capture '%s'\n", capture_filename); return 0;   }
+
+    size_t      size = (size_t)data_st.st_size;
+    char const *data = (size
+                        ? (char const *)mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(capture), 0)
+                        : "");
+    if ((void const *)data == MAP_FAILED)
+    {   fprintf(stderr, "could not map '%s'\n", capture_filename); return 0;   }
+
+    AnBuild build;
+    memset(&build, 0, sizeof(build));
+    build.start_ns = ~(uint64_t)0;
+
+    int result = 1;
+    if (size >= sizeof(ProfBinHeader) && ! memcmp(data, PROF_BIN_MAGIC, sizeof(PROF_BIN_MAGIC)))
+    {
+        result = (((ProfBinHeader const *)data)->version == PROF_BIN_VERSION &&
+                  an_read_bin(&build, data, size));
+    }
+    else
+    {   an_read_trace(&build, data, size);   }
+    if (! build.smpls_n)
+    {   build.start_ns = 0;   }
+
+    if (! result)
+    {   fprintf(stderr, "'%s' is not a capture this version can read\n", capture_filename);   }
+    else if (! an_write_index(&build, index_filename, &capture_st))
+    {   fprintf(stderr, "could not write the index '%s'\n", index_filename); result = 0;   }
+
+    if (size)
+    {   munmap((void *)data, size);   }
+    fclose(capture);
+    for (uint32_t thread_i = 0; thread_i < build.threads_n; ++thread_i)
+    {   free(build.threads[thread_i].opens);   }
+    free(build.threads);
+    free(build.smpls);
+    free(build.strings);
+    free(build.records);
+    return result;
+}
+
+// returns non-zero if the index is there, readable and up to date with the capture
+static int
+an_open_index(AnIdx *idx, char const *index_filename, struct stat const *capture_st)
+{
+    memset(idx, 0, sizeof(*idx));
+    int fd = open(index_filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+    {   return 0;   }
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(AnIdxHeader))
+    {   close(fd); return 0;   }
+
+    idx->size = (size_t)st.st_size;
+    idx->hdr  = (AnIdxHeader const *)mmap(0, idx->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ((void const *)idx->hdr == MAP_FAILED)
+    {   idx->hdr = 0; return 0;   }
+
+    AnIdxHeader const *hdr = idx->hdr;
+    if (memcmp(hdr->magic, AN_IDX_MAGIC, sizeof(AN_IDX_MAGIC)) || hdr->version != AN_IDX_VERSION ||
+        hdr->capture_size != (uint64_t)capture_st->st_size || hdr->capture_mtime != (int64_t)capture_st->st_mtime ||
+        hdr->max_ends_offset + hdr->smpls_n * sizeof(uint64_t) > idx->size)
+    {
+        munmap((void *)idx->hdr, idx->size);
+        idx->hdr = 0;
+        return 0;
+    }
+
+    char const *base = (char const *)hdr;
+    idx->records  = (AnRecord const *)(base + hdr->records_offset);
+    idx->strings  = base + hdr->strings_offset;
+    idx->threads  = (AnThread const *)(base + hdr->threads_offset);
+    idx->smpls    = (AnSmpl const *)(base + hdr->smpls_offset);
+    idx->max_ends = (uint64_t const *)(base + hdr->max_ends_offset);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////
+// QUERIES
+typedef struct AnQuery {
+    uint64_t    from_ns, to_ns; // the window, [from, to)
+    uint64_t    over_ns;     // for find
+    char const *name;
+    size_t      rows_n;      // 0 for all
+    int         has_tid;
+    uint64_t    tid;
+} AnQuery;
+
+typedef void (*AnVisit)(AnIdx const *idx, AnThread const *thread, uint64_t smpl_i, void *ctx);
+
+// visits the samples of the thread overlapping [from, to), in start order
+static void
+an_overlapping(AnIdx const *idx, AnThread const *thread, uint64_t lo, uint64_t hi,
+               uint64_t from_ns, uint64_t to_ns, AnVisit visit, void *ctx)
+{
+    while (lo < hi)
+    {
+        AnSmpl const   *smpls    = idx->smpls    + thread->first_i;
+        uint64_t const *max_ends = idx->max_ends + thread->first_i;
+        uint64_t        mid      = lo + (hi - lo) / 2;
+        if (max_ends[mid] <= from_ns)
+        {   return;   } // everything in [lo, hi) ended before the window
+
+        an_overlapping(idx, thread, lo, mid, from_ns, to_ns, visit, ctx);
+        if (smpls[mid].start_ns >= to_ns)
+        {   return;   } // and so does everything after it
+        if (smpls[mid].end_ns > from_ns)
+        {   visit(idx, thread, mid, ctx);   }
+        lo = mid + 1; // the right half, without recursing
+    }
+}
+
+static void
+an_query(AnIdx const *idx, AnQuery const *query, AnVisit visit, void *ctx)
+{
+    for (uint64_t thread_i = 0; thread_i < idx->hdr->threads_n; ++thread_i)
+    {
+        AnThread const *thread = &idx->threads[thread_i];
+        if (! query->has_tid || thread->tid == query->tid)
+        {   an_overlapping(idx, thread, 0, thread->smpls_n, query->from_ns, query->to_ns, visit, ctx);   }
+    }
+}
+
+static char const *an_name(AnIdx const *idx, uint32_t record_i) {   return idx->strings + idx->records[record_i].name_offset;   }
+
+typedef struct AnTop {
+    AnQuery const *query;
+    uint64_t      *hits_n; // parallel with records
+    int64_t       *self_ns;
+    uint64_t      *incl_ns;
+} AnTop;
+
+static void
+an_top_visit(AnIdx const *idx, AnThread const *thread, uint64_t smpl_i, void *ctx)
+{
+    AnTop        *top   = (AnTop *)ctx;
+    AnSmpl const *smpl  = &idx->smpls[thread->first_i + smpl_i];
+    uint64_t      start = (smpl->start_ns > top->query->from_ns ? smpl->start_ns : top->query->from_ns);
+    uint64_t      end   = (smpl->end_ns   < top->query->to_ns   ? smpl->end_ns   : top->query->to_ns);
+    uint64_t      ns    = end - start; // within the window
+
+    top->hits_n[smpl->record_i]  += 1;
+    top->incl_ns[smpl->record_i] += ns;
+    top->self_ns[smpl->record_i] += (int64_t)ns;
+    if (~smpl->parent_i) // the parent overlaps the window too, as it encloses this
+    {   top->self_ns[idx->smpls[thread->first_i + smpl->parent_i].record_i] -= (int64_t)ns;   }
+}
+
+static int64_t const *an_sort_keys; // NOTE: qsort has no context parameter
+
+static int
+an_cmp_by_key(void const *a_, void const *b_)
+{
+    int64_t a = an_sort_keys[*(uint32_t const *)a_];
+    int64_t b = an_sort_keys[*(uint32_t const *)b_];
+    return (a > b ? -1 : a < b);
+}
+
+static void
+an_print_top(AnIdx const *idx, AnQuery const *query)
+{
+    uint64_t records_n = idx->hdr->records_n;
+    AnTop    top       = { query, 0, 0, 0 };
+    top.hits_n  = (uint64_t *)calloc(records_n + 1, sizeof(*top.hits_n));
+    top.self_ns = (int64_t *)calloc(records_n + 1, sizeof(*top.self_ns));
+    top.incl_ns = (uint64_t *)calloc(records_n + 1, sizeof(*top.incl_ns));
+    an_query(idx, query, an_top_visit, &top);
+
+    uint32_t *order = (uint32_t *)malloc((records_n + 1) * sizeof(*order));
+    for (uint32_t record_i = 0; record_i < records_n; ++record_i)
+    {   order[record_i] = record_i;   }
+    an_sort_keys = top.self_ns;
+    qsort(order, records_n, sizeof(*order), an_cmp_by_key);
+
+    uint64_t window_ns = query->to_ns - query->from_ns;
+    printf("%10s %12s %12s %8s  %s\n", "hits", "self ms", "incl ms", "self %", "record");
+    for (uint64_t row_i = 0; row_i < records_n && (! query->rows_n || row_i < query->rows_n); ++row_i)
+    {
+        uint32_t record_i = order[row_i];
+        if (! top.hits_n[record_i])
+        {   break;   }
+        printf("%10llu %12.3f %12.3f %8.2f  %s\n", (unsigned long long)top.hits_n[record_i],
+               (double)top.self_ns[record_i] / 1e6, (double)top.incl_ns[record_i] / 1e6,
+               (window_ns ? 100.0 * (double)top.self_ns[record_i] / (double)window_ns : 0.0),
+               an_name(idx, record_i));
+    }
+
+    free(order);
+    free(top.incl_ns);
+    free(top.self_ns);
+    free(top.hits_n);
+}
+
+typedef struct AnFind {
+    AnQuery const *query;
+    uint64_t       found_n;
+} AnFind;
+
+static void
+an_find_visit(AnIdx const *idx, AnThread const *thread, uint64_t smpl_i, void *ctx)
+{
+    AnFind       *find = (AnFind *)ctx;
+    AnSmpl const *smpl = &idx->smpls[thread->first_i + smpl_i];
+    if (strcmp(an_name(idx, smpl->record_i), find->query->name) ||
+        smpl->end_ns - smpl->start_ns < find->query->over_ns)
+    {   return;   }
+
+    if (find->query->rows_n && find->found_n >= find->query->rows_n)
+    {   ++find->found_n; return;   } // just counted
+
+    uint32_t stack[AN_STACK_MAX];
+    size_t   stack_n = 0;
+    for (uint32_t parent_i = smpl->parent_i; ~parent_i && stack_n < AN_STACK_MAX; parent_i = idx->smpls[thread->first_i + parent_i].parent_i)
+    {   stack[stack_n++] = idx->smpls[thread->first_i + parent_i].record_i;   }
+
+    printf("%14.3f %12.3f %8llu %8llu  ", (double)smpl->start_ns / 1e6, (double)(smpl->end_ns - smpl->start_ns) / 1e6,
+           (unsigned long long)thread->pid, (unsigned long long)thread->tid);
+    while (stack_n)
+    {   printf("%s > ", an_name(idx, stack[--stack_n]));   }
+    printf("%s\n", an_name(idx, smpl->record_i));
+    ++find->found_n;
+}
+
+static void
+an_print_find(AnIdx const *idx, AnQuery const *query)
+{
+    AnFind find = { query, 0 };
+    printf("%14s %12s %8s %8s  %s\n", "start ms", "ms", "pid", "tid", "stack");
+    an_query(idx, query, an_find_visit, &find);
+    if (query->rows_n && find.found_n > query->rows_n)
+    {   printf("... %llu more\n", (unsigned long long)(find.found_n - query->rows_n));   }
+    else if (! find.found_n)
+    {   printf("no samples of '%s'%s\n", query->name, (query->over_ns ? " that long" : ""));   }
+}
+
+typedef struct AnDur {
+    uint32_t record_i;
+    uint64_t ns;
+} AnDur;
+
+typedef struct AnDurs {
+    AnDur *durs;
+    size_t durs_n, durs_m;
+} AnDurs;
+
+static void
+an_durs_visit(AnIdx const *idx, AnThread const *thread, uint64_t smpl_i, void *ctx)
+{
+    AnDurs       *durs = (AnDurs *)ctx;
+    AnSmpl const *smpl = &idx->smpls[thread->first_i + smpl_i];
+    if (durs->durs_n == durs->durs_m)
+    {
+        durs->durs_m = durs->durs_m ? durs->durs_m * 2 : 1 << 16;
+        durs->durs   = (AnDur *)realloc(durs->durs, durs->durs_m * sizeof(*durs->durs));
+    }
+    durs->durs[durs->durs_n].record_i = smpl->record_i;
+    durs->durs[durs->durs_n].ns       = smpl->end_ns - smpl->start_ns;
+    ++durs->durs_n;
+}
+
+static int
+an_cmp_durs(void const *a_, void const *b_)
+{
+    AnDur const *a = (AnDur const *)a_;
+    AnDur const *b = (AnDur const *)b_;
+    if (a->record_i != b->record_i) {   return a->record_i < b->record_i ? -1 : 1;   }
+    return (a->ns < b->ns ? -1 : a->ns > b->ns);
+}
+
+static void
+an_print_percentiles(AnIdx const *idx, AnQuery const *query)
+{
+    AnDurs durs = { 0, 0, 0 };
+    an_query(idx, query, an_durs_visit, &durs);
+    qsort(durs.durs, durs.durs_n, sizeof(*durs.durs), an_cmp_durs);
+
+    // one row per record, biggest total first
+    uint64_t  records_n = idx->hdr->records_n;
+    int64_t  *totals    = (int64_t *)calloc(records_n + 1, sizeof(*totals));
+    size_t   *firsts    = (size_t *)calloc(records_n + 1, sizeof(*firsts));
+    size_t   *counts    = (size_t *)calloc(records_n + 1, sizeof(*counts));
+    uint32_t *order     = (uint32_t *)malloc((records_n + 1) * sizeof(*order));
+    for (size_t dur_i = 0; dur_i < durs.durs_n; ++dur_i)
+    {
+        AnDur dur = durs.durs[dur_i];
+        if (! counts[dur.record_i]++)
+        {   firsts[dur.record_i] = dur_i;   }
+        totals[dur.record_i] += (int64_t)dur.ns;
+    }
+    for (uint32_t record_i = 0; record_i < records_n; ++record_i)
+    {   order[record_i] = record_i;   }
+    an_sort_keys = totals;
+    qsort(order, records_n, sizeof(*order), an_cmp_by_key);
+
+    printf("%10s %12s %10s %10s %10s %10s %10s  %s\n", "samples", "total ms", "mean ms", "p50 ms", "p90 ms", "p99 ms",
+           "max ms", "record");
+    for (uint64_t row_i = 0; row_i < records_n && (! query->rows_n || row_i < query->rows_n); ++row_i)
+    {
+        uint32_t     record_i = order[row_i];
+        size_t       n        = counts[record_i];
+        AnDur const *sorted   = durs.durs + firsts[record_i];
+        if (! n)
+        {   break;   }
+#define an_percentile(p) ((double)sorted[(size_t)((p) * (double)(n - 1) + 0.5)].ns / 1e6)
+        printf("%10zu %12.3f %10.4f %10.4f %10.4f %10.4f %10.4f  %s\n", n, (double)totals[record_i] / 1e6,
+               (double)totals[record_i] / 1e6 / (double)n,
+               an_percentile(0.5), an_percentile(0.9), an_percentile(0.99), an_percentile(1.0),
+               an_name(idx, record_i));
+#undef an_percentile
+    }
+
+    free(order);
+    free(counts);
+    free(firsts);
+    free(totals);
+    free(durs.durs);
+}
+
+int main(int argc, char **argv)
+{
+    char const *capture_filename = 0;
+    char const *index_filename   = 0;
+    char const *command          = 0;
+    int         reindex          = 0;
+    double      from_ms = 0.0, to_ms = -1.0, over_ms = 0.0;
+    AnQuery     query;
+    memset(&query, 0, sizeof(query));
+    query.rows_n = 20;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if      (! strcmp(argv[arg_i], "-from")  && arg_i + 1 < argc) {   from_ms        = atof(argv[++arg_i]);   }
+        else if (! strcmp(argv[arg_i], "-to")    && arg_i + 1 < argc) {   to_ms          = atof(argv[++arg_i]);   }
+        else if (! strcmp(argv[arg_i], "-over")  && arg_i + 1 < argc) {   over_ms        = atof(argv[++arg_i]);   }
+        else if (! strcmp(argv[arg_i], "-n")     && arg_i + 1 < argc) {   query.rows_n   = (size_t)atol(argv[++arg_i]);   }
+        else if (! strcmp(argv[arg_i], "-tid")   && arg_i + 1 < argc) {   query.tid      = strtoull(argv[++arg_i], 0, 10); query.has_tid = 1;   }
+        else if (! strcmp(argv[arg_i], "-index") && arg_i + 1 < argc) {   index_filename = argv[++arg_i];   }
+        else if (! strcmp(argv[arg_i], "-reindex"))                    {   reindex        = 1;   }
+        else if (! capture_filename)                                   {   capture_filename = argv[arg_i];   }
+        else if (! command)                                            {   command        = argv[arg_i];   }
+        else if (! query.name)                                         {   query.name     = argv[arg_i];   }
+    }
+    int known = (command && (! strcmp(command, "top") || ! strcmp(command, "percentiles") ||
+                             (! strcmp(command, "find") && query.name)));
+    if (! capture_filename || (command && ! known))
+    {
+        fprintf(stderr, "usage: %s capture [-from ms] [-to ms] [-tid tid] [-n rows] [-over ms] [-index path] [-reindex]\n"
+                        "       %*s top | find NAME | percentiles\n", argv[0], (int)strlen(argv[0]), "");
+        return 1;
+    }
+
+    char default_index_filename[4096];
+    if (! index_filename)
+    {
+        snprintf(default_index_filename, sizeof(default_index_filename), "%s.idx", capture_filename);
+        index_filename = default_index_filename;
+    }
+
+    struct stat capture_st;
+    if (stat(capture_filename, &capture_st))
+    {   fprintf(stderr, "could not read capture '%s'\n", capture_filename); return 1;   }
+
+    AnIdx idx;
+    if (reindex || ! an_open_index(&idx, index_filename, &capture_st))
+    {
+        if (! an_build_index(capture_filename, index_filename) ||
+            ! an_open_index(&idx, index_filename, &capture_st))
+        {   return 1;   }
+        fprintf(stderr, "indexed %llu samples of %llu records on %llu threads into '%s'\n",
+                (unsigned long long)idx.hdr->smpls_n, (unsigned long long)idx.hdr->records_n,
+                (unsigned long long)idx.hdr->threads_n, index_filename);
+    }
+
+    query.from_ns = (from_ms > 0.0 ? (uint64_t)(from_ms * 1e6) : 0);
+    query.to_ns   = (to_ms >= 0.0 ? (uint64_t)(to_ms * 1e6) : idx.hdr->span_ns + 1);
+    query.over_ns = (uint64_t)(over_ms * 1e6);
+    printf("%.3f ms, %llu samples on %llu threads; window %.3f - %.3f ms\n\n",
+           (double)idx.hdr->span_ns / 1e6, (unsigned long long)idx.hdr->smpls_n,
+           (unsigned long long)idx.hdr->threads_n, (double)query.from_ns / 1e6, (double)query.to_ns / 1e6);
+    if (query.to_ns <= query.from_ns)
+    {   fprintf(stderr, "the window is empty\n"); return 1;   }
+
+    if      (! command)                       {   an_print_top(&idx, &query);           }
+    else if (! strcmp(command, "top"))        {   an_print_top(&idx, &query);           }
+    else if (! strcmp(command, "find"))       {   an_print_find(&idx, &query);          }
+    else if (! strcmp(command, "percentiles")) {  an_print_percentiles(&idx, &query);   }
+
+    munmap((void *)idx.hdr, idx.size);
+    return 0;
+}
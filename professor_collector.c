@@ -0,0 +1,314 @@
+// professor_collector.c - receive samples streamed by PROF_STREAM processes, and write or aggregate them
+// Binds a Unix datagram socket and reassembles each sender's flushes, keyed by pid and thread id. Complete flushes
+// are written out as they arrive (as if the sender had called prof_dump_timings_file), or with -aggregate, kept
+// and summed per record until exit. Flushes missing batches, because the sender dropped them, are thrown away.
+// Runs until SIGINT/SIGTERM, or -n flushes.
+//
+// usage: professor_collector socket_path [-o out.json | -aggregate [out.txt]] [-n flushes]
+#define _CRT_SECURE_NO_WARNINGS
+#define PROF_STREAM 1
+#include "professor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+typedef struct CollectorStream {
+    uint64_t pid, tid;
+    Prof     prof[1];
+    uint64_t flush_i;          // the flush being received
+    uint32_t batches_n;        // received of it
+    int      broken;           // a batch was missing
+    ProfIdx  smpls_base;       // where its samples start in prof (non-0 when aggregating)
+    ProfIdx  hits_base;
+    uint64_t flushes_n;        // completed
+    uint64_t incomplete_n;     // thrown away
+    uint64_t sender_dropped_n; // as last reported by the sender
+} CollectorStream;
+
+static volatile sig_atomic_t collector_stop;
+static void collector_on_signal(int sig) {   (void)sig; collector_stop = 1;   }
+
+// streams are allocated one by one, as their Profs must not move once they have a writer
+static CollectorStream *
+collector_find_stream(CollectorStream ***streams, size_t *streams_n, uint64_t pid, uint64_t tid)
+{
+    for (size_t stream_i = 0; stream_i < *streams_n; ++stream_i)
+    {
+        if ((*streams)[stream_i]->pid == pid && (*streams)[stream_i]->tid == tid)
+        {   return (*streams)[stream_i];   }
+    }
+
+    CollectorStream *stream = (CollectorStream *)calloc(1, sizeof(*stream));
+    stream->pid       = pid;
+    stream->tid       = tid;
+    stream->flush_i   = ~(uint64_t)0;
+    stream->prof->pid = pid;
+    stream->prof->tid = tid;
+    stream->prof->open_record_smpl_tree_i = ~(ProfIdx)0;
+    *streams = (CollectorStream **)realloc(*streams, (*streams_n + 1) * sizeof(**streams));
+    (*streams)[(*streams_n)++] = stream;
+    return stream;
+}
+
+static void
+collector_start_flush(CollectorStream *stream, uint64_t flush_i)
+{
+    Prof *prof = stream->prof;
+    if (~stream->flush_i && stream->flush_i != flush_i && stream->batches_n)
+    {   ++stream->incomplete_n;   } // never got its end batch
+
+    prof->record_smpl_tree_n = stream->smpls_base;
+    prof->hits_smpls_n       = stream->hits_base;
+    stream->flush_i   = flush_i;
+    stream->batches_n = 0;
+    stream->broken    = 0;
+}
+
+static void
+collector_put_records(Prof *prof, ProfStreamBatch const *hdr, char const *items, size_t items_size)
+{
+    size_t offset = 0;
+    for (uint32_t item_i = 0; item_i < hdr->items_n; ++item_i)
+    {
+        ProfStreamRecord stream_record;
+        if (offset + sizeof(stream_record) > items_size)
+        {   break;   }
+        memcpy(&stream_record, items + offset, sizeof(stream_record));
+        offset += sizeof(stream_record);
+        if (offset + stream_record.name_n + stream_record.filename_n > items_size)
+        {   break;   }
+
+        ProfIdx record_i = hdr->first_i + item_i;
+        while (record_i >= prof->records_m)
+        {
+            ProfIdx records_m = prof->records_m;
+            prof->records     = (ProfRecord *)prof_grow(prof, prof->records, &prof->records_m, sizeof(*prof->records));
+            memset(prof->records + records_m, 0, (prof->records_m - records_m) * sizeof(*prof->records));
+        }
+        if (record_i >= prof->records_n)
+        {   prof->records_n = record_i + 1;   }
+
+        ProfRecord *record = &prof->records[record_i];
+        char *name     = (char *)malloc(stream_record.name_n + 1);
+        char *filename = (char *)malloc(stream_record.filename_n + 1);
+        memcpy(name,     items + offset, stream_record.name_n);     name[stream_record.name_n]         = 0;
+        offset += stream_record.name_n;
+        memcpy(filename, items + offset, stream_record.filename_n); filename[stream_record.filename_n] = 0;
+        offset += stream_record.filename_n;
+
+        free((char *)record->name); // if sent again
+        free((char *)record->filename);
+        record->name     = name;
+        record->filename = filename;
+        record->line_num = stream_record.line_num;
+    }
+}
+
+static void
+collector_put_smpls(CollectorStream *stream, ProfStreamBatch const *hdr, char const *items, size_t items_size)
+{
+    Prof   *prof    = stream->prof;
+    ProfIdx items_n = hdr->items_n;
+    if (items_n > items_size / sizeof(ProfRecordSmpl))
+    {   stream->broken = 1; return;   }
+
+    ProfIdx end_i = stream->smpls_base + hdr->first_i + items_n;
+    while (end_i > prof->record_smpl_tree_m)
+    {   prof->record_smpl_tree = (ProfRecordSmpl *)prof_grow(prof, prof->record_smpl_tree, &prof->record_smpl_tree_m, sizeof(*prof->record_smpl_tree));   }
+
+    for (ProfIdx item_i = 0; item_i < items_n; ++item_i)
+    {
+        ProfRecordSmpl smpl;
+        memcpy(&smpl, items + item_i * sizeof(smpl), sizeof(smpl));
+        smpl.parent_i += stream->smpls_base;
+        if (smpl.record_i >= prof->records_n)
+        {   stream->broken = 1; return;   } // NOTE: can't happen if the records arrived, which they did first
+        prof->record_smpl_tree[stream->smpls_base + hdr->first_i + item_i] = smpl;
+    }
+    if (end_i > prof->record_smpl_tree_n)
+    {   prof->record_smpl_tree_n = end_i;   }
+}
+
+static void
+collector_put_hits(CollectorStream *stream, ProfStreamBatch const *hdr, char const *items, size_t items_size)
+{
+    Prof   *prof    = stream->prof;
+    ProfIdx items_n = hdr->items_n;
+    if (items_n > items_size / sizeof(ProfHitsSmpl))
+    {   stream->broken = 1; return;   }
+
+    for (ProfIdx item_i = 0; item_i < items_n; ++item_i)
+    {
+        if (prof->hits_smpls_n == prof->hits_smpls_m)
+        {   prof->hits_smpls = (ProfHitsSmpl *)prof_grow(prof, prof->hits_smpls, &prof->hits_smpls_m, sizeof(*prof->hits_smpls));   }
+        ProfHitsSmpl hits;
+        memcpy(&hits, items + item_i * sizeof(hits), sizeof(hits));
+        hits.smpl_i += stream->smpls_base;
+        prof->hits_smpls[prof->hits_smpls_n++] = hits;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char const *socket_path  = 0;
+    char const *out_filename = 0;
+    int         aggregate    = 0;
+    uint64_t    flushes_max  = 0;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if      (! strcmp(argv[arg_i], "-o") && arg_i + 1 < argc) {   out_filename = argv[++arg_i];   }
+        else if (! strcmp(argv[arg_i], "-n") && arg_i + 1 < argc) {   flushes_max  = strtoull(argv[++arg_i], 0, 10);   }
+        else if (! strcmp(argv[arg_i], "-aggregate"))              {   aggregate    = 1;   }
+        else if (! socket_path)                                    {   socket_path  = argv[arg_i];   }
+        else if (aggregate && ! out_filename)                      {   out_filename = argv[arg_i];   }
+    }
+    if (! socket_path || (! aggregate && ! out_filename))
+    {
+        fprintf(stderr, "usage: %s socket_path [-o out.json | -aggregate [out.txt]] [-n flushes]\n", argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {   fprintf(stderr, "socket path '%s' is too long\n", socket_path); return 1;   }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    unlink(socket_path); // left over from a previous run
+    if (fd < 0 || bind(fd, (struct sockaddr const *)&addr, sizeof(addr)))
+    {   fprintf(stderr, "could not bind '%s': %s\n", socket_path, strerror(errno)); return 1;   }
+
+    int rcvbuf = 16 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct timeval timeout = { 0, 200 * 1000 }; // to notice signals
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = collector_on_signal; // NOTE: no SA_RESTART, so recv returns
+    sigaction(SIGINT,  &action, 0);
+    sigaction(SIGTERM, &action, 0);
+
+    FILE            *out       = 0;
+    CollectorStream **streams  = 0;
+    size_t           streams_n = 0;
+    uint64_t         flushes_n = 0;
+    uint64_t         invalid_n = 0;
+    char            *buf       = (char *)malloc(PROF_STREAM_BATCH_SIZE);
+
+    while (! collector_stop && (! flushes_max || flushes_n < flushes_max))
+    {
+        ssize_t size = recv(fd, buf, PROF_STREAM_BATCH_SIZE, 0);
+        if (size < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {   continue;   }
+            perror("recv");
+            break;
+        }
+
+        ProfStreamBatch hdr;
+        if ((size_t)size < sizeof(hdr))
+        {   ++invalid_n; continue;   }
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (memcmp(hdr.magic, PROF_STREAM_MAGIC, sizeof(PROF_STREAM_MAGIC)) ||
+            hdr.version != PROF_STREAM_VERSION ||
+            hdr.header_size > (size_t)size)
+        {   ++invalid_n; continue;   }
+
+        CollectorStream *stream = collector_find_stream(&streams, &streams_n, hdr.pid, hdr.tid);
+        stream->prof->freq       = hdr.freq;
+        stream->sender_dropped_n = hdr.dropped_n;
+        if (hdr.flush_i != stream->flush_i)
+        {   collector_start_flush(stream, hdr.flush_i);   }
+        if (hdr.batch_i != stream->batches_n)
+        {   stream->broken = 1;   }
+
+        char const *items      = buf + hdr.header_size;
+        size_t      items_size = (size_t)size - hdr.header_size;
+        switch (hdr.kind)
+        {
+            case PROF_STREAM_records: collector_put_records(stream->prof, &hdr, items, items_size); break;
+            case PROF_STREAM_smpls:   collector_put_smpls(stream, &hdr, items, items_size);         break;
+            case PROF_STREAM_hits:    collector_put_hits(stream, &hdr, items, items_size);          break;
+            case PROF_STREAM_end:
+            {
+                Prof *prof = stream->prof;
+                if (stream->broken)
+                {
+                    ++stream->incomplete_n;
+                    stream->batches_n = 0; // counted
+                    collector_start_flush(stream, ~(uint64_t)0);
+                    continue;
+                }
+
+                if (aggregate)
+                {
+                    stream->smpls_base = prof->record_smpl_tree_n;
+                    stream->hits_base  = prof->hits_smpls_n;
+                }
+                else
+                {   prof_dump_timings_file(&out, out_filename, prof);   }
+                ++stream->flushes_n;
+                ++flushes_n;
+                stream->flush_i   = ~(uint64_t)0;
+                stream->batches_n = 0;
+                continue;
+            }
+            default: ++invalid_n; break;
+        }
+        ++stream->batches_n;
+    }
+
+    if (aggregate)
+    {
+        out = (out_filename
+               ? fopen(out_filename, "w")
+               : stdout);
+        if (! out)
+        {   fprintf(stderr, "could not open '%s'\n", out_filename); return 1;   }
+        for (size_t stream_i = 0; stream_i < streams_n; ++stream_i)
+        {
+            CollectorStream *stream = streams[stream_i];
+            fprintf(out, "%spid %llu tid %llu: %llu flushes\n", (stream_i ? "\n" : ""),
+                    (unsigned long long)stream->pid, (unsigned long long)stream->tid,
+                    (unsigned long long)stream->flushes_n);
+            stream->prof->record_smpl_tree_n = stream->smpls_base; // without any unfinished flush
+            stream->prof->hits_smpls_n       = stream->hits_base;
+            prof_dump_aggregate_file(out, stream->prof);
+        }
+        if (out != stdout)
+        {   fclose(out);   }
+    }
+    else if (out)
+    {
+        fputs("\n]\n", out);
+        fclose(out);
+    }
+
+    close(fd);
+    unlink(socket_path);
+
+    fprintf(stderr, "%llu flushes from %zu threads\n", (unsigned long long)flushes_n, streams_n);
+    for (size_t stream_i = 0; stream_i < streams_n; ++stream_i)
+    {
+        CollectorStream *stream = streams[stream_i];
+        if (stream->incomplete_n || stream->sender_dropped_n)
+        {
+            fprintf(stderr, "pid %llu tid %llu: %llu flushes dropped by the sender, %llu of them partly received\n",
+                    (unsigned long long)stream->pid, (unsigned long long)stream->tid,
+                    (unsigned long long)stream->sender_dropped_n, (unsigned long long)stream->incomplete_n);
+        }
+    }
+    if (invalid_n)
+    {   fprintf(stderr, "%llu datagrams weren't professor batches\n", (unsigned long long)invalid_n);   }
+    return 0;
+}
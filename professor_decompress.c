@@ -0,0 +1,69 @@
+// professor_decompress.c - turn a trace dumped with PROF_COMPRESS back into plain JSON, e.g. for chrome://tracing
+// The other tools read compressed traces directly. -c goes the other way, compressing any file into the same blocks.
+//
+// usage: professor_decompress [-c] in [out]
+#define _CRT_SECURE_NO_WARNINGS
+#include "professor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv)
+{
+    char const *in_filename  = 0;
+    char const *out_filename = 0;
+    int         compress     = 0;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if      (! strcmp(argv[arg_i], "-c")) {   compress     = 1;   }
+        else if (! in_filename)              {   in_filename  = argv[arg_i];   }
+        else if (! out_filename)             {   out_filename = argv[arg_i];   }
+    }
+    if (! in_filename)
+    {
+        fprintf(stderr, "usage: %s [-c] in [out]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in  = fopen(in_filename, "rb");
+    FILE *out = (out_filename
+                 ? fopen(out_filename, "wb")
+                 : stdout);
+    if (! in)
+    {   fprintf(stderr, "could not open '%s'\n", in_filename); return 1;   }
+    if (! out)
+    {   fprintf(stderr, "could not open '%s'\n", out_filename); return 1;   }
+
+    int result = 1;
+    if (compress)
+    {
+        char     *raw      = (char *)malloc(PROF_LZ_BLOCK_SIZE);
+        char     *data     = (char *)malloc(PROF_LZ_BOUND(PROF_LZ_BLOCK_SIZE));
+        uint32_t *table    = (uint32_t *)malloc(sizeof(*table) << PROF_LZ_HASH_BITS);
+        size_t    raw_n;
+        while (result && (raw_n = fread(raw, 1, PROF_LZ_BLOCK_SIZE, in)) > 0)
+        {
+            ProfLzBlock block;
+            memcpy(block.magic, PROF_LZ_MAGIC, sizeof(block.magic));
+            block.raw_n  = (uint32_t)raw_n;
+            block.data_n = (uint32_t)prof_lz_compress(raw, raw_n, data, table);
+            char const *block_data = data;
+            if (block.data_n >= block.raw_n)
+            {   block.data_n = block.raw_n; block_data = raw;   }
+            result = (fwrite(&block, sizeof(block), 1, out) == 1 &&
+                      fwrite(block_data, 1, block.data_n, out) == block.data_n);
+        }
+        free(table);
+        free(data);
+        free(raw);
+    }
+    else
+    {   result = prof_lz_decompress_file(in, out);   }
+
+    fclose(in);
+    if (out != stdout)
+    {   fclose(out);   }
+    if (! result)
+    {   fprintf(stderr, "'%s' is corrupt, or couldn't be written out\n", in_filename); return 1;   }
+    return 0;
+}
@@ -0,0 +1,610 @@
+// professor_diff.c - compare two profiles of the same program and flag per-record regressions
+// Each input is either a trace written by prof_dump_timings_file (one event per line) or the text written by
+// prof_dump_aggregate_file. Inputs are streamed, so memory is bounded by the number of records, not events.
+// Traces dumped with PROF_COMPRESS are decompressed to a temporary file first.
+//
+// Records are matched by name, filename and line number. Traces only have the name, so if either input is a
+// trace, records are matched by name alone.
+// From traces: hits, inclusive and self time (inclusive less that of the slices nested directly inside it, per
+// thread), per-hit mean/spread and percentiles of the sample durations.
+// From aggregates: hits, inclusive time and per-hit mean/spread.
+//
+// A record has regressed if its mean time per hit rose by more than -threshold percent and by more than -min-us,
+// and Welch's t statistic is above -t (i.e. the change is large relative to the spread between samples).
+// Exits with 1 if any record regressed, 2 on bad input, 0 otherwise.
+//
+// usage: professor_diff base.json new.json [-threshold percent] [-min-us us] [-t t] [-min-samples n]
+//                                          [-json out.json] [-n rows]
+#define _CRT_SECURE_NO_WARNINGS
+#define _GNU_SOURCE // getline
+#include "professor.h" // prof_lz_fopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <math.h> // INFINITY only; no -lm needed
+
+#define DIFF_HIST_SUB_BITS 3 // 8 buckets per power of 2, so percentiles are within 12.5%
+#define DIFF_HIST_SUB_N    (1 << DIFF_HIST_SUB_BITS)
+#define DIFF_HIST_N        (64 * DIFF_HIST_SUB_N)
+
+typedef struct DiffKey {
+    char const *name;
+    char const *loc; // "filename:line_num", or "" if unknown
+} DiffKey;
+
+typedef struct DiffStats {
+    uint64_t smpls_n;
+    uint64_t hits_n;
+    double   incl_ms;
+    double   self_ms;
+    double   hit_ms_mean, hit_ms_m2; // per hit, weighted by each sample's hits (West's algorithm)
+    uint32_t hist[DIFF_HIST_N];     // sample durations in ns, only from traces
+} DiffStats;
+
+typedef struct DiffRecord {
+    DiffKey   key;
+    DiffStats stats[2]; // base, new
+} DiffRecord;
+
+static uint64_t
+diff_hash_str(uint64_t hash, char const *str)
+{
+    for (; str && *str; ++str)
+    {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static inline uint64_t
+diff_hash_key(DiffKey key)
+{   return diff_hash_str(diff_hash_str(0xcbf29ce484222325, key.name), key.loc);   }
+
+static inline int
+diff_key_eq(DiffKey a, DiffKey b)
+{
+    return (a.name && b.name &&
+            ! strcmp(a.name, b.name) &&
+            ! strcmp(a.loc,  b.loc));
+}
+
+#define MAP_INVALID_VAL (~(uint32_t) 0)
+#define MAP_HASH_KEY(key) diff_hash_key(key)
+#define MAP_KEY_EQ(a, b) diff_key_eq(a, b)
+#define MAP_TYPES (DiffRecordMap, diff_record_map, DiffKey, uint32_t)
+#include "hash.h"
+
+typedef struct DiffOpen { // a slice that may still have slices nested inside it
+    uint32_t record_i;
+    double   end_ms;
+    double   dur_ms;
+    double   child_ms;
+} DiffOpen;
+
+typedef struct DiffThread {
+    uint64_t  pid, tid;
+    DiffOpen *opens; // stack
+    size_t    opens_n, opens_m;
+} DiffThread;
+
+typedef struct Diff {
+    DiffRecord   *records;
+    uint32_t      records_n, records_m;
+    DiffRecordMap record_map[1];
+    int           match_locs;
+
+    DiffThread   *threads;
+    size_t        threads_n, threads_m;
+} Diff;
+
+static inline uint32_t
+diff_hist_i(uint64_t ns)
+{
+    uint32_t result = (uint32_t)ns;
+    if (ns >= DIFF_HIST_SUB_N)
+    {
+        uint32_t msb = DIFF_HIST_SUB_BITS;
+        while (ns >> (msb + 1))
+        {   ++msb;   }
+        uint32_t sub = (uint32_t)(ns >> (msb - DIFF_HIST_SUB_BITS)) & (DIFF_HIST_SUB_N - 1);
+        result = (msb - DIFF_HIST_SUB_BITS + 1) * DIFF_HIST_SUB_N + sub;
+    }
+    return result;
+}
+
+static inline double
+diff_abs(double x)
+{   return (x < 0.0 ? -x : x);   } // NOTE: with prof_sqrt, keeps the diff free of libm
+
+// the middle of the bucket
+static inline double
+diff_hist_ns(uint32_t hist_i)
+{
+    double result = hist_i;
+    if (hist_i >= DIFF_HIST_SUB_N)
+    {
+        uint32_t msb = hist_i / DIFF_HIST_SUB_N + DIFF_HIST_SUB_BITS - 1;
+        uint32_t sub = hist_i % DIFF_HIST_SUB_N;
+        double   unit = (double)((uint64_t)1 << (msb - DIFF_HIST_SUB_BITS)); // NOTE: msb >= DIFF_HIST_SUB_BITS here
+        result = (DIFF_HIST_SUB_N + sub + 0.5) * unit;
+    }
+    return result;
+}
+
+// in ms, or -1 if there are no samples with durations
+static double
+diff_percentile(DiffStats const *stats, double percentile)
+{
+    uint64_t smpls_n = 0;
+    for (uint32_t hist_i = 0; hist_i < DIFF_HIST_N; ++hist_i)
+    {   smpls_n += stats->hist[hist_i];   }
+
+    double   result = -1.0;
+    uint64_t rank   = (uint64_t)(percentile / 100.0 * (double)smpls_n);
+    uint64_t seen_n = 0;
+    for (uint32_t hist_i = 0; smpls_n && hist_i < DIFF_HIST_N; ++hist_i)
+    {
+        seen_n += stats->hist[hist_i];
+        if (seen_n > rank)
+        {   result = diff_hist_ns(hist_i) / 1000000.0; break;   }
+    }
+    return result;
+}
+
+static char *
+diff_strdup(char const *str, size_t len)
+{
+    char *result = (char *)malloc(len + 1);
+    memcpy(result, str, len);
+    result[len] = 0;
+    return result;
+}
+
+static uint32_t
+diff_record_i(Diff *diff, char const *name, size_t name_len, char const *loc, size_t loc_len)
+{
+    char name_buf[1024], loc_buf[1024];
+    if (name_len >= sizeof(name_buf)) {   name_len = sizeof(name_buf) - 1;   }
+    if (loc_len  >= sizeof(loc_buf))  {   loc_len  = sizeof(loc_buf)  - 1;   }
+    if (! diff->match_locs)
+    {   loc_len = 0;   }
+    memcpy(name_buf, name, name_len); name_buf[name_len] = 0;
+    memcpy(loc_buf,  loc,  loc_len);  loc_buf[loc_len]   = 0;
+
+    DiffKey  key      = { name_buf, loc_buf };
+    uint32_t record_i = diff_record_map_get(diff->record_map, key);
+    if (! ~record_i)
+    {
+        if (diff->records_n == diff->records_m)
+        {
+            diff->records_m = diff->records_m ? diff->records_m * 2 : 256;
+            diff->records   = (DiffRecord *)realloc(diff->records, diff->records_m * sizeof(*diff->records));
+        }
+        record_i = diff->records_n++;
+
+        DiffRecord *record = &diff->records[record_i];
+        memset(record, 0, sizeof(*record));
+        record->key.name = diff_strdup(name_buf, name_len);
+        record->key.loc  = diff_strdup(loc_buf,  loc_len);
+        diff_record_map_insert(diff->record_map, record->key, record_i);
+    }
+    return record_i;
+}
+
+static void
+diff_add_smpl(DiffStats *stats, double dur_ms, uint64_t hits_n)
+{
+    stats->smpls_n += 1;
+    stats->hits_n  += hits_n;
+    stats->incl_ms += dur_ms;
+    if (hits_n)
+    {
+        double hit_ms    = dur_ms / (double)hits_n;
+        double mean_prev = stats->hit_ms_mean;
+        stats->hit_ms_mean += ((double)hits_n / (double)stats->hits_n) * (hit_ms - mean_prev);
+        stats->hit_ms_m2   += (double)hits_n * (hit_ms - mean_prev) * (hit_ms - stats->hit_ms_mean);
+    }
+    ++stats->hist[diff_hist_i((uint64_t)(dur_ms * 1000000.0 + 0.5))];
+}
+
+static void
+diff_close_open(Diff *diff, DiffThread *thread, int side)
+{
+    DiffOpen open = thread->opens[--thread->opens_n];
+    double   self = open.dur_ms - open.child_ms;
+    diff->records[open.record_i].stats[side].self_ms += (self > 0.0 ? self : 0.0);
+}
+
+static DiffThread *
+diff_thread(Diff *diff, uint64_t pid, uint64_t tid)
+{
+    for (size_t thread_i = 0; thread_i < diff->threads_n; ++thread_i)
+    {
+        if (diff->threads[thread_i].pid == pid && diff->threads[thread_i].tid == tid)
+        {   return &diff->threads[thread_i];   }
+    }
+
+    if (diff->threads_n == diff->threads_m)
+    {
+        diff->threads_m = diff->threads_m ? diff->threads_m * 2 : 16;
+        diff->threads   = (DiffThread *)realloc(diff->threads, diff->threads_m * sizeof(*diff->threads));
+    }
+    DiffThread *result = &diff->threads[diff->threads_n++];
+    memset(result, 0, sizeof(*result));
+    result->pid = pid;
+    result->tid = tid;
+    return result;
+}
+
+// finds `"key":` and returns what follows it, skipping spaces
+static char const *
+diff_field(char const *line, char const *key)
+{
+    char const *result = strstr(line, key);
+    if (result)
+    {
+        result += strlen(key);
+        while (*result == ' ')
+        {   ++result;   }
+    }
+    return result;
+}
+
+static void
+diff_read_trace_event(Diff *diff, char const *line, int side)
+{
+    char const *ph   = diff_field(line, "\"ph\":");
+    char const *name = diff_field(line, "\"name\":");
+    char const *ts   = diff_field(line, "\"ts\":");
+    if (! ph || ! name || ! ts || *name != '"' || ph[0] != '"' ||
+        (ph[1] != 'X' && ph[1] != 'i'))
+    {   return;   } // metadata, counters, async...
+
+    char   name_buf[1024]; // names are JSON-escaped in the trace
+    size_t name_n = 0;
+    for (++name; *name != '"'; ++name)
+    {
+        char c = *name;
+        if (! c)
+        {   return;   }
+        if (c == '\\')
+        {
+            c = *++name;
+            if      (c == 'n') {   c = '\n';   }
+            else if (c == 't') {   c = '\t';   }
+            else if (c == 'r') {   c = '\r';   }
+            else if (c == 'u' && name[1] && name[2] && name[3] && name[4])
+            { // only control characters are written this way
+                char hex[3] = { name[3], name[4], 0 };
+                c     = (char)strtol(hex, 0, 16);
+                name += 4;
+            }
+            else if (! c)
+            {   return;   }
+        }
+        if (name_n < sizeof(name_buf))
+        {   name_buf[name_n++] = c;   }
+    }
+
+    char const *dur  = diff_field(line, "\"dur\":");
+    char const *pid  = diff_field(line, "\"pid\":");
+    char const *tid  = diff_field(line, "\"tid\":");
+    char const *hits = diff_field(line, "\"hits\":");
+    double   ts_ms  = strtod(ts, 0);
+    double   dur_ms = (ph[1] == 'X' && dur ? strtod(dur, 0) : 0.0);
+    uint64_t hits_n = (hits ? strtoull(hits, 0, 10) : 1);
+
+    uint32_t    record_i = diff_record_i(diff, name_buf, name_n, "", 0);
+    DiffStats  *stats    = &diff->records[record_i].stats[side];
+    if (ph[1] == 'i')
+    {   stats->hits_n += hits_n; return;   }
+    diff_add_smpl(stats, dur_ms, hits_n);
+
+    // slices on a thread are in start order, and nested ones are within their parents
+    double const eps    = 1e-6; // the trace's rounding
+    DiffThread  *thread = diff_thread(diff, pid ? strtoull(pid, 0, 10) : 0, tid ? strtoull(tid, 0, 10) : 0);
+    while (thread->opens_n && thread->opens[thread->opens_n - 1].end_ms < ts_ms + dur_ms - eps)
+    {   diff_close_open(diff, thread, side);   }
+    if (thread->opens_n)
+    {   thread->opens[thread->opens_n - 1].child_ms += dur_ms;   }
+
+    if (thread->opens_n == thread->opens_m)
+    {
+        thread->opens_m = thread->opens_m ? thread->opens_m * 2 : 64;
+        thread->opens   = (DiffOpen *)realloc(thread->opens, thread->opens_m * sizeof(*thread->opens));
+    }
+    DiffOpen *open = &thread->opens[thread->opens_n++];
+    open->record_i = record_i;
+    open->end_ms   = ts_ms + dur_ms;
+    open->dur_ms   = dur_ms;
+    open->child_ms = 0.0;
+}
+
+// a line of prof_dump_aggregate_file: samples hits total_ms us/hit stddev_us min_us max_us  name (filename:line)
+static void
+diff_read_aggregate_line(Diff *diff, char const *line, int side)
+{
+    unsigned long long smpls_n, hits_n;
+    double incl_ms, hit_us, stddev_us, min_us, max_us;
+    int    fields_len = 0;
+    if (sscanf(line, "%llu %llu %lf %lf %lf %lf %lf %n",
+               &smpls_n, &hits_n, &incl_ms, &hit_us, &stddev_us, &min_us, &max_us, &fields_len) < 7 ||
+        ! fields_len)
+    {   return;   } // header
+
+    char const *name     = line + fields_len;
+    size_t      name_len = strlen(name);
+    char const *loc      = "";
+    size_t      loc_len  = 0;
+    if (name_len && name[name_len - 1] == ')')
+    { // "name (filename:line)"
+        char const *paren = strrchr(name, '(');
+        if (paren && paren - 1 > name && paren[-1] == ' ')
+        {
+            loc      = paren + 1;
+            loc_len  = name_len - (size_t)(loc - name) - 1;
+            name_len = (size_t)(paren - 1 - name);
+        }
+    }
+
+    uint32_t   record_i = diff_record_i(diff, name, name_len, loc, loc_len);
+    DiffStats *stats    = &diff->records[record_i].stats[side];
+    stats->smpls_n    += smpls_n;
+    stats->hits_n     += hits_n;
+    stats->incl_ms    += incl_ms;
+    stats->hit_ms_mean = hit_us / 1000.0;
+    stats->hit_ms_m2   = (stddev_us / 1000.0) * (stddev_us / 1000.0) * (double)hits_n;
+}
+
+// returns 0 if the file can't be read
+static int
+diff_read(Diff *diff, FILE *file, int is_trace, int side)
+{
+    char   *line   = 0;
+    size_t  line_m = 0;
+    ssize_t line_n;
+    while ((line_n = getline(&line, &line_m, file)) >= 0)
+    {
+        while (line_n > 0 && strchr(" \t\r\n,", line[line_n - 1]))
+        {   line[--line_n] = 0;   }
+        if (is_trace) {   diff_read_trace_event(diff, line, side);      }
+        else          {   diff_read_aggregate_line(diff, line, side);   }
+    }
+    free(line);
+
+    for (size_t thread_i = 0; thread_i < diff->threads_n; ++thread_i)
+    {
+        DiffThread *thread = &diff->threads[thread_i];
+        while (thread->opens_n)
+        {   diff_close_open(diff, thread, side);   }
+    }
+    return ! ferror(file);
+}
+
+// 1 for a trace, 0 for an aggregate, -1 if empty
+static int
+diff_is_trace(FILE *file)
+{
+    int c;
+    while ((c = fgetc(file)) != EOF && (c == ' ' || c == '\t' || c == '\r' || c == '\n'))
+    {}
+    if (c != EOF)
+    {   ungetc(c, file);   }
+    return (c == EOF ? -1 : c == '[');
+}
+
+typedef enum DiffStatus {
+    DIFF_same,
+    DIFF_regressed,
+    DIFF_improved,
+    DIFF_added,
+    DIFF_removed,
+    DIFF_too_few,
+} DiffStatus;
+
+static char const *diff_status_names[] = { "same", "REGRESSED", "improved", "added", "removed", "too_few" };
+
+typedef struct DiffResult {
+    uint32_t   record_i;
+    DiffStatus status;
+    double     hit_ms_change; // fraction
+    double     t;
+} DiffResult;
+
+static DiffRecord const *diff_sort_records; // NOTE: qsort has no context parameter
+
+// biggest change in inclusive time first
+static int
+diff_cmp_results(void const *a, void const *b)
+{
+    DiffRecord const *a_record = &diff_sort_records[((DiffResult const *)a)->record_i];
+    DiffRecord const *b_record = &diff_sort_records[((DiffResult const *)b)->record_i];
+    double a_delta = diff_abs(a_record->stats[1].incl_ms - a_record->stats[0].incl_ms);
+    double b_delta = diff_abs(b_record->stats[1].incl_ms - b_record->stats[0].incl_ms);
+    int    result  = (a_delta < b_delta) - (a_delta > b_delta);
+    if (! result)
+    {   result = strcmp(a_record->key.name, b_record->key.name);   }
+    return result;
+}
+
+static void
+diff_json_str(FILE *out, char const *str)
+{
+    fputc('"', out);
+    for (; *str; ++str)
+    {
+        if      (*str == '"' || *str == '\\')       {   fputc('\\', out); fputc(*str, out);            }
+        else if ((unsigned char)*str < 0x20)        {   fprintf(out, "\\u%04x", (unsigned char)*str);  }
+        else                                        {   fputc(*str, out);                              }
+    }
+    fputc('"', out);
+}
+
+static void
+diff_json_num(FILE *out, double x)
+{
+    if (x < 0.0 || x != x) {   fputs("null", out);      } // not known
+    else                   {   fprintf(out, "%.9g", x); }
+}
+
+int main(int argc, char **argv)
+{
+    char const *filenames[2]   = {0};
+    char const *json_filename  = 0;
+    double      threshold      = 5.0;
+    double      min_us         = 0.1;
+    double      t_min          = 3.0;
+    uint64_t    min_smpls_n    = 2;
+    int         rows_n         = 40;
+    int         filenames_n    = 0;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if      (! strcmp(argv[arg_i], "-threshold")   && arg_i + 1 < argc) {   threshold     = atof(argv[++arg_i]);     }
+        else if (! strcmp(argv[arg_i], "-min-us")      && arg_i + 1 < argc) {   min_us        = atof(argv[++arg_i]);     }
+        else if (! strcmp(argv[arg_i], "-t")           && arg_i + 1 < argc) {   t_min         = atof(argv[++arg_i]);     }
+        else if (! strcmp(argv[arg_i], "-min-samples") && arg_i + 1 < argc) {   min_smpls_n   = strtoull(argv[++arg_i], 0, 10); }
+        else if (! strcmp(argv[arg_i], "-json")        && arg_i + 1 < argc) {   json_filename = argv[++arg_i];           }
+        else if (! strcmp(argv[arg_i], "-n")           && arg_i + 1 < argc) {   rows_n        = atoi(argv[++arg_i]);     }
+        else if (filenames_n < 2)                                            {   filenames[filenames_n++] = argv[arg_i];  }
+    }
+    if (filenames_n != 2)
+    {
+        fprintf(stderr, "usage: %s base.json new.json [-threshold percent] [-min-us us] [-t t] [-min-samples n]\n"
+                        "       %*s [-json out.json] [-n rows]\n", argv[0], (int)strlen(argv[0]), "");
+        return 2;
+    }
+
+    FILE *files[2];
+    int   is_trace[2];
+    for (int side = 0; side < 2; ++side)
+    {
+        files[side] = prof_lz_fopen(filenames[side]);
+        if (! files[side])
+        {   fprintf(stderr, "could not open '%s'\n", filenames[side]); return 2;   }
+        setvbuf(files[side], 0, _IOFBF, 1 << 20);
+        is_trace[side] = diff_is_trace(files[side]);
+        if (is_trace[side] < 0)
+        {   fprintf(stderr, "'%s' is empty\n", filenames[side]); return 2;   }
+    }
+
+    Diff diff[1];
+    memset(diff, 0, sizeof(*diff));
+    diff->match_locs = ! is_trace[0] && ! is_trace[1];
+    for (int side = 0; side < 2; ++side)
+    {
+        if (! diff_read(diff, files[side], is_trace[side], side))
+        {   fprintf(stderr, "could not read '%s'\n", filenames[side]); return 2;   }
+        fclose(files[side]);
+    }
+
+    DiffResult *results      = (DiffResult *)calloc(diff->records_n ? diff->records_n : 1, sizeof(*results));
+    uint32_t    regressed_n  = 0;
+    for (uint32_t record_i = 0; record_i < diff->records_n; ++record_i)
+    {
+        DiffStats const *a      = &diff->records[record_i].stats[0];
+        DiffStats const *b      = &diff->records[record_i].stats[1];
+        DiffResult      *result = &results[record_i];
+        result->record_i = record_i;
+
+        if      (! a->hits_n)                                           {   result->status = DIFF_added;   }
+        else if (! b->hits_n)                                           {   result->status = DIFF_removed; }
+        else if (a->smpls_n < min_smpls_n || b->smpls_n < min_smpls_n) {   result->status = DIFF_too_few; }
+        else
+        {
+            double a_var = a->hit_ms_m2 / (double)a->hits_n;
+            double b_var = b->hit_ms_m2 / (double)b->hits_n;
+            double se    = prof_sqrt(a_var / (double)a->smpls_n + b_var / (double)b->smpls_n);
+            double delta = b->hit_ms_mean - a->hit_ms_mean;
+            result->hit_ms_change = (a->hit_ms_mean > 0.0 ? delta / a->hit_ms_mean : 0.0);
+            result->t             = (se > 0.0
+                                     ? delta / se
+                                     : (delta > 0.0 ? INFINITY : delta < 0.0 ? -INFINITY : 0.0));
+
+            int is_big = (diff_abs(result->hit_ms_change) * 100.0 > threshold &&
+                          diff_abs(delta) * 1000.0 > min_us &&
+                          diff_abs(result->t) > t_min);
+            result->status = (! is_big   ? DIFF_same      :
+                              delta > 0. ? DIFF_regressed :
+                              /* else */   DIFF_improved);
+            regressed_n += result->status == DIFF_regressed;
+        }
+    }
+
+    diff_sort_records = diff->records;
+    qsort(results, diff->records_n, sizeof(*results), diff_cmp_results);
+
+    printf("%s -> %s: %u records, %u regressed (threshold %.1f%%, %.3f us, t > %.1f)\n\n",
+           filenames[0], filenames[1], diff->records_n, regressed_n, threshold, min_us, t_min);
+    printf("%-10s %10s %10s %11s %11s %11s %11s %10s %10s %8s %10s %10s %8s  %s\n",
+           "status", "hits", "new hits", "incl ms", "new incl", "self ms", "new self",
+           "us/hit", "new us/hit", "change", "p99 ms", "new p99", "t", "record");
+    for (uint32_t result_i = 0; result_i < diff->records_n && (int)result_i < rows_n; ++result_i)
+    {
+        DiffResult       result = results[result_i];
+        DiffRecord const *record = &diff->records[result.record_i];
+        DiffStats const  *a      = &record->stats[0];
+        DiffStats const  *b      = &record->stats[1];
+        char a_self[32] = "n/a", b_self[32] = "n/a", a_p99[32] = "n/a", b_p99[32] = "n/a"; // only known from traces
+        if (is_trace[0] && a->smpls_n) {   snprintf(a_self, sizeof(a_self), "%.3f", a->self_ms); snprintf(a_p99, sizeof(a_p99), "%.4f", diff_percentile(a, 99.0));   }
+        if (is_trace[1] && b->smpls_n) {   snprintf(b_self, sizeof(b_self), "%.3f", b->self_ms); snprintf(b_p99, sizeof(b_p99), "%.4f", diff_percentile(b, 99.0));   }
+        printf("%-10s %10llu %10llu %11.3f %11.3f %11s %11s %10.3f %10.3f %+7.1f%% %10s %10s %8.1f  %s%s%s%s\n",
+               diff_status_names[result.status],
+               (unsigned long long)a->hits_n, (unsigned long long)b->hits_n,
+               a->incl_ms, b->incl_ms, a_self, b_self,
+               a->hit_ms_mean * 1000.0, b->hit_ms_mean * 1000.0,
+               result.hit_ms_change * 100.0,
+               a_p99, b_p99,
+               result.t,
+               record->key.name, *record->key.loc ? " (" : "", record->key.loc, *record->key.loc ? ")" : "");
+    }
+
+    if (json_filename)
+    {
+        FILE *out = (strcmp(json_filename, "-")
+                     ? fopen(json_filename, "wb")
+                     : stdout);
+        if (! out)
+        {   fprintf(stderr, "could not open '%s'\n", json_filename); return 2;   }
+
+        fprintf(out, "{\"base\": "); diff_json_str(out, filenames[0]);
+        fprintf(out, ", \"new\": ");  diff_json_str(out, filenames[1]);
+        fprintf(out, ", \"threshold_percent\": %g, \"min_us\": %g, \"t\": %g, \"has_self\": %s, \"regressed_n\": %u, \"records\": [",
+                threshold, min_us, t_min, is_trace[0] && is_trace[1] ? "true" : "false", regressed_n);
+        for (uint32_t result_i = 0; result_i < diff->records_n; ++result_i)
+        {
+            DiffResult        result = results[result_i];
+            DiffRecord const *record = &diff->records[result.record_i];
+            fprintf(out, "%s\n  {\"name\": ", result_i ? "," : "");
+            diff_json_str(out, record->key.name);
+            fprintf(out, ", \"loc\": ");
+            diff_json_str(out, record->key.loc);
+            fprintf(out, ", \"status\": \"%s\", \"t\": ", diff_status_names[result.status]);
+            if (isinf(result.t)) {   fputs(result.t > 0 ? "1e308" : "-1e308", out);   }
+            else                 {   fprintf(out, "%.9g", result.t);                  }
+            fprintf(out, ", \"hit_ms_change\": %.9g", result.hit_ms_change);
+            for (int side = 0; side < 2; ++side)
+            {
+                DiffStats const *stats = &record->stats[side];
+                fprintf(out, ", \"%s\": {\"samples\": %llu, \"hits\": %llu, \"incl_ms\": %.9g, \"self_ms\": ",
+                        side ? "new" : "base",
+                        (unsigned long long)stats->smpls_n, (unsigned long long)stats->hits_n, stats->incl_ms);
+                diff_json_num(out, is_trace[side] ? stats->self_ms : -1.0);
+                fprintf(out, ", \"ms_per_hit\": %.9g, \"ms_per_hit_stddev\": %.9g",
+                        stats->hit_ms_mean, stats->hits_n ? prof_sqrt(stats->hit_ms_m2 / (double)stats->hits_n) : 0.0);
+                fprintf(out, ", \"p50_ms\": ");  diff_json_num(out, is_trace[side] ? diff_percentile(stats, 50.0) : -1.0);
+                fprintf(out, ", \"p90_ms\": ");  diff_json_num(out, is_trace[side] ? diff_percentile(stats, 90.0) : -1.0);
+                fprintf(out, ", \"p99_ms\": ");  diff_json_num(out, is_trace[side] ? diff_percentile(stats, 99.0) : -1.0);
+                fputc('}', out);
+            }
+            fputc('}', out);
+        }
+        fputs("\n]}\n", out);
+        if (out != stdout)
+        {   fclose(out);   }
+    }
+
+    return regressed_n ? 1 : 0;
+}
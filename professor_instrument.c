@@ -0,0 +1,183 @@
+// professor_instrument.c - whole-program function scopes from GCC/Clang's -finstrument-functions
+// Build your code with -finstrument-functions and link this file in, built without it (and with the same PROF_*
+// defines as the rest of the program). -finstrument-functions-exclude-file-list=professor.h,hash.h keeps the
+// profiler's own inline functions out. Then, on each thread to be profiled:
+//
+//     prof_instrument_thread(prof);     // every function this thread enters from now on is a scope in prof
+//     ...
+//     prof_instrument_symbolize(prof);  // optional: function addresses -> names, before dumping
+//     prof_dump_timings_file(&out, "trace.json", prof);
+//
+// Functions are address-keyed records (see PROF_ADDR), with the last function looked up cached in front of
+// the Prof's map, as loops tend to call the same function over and over.
+// prof_instrument_include/exclude limit which functions are sampled by address range, e.g. to leave out
+// small hot helpers. Set them up before any thread is instrumented.
+//
+// prof_instrument_symbolize names what it can with dladdr, which only sees the dynamic symbol table: link with
+// -rdynamic to name functions in the executable. Anything else keeps its address for professor_symbolize.
+// NOTE: exceptions and longjmp skip the exit hooks, leaving the scopes they unwind through open
+#define _CRT_SECURE_NO_WARNINGS
+#define _GNU_SOURCE // dladdr
+#define PROF_INSTRUMENT 1
+#include "professor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#define PROF_NO_INSTRUMENT __attribute__((no_instrument_function))
+
+#ifndef  PROF_INSTRUMENT_RANGES_MAX
+# define PROF_INSTRUMENT_RANGES_MAX 64
+#endif //PROF_INSTRUMENT_RANGES_MAX
+
+typedef struct ProfInstrumentRange {
+    uintptr_t lo, hi; // [lo, hi)
+} ProfInstrumentRange;
+
+static struct {
+    ProfInstrumentRange includes[PROF_INSTRUMENT_RANGES_MAX]; // if there are any, functions must be in one
+    ProfInstrumentRange excludes[PROF_INSTRUMENT_RANGES_MAX];
+    int                 includes_n, excludes_n;
+} prof_instrument_filters;
+
+typedef struct ProfInstrumentThread {
+    Prof    *prof;
+    void    *last_fn;       // the last lookup, checked before the Prof's map
+    ProfIdx  last_record_i;
+    uint64_t depth;         // scopes started here, so exits from functions entered before are ignored
+    int      in_hook;       // in case the profiler itself was built with -finstrument-functions
+} ProfInstrumentThread;
+
+static __thread ProfInstrumentThread prof_instrument_state;
+
+// returns non-zero on success
+PROF_NO_INSTRUMENT static int
+prof_instrument_add_range(ProfInstrumentRange *ranges, int *ranges_n, void const *lo, void const *hi)
+{
+    int result = *ranges_n < PROF_INSTRUMENT_RANGES_MAX;
+    if (result)
+    {
+        ranges[*ranges_n].lo = (uintptr_t)lo;
+        ranges[*ranges_n].hi = (uintptr_t)hi;
+        ++*ranges_n;
+    }
+    return result;
+}
+
+PROF_NO_INSTRUMENT int
+prof_instrument_include(void const *lo, void const *hi)
+{   return prof_instrument_add_range(prof_instrument_filters.includes, &prof_instrument_filters.includes_n, lo, hi);   }
+
+PROF_NO_INSTRUMENT int
+prof_instrument_exclude(void const *lo, void const *hi)
+{   return prof_instrument_add_range(prof_instrument_filters.excludes, &prof_instrument_filters.excludes_n, lo, hi);   }
+
+PROF_NO_INSTRUMENT static int
+prof_instrument_is_included(void const *fn)
+{
+    if (! prof_instrument_filters.includes_n && ! prof_instrument_filters.excludes_n)
+    {   return 1;   }
+
+    uintptr_t addr   = (uintptr_t)fn;
+    int       result = ! prof_instrument_filters.includes_n;
+    for (int range_i = 0; range_i < prof_instrument_filters.includes_n && ! result; ++range_i)
+    {   result = (prof_instrument_filters.includes[range_i].lo <= addr && addr < prof_instrument_filters.includes[range_i].hi);   }
+    for (int range_i = 0; range_i < prof_instrument_filters.excludes_n && result; ++range_i)
+    {   result = ! (prof_instrument_filters.excludes[range_i].lo <= addr && addr < prof_instrument_filters.excludes[range_i].hi);   }
+    return result;
+}
+
+// samples this thread's functions into prof, until called again with 0
+PROF_NO_INSTRUMENT void
+prof_instrument_thread(Prof *prof)
+{
+    ProfInstrumentThread *state = &prof_instrument_state;
+    state->prof    = prof;
+    state->last_fn = 0;
+    state->depth   = 0;
+}
+
+PROF_NO_INSTRUMENT static ProfIdx
+prof_instrument_record_i(ProfInstrumentThread *state, void *fn)
+{
+    if (fn != state->last_fn)
+    {
+        state->last_fn       = fn;
+        state->last_record_i = prof_add_addr_record(state->prof, fn);
+    }
+    return state->last_record_i;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+PROF_NO_INSTRUMENT void
+__cyg_profile_func_enter(void *fn, void *call_site)
+{
+    (void)call_site;
+    ProfInstrumentThread *state = &prof_instrument_state;
+    if (state->prof && ! state->in_hook)
+    {
+        state->in_hook = 1;
+        if (prof_instrument_is_included(fn))
+        {
+            prof_start_(state->prof, prof_instrument_record_i(state, fn));
+            ++state->depth;
+        }
+        state->in_hook = 0;
+    }
+}
+
+PROF_NO_INSTRUMENT void
+__cyg_profile_func_exit(void *fn, void *call_site)
+{
+    (void)call_site;
+    ProfInstrumentThread *state = &prof_instrument_state;
+    if (state->prof && ! state->in_hook && state->depth)
+    {
+        state->in_hook = 1;
+        if (prof_instrument_is_included(fn))
+        {
+            prof_end_n_unchecked(state->prof, 1);
+            --state->depth;
+        }
+        state->in_hook = 0;
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+// names the functions that dladdr can, leaving the rest for professor_symbolize
+PROF_NO_INSTRUMENT void
+prof_instrument_symbolize(Prof *prof)
+{
+    ProfInstrumentThread *state = &prof_instrument_state;
+    int was_in_hook = state->in_hook;
+    state->in_hook  = 1;
+
+    ProfAddrMap const *map = prof->addr_records_i_map;
+    for (size_t key_i = 0; key_i < map->n; ++key_i)
+    {
+        void const *fn       = map->keys[key_i];
+        ProfIdx     record_i = map->vals[key_i];
+
+        Dl_info info;
+        if (dladdr(fn, &info) && info.dli_sname && info.dli_saddr == fn)
+        {
+            ProfRecord *record = &prof->records[record_i];
+            size_t      name_n = strlen(info.dli_sname);
+            char       *name   = (char *)prof->reallocate(prof->allocator, 0, name_n + 1);
+            memcpy(name, info.dli_sname, name_n + 1);
+            record->name     = name;
+            record->filename = info.dli_fname;
+        }
+    }
+
+    if (prof->writer)
+    {   prof_writer_forget_names(prof->writer);   }
+    state->in_hook = was_in_hook;
+}
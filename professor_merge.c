@@ -0,0 +1,149 @@
+// professor_merge.c - merge the traces of several processes into one timeline
+// Each input is a trace written by prof_dump_timings_file (one event per line, in timestamp order), compressed or not.
+// Inputs are streamed and k-way merged on their timestamps, so only one event per input is held in memory.
+// As all the timestamps come from the same TSC, traces from processes on the same machine line up.
+//
+// usage: professor_merge [-o out.json] in_a.json in_b.json ...
+#define _CRT_SECURE_NO_WARNINGS
+#define _GNU_SOURCE // getline
+#include "professor.h" // prof_lz_fopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+typedef struct MergeInput {
+    FILE       *file;
+    char const *filename;
+    char       *line;   // current event, trimmed of trailing commas
+    size_t      line_m;
+    double      ts;     // -inf for events without a timestamp (metadata), so they come first
+    char       *buf;    // for setvbuf
+} MergeInput;
+
+// returns 0 at the end of the input
+static int
+merge_next_event(MergeInput *input)
+{
+    ssize_t line_n;
+    while ((line_n = getline(&input->line, &input->line_m, input->file)) >= 0)
+    {
+        char *line = input->line;
+        while (line_n > 0 && strchr(" \t\r\n,", line[line_n - 1]))
+        {   line[--line_n] = 0;   }
+
+        char *event = line;
+        while (*event == ' ' || *event == '\t')
+        {   ++event;   }
+        if (*event != '{')
+        {   continue;   } // '[', ']', blank lines between dumps
+
+        memmove(line, event, strlen(event) + 1);
+        char *ts = strstr(line, "\"ts\":");
+        input->ts = (ts
+                     ? strtod(ts + 5, 0)
+                     : -INFINITY);
+        return 1;
+    }
+    return 0;
+}
+
+// min-heap of input indices, ordered by their current event's timestamp
+static void
+merge_sift_down(MergeInput *inputs, size_t *heap, size_t heap_n, size_t heap_i)
+{
+    for (;;)
+    {
+        size_t min_i   = heap_i;
+        size_t child_i = 2 * heap_i + 1;
+        if (child_i < heap_n     && inputs[heap[child_i]].ts     < inputs[heap[min_i]].ts) {   min_i = child_i;     }
+        if (child_i + 1 < heap_n && inputs[heap[child_i + 1]].ts < inputs[heap[min_i]].ts) {   min_i = child_i + 1; }
+        if (min_i == heap_i)
+        {   break;   }
+
+        size_t tmp   = heap[heap_i];
+        heap[heap_i] = heap[min_i];
+        heap[min_i]  = tmp;
+        heap_i       = min_i;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char const *out_filename = 0;
+    size_t      inputs_n     = 0;
+    MergeInput *inputs       = (MergeInput *)calloc(argc, sizeof(*inputs));
+    size_t     *heap         = (size_t *)calloc(argc, sizeof(*heap));
+    size_t      heap_n       = 0;
+    size_t const buf_size    = 1 << 20;
+
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if (! strcmp(argv[arg_i], "-o") && arg_i + 1 < argc)
+        {   out_filename = argv[++arg_i];   }
+        else
+        {
+            MergeInput *input = &inputs[inputs_n];
+            input->filename = argv[arg_i];
+            input->file     = prof_lz_fopen(input->filename);
+            if (! input->file)
+            {   fprintf(stderr, "could not open '%s'\n", input->filename); return 1;   }
+            input->buf = (char *)malloc(buf_size);
+            setvbuf(input->file, input->buf, _IOFBF, buf_size);
+            ++inputs_n;
+        }
+    }
+    if (! inputs_n)
+    {
+        fprintf(stderr, "usage: %s [-o out.json] in_a.json in_b.json ...\n", argv[0]);
+        return 1;
+    }
+
+    FILE *out = (out_filename
+                 ? fopen(out_filename, "wb")
+                 : stdout);
+    if (! out)
+    {   fprintf(stderr, "could not open '%s'\n", out_filename); return 1;   }
+    setvbuf(out, 0, _IOFBF, buf_size);
+
+    for (size_t input_i = 0; input_i < inputs_n; ++input_i)
+    {
+        if (merge_next_event(&inputs[input_i]))
+        {   heap[heap_n++] = input_i;   }
+    }
+    for (size_t heap_i = heap_n / 2; heap_i-- > 0;)
+    {   merge_sift_down(inputs, heap, heap_n, heap_i);   }
+
+    uint64_t events_n    = 0;
+    uint64_t unordered_n = 0;
+    double   last_ts     = -INFINITY;
+    fputs("[\n", out);
+    while (heap_n)
+    {
+        MergeInput *input = &inputs[heap[0]];
+        if (input->ts < last_ts)
+        {   ++unordered_n;   }
+        last_ts = input->ts;
+
+        if (events_n++)
+        {   fputs(",\n", out);   }
+        fputs("    ", out);
+        fputs(input->line, out);
+
+        if (! merge_next_event(input))
+        {   heap[0] = heap[--heap_n];   }
+        merge_sift_down(inputs, heap, heap_n, 0);
+    }
+    fputs("\n]\n", out);
+
+    if (out != stdout)
+    {   fclose(out);   }
+    for (size_t input_i = 0; input_i < inputs_n; ++input_i)
+    {   fclose(inputs[input_i].file);   }
+
+    fprintf(stderr, "merged %llu events from %zu traces\n", (unsigned long long)events_n, inputs_n);
+    if (unordered_n)
+    {   fprintf(stderr, "%llu events were out of order in their input\n", (unsigned long long)unordered_n);   }
+    return 0;
+}
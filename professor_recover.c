@@ -0,0 +1,177 @@
+// professor_recover.c - convert a (possibly partially written) binary capture into a chrome://tracing file
+// Binary captures come from PROF_MMAP mode, or from a crash.
+//
+// usage: professor_recover capture.bin [out.json] [-freq cycles_per_second]
+#define _CRT_SECURE_NO_WARNINGS
+#include "professor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// how many of n elements of elem_size at offset made it into the file
+static uint64_t
+recover_n_in_file(uint64_t offset, uint64_t n, size_t elem_size, size_t file_size)
+{
+    if (offset > file_size)
+    {   return 0;   }
+    if (n > (file_size - offset) / elem_size)
+    {   n = (file_size - offset) / elem_size;   }
+    return n;
+}
+
+static char const *
+recover_string(ProfBinHeader const *hdr, size_t file_size, uint32_t offset)
+{
+    char const *result    = 0;
+    uint64_t    strings_n = recover_n_in_file(hdr->strings_offset, hdr->strings_n, 1, file_size);
+    if (offset < strings_n)
+    {
+        char const *strings = (char const *)hdr + hdr->strings_offset;
+        if (memchr(strings + offset, 0, strings_n - offset)) // the string was finished
+        {   result = strings + offset;   }
+    }
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    char const *in_filename  = 0;
+    char const *out_filename = 0;
+    double      freq         = 0.0;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if      (! strcmp(argv[arg_i], "-freq") && arg_i + 1 < argc) {   freq = atof(argv[++arg_i]);   }
+        else if (! in_filename)                                       {   in_filename  = argv[arg_i];   }
+        else if (! out_filename)                                      {   out_filename = argv[arg_i];   }
+    }
+    if (! in_filename)
+    {
+        fprintf(stderr, "usage: %s capture.bin [out.json] [-freq cycles_per_second]\n", argv[0]);
+        return 1;
+    }
+
+    char default_out_filename[4096];
+    if (! out_filename)
+    {
+        snprintf(default_out_filename, sizeof(default_out_filename), "%s.json", in_filename);
+        out_filename = default_out_filename;
+    }
+
+    int fd = open(in_filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(ProfBinHeader))
+    {   fprintf(stderr, "could not read capture '%s'\n", in_filename); return 1;   }
+
+    size_t file_size = (size_t)st.st_size;
+    // NOTE: private mapping so that still-open samples can be closed off without touching the file
+    ProfBinHeader *hdr = (ProfBinHeader *)mmap(0, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ((void *)hdr == MAP_FAILED ||
+        memcmp(hdr->magic, PROF_BIN_MAGIC, sizeof(PROF_BIN_MAGIC)) ||
+        hdr->version != PROF_BIN_VERSION)
+    {   fprintf(stderr, "'%s' is not a professor capture\n", in_filename); return 1;   }
+
+    Prof prof[1] = {{0}};
+    prof->freq = (freq != 0.0
+                  ? freq
+                  : hdr->freq);
+    prof->pid      = hdr->pid;
+    prof->fork_gen = hdr->fork_gen;
+
+    { // samples - the file may have been cut short anywhere, even before them
+        ProfIdx         smpls_m = (ProfIdx)recover_n_in_file(hdr->smpls_offset, hdr->smpls_m, sizeof(ProfRecordSmpl), file_size);
+        ProfRecordSmpl *smpls   = (ProfRecordSmpl *)((char *)hdr + (smpls_m ? hdr->smpls_offset : 0));
+        ProfIdx         smpls_n = hdr->smpls_n;
+        if (! smpls_n || smpls_n > smpls_m)
+        {
+            for (smpls_n = 0; smpls_n < smpls_m && smpls[smpls_n].cycles_start; ++smpls_n)
+            {   /* find the first unwritten sample */   }
+        }
+
+        prof->record_smpl_tree   = smpls;
+        prof->record_smpl_tree_n = prof->record_smpl_tree_m = smpls_n;
+    }
+
+    { // records, including any that were sampled but didn't make it into the file
+        ProfIdx records_n = hdr->records_n;
+        for (ProfIdx smpl_i = 0; smpl_i < prof->record_smpl_tree_n; ++smpl_i)
+        {
+            ProfIdx record_i = prof->record_smpl_tree[smpl_i].record_i;
+            if (record_i >= records_n)
+            {   records_n = record_i + 1;   }
+        }
+
+        ProfIdx              bin_records_n = (ProfIdx)recover_n_in_file(hdr->records_offset, hdr->records_n, sizeof(ProfBinRecord), file_size);
+        ProfBinRecord const *bin_records   = (ProfBinRecord const *)((char const *)hdr + (bin_records_n ? hdr->records_offset : 0));
+        prof->records   = (ProfRecord *)calloc(records_n ? records_n : 1, sizeof(ProfRecord));
+        prof->records_n = prof->records_m = records_n;
+        for (ProfIdx record_i = 0; record_i < records_n; ++record_i)
+        {
+            ProfRecord *record = &prof->records[record_i];
+            record->name     = "(unknown)";
+            record->filename = "(unknown)";
+            if (record_i < bin_records_n)
+            {
+                ProfBinRecord bin_record = bin_records[record_i];
+                char const   *name       = recover_string(hdr, file_size, bin_record.name_offset);
+                char const   *filename   = recover_string(hdr, file_size, bin_record.filename_offset);
+                if (name)     {   record->name     = name;       }
+                if (filename) {   record->filename = filename;   }
+                record->line_num = bin_record.line_num;
+            }
+        }
+    }
+
+    { // still-open scopes
+        ProfIdx open_i = hdr->open_record_smpl_tree_i;
+        if (open_i >= prof->record_smpl_tree_n)
+        { // the deepest open sample is the last one that wasn't closed
+            open_i = ~(ProfIdx)0;
+            for (ProfIdx smpl_i = prof->record_smpl_tree_n; smpl_i-- > 0;)
+            {
+                if (! ~prof->record_smpl_tree[smpl_i].cycles_end)
+                {   open_i = smpl_i; break;   }
+            }
+        }
+        prof->open_record_smpl_tree_i = open_i;
+
+        if (~open_i)
+        {
+            fprintf(stderr, "scopes still open in '%s':\n", in_filename);
+            prof_dump_still_open(stderr, prof);
+        }
+
+        uint64_t last_cycles = 0;
+        for (ProfIdx smpl_i = 0; smpl_i < prof->record_smpl_tree_n; ++smpl_i)
+        {
+            ProfRecordSmpl smpl = prof->record_smpl_tree[smpl_i];
+            if (smpl.cycles_start > last_cycles)                    {   last_cycles = smpl.cycles_start;   }
+            if (~smpl.cycles_end && smpl.cycles_end > last_cycles) {   last_cycles = smpl.cycles_end;     }
+        }
+
+        for (ProfIdx smpl_i = 0; smpl_i < prof->record_smpl_tree_n; ++smpl_i)
+        { // close everything off at the last time we know the process was alive
+            ProfRecordSmpl *smpl = &prof->record_smpl_tree[smpl_i];
+            if (! ~smpl->cycles_end)
+            {
+                smpl->cycles_end = (last_cycles > smpl->cycles_start
+                                    ? last_cycles
+                                    : smpl->cycles_start + 1); // keep it from looking like a mark
+            }
+        }
+    }
+
+    ProfIdx smpls_n = prof->record_smpl_tree_n;
+    FILE   *out     = 0;
+    prof_dump_timings_file(&out, out_filename, prof);
+    fputs("\n]\n", out);
+    fclose(out);
+
+    fprintf(stderr, "recovered %u samples of %u records into '%s'\n",
+            smpls_n, prof->records_n, out_filename);
+    return 0;
+}
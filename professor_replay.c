@@ -0,0 +1,501 @@
+// professor_replay.c - replay a program's captured allocations against other allocators
+// Captures come from prof_dump_ptrs_file, i.e. the prof_ptr_alloc/realloc/free samples in the order they were taken.
+// The captured addresses are first turned into block slots, then every allocator replays the same sequence of
+// allocs, reallocs and frees as fast as it can, each in a child process of its own so their RSS don't mix.
+// Reports throughput, the peak RSS the replay added, and fragmentation: how much of that wasn't live blocks.
+//
+// Allocators: malloc (the C library's), bump (an arena that never frees), pools (power of 2 size classes, falling
+// back to malloc for large blocks) and prof (Prof.reallocate, i.e. whatever the profiler was built to use).
+// Blocks are written to once when allocated, as a program would, so that RSS reflects them; -notouch doesn't.
+//
+// usage: professor_replay capture.ptrs [-repeat n] [-notouch] [allocator...]
+#define _CRT_SECURE_NO_WARNINGS
+#include "professor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+typedef enum ReplayOpKind {
+    REPLAY_alloc,
+    REPLAY_realloc,
+    REPLAY_free,
+} ReplayOpKind;
+
+typedef struct ReplayOp {
+    uint32_t kind;
+    uint32_t slot_i;   // the block, whatever address it gets
+    uint64_t size;     // the new size, 0 if freed
+    uint64_t size_p;   // the old size if realloc'd/freed
+} ReplayOp;
+
+typedef struct ReplayTrace {
+    ReplayOp *ops;
+    size_t    ops_n;
+    uint32_t  slots_n;
+    uint64_t  bytes;           // allocated in total, reallocs included
+    uint64_t  peak_live_bytes; // of the blocks in the capture
+    uint64_t  unmatched_n;     // frees of blocks allocated before the capture started
+} ReplayTrace;
+
+typedef struct ReplayAllocator {
+    char const *name;
+    void  (*init)(ReplayTrace const *trace);
+    void *(*alloc)(size_t size);
+    void *(*realloc)(void *ptr, size_t size_p, size_t size);
+    void  (*free)(void *ptr, size_t size);
+    void  (*reset)(void); // between repeats, once every block is freed; 0 if there's nothing to do
+} ReplayAllocator;
+
+typedef struct ReplayResult {
+    double   secs;
+    uint64_t ops_n;
+    uint64_t rss_start; // bytes
+    uint64_t rss_peak;  // bytes
+    int      ok;
+} ReplayResult;
+
+////////////////////////////////////////////////////////////////
+// MALLOC
+static void  replay_malloc_init(ReplayTrace const *trace)                {   (void)trace;   }
+static void *replay_malloc_alloc(size_t size)                            {   return malloc(size);   }
+static void *replay_malloc_realloc(void *ptr, size_t size_p, size_t size) {   (void)size_p; return realloc(ptr, size);   }
+static void  replay_malloc_free(void *ptr, size_t size)                  {   (void)size; free(ptr);   }
+
+////////////////////////////////////////////////////////////////
+// BUMP ARENA
+// NOTE: reserved up front for every byte the capture allocates, so it never runs out; only what's touched is resident
+static struct {
+    char  *base, *next, *last; // last: the latest block, which can grow in place
+    size_t size;
+} replay_bump;
+
+#define REPLAY_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+static void
+replay_bump_init(ReplayTrace const *trace)
+{
+    replay_bump.size = REPLAY_ALIGN(trace->bytes) + 16 * trace->ops_n + 4096;
+    replay_bump.base = (char *)mmap(0, replay_bump.size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ((void *)replay_bump.base == MAP_FAILED)
+    {   replay_bump.base = 0;   }
+    replay_bump.next = replay_bump.last = replay_bump.base;
+}
+
+static void *
+replay_bump_alloc(size_t size)
+{
+    char *result = replay_bump.next;
+    if (! result || (size_t)(result - replay_bump.base) + REPLAY_ALIGN(size) > replay_bump.size)
+    {   return 0;   }
+    replay_bump.last  = result;
+    replay_bump.next += REPLAY_ALIGN(size);
+    return result;
+}
+
+static void *
+replay_bump_realloc(void *ptr, size_t size_p, size_t size)
+{
+    void *result = ptr;
+    if (ptr == replay_bump.last && replay_bump.last)
+    { // grow/shrink in place
+        size_t used = (size_t)(replay_bump.last - replay_bump.base);
+        if (used + REPLAY_ALIGN(size) > replay_bump.size)
+        {   return 0;   }
+        replay_bump.next = replay_bump.last + REPLAY_ALIGN(size);
+    }
+    else
+    {
+        result = replay_bump_alloc(size);
+        if (result && ptr)
+        {   memcpy(result, ptr, (size_p < size ? size_p : size));   }
+    }
+    return result;
+}
+
+static void replay_bump_free(void *ptr, size_t size) {   (void)ptr; (void)size;   }
+static void replay_bump_reset(void)                  {   replay_bump.next = replay_bump.last = replay_bump.base;   } // sized for one pass
+
+////////////////////////////////////////////////////////////////
+// SIZE-CLASS POOLS
+// Classes are powers of 2 from 16 bytes up; each has a free list threaded through its free blocks and carves
+// new blocks from slabs. Blocks bigger than the largest class go to malloc.
+#define REPLAY_POOL_CLASSES_N  12 // 16 B .. 32 KB
+#define REPLAY_POOL_SLAB_SIZE  (1 << 20)
+
+static struct {
+    void  *free_lists[REPLAY_POOL_CLASSES_N];
+    char  *slab_next, *slab_end;
+} replay_pools;
+
+static int
+replay_pool_class(size_t size)
+{
+    int class_i = 0;
+    while (class_i < REPLAY_POOL_CLASSES_N && ((size_t)16 << class_i) < size)
+    {   ++class_i;   }
+    return class_i; // == REPLAY_POOL_CLASSES_N if too big
+}
+
+static void replay_pools_init(ReplayTrace const *trace) {   (void)trace; memset(&replay_pools, 0, sizeof(replay_pools));   }
+
+static void *
+replay_pools_alloc(size_t size)
+{
+    int class_i = replay_pool_class(size);
+    if (class_i == REPLAY_POOL_CLASSES_N)
+    {   return malloc(size);   }
+
+    void *result = replay_pools.free_lists[class_i];
+    if (result)
+    {   replay_pools.free_lists[class_i] = *(void **)result;   }
+    else
+    {
+        size_t block_size = (size_t)16 << class_i;
+        if (replay_pools.slab_end - replay_pools.slab_next < (ptrdiff_t)block_size)
+        { // NOTE: the rest of the old slab is wasted, as it would be in a real pool allocator without carving
+            replay_pools.slab_next = (char *)malloc(REPLAY_POOL_SLAB_SIZE);
+            if (! replay_pools.slab_next)
+            {   return 0;   }
+            replay_pools.slab_end = replay_pools.slab_next + REPLAY_POOL_SLAB_SIZE;
+        }
+        result                  = replay_pools.slab_next;
+        replay_pools.slab_next += block_size;
+    }
+    return result;
+}
+
+static void
+replay_pools_free(void *ptr, size_t size)
+{
+    int class_i = replay_pool_class(size);
+    if (! ptr)
+    {   return;   }
+    if (class_i == REPLAY_POOL_CLASSES_N)
+    {   free(ptr); return;   }
+
+    *(void **)ptr = replay_pools.free_lists[class_i];
+    replay_pools.free_lists[class_i] = ptr;
+}
+
+static void *
+replay_pools_realloc(void *ptr, size_t size_p, size_t size)
+{
+    int class_i   = replay_pool_class(size);
+    int class_p_i = replay_pool_class(size_p);
+    if (ptr && class_i == class_p_i)
+    {
+        return (class_i == REPLAY_POOL_CLASSES_N
+                ? realloc(ptr, size)
+                : ptr);
+    }
+
+    void *result = replay_pools_alloc(size);
+    if (result && ptr)
+    {
+        memcpy(result, ptr, (size_p < size ? size_p : size));
+        replay_pools_free(ptr, size_p);
+    }
+    return result;
+}
+
+////////////////////////////////////////////////////////////////
+// PROF.REALLOCATE
+static Prof replay_prof[1];
+
+static void
+replay_prof_init(ReplayTrace const *trace)
+{
+    (void)trace;
+    if (! replay_prof->reallocate)
+    {   replay_prof->reallocate = prof_realloc;   }
+}
+
+static void *replay_prof_alloc(size_t size)                              {   return replay_prof->reallocate(replay_prof->allocator, 0, size);   }
+static void *replay_prof_realloc(void *ptr, size_t size_p, size_t size)  {   (void)size_p; return replay_prof->reallocate(replay_prof->allocator, ptr, size);   }
+static void  replay_prof_free(void *ptr, size_t size)                    {   (void)size; replay_prof->reallocate(replay_prof->allocator, ptr, 0);   }
+
+static ReplayAllocator const replay_allocators[] = {
+    { "malloc", replay_malloc_init, replay_malloc_alloc, replay_malloc_realloc, replay_malloc_free, 0                 },
+    { "bump",   replay_bump_init,   replay_bump_alloc,   replay_bump_realloc,   replay_bump_free,   replay_bump_reset },
+    { "pools",  replay_pools_init,  replay_pools_alloc,  replay_pools_realloc,  replay_pools_free,  0                 },
+    { "prof",   replay_prof_init,   replay_prof_alloc,   replay_prof_realloc,   replay_prof_free,   0                 },
+};
+#define REPLAY_ALLOCATORS_N (sizeof(replay_allocators) / sizeof(*replay_allocators))
+
+////////////////////////////////////////////////////////////////
+
+// the captured addresses -> slots, so replays only index arrays
+static ReplayTrace
+replay_trace_from_smpls(ProfBinPtrSmpl const *smpls, size_t smpls_n)
+{
+    ReplayTrace trace = {0};
+    trace.ops = (ReplayOp *)malloc((smpls_n ? smpls_n : 1) * sizeof(*trace.ops));
+
+    ProfPtrMap live[1]    = {{0}}; // captured address -> slot
+    uint64_t  *slot_sizes = 0;
+    uint32_t   slots_m    = 0;
+    uint64_t   live_bytes = 0;
+    for (size_t smpl_i = 0; smpl_i < smpls_n; ++smpl_i)
+    {
+        ProfBinPtrSmpl smpl   = smpls[smpl_i];
+        ReplayOp       op     = {0};
+        uintptr_t      old    = (uintptr_t)(smpl.size ? smpl.addr_p : smpl.addr);
+        ProfIdx        slot_i = (old ? prof_ptr_map_remove(live, old) : ~(ProfIdx)0);
+
+        if (! smpl.size)
+        {
+            if (! ~slot_i)
+            {   ++trace.unmatched_n; continue;   }
+            op.kind   = REPLAY_free;
+            op.slot_i = slot_i;
+            op.size_p = slot_sizes[slot_i];
+            live_bytes -= op.size_p;
+        }
+        else
+        {
+            if (~slot_i)
+            {
+                op.kind   = REPLAY_realloc;
+                op.size_p = slot_sizes[slot_i];
+                live_bytes -= op.size_p;
+            }
+            else
+            {
+                if (old)
+                {   ++trace.unmatched_n;   } // realloc of a block from before: replayed as an allocation
+                if (trace.slots_n == slots_m)
+                {
+                    slots_m    = (slots_m ? 2 * slots_m : 1024);
+                    slot_sizes = (uint64_t *)realloc(slot_sizes, slots_m * sizeof(*slot_sizes));
+                }
+                op.kind = REPLAY_alloc;
+                slot_i  = trace.slots_n++;
+            }
+            op.slot_i          = slot_i;
+            op.size            = smpl.size;
+            slot_sizes[slot_i] = smpl.size;
+            prof_ptr_map_set(live, (uintptr_t)smpl.addr, slot_i);
+
+            trace.bytes += smpl.size;
+            live_bytes  += smpl.size;
+            if (live_bytes > trace.peak_live_bytes)
+            {   trace.peak_live_bytes = live_bytes;   }
+        }
+        trace.ops[trace.ops_n++] = op;
+    }
+
+    prof_ptr_map_free(live);
+    free(slot_sizes);
+    return trace;
+}
+
+// the high-water mark of this process's RSS, from the last replay_rss_peak_reset (or the fork) on
+static uint64_t
+replay_rss_peak(void)
+{
+    uint64_t result = 0;
+    FILE *status = fopen("/proc/self/status", "r");
+    char  line[256];
+    unsigned long long kb;
+    while (status && fgets(line, sizeof(line), status))
+    {
+        if (sscanf(line, "VmHWM: %llu kB", &kb) == 1)
+        {   result = (uint64_t)kb * 1024; break;   }
+    }
+    if (status)
+    {   fclose(status);   }
+    return result;
+}
+
+// NOTE: a forked child's getrusage ru_maxrss is the parent's peak, so the child resets its own mark instead.
+// Without clear_refs (Linux < 4.0), the mark starts at the RSS at the fork, which is still close
+static void
+replay_rss_peak_reset(void)
+{
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+    if (clear_refs)
+    {   fputs("5", clear_refs); fclose(clear_refs);   }
+}
+
+static uint64_t
+replay_rss(void)
+{
+    uint64_t result = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    unsigned long long size_pages, resident_pages;
+    if (statm && fscanf(statm, "%llu %llu", &size_pages, &resident_pages) == 2)
+    {   result = (uint64_t)resident_pages * (uint64_t)sysconf(_SC_PAGESIZE);   }
+    if (statm)
+    {   fclose(statm);   }
+    return result;
+}
+
+static double
+replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+// runs in the child process
+static ReplayResult
+replay_run(ReplayAllocator const *allocator, ReplayTrace const *trace, int repeat_n, int touch)
+{
+    ReplayResult result = {0};
+    void    **slots = (void **)calloc(trace->slots_n ? trace->slots_n : 1, sizeof(*slots));
+    uint64_t *sizes = (uint64_t *)calloc(trace->slots_n ? trace->slots_n : 1, sizeof(*sizes)); // for the leftovers
+    allocator->init(trace);
+    replay_rss_peak_reset();
+    result.rss_start = replay_rss();
+    result.ok        = 1;
+
+    double start = replay_now();
+    for (int repeat_i = 0; repeat_i < repeat_n && result.ok; ++repeat_i)
+    {
+        for (size_t op_i = 0; op_i < trace->ops_n; ++op_i)
+        {
+            ReplayOp op = trace->ops[op_i];
+            void   **slot = &slots[op.slot_i];
+            switch (op.kind)
+            {
+                case REPLAY_alloc:   *slot = allocator->alloc(op.size);                   break;
+                case REPLAY_realloc: *slot = allocator->realloc(*slot, op.size_p, op.size); break;
+                case REPLAY_free:    allocator->free(*slot, op.size_p); *slot = 0;        break;
+            }
+            if (op.kind != REPLAY_free)
+            {
+                if (! *slot)
+                {   result.ok = 0; break;   }
+                sizes[op.slot_i] = op.size;
+                if (touch && op.size > op.size_p)
+                {   memset((char *)*slot + op.size_p, (int)op_i, op.size - op.size_p);   }
+            }
+        }
+
+        // blocks never freed in the capture, so each repeat starts over
+        for (uint32_t slot_i = 0; slot_i < trace->slots_n; ++slot_i)
+        {
+            if (slots[slot_i])
+            {   allocator->free(slots[slot_i], sizes[slot_i]); slots[slot_i] = 0;   }
+        }
+        if (allocator->reset)
+        {   allocator->reset();   }
+        result.ops_n += trace->ops_n;
+    }
+    result.secs = replay_now() - start;
+
+    result.rss_peak = replay_rss_peak();
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    char const *in_filename = 0;
+    int         repeat_n    = 1;
+    int         touch       = 1;
+    int         use[REPLAY_ALLOCATORS_N] = {0};
+    int         use_n       = 0;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if      (! strcmp(argv[arg_i], "-repeat") && arg_i + 1 < argc) {   repeat_n = atoi(argv[++arg_i]);   }
+        else if (! strcmp(argv[arg_i], "-notouch"))                    {   touch    = 0;   }
+        else if (! in_filename)                                         {   in_filename = argv[arg_i];   }
+        else
+        {
+            size_t allocator_i = 0;
+            while (allocator_i < REPLAY_ALLOCATORS_N && strcmp(argv[arg_i], replay_allocators[allocator_i].name))
+            {   ++allocator_i;   }
+            if (allocator_i == REPLAY_ALLOCATORS_N)
+            {   fprintf(stderr, "unknown allocator '%s'\n", argv[arg_i]); return 1;   }
+            use[allocator_i] = 1;
+            ++use_n;
+        }
+    }
+    if (! in_filename || repeat_n < 1)
+    {
+        fprintf(stderr, "usage: %s capture.ptrs [-repeat n] [-notouch] [malloc|bump|pools|prof...]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(in_filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(ProfBinPtrHeader))
+    {   fprintf(stderr, "could not read capture '%s'\n", in_filename); return 1;   }
+
+    size_t file_size = (size_t)st.st_size;
+    ProfBinPtrHeader const *hdr = (ProfBinPtrHeader const *)mmap(0, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ((void const *)hdr == MAP_FAILED ||
+        memcmp(hdr->magic, PROF_BIN_PTR_MAGIC, sizeof(PROF_BIN_PTR_MAGIC)) ||
+        hdr->version != PROF_BIN_PTR_VERSION ||
+        hdr->smpls_offset > file_size)
+    {   fprintf(stderr, "'%s' is not a professor pointer capture\n", in_filename); return 1;   }
+
+    size_t smpls_n = (size_t)hdr->smpls_n;
+    if (smpls_n > (file_size - hdr->smpls_offset) / sizeof(ProfBinPtrSmpl))
+    { // cut short
+        smpls_n = (file_size - hdr->smpls_offset) / sizeof(ProfBinPtrSmpl);
+        fprintf(stderr, "'%s' is truncated: replaying the first %zu samples\n", in_filename, smpls_n);
+    }
+    ReplayTrace trace = replay_trace_from_smpls((ProfBinPtrSmpl const *)((char const *)hdr + hdr->smpls_offset), smpls_n);
+    munmap((void *)hdr, file_size);
+
+    printf("%zu operations on %u blocks, %.3f MB allocated, %.3f MB peak live",
+           trace.ops_n, trace.slots_n, (double)trace.bytes / 1e6, (double)trace.peak_live_bytes / 1e6);
+    if (trace.unmatched_n)
+    {   printf(", %llu frees/reallocs of blocks from before the capture", (unsigned long long)trace.unmatched_n);   }
+    printf("\n\n%-8s %14s %12s %14s %10s\n", "", "Mops/s", "ns/op", "peak RSS MB", "frag %");
+    fflush(stdout);
+
+    for (size_t allocator_i = 0; allocator_i < REPLAY_ALLOCATORS_N; ++allocator_i)
+    {
+        ReplayAllocator const *allocator = &replay_allocators[allocator_i];
+        if (use_n && ! use[allocator_i])
+        {   continue;   }
+
+        int pipe_fds[2];
+        if (pipe(pipe_fds))
+        {   perror("pipe"); return 1;   }
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            ReplayResult result = replay_run(allocator, &trace, repeat_n, touch);
+            ssize_t written = write(pipe_fds[1], &result, sizeof(result));
+            _exit(written == sizeof(result) ? 0 : 1);
+        }
+        close(pipe_fds[1]);
+
+        ReplayResult result = {0};
+        int got_result = (pid > 0 && read(pipe_fds[0], &result, sizeof(result)) == sizeof(result));
+        close(pipe_fds[0]);
+        if (pid > 0)
+        {   waitpid(pid, 0, 0);   }
+
+        if (! got_result || ! result.ok)
+        {   printf("%-8s %14s\n", allocator->name, (got_result ? "out of memory" : "failed")); continue;   }
+
+        uint64_t rss  = (result.rss_peak > result.rss_start ? result.rss_peak - result.rss_start : 0);
+        double   frag = (touch && rss > trace.peak_live_bytes
+                         ? 100.0 * (double)(rss - trace.peak_live_bytes) / (double)rss
+                         : 0.0);
+        printf("%-8s %14.3f %12.1f %14.3f %10.1f\n", allocator->name,
+               (result.secs > 0.0 ? (double)result.ops_n / result.secs / 1e6 : 0.0),
+               (result.ops_n ? 1e9 * result.secs / (double)result.ops_n : 0.0),
+               (double)rss / 1e6, frag);
+        fflush(stdout);
+    }
+    if (! touch)
+    {   printf("\n(-notouch: RSS only counts what the allocators themselves wrote)\n");   }
+
+    free(trace.ops);
+    return 0;
+}
@@ -0,0 +1,334 @@
+// professor_symbolize.c - name the address-keyed records of a trace offline (see PROF_ADDR)
+// The trace's "prof_module" events say which ELF object each address was in, with its build-id and load bias, so
+// the addresses can be looked up with addr2line in the unstripped binaries or their separate debug files, e.g. on
+// a dev machine with a trace from a stripped production build.
+// For each -d dir, debug files are looked for at <dir>/.build-id/xx/yyyy.debug then <dir>/<basename>, and
+// otherwise the module is read from the path it was loaded from.
+// Events named "0x<address>" are renamed "function (file:line)", or just "function" without line info. Addresses
+// that can't be symbolized are left as they are. A compressed trace (PROF_COMPRESS) is written out uncompressed.
+//
+// usage: professor_symbolize trace.json [-o out.json] [-d debug_dir]... [-addr2line path]
+#define _CRT_SECURE_NO_WARNINGS
+#define _GNU_SOURCE // getline, popen
+#include "professor.h" // prof_lz_fopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define SYM_BATCH_N 256 // addresses per addr2line run, to keep the command line short
+
+typedef struct SymModule {
+    uint64_t start, end; // executable range, as loaded
+    uint64_t bias;       // load address - ELF virtual address
+    char    *build_id;   // hex, "" if unknown
+    char    *path;
+} SymModule;
+
+typedef struct SymAddr {
+    uint64_t addr;
+    char    *name; // 0 until symbolized
+} SymAddr;
+
+// copies the string value of "key":"..." out of a one-line JSON event, unescaped. Returns 0 if not found
+static int
+sym_json_str(char const *line, char const *key, char *dst, size_t dst_m)
+{
+    char const *str = strstr(line, key);
+    if (! str)
+    {   return 0;   }
+    str += strlen(key);
+
+    size_t dst_n = 0;
+    for (; *str && *str != '"'; ++str)
+    {
+        if (*str == '\\' && str[1])
+        {   ++str;   } // only \" \\ \/ are expected in paths
+        if (dst_n + 1 < dst_m)
+        {   dst[dst_n++] = *str;   }
+    }
+    dst[dst_n] = 0;
+    return 1;
+}
+
+// the event's own name, which is always its first field. Returns 0 if it isn't an address
+static int
+sym_event_addr(char const *line, char const **name, size_t *name_n, uint64_t *addr)
+{
+    char const *start = strstr(line, "{\"name\":\"");
+    if (! start)
+    {   return 0;   }
+    start += sizeof("{\"name\":\"") - 1;
+
+    char const *end = start;
+    while (*end && *end != '"')
+    {   ++end;   }
+    if (end - start < 3 || start[0] != '0' || start[1] != 'x' ||
+        strspn(start + 2, "0123456789abcdef") != (size_t)(end - start - 2))
+    {   return 0;   }
+
+    *name   = start;
+    *name_n = (size_t)(end - start);
+    *addr   = strtoull(start + 2, 0, 16);
+    return 1;
+}
+
+static int
+sym_addr_cmp(void const *a, void const *b)
+{
+    uint64_t a_addr = ((SymAddr const *)a)->addr;
+    uint64_t b_addr = ((SymAddr const *)b)->addr;
+    return (a_addr > b_addr) - (a_addr < b_addr);
+}
+
+static int
+sym_module_cmp(void const *a, void const *b)
+{
+    uint64_t a_start = ((SymModule const *)a)->start;
+    uint64_t b_start = ((SymModule const *)b)->start;
+    return (a_start > b_start) - (a_start < b_start);
+}
+
+// returns 0 if there's nothing readable to symbolize from
+static int
+sym_find_file(SymModule const *module, char const *const *dirs, int dirs_n, char *path, size_t path_m)
+{
+    char const *basename = strrchr(module->path, '/');
+    basename = basename ? basename + 1 : module->path;
+    for (int dir_i = 0; dir_i < dirs_n; ++dir_i)
+    {
+        if (strlen(module->build_id) > 2)
+        {
+            snprintf(path, path_m, "%s/.build-id/%.2s/%s.debug", dirs[dir_i], module->build_id, module->build_id + 2);
+            if (! access(path, R_OK))
+            {   return 1;   }
+        }
+        snprintf(path, path_m, "%s/%s", dirs[dir_i], basename);
+        if (*basename && ! access(path, R_OK))
+        {   return 1;   }
+    }
+    snprintf(path, path_m, "%s", module->path);
+    return *path && ! access(path, R_OK);
+}
+
+// runs addr2line on addrs[0..addrs_n), all in module, and names the ones it knows
+static void
+sym_resolve(char const *addr2line, char const *file, SymModule const *module, SymAddr *addrs, size_t addrs_n)
+{
+    size_t cmd_m = strlen(addr2line) + 2 * strlen(file) + SYM_BATCH_N * 20 + 64;
+    char  *cmd   = (char *)malloc(cmd_m);
+    char  *func  = 0, *loc = 0;
+    size_t func_m = 0, loc_m = 0;
+
+    for (size_t batch_i = 0; batch_i < addrs_n; batch_i += SYM_BATCH_N)
+    {
+        size_t batch_n = addrs_n - batch_i < SYM_BATCH_N ? addrs_n - batch_i : SYM_BATCH_N;
+        size_t cmd_n   = (size_t)snprintf(cmd, cmd_m, "%s -f -C -e '", addr2line);
+        for (char const *c = file; *c; ++c)
+        {   cmd_n += (size_t)snprintf(cmd + cmd_n, cmd_m - cmd_n, *c == '\'' ? "'\\''" : "%c", *c);   }
+        cmd_n += (size_t)snprintf(cmd + cmd_n, cmd_m - cmd_n, "'");
+        for (size_t addr_i = batch_i; addr_i < batch_i + batch_n; ++addr_i)
+        {
+            cmd_n += (size_t)snprintf(cmd + cmd_n, cmd_m - cmd_n, " 0x%llx",
+                                      (unsigned long long)(addrs[addr_i].addr - module->bias));
+        }
+
+        FILE *pipe = popen(cmd, "r");
+        if (! pipe)
+        {   break;   }
+        for (size_t addr_i = batch_i; addr_i < batch_i + batch_n; ++addr_i)
+        { // 2 lines per address: function, then file:line
+            ssize_t func_n = getline(&func, &func_m, pipe);
+            ssize_t loc_n  = getline(&loc,  &loc_m,  pipe);
+            if (func_n <= 0 || loc_n <= 0)
+            {   break;   }
+            func[strcspn(func, "\r\n")] = 0;
+            loc[strcspn(loc, "\r\n")]   = 0;
+            loc[strcspn(loc, " ")]      = 0; // " (discriminator n)"
+            if (! strcmp(func, "??"))
+            {   continue;   }
+
+            char const *loc_file = strrchr(loc, '/');
+            loc_file = loc_file ? loc_file + 1 : loc;
+            int    has_loc = loc_file[0] != '?' && ! strstr(loc_file, ":0") && ! strstr(loc_file, ":?");
+            size_t name_m  = strlen(func) + strlen(loc_file) + 4;
+            char  *name    = (char *)malloc(name_m);
+            if (has_loc) {   snprintf(name, name_m, "%s (%s)", func, loc_file);   }
+            else         {   snprintf(name, name_m, "%s", func);                  }
+            addrs[addr_i].name = name;
+        }
+        pclose(pipe);
+    }
+
+    free(func);
+    free(loc);
+    free(cmd);
+}
+
+static void
+sym_put_escaped(FILE *out, char const *str)
+{
+    for (; *str; ++str)
+    {
+        if      (*str == '"' || *str == '\\')    {   fputc('\\', out); fputc(*str, out);   }
+        else if ((unsigned char)*str < 0x20)     {   fputc(' ', out);                      }
+        else                                     {   fputc(*str, out);                     }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char const  *in_filename  = 0;
+    char const  *out_filename = 0;
+    char const  *addr2line    = "addr2line";
+    char const **dirs         = (char const **)calloc(argc, sizeof(*dirs));
+    int          dirs_n       = 0;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if      (! strcmp(argv[arg_i], "-o")         && arg_i + 1 < argc) {   out_filename   = argv[++arg_i];   }
+        else if (! strcmp(argv[arg_i], "-d")         && arg_i + 1 < argc) {   dirs[dirs_n++] = argv[++arg_i];   }
+        else if (! strcmp(argv[arg_i], "-addr2line") && arg_i + 1 < argc) {   addr2line      = argv[++arg_i];   }
+        else                                                              {   in_filename    = argv[arg_i];     }
+    }
+    if (! in_filename)
+    {
+        fprintf(stderr, "usage: %s trace.json [-o out.json] [-d debug_dir]... [-addr2line path]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = prof_lz_fopen(in_filename);
+    if (! in)
+    {   fprintf(stderr, "could not open '%s'\n", in_filename); return 1;   }
+
+    SymModule *modules   = 0;
+    size_t     modules_n = 0, modules_m = 0;
+    SymAddr   *addrs     = 0;
+    size_t     addrs_n   = 0, addrs_m = 0;
+    char      *line      = 0;
+    size_t     line_m    = 0;
+
+    // first pass: the modules, and every address named
+    while (getline(&line, &line_m, in) >= 0)
+    {
+        char const *name;
+        size_t      name_n;
+        uint64_t    addr;
+        if (strstr(line, "{\"name\":\"prof_module\""))
+        {
+            char start[32], end[32], bias[32], build_id[128], path[4096];
+            if (! sym_json_str(line, "\"start\":\"",    start,    sizeof(start))    ||
+                ! sym_json_str(line, "\"end\":\"",      end,      sizeof(end))      ||
+                ! sym_json_str(line, "\"bias\":\"",     bias,     sizeof(bias))     ||
+                ! sym_json_str(line, "\"build_id\":\"", build_id, sizeof(build_id)) ||
+                ! sym_json_str(line, "\"path\":\"",     path,     sizeof(path)))
+            {   continue;   }
+
+            SymModule module; {
+                module.start    = strtoull(start, 0, 16);
+                module.end      = strtoull(end,   0, 16);
+                module.bias     = strtoull(bias,  0, 16);
+                module.build_id = build_id;
+                module.path     = path;
+            }
+            int is_dup = 0; // every dump repeats the modules
+            for (size_t module_i = 0; module_i < modules_n && ! is_dup; ++module_i)
+            {
+                is_dup = (modules[module_i].start == module.start &&
+                          ! strcmp(modules[module_i].path, module.path));
+            }
+            if (is_dup)
+            {   continue;   }
+
+            if (modules_n == modules_m)
+            {
+                modules_m = modules_m ? 2 * modules_m : 64;
+                modules   = (SymModule *)realloc(modules, modules_m * sizeof(*modules));
+            }
+            module.build_id       = strdup(build_id);
+            module.path           = strdup(path);
+            modules[modules_n++] = module;
+        }
+        else if (sym_event_addr(line, &name, &name_n, &addr))
+        {
+            if (addrs_n == addrs_m)
+            {
+                addrs_m = addrs_m ? 2 * addrs_m : 1024;
+                addrs   = (SymAddr *)realloc(addrs, addrs_m * sizeof(*addrs));
+            }
+            addrs[addrs_n].addr   = addr;
+            addrs[addrs_n++].name = 0;
+        }
+    }
+
+    qsort(addrs, addrs_n, sizeof(*addrs), sym_addr_cmp);
+    size_t unique_n = 0;
+    for (size_t addr_i = 0; addr_i < addrs_n; ++addr_i)
+    {
+        if (! unique_n || addrs[unique_n - 1].addr != addrs[addr_i].addr)
+        {   addrs[unique_n++] = addrs[addr_i];   }
+    }
+    addrs_n = unique_n;
+
+    // both sorted, and modules don't overlap, so each module's addresses are a contiguous run
+    qsort(modules, modules_n, sizeof(*modules), sym_module_cmp);
+    size_t named_n = 0;
+    size_t addr_i  = 0;
+    for (size_t module_i = 0; module_i < modules_n; ++module_i)
+    {
+        SymModule const *module = &modules[module_i];
+        while (addr_i < addrs_n && addrs[addr_i].addr < module->start)
+        {   ++addr_i;   }
+        size_t first_i = addr_i;
+        while (addr_i < addrs_n && addrs[addr_i].addr < module->end)
+        {   ++addr_i;   }
+        if (first_i == addr_i)
+        {   continue;   }
+
+        char file[4096];
+        if (! sym_find_file(module, dirs, dirs_n, file, sizeof(file)))
+        {
+            fprintf(stderr, "no file for '%s' (build-id %s), skipping its %zu addresses\n",
+                    module->path, *module->build_id ? module->build_id : "unknown", addr_i - first_i);
+            continue;
+        }
+        sym_resolve(addr2line, file, module, addrs + first_i, addr_i - first_i);
+        for (size_t named_i = first_i; named_i < addr_i; ++named_i)
+        {   named_n += addrs[named_i].name != 0;   }
+    }
+
+    // second pass: copy the trace, renaming what was symbolized
+    FILE *out = (out_filename
+                 ? fopen(out_filename, "wb")
+                 : stdout);
+    if (! out)
+    {   fprintf(stderr, "could not open '%s'\n", out_filename); return 1;   }
+    setvbuf(out, 0, _IOFBF, 1 << 20);
+
+    rewind(in);
+    while (getline(&line, &line_m, in) >= 0)
+    {
+        char const *name;
+        size_t      name_n;
+        SymAddr     key;
+        SymAddr    *found = 0;
+        if (sym_event_addr(line, &name, &name_n, &key.addr))
+        {   found = (SymAddr *)bsearch(&key, addrs, addrs_n, sizeof(*addrs), sym_addr_cmp);   }
+
+        if (found && found->name)
+        {
+            fwrite(line, 1, (size_t)(name - line), out);
+            sym_put_escaped(out, found->name);
+            fputs(name + name_n, out);
+        }
+        else
+        {   fputs(line, out);   }
+    }
+
+    if (out != stdout)
+    {   fclose(out);   }
+    fclose(in);
+
+    fprintf(stderr, "symbolized %zu of %zu addresses, from %zu modules\n", named_n, addrs_n, modules_n);
+    return 0;
+}
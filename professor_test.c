@@ -1,23 +1,1453 @@
+// professor_test.c - an example of use, and checks of the parts that are easy to get subtly wrong
+// Modes are compile-time, so build it once for each one to check, e.g.
+//   cc professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_COMPACT=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_COMPRESS=1 professor_test.c -o professor_test && ./professor_test
+//   cc professor_recover.c -o professor_recover && cc -DPROF_MMAP=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_PARALLEL_DUMP=1 professor_test.c -o professor_test -lpthread && ./professor_test
+//   cc -DPROF_REGISTRY=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_SHM=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_PERF=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_CPU_TIME=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_ADDR=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_INSTRUMENT=1 professor_test.c professor_instrument.c -o professor_test -ldl && ./professor_test
+//   cc -DPROF_FRAMES=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_SIGNAL=1 professor_test.c -o professor_test && ./professor_test
+//   cc -DPROF_TRIGGER=1 professor_test.c -o professor_test -lpthread && ./professor_test
+//   cc -DPROF_WAIT=1 professor_test.c -o professor_test -lpthread && ./professor_test
+//   cc -DPROF_STREAM=1 professor_test.c -o professor_test && ./professor_test
+// Returns non-zero if any check failed.
 #define _CRT_SECURE_NO_WARNINGS
 #include "professor.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 Prof prof[1] = {0};
 
+static int test_failed_n;
+#define test_check(cond) \
+    do { \
+        if (! (cond)) \
+        {   ++test_failed_n; fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   } \
+    } while (0)
+
+static uint64_t test_rand_state = 0x9e3779b97f4a7c15;
+static inline uint64_t
+test_rand(void)
+{ // xorshift64*
+    test_rand_state ^= test_rand_state >> 12;
+    test_rand_state ^= test_rand_state << 25;
+    test_rand_state ^= test_rand_state >> 27;
+    return test_rand_state * 0x2545f4914f6cdd1d;
+}
+
+// the whole file, decompressed if need be and NUL-terminated, or 0 if it can't be read. Free it
+static char *
+test_read_text(char const *filename)
+{
+    FILE *file = prof_lz_fopen(filename);
+    if (! file)
+    {   return 0;   }
+    fseek(file, 0, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    char  *text = (char *)malloc(size + 1);
+    rewind(file);
+    size = fread(text, 1, size, file);
+    text[size] = '\0';
+    fclose(file);
+    return text;
+}
+
+// how many times needle appears in text
+static int
+test_count(char const *text, char const *needle)
+{
+    int result = 0;
+    for (char const *found = text ? strstr(text, needle) : 0; found; found = strstr(found + 1, needle))
+    {   ++result;   }
+    return result;
+}
+
+// a Prof that has never taken a sample, or grown anything, can still be dumped
+static void
+test_dump_empty(void)
+{
+    Prof  empty[1];
+    FILE *out = tmpfile();
+    memset(empty, 0, sizeof(empty));
+    empty->open_record_smpl_tree_i = ~(ProfIdx)0;
+    test_check(out);
+    if (! out)
+    {   return;   }
+    prof_dump_aggregate_file(out, empty);
+    prof_dump_timings_file(&out, 0, empty);
+    prof_dump_close(empty);
+    test_check(! ferror(out));
+    fclose(out);
+}
+
+// timestamps are ms with 6 decimal places; with no freq set, a cycle counts as a ms
+static void
+test_writer_ts(void)
+{
+    static struct { double freq; uint64_t cycles; char const *ts; } const cases[] = {
+        { 0,         12314944553692,       "12314944553692.000000"       }, // raw TSC values
+        { 0,         ~(uint64_t)0,         "18446744073709551615.000000" },
+        { 3330146,   3330146,              "1000.000000"                 },
+        { 3e9,       1500,                 "0.000500"                    },
+        { 3e9,       3e9 * 7200 + 1,       "7200000.000000"              }, // 2 h of uptime, + 1/3 ns
+        { 3e9,       ~(uint64_t)0,         "6148914691236.517205"        },
+        { 2.4e9,     2400000000001,        "1000000.000000"              }, // 0.42 ns rounds down
+        { 2.4e9,     2400000000002,        "1000000.000001"              }, // 0.83 ns rounds up
+    };
+    for (size_t case_i = 0; case_i < sizeof(cases) / sizeof(*cases); ++case_i)
+    {
+        ProfWriter w[1];
+        prof_writer_init(w, 0, cases[case_i].freq, 0, 0);
+        prof_writer_put_cycles(w, cases[case_i].cycles);
+        int ok = (w->buf_n == strlen(cases[case_i].ts) && ! memcmp(w->buf, cases[case_i].ts, w->buf_n));
+        if (! ok)
+        {   fprintf(stderr, "ts of %llu cycles at %g Hz: got '%.*s', not '%s'\n", (unsigned long long)cases[case_i].cycles, cases[case_i].freq, (int)w->buf_n, w->buf, cases[case_i].ts);   }
+        test_check(ok);
+        prof_writer_close(w);
+    }
+}
+
+// the async ring keeps the newest capacity events, on the thread that made them, until they're dumped
+static void
+test_async_ring(void)
+{
+    Prof a[1];
+    memset(a, 0, sizeof(a));
+    a->open_record_smpl_tree_i = ~(ProfIdx)0;
+    ProfIdx record_i = prof_new_record(a, "span", __FILE__, __LINE__);
+    prof_async_init(a, 3); // rounds up to 4
+    test_check(a->async_smpls_m == 4);
+    for (uint64_t id = 0x10; id < 0x16; ++id)
+    {   prof_async_(a, record_i, id, PROF_ASYNC_begin);   }
+
+    char tid[32];
+    snprintf(tid, sizeof(tid), "\"tid\": %llu}", (unsigned long long)prof_thread_id());
+    for (int dump_i = 0; dump_i < 2; ++dump_i)
+    {
+        ProfWriter w[1];
+        prof_writer_init(w, 0, 0.0, 0, 0);
+        prof_writer_cache_names(w, a);
+        prof_dump_async(w, w, a);
+        char *text = (char *)malloc(w->buf_n + 1);
+        memcpy(text, w->buf, w->buf_n);
+        text[w->buf_n] = '\0';
+
+        int events_n = test_count(text, "\"ph\":\"b\"");
+        if (dump_i == 0)
+        {
+            test_check(events_n == 4);
+            test_check(! strstr(text, "\"0x11\"") && strstr(text, "\"0x12\"") && strstr(text, "\"0x15\""));
+            test_check(strstr(text, tid));
+        }
+        else
+        {   test_check(events_n == 0);   } // already dumped
+        free(text);
+        prof_writer_close(w);
+    }
+
+    prof_after_fork(a); // the child's threads have new ids
+    test_check(prof_thread_id_cache == 0);
+    prof_dump_close(a);
+    free(a->records);
+    free(a->async_smpls);
+}
+
+// counters are only sampled when their value changes, at most every every_n calls, and a dump
+// samples any change that every_n skipped
+static void
+test_counters(void)
+{
+    static struct { double value; uint32_t every_n; } const calls[] = {
+        { 1, 1 }, // sampled
+        { 1, 1 }, // unchanged
+        { 2, 1 }, // sampled
+        { 3, 4 }, { 4, 4 }, { 5, 4 },
+        { 6, 4 }, // the 4th call: sampled
+        { 7, 4 }, // skipped until the dump
+    };
+    Prof c[1];
+    memset(c, 0, sizeof(c));
+    c->open_record_smpl_tree_i = ~(ProfIdx)0;
+    ProfIdx record_i = prof_new_record(c, "queue depth", __FILE__, __LINE__);
+    for (size_t call_i = 0; call_i < sizeof(calls) / sizeof(*calls); ++call_i)
+    {   prof_counter_(c, record_i, calls[call_i].value, calls[call_i].every_n);   }
+    test_check(c->counter_smpls_n == 3);
+    if (c->counter_smpls_n == 3)
+    {   test_check(c->counter_smpls[0].value == 1 && c->counter_smpls[1].value == 2 && c->counter_smpls[2].value == 6);   }
+
+    for (int dump_i = 0; dump_i < 2; ++dump_i)
+    {
+        ProfWriter w[1];
+        prof_writer_init(w, 0, 0.0, 0, 0);
+        prof_writer_cache_names(w, c);
+        prof_dump_counters(w, w, c);
+        char *text = (char *)malloc(w->buf_n + 1);
+        memcpy(text, w->buf, w->buf_n);
+        text[w->buf_n] = '\0';
+        if (dump_i == 0)
+        {
+            test_check(test_count(text, "\"name\":\"queue depth\", \"ph\":\"C\"") == 4);
+            test_check(strstr(text, "\"args\": {\"value\": 6}") && strstr(text, "\"args\": {\"value\": 7}"));
+        }
+        else
+        {   test_check(w->buf_n == 0);   } // nothing changed since
+        free(text);
+        prof_writer_close(w);
+    }
+
+    prof_dump_close(c);
+    free(c->records);
+    free(c->counters);
+    free(c->counter_smpls);
+}
+
+// allocations count towards every scope open at the time, and frees lower the live bytes of the scopes that
+// allocated them, wherever they happen
+static void
+test_alloc_attribution(void)
+{
+    Prof a[1];
+    memset(a, 0, sizeof(a));
+    a->open_record_smpl_tree_i = ~(ProfIdx)0;
+    ProfIdx outer_i = prof_new_record(a, "alloc outer", __FILE__, __LINE__);
+    ProfIdx inner_i = prof_new_record(a, "alloc inner", __FILE__, __LINE__);
+    ProfIdx site_i  = prof_new_record(a, "malloc",      __FILE__, __LINE__);
+    prof_start_(a, outer_i);
+    prof_ptr_realloc_(a, site_i, (void *)0xa0, 0, 100);
+    prof_start_(a, inner_i);
+    prof_ptr_realloc_(a, site_i, (void *)0xb0, 0, 50);
+    prof_ptr_realloc_(a, site_i, (void *)0xc0, 0, 30);
+    prof_ptr_realloc_(a, site_i, (void *)0xb0, 0, 0);     // inner's live bytes peaked at 80
+    prof_end_n_unchecked(a, 1);
+    prof_ptr_realloc_(a, site_i, (void *)0xd0, (void *)0xc0, 60); // outer's peaked at 180, before this
+    prof_end_n_unchecked(a, 1);
+    prof_ptr_realloc_(a, site_i, (void *)0xe0, 0, 7);
+    prof_ptr_realloc_(a, site_i, (void *)0xa0, 0, 0);
+
+    FILE *out = tmpfile();
+    test_check(out);
+    if (! out)
+    {   return;   }
+    prof_dump_alloc_file(out, a);
+    char text[2048] = {0};
+    rewind(out);
+    test_check(fread(text, 1, sizeof(text) - 1, out) > 0);
+    fclose(out);
+
+    static struct { char const *name; unsigned long long smpls_n, allocs_n, bytes; long long peak; unsigned long long self_allocs_n, self_bytes; } const rows[] = {
+        { "alloc outer",          1, 4, 240, 180, 2, 160 },
+        { "alloc inner",          1, 2, 80,  80,  2, 80  },
+        { "(outside any scope)",  1, 1, 7,   7,   1, 7   },
+    };
+    char const *prev_row = text;
+    for (size_t row_i = 0; row_i < sizeof(rows) / sizeof(*rows); ++row_i)
+    {
+        char const *row = strstr(text, rows[row_i].name);
+        test_check(row && row > prev_row); // by inclusive bytes
+        if (! row)
+        {   continue;   }
+        for (; row > text && row[-1] != '\n'; --row) {}
+        unsigned long long smpls_n = 0, allocs_n = 0, bytes = 0, self_allocs_n = 0, self_bytes = 0;
+        long long          peak    = 0;
+        test_check(sscanf(row, "%llu %llu %llu %lld %llu %llu", &smpls_n, &allocs_n, &bytes, &peak, &self_allocs_n, &self_bytes) == 6);
+        test_check(smpls_n == rows[row_i].smpls_n && allocs_n == rows[row_i].allocs_n && bytes == rows[row_i].bytes &&
+                   peak == rows[row_i].peak && self_allocs_n == rows[row_i].self_allocs_n && self_bytes == rows[row_i].self_bytes);
+        prev_row = row;
+    }
+
+    prof_dump_close(a);
+    free(a->records);
+    free(a->record_smpl_tree);
+    free(a->hits_smpls);
+    free(a->ptr_smpls);
+}
+
+// after a fork, only the open scopes are kept, re-linked into a chain, so the child can close them
+static void
+test_after_fork(void)
+{
+    Prof c[1];
+    memset(c, 0, sizeof(c));
+    c->open_record_smpl_tree_i = ~(ProfIdx)0;
+    ProfIdx outer_i = prof_new_record(c, "outer", __FILE__, __LINE__);
+    ProfIdx done_i  = prof_new_record(c, "done",  __FILE__, __LINE__);
+    ProfIdx inner_i = prof_new_record(c, "inner", __FILE__, __LINE__);
+#if PROF_WAIT
+    ProfWait wait;
+    prof_wait_open(c, &wait);
+#endif
+    prof_start_(c, outer_i);
+    prof_start_(c, done_i);
+#if PROF_WAIT
+    prof_wait_tag(c, PROF_WAIT_lock, 1); // closed before the fork: dropped
+#endif
+    prof_end_n_unchecked(c, 3);
+    prof_mark_(c, done_i);
+    prof_start_(c, inner_i);
+#if PROF_WAIT
+    prof_wait_tag(c, PROF_WAIT_lock, 2); // held across the fork: kept
+#endif
+
+    prof_after_fork(c);
+    test_check(c->fork_gen == 1 && c->pid == (uint64_t)prof_getpid());
+    test_check(c->record_smpl_tree_n == 2 && c->open_record_smpl_tree_i == 1);
+    test_check(c->hits_smpls_n == 0);
+    if (c->record_smpl_tree_n == 2)
+    {
+        test_check(c->record_smpl_tree[0].record_i == outer_i && c->record_smpl_tree[0].parent_i == 0);
+        test_check(c->record_smpl_tree[1].record_i == inner_i && c->record_smpl_tree[1].parent_i == 0);
+    }
+#if PROF_WAIT
+    test_check(wait.smpls_n == 1 && wait.smpls[0].smpl_i == 1 && wait.smpls[0].obj == 2);
+#endif
+
+    prof_end_n_unchecked(c, 1);
+    prof_end_n_unchecked(c, 1);
+    test_check(! ~c->open_record_smpl_tree_i);
+    test_check(~c->record_smpl_tree[0].cycles_end && ~c->record_smpl_tree[1].cycles_end);
+
+#if PROF_WAIT
+    prof_wait_close(c);
+#endif
+    prof_dump_close(c);
+    free(c->records);
+    free(c->record_smpl_tree);
+    free(c->hits_smpls);
+}
+
+// fills buf with content_i's kind of data: random bytes, trace-like text, runs of one byte, or a mix
+static void
+test_lz_fill(char *buf, size_t size, int content_i)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+        int kind = (content_i < 3 ? content_i : (int)(test_rand() % 3));
+        size_t n = (content_i < 3 ? size - i : 1 + test_rand() % 300);
+        if (n > size - i)
+        {   n = size - i;   }
+        if (kind == 0)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {   buf[i + j] = (char)test_rand();   }
+        }
+        else if (kind == 1)
+        {
+            char line[128];
+            for (size_t j = 0; j < n;)
+            {
+                int line_n = snprintf(line, sizeof(line), ",\n    {\"name\":\"record %d\", \"ph\":\"X\", \"ts\": %llu.%03d}",
+                                      (int)(test_rand() % 8), (unsigned long long)(i + j), (int)(test_rand() % 1000));
+                size_t copy_n = ((size_t)line_n < n - j ? (size_t)line_n : n - j);
+                memcpy(buf + i + j, line, copy_n);
+                j += copy_n;
+            }
+        }
+        else
+        {   memset(buf + i, (int)(test_rand() % 3), n);   } // matches that overlap what they copy
+        i += n;
+    }
+}
+
+// what prof_lz_compress makes has to decode to exactly the input, and only at exactly its size;
+// and prof_lz_decompress_file has to pass the bytes around the blocks through untouched
+static void
+test_lz_round_trip(void)
+{
+    static size_t const sizes[] = { 0, 1, 4, 5, 12, 13, 17, 100, 4096, 65536 + 7, PROF_LZ_BLOCK_SIZE };
+    size_t    sizes_n = sizeof(sizes) / sizeof(*sizes);
+    char     *raw     = (char *)malloc(PROF_LZ_BLOCK_SIZE);
+    char     *data    = (char *)malloc(PROF_LZ_BOUND(PROF_LZ_BLOCK_SIZE));
+    char     *out     = (char *)malloc(PROF_LZ_BLOCK_SIZE);
+    uint32_t *table   = (uint32_t *)malloc(sizeof(*table) << PROF_LZ_HASH_BITS);
+    FILE     *blocks  = tmpfile();
+    FILE     *expect  = tmpfile();
+    int       failed_n = 0;
+    test_check(blocks && expect);
+    if (! blocks || ! expect)
+    {   return;   }
+
+    fputs("[\n\x9f\x9fP", blocks); // a block's first magic byte that doesn't start one
+    fputs("[\n\x9f\x9fP", expect);
+    for (size_t size_i = 0; size_i < sizes_n; ++size_i)
+    {
+        for (int content_i = 0; content_i < 4; ++content_i)
+        {
+            size_t size = sizes[size_i];
+            test_lz_fill(raw, size, content_i);
+            size_t data_n = prof_lz_compress(raw, size, data, table);
+            int    ok     = (data_n <= PROF_LZ_BOUND(size) &&
+                             prof_lz_decompress(data, data_n, out, size) &&
+                             ! memcmp(raw, out, size));
+            if (size)
+            {   ok &= ! prof_lz_decompress(data, data_n, out, size - 1);   }
+            if (content_i == 1 && size >= 4096)
+            {   ok &= (data_n < size / 2);   } // repetitive text does compress
+            if (! ok)
+            {   fprintf(stderr, "LZ round trip failed for %zu bytes of content %d\n", size, content_i); ++failed_n;   }
+
+            if (size)
+            { // as the writer and professor_decompress -c store them
+                ProfLzBlock block;
+                char const *block_data = (data_n < size ? data : raw);
+                memcpy(block.magic, PROF_LZ_MAGIC, sizeof(block.magic));
+                block.raw_n  = (uint32_t)size;
+                block.data_n = (uint32_t)(data_n < size ? data_n : size);
+                fwrite(&block, sizeof(block), 1, blocks);
+                fwrite(block_data, 1, block.data_n, blocks);
+                fwrite(raw, 1, size, expect);
+            }
+        }
+    }
+    fputs("\n]\n", blocks);
+    fputs("\n]\n", expect);
+    test_check(failed_n == 0);
+
+    FILE *decompressed = tmpfile();
+    rewind(blocks);
+    test_check(decompressed && prof_lz_decompress_file(blocks, decompressed));
+    if (decompressed)
+    {
+        rewind(decompressed);
+        rewind(expect);
+        size_t mismatched_n = 0;
+        int    a, b;
+        do {
+            a = getc(decompressed);
+            b = getc(expect);
+            mismatched_n += (a != b);
+        } while (a != EOF && b != EOF);
+        test_check(mismatched_n == 0);
+        fclose(decompressed);
+    }
+
+    fclose(blocks);
+    fclose(expect);
+    free(table);
+    free(out);
+    free(data);
+    free(raw);
+}
+
+#if PROF_COMPACT
+// what prof_start_/prof_end_n_unchecked/prof_mark_ make in the regular layout, with the times given
+static void
+test_ref_start(Prof *ref, ProfIdx record_i, uint64_t cycles)
+{
+    if (ref->record_smpl_tree_n == ref->record_smpl_tree_m)
+    {   ref->record_smpl_tree = (ProfRecordSmpl *)prof_grow(ref, ref->record_smpl_tree, &ref->record_smpl_tree_m, sizeof(*ref->record_smpl_tree));   }
+    ProfRecordSmpl *smpl = &ref->record_smpl_tree[ref->record_smpl_tree_n];
+    smpl->record_i     = record_i;
+    smpl->parent_i     = ~ref->open_record_smpl_tree_i ? ref->open_record_smpl_tree_i : ref->record_smpl_tree_n;
+    smpl->cycles_start = cycles;
+    smpl->cycles_end   = ~(uint64_t)0;
+    ref->open_record_smpl_tree_i = ref->record_smpl_tree_n++;
+}
+
+static void
+test_ref_end(Prof *ref, uint32_t hits_n, uint64_t cycles)
+{
+    ProfRecordSmpl *smpl = &ref->record_smpl_tree[ref->open_record_smpl_tree_i];
+    smpl->cycles_end = cycles;
+    if (hits_n != 1)
+    {
+        if (ref->hits_smpls_n == ref->hits_smpls_m)
+        {   ref->hits_smpls = (ProfHitsSmpl *)prof_grow(ref, ref->hits_smpls, &ref->hits_smpls_m, sizeof(*ref->hits_smpls));   }
+        ref->hits_smpls[ref->hits_smpls_n].smpl_i = ref->open_record_smpl_tree_i;
+        ref->hits_smpls[ref->hits_smpls_n].hits_n = hits_n;
+        ++ref->hits_smpls_n;
+    }
+    ref->open_record_smpl_tree_i = (smpl->parent_i != ref->open_record_smpl_tree_i
+                                    ? smpl->parent_i
+                                    : ~(ProfIdx)0);
+}
+
+static void
+test_ref_mark(Prof *ref, ProfIdx record_i, uint64_t cycles)
+{
+    if (ref->record_smpl_tree_n == ref->record_smpl_tree_m)
+    {   ref->record_smpl_tree = (ProfRecordSmpl *)prof_grow(ref, ref->record_smpl_tree, &ref->record_smpl_tree_m, sizeof(*ref->record_smpl_tree));   }
+    ProfRecordSmpl *smpl = &ref->record_smpl_tree[ref->record_smpl_tree_n++];
+    smpl->record_i     = record_i;
+    smpl->parent_i     = ref->open_record_smpl_tree_i;
+    smpl->cycles_start = smpl->cycles_end = cycles;
+}
+
+// random starts, ends and marks, with equal times, gaps and durations too big for 32 bits, and hits;
+// expanding the compact samples has to give exactly what the regular layout would have
+static void
+test_compact_round_trip(void)
+{
+    Prof        compact_prof[1], ref[1];
+    ProfCompact compact;
+    memset(compact_prof, 0, sizeof(compact_prof));
+    memset(ref,          0, sizeof(ref));
+    ref->reallocate              = prof_realloc;
+    ref->open_record_smpl_tree_i = ~(ProfIdx)0;
+    prof_compact_open(compact_prof, &compact);
+
+    uint64_t cycles = test_rand() >> 8;
+    for (int round_i = 0; round_i < 2; ++round_i) // the second reuses the blocks
+    {
+        int depth = 0;
+        for (int op_i = 0; op_i < 1000000; ++op_i)
+        {
+            uint64_t r   = test_rand();
+            uint64_t gap = (r >> 8) % 1000;
+            if      (r % 4096 == 0) {   gap += (uint64_t)1 << (32 + (r >> 20) % 4);   } // more than 32 bits hold
+            else if (r % 8 == 0)    {   gap  = 0;   } // the same time as the last op
+
+            ProfIdx record_i = (ProfIdx)((r >> 24) % 16);
+            int     op       = (int)((r >> 32) % 8);
+            if (op < 4 && depth < 64)
+            {
+                cycles += gap;
+                prof_compact_start(compact_prof, record_i, cycles);
+                test_ref_start(ref, record_i, cycles);
+                ++depth;
+            }
+            else if (op < 7 && depth)
+            {
+                uint32_t hits_n = ((r >> 40) % 4 == 0 ? (uint32_t)((r >> 44) % 5) : 1);
+                cycles += gap ? gap : 1; // a scope that ends when it starts is a mark
+                prof_compact_end(compact_prof, hits_n, cycles);
+                test_ref_end(ref, hits_n, cycles);
+                --depth;
+            }
+            else
+            {
+                cycles += gap;
+                prof_compact_mark(compact_prof, record_i, cycles);
+                test_ref_mark(ref, record_i, cycles);
+            }
+        }
+
+        if (round_i == 1)
+        { // and with everything closed
+            for (; depth; --depth)
+            {
+                cycles += 1 + test_rand() % 1000;
+                prof_compact_end(compact_prof, 1, cycles);
+                test_ref_end(ref, 1, cycles);
+            }
+        }
+
+        prof_compact_expand(compact_prof);
+        test_check(compact_prof->record_smpl_tree_n == ref->record_smpl_tree_n);
+        test_check(compact_prof->hits_smpls_n       == ref->hits_smpls_n);
+        ProfIdx mismatched_n = 0;
+        for (ProfIdx smpl_i = 0; smpl_i < ref->record_smpl_tree_n && smpl_i < compact_prof->record_smpl_tree_n; ++smpl_i)
+        {
+            ProfRecordSmpl a = compact_prof->record_smpl_tree[smpl_i];
+            ProfRecordSmpl b = ref->record_smpl_tree[smpl_i];
+            mismatched_n += (a.record_i     != b.record_i     ||
+                             a.parent_i     != b.parent_i     ||
+                             a.cycles_start != b.cycles_start ||
+                             a.cycles_end   != b.cycles_end);
+        }
+        for (ProfIdx hits_smpl_i = 0; hits_smpl_i < ref->hits_smpls_n && hits_smpl_i < compact_prof->hits_smpls_n; ++hits_smpl_i)
+        {
+            ProfHitsSmpl a = compact_prof->hits_smpls[hits_smpl_i];
+            ProfHitsSmpl b = ref->hits_smpls[hits_smpl_i];
+            mismatched_n += (a.smpl_i != b.smpl_i || a.hits_n != b.hits_n);
+        }
+        test_check(mismatched_n == 0);
+
+        if (round_i == 0)
+        { // carry on from here with only the open samples' times left to compare
+            while (depth)
+            {
+                cycles += 1 + test_rand() % 1000;
+                prof_compact_end(compact_prof, 1, cycles);
+                test_ref_end(ref, 1, cycles);
+                --depth;
+            }
+            prof_dump_reset(compact_prof);
+            ref->record_smpl_tree_n = ref->hits_smpls_n = 0;
+        }
+    }
+
+    prof_compact_close(compact_prof);
+    free(compact_prof->record_smpl_tree);
+    free(compact_prof->hits_smpls);
+    free(ref->record_smpl_tree);
+    free(ref->hits_smpls);
+}
+#endif // PROF_COMPACT
+
+#if PROF_MMAP
+#include <sys/wait.h>
+
+// returns the exit status, or -1 if it crashed
+static int
+test_run(char const *path, char const *arg_0, char const *arg_1)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (! freopen("/dev/null", "w", stderr))
+        {   _exit(127);   }
+        execl(path, path, arg_0, arg_1, (char *)0);
+        _exit(127);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+    {   return 127;   }
+    return (WIFEXITED(status)
+            ? WEXITSTATUS(status)
+            : -1);
+}
+
+// professor_recover is for captures cut short, so it has to cope with one cut anywhere
+static void
+test_recover_truncated(void)
+{
+    char const *recover = "./professor_recover";
+    if (access(recover, X_OK))
+    {   fprintf(stderr, "skipping the truncated capture test: build professor_recover in this directory\n"); return;   }
+
+    Prof     capture_prof[1];
+    ProfMmap mm;
+    memset(capture_prof, 0, sizeof(capture_prof));
+    capture_prof->freq = 3330146;
+    test_check(prof_mmap_open(capture_prof, &mm, "professor_test.bin", 64, 4096, 64));
+    for (int i = 0; i < 1000; ++i)
+    {
+        prof_start(capture_prof, "outer");
+        prof_scope(capture_prof, "inner")
+        {
+            prof_mark(capture_prof, "mark");
+        }
+        prof_end_unchecked(capture_prof);
+    }
+    prof_start(capture_prof, "still open");
+    prof_mmap_close(capture_prof);
+    free(capture_prof->records); // only the samples were mapped
+    free(capture_prof->hits_smpls);
+
+    FILE  *file    = fopen("professor_test.bin", "rb");
+    char  *capture = 0;
+    size_t size    = 0;
+    if (file)
+    {
+        fseek(file, 0, SEEK_END);
+        size    = (size_t)ftell(file);
+        capture = (char *)malloc(size);
+        rewind(file);
+        size = fread(capture, 1, size, file);
+        fclose(file);
+    }
+    test_check(size > 4096);
+    test_check(test_run(recover, "professor_test.bin", "professor_test.bin.json") == 0);
+
+    size_t cut_sizes[] = { 1, sizeof(ProfBinHeader) - 1, sizeof(ProfBinHeader), 4096, size - 1 }; // then every 173 bytes
+    size_t cut_sizes_n = sizeof(cut_sizes) / sizeof(*cut_sizes);
+    int    crashed_n   = 0;
+    for (size_t cut_i = 0; cut_i < cut_sizes_n + size / 173; ++cut_i)
+    {
+        size_t cut_size = (cut_i < cut_sizes_n
+                           ? cut_sizes[cut_i]
+                           : (cut_i - cut_sizes_n) * 173);
+        file = fopen("professor_test_cut.bin", "wb");
+        fwrite(capture, 1, cut_size, file);
+        fclose(file);
+        int status = test_run(recover, "professor_test_cut.bin", "professor_test_cut.bin.json");
+        if (status != 0 && status != 1)
+        {   fprintf(stderr, "professor_recover failed (%d) on the capture cut to %zu bytes\n", status, cut_size); ++crashed_n;   }
+    }
+    test_check(crashed_n == 0);
+
+    free(capture);
+    remove("professor_test.bin");
+    remove("professor_test.bin.json");
+    remove("professor_test_cut.bin");
+    remove("professor_test_cut.bin.json");
+}
+#endif // PROF_MMAP
+
+#if PROF_PARALLEL_DUMP
+#define TEST_PROFS_N 6
+
+// the events of a dump, one per line, without the metadata (the parallel dump names each thread), blank lines or commas
+static char **
+test_read_events(char const *filename, size_t *events_n, char **data)
+{
+    FILE  *file = prof_lz_fopen(filename);
+    size_t size = 0;
+    *data     = 0;
+    *events_n = 0;
+    if (! file)
+    {   return 0;   }
+    fseek(file, 0, SEEK_END);
+    size  = (size_t)ftell(file);
+    *data = (char *)malloc(size + 1);
+    rewind(file);
+    size = fread(*data, 1, size, file);
+    (*data)[size] = '\0';
+    fclose(file);
+
+    char **events = (char **)malloc((size + 1) * sizeof(*events));
+    for (char *line = *data, *line_end; *line; line = line_end + 1)
+    {
+        line_end = strchr(line, '\n');
+        if (! line_end)
+        {   line_end = line + strlen(line);   }
+        int is_last = ! *line_end;
+        *line_end = '\0'; // NOTE: so the searches stop at the end of the line, not the file
+        char *last = line_end;
+        while (last > line && (last[-1] == ',' || last[-1] == '\r'))
+        {   --last;   }
+        int is_event = (line[0] == ' ' && strstr(line, "{\"name\":") && last > line);
+        if (is_event)
+        {
+            *last = '\0';
+            if (! strstr(line, "\"ph\":\"M\""))
+            {   events[(*events_n)++] = line;   }
+        }
+        if (is_last)
+        {   break;   }
+    }
+    return events;
+}
+
+// several Profs dumped in parallel have to give the same events, in the same order, as dumping each in turn,
+// including across chunk boundaries, for Profs with no samples, and with hits and names that need escaping
+static void
+test_parallel_dump(void)
+{
+    static ProfIdx const smpls_ns[TEST_PROFS_N] = { 0, 1, 100, PROF_DUMP_CHUNK_SMPLS, PROF_DUMP_CHUNK_SMPLS + 1, 100000 };
+    Prof   profs[TEST_PROFS_N];
+    Prof  *prof_ptrs[TEST_PROFS_N];
+    Prof   saved[TEST_PROFS_N];
+    memset(profs, 0, sizeof(profs));
+    for (int prof_i = 0; prof_i < TEST_PROFS_N; ++prof_i)
+    {
+        Prof *p = &profs[prof_i];
+        prof_ptrs[prof_i]          = p;
+        p->reallocate              = prof_realloc;
+        p->open_record_smpl_tree_i = ~(ProfIdx)0;
+        p->freq                    = 3330146;
+        p->tid                     = 100 + prof_i;
+        ProfIdx records_i[4] = {
+            prof_new_record(p, "outer", __FILE__, __LINE__),
+            prof_new_record(p, "inner \"quoted\" \\ back\\slashed", __FILE__, __LINE__),
+            prof_new_record(p, "mark\tand\nnewline", __FILE__, __LINE__),
+            prof_new_record(p, "hits", __FILE__, __LINE__),
+        };
+        int depth = 0;
+        while (p->record_smpl_tree_n < smpls_ns[prof_i])
+        {
+            uint64_t r  = test_rand();
+            int      op = (int)(r % 8);
+            if (depth && (op < 3 || p->record_smpl_tree_n + depth >= smpls_ns[prof_i]))
+            {   prof_end_n_unchecked(p, (r >> 8) % 4 == 0 ? (uint32_t)((r >> 12) % 1000) : 1); --depth;   }
+            else if (op < 6 && depth < 16)
+            {   prof_start_(p, records_i[(r >> 16) % 4]); ++depth;   }
+            else
+            {   prof_mark_(p, records_i[2]);   }
+        }
+        for (; depth; --depth)
+        {   prof_end_n_unchecked(p, 1);   }
+
+        saved[prof_i] = *p; // the dumps reset the samples, so keep copies to put back
+        saved[prof_i].record_smpl_tree = (ProfRecordSmpl *)malloc(p->record_smpl_tree_n * sizeof(ProfRecordSmpl) + 1);
+        saved[prof_i].hits_smpls       = (ProfHitsSmpl   *)malloc(p->hits_smpls_n       * sizeof(ProfHitsSmpl)   + 1);
+        if (p->record_smpl_tree_n) // NOTE: the arrays are null until they grow
+        {   memcpy(saved[prof_i].record_smpl_tree, p->record_smpl_tree, p->record_smpl_tree_n * sizeof(ProfRecordSmpl));   }
+        if (p->hits_smpls_n)
+        {   memcpy(saved[prof_i].hits_smpls, p->hits_smpls, p->hits_smpls_n * sizeof(ProfHitsSmpl));   }
+    }
+
+    FILE *file = 0;
+    for (int prof_i = 0; prof_i < TEST_PROFS_N; ++prof_i)
+    {   prof_dump_timings_file(&file, "professor_test_serial.json", &profs[prof_i]);   }
+    fputs("\n]\n", file);
+    fclose(file);
+    size_t serial_n;
+    char  *serial_data;
+    char **serial = test_read_events("professor_test_serial.json", &serial_n, &serial_data);
+    test_check(serial_n >= 100000);
+
+    static int const workers_ns[] = { 3, 64 };
+    for (int workers_i = 0; workers_i < (int)(sizeof(workers_ns) / sizeof(*workers_ns)); ++workers_i)
+    {
+        for (int prof_i = 0; prof_i < TEST_PROFS_N; ++prof_i)
+        {
+            Prof *p = &profs[prof_i];
+            p->record_smpl_tree_n = saved[prof_i].record_smpl_tree_n;
+            p->hits_smpls_n       = saved[prof_i].hits_smpls_n;
+            if (p->record_smpl_tree_n)
+            {   memcpy(p->record_smpl_tree, saved[prof_i].record_smpl_tree, p->record_smpl_tree_n * sizeof(ProfRecordSmpl));   }
+            if (p->hits_smpls_n)
+            {   memcpy(p->hits_smpls, saved[prof_i].hits_smpls, p->hits_smpls_n * sizeof(ProfHitsSmpl));   }
+        }
+
+        file = 0;
+        prof_dump_timings_file_parallel(&file, "professor_test_parallel.json", prof_ptrs, TEST_PROFS_N, workers_ns[workers_i]);
+        fputs("\n]\n", file);
+        fclose(file);
+        size_t parallel_n;
+        char  *parallel_data;
+        char **parallel = test_read_events("professor_test_parallel.json", &parallel_n, &parallel_data);
+        test_check(parallel_n == serial_n);
+        size_t mismatched_n = 0;
+        for (size_t event_i = 0; event_i < serial_n && event_i < parallel_n; ++event_i)
+        {   mismatched_n += (strcmp(serial[event_i], parallel[event_i]) != 0);   }
+        test_check(mismatched_n == 0);
+        free(parallel);
+        free(parallel_data);
+    }
+
+    for (int prof_i = 0; prof_i < TEST_PROFS_N; ++prof_i)
+    {
+        Prof *p = &profs[prof_i];
+        prof_dump_close(p);
+        free(p->records);
+        free(p->record_smpl_tree);
+        free(p->hits_smpls);
+        free(saved[prof_i].record_smpl_tree);
+        free(saved[prof_i].hits_smpls);
+    }
+    free(serial);
+    free(serial_data);
+    remove("professor_test_serial.json");
+    remove("professor_test_parallel.json");
+}
+#endif // PROF_PARALLEL_DUMP
+
+#if PROF_REGISTRY
+static void
+test_registry_site(void)
+{
+    prof_scope(prof, "registry site")
+    {   test_check(prof->records_n);   }
+}
+
+// every call site's record is in the table from startup, at its index in the section
+static void
+test_registry(void)
+{
+    ProfIdx registry_n = (ProfIdx)(__stop_prof_records - __start_prof_records);
+    ProfIdx site_i     = ~(ProfIdx)0;
+    test_check(registry_n >= 3 && prof->records_n >= registry_n);
+    for (ProfIdx record_i = 0; record_i < registry_n && record_i < prof->records_n; ++record_i)
+    {
+        test_check(prof->records[record_i].name == __start_prof_records[record_i]->name);
+        if (! strcmp(prof->records[record_i].name, "registry site"))
+        {   site_i = record_i;   }
+    }
+    test_check(~site_i); // before the site has ever run
+
+    ProfIdx records_n = prof->records_n;
+    test_registry_site();
+    test_check(prof->records_n == records_n);
+#if PROF_COMPACT
+    ProfCompactBlock const *block = prof->compact->block;
+    test_check(block && block->smpls_n && block->record_i[block->smpls_n - 1] == site_i);
+#else
+    test_check(prof->record_smpl_tree_n && prof->record_smpl_tree[prof->record_smpl_tree_n - 1].record_i == site_i);
+#endif
+}
+#endif // PROF_REGISTRY
+
+#if PROF_SHM
+// a viewer mapping the segment sees the records, their totals and the open scopes as they change
+static void
+test_shm_live(void)
+{
+    Prof l[1];
+    memset(l, 0, sizeof(l));
+    l->open_record_smpl_tree_i = ~(ProfIdx)0;
+    ProfIdx outer_i = prof_new_record(l, "shm outer", __FILE__, __LINE__);
+    char name[64];
+    snprintf(name, sizeof(name), "/professor_test.%llu", (unsigned long long)prof_getpid());
+    ProfShm shm;
+    test_check(prof_shm_open(l, &shm, name, 2));
+    if (! l->shm)
+    {   return;   }
+
+    int                  fd   = shm_open(name, O_RDONLY, 0);
+    void                *base = (fd >= 0 ? mmap(0, shm.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED);
+    ProfShmHeader const *hdr  = (ProfShmHeader const *)base;
+    ProfShmRecord const *records = (ProfShmRecord const *)(hdr + 1);
+    test_check(base != MAP_FAILED);
+    if (fd >= 0)
+    {   close(fd);   }
+    if (base == MAP_FAILED)
+    {   prof_shm_close(l); return;   }
+
+    ProfIdx inner_i = prof_new_record(l, "shm inner", __FILE__, __LINE__); // made after the segment
+    ProfIdx extra_i = prof_new_record(l, "shm extra", __FILE__, __LINE__); // past records_m
+    test_check(! memcmp(hdr->magic, PROF_SHM_MAGIC, sizeof(PROF_SHM_MAGIC)) && hdr->records_n == 2);
+    test_check(! strcmp(records[outer_i].name, "shm outer") && ! strcmp(records[inner_i].name, "shm inner"));
+
+    prof_start_(l, outer_i);
+    prof_start_(l, inner_i);
+    test_check(hdr->open_n == 2 && hdr->open_record_i[0] == outer_i && hdr->open_record_i[1] == inner_i);
+    prof_end_n_unchecked(l, 3);
+    prof_start_(l, extra_i);
+    prof_end_n_unchecked(l, 1);
+    test_check(hdr->open_n == 1 && records[inner_i].hits_n == 3 && records[inner_i].cycles_n);
+    prof_end_n_unchecked(l, 1);
+    test_check(hdr->open_n == 0 && records[outer_i].hits_n == 1 && hdr->records_n == 2);
+    test_check(records[outer_i].cycles_n >= records[inner_i].cycles_n);
+    test_check(! (hdr->open_seq & 1) && ! (records[inner_i].seq & 1)); // not left mid-write
+
+    munmap(base, shm.size);
+    prof_shm_close(l);
+    test_check(shm_open(name, O_RDONLY, 0) < 0); // unlinked
+    prof_dump_close(l);
+    free(l->records);
+    free(l->record_smpl_tree);
+    free(l->hits_smpls);
+}
+#endif // PROF_SHM
+
+#if PROF_PERF
+// counters are read around each scope, so an outer scope counts at least what its inner one did.
+// perf_event_open is often not allowed (containers, perf_event_paranoid), in which case this is skipped
+static void
+test_perf_counters(void)
+{
+    Prof     f[1];
+    ProfPerf perf;
+    memset(f, 0, sizeof(f));
+    f->open_record_smpl_tree_i = ~(ProfIdx)0;
+    f->freq = 1000000;
+    if (! prof_perf_open(f, &perf))
+    {
+        test_check(! f->perf);
+        fprintf(stderr, "test_perf_counters: skipped, perf_event_open isn't allowed here\n");
+        return;
+    }
+
+    ProfIdx outer_i = prof_new_record(f, "perf outer", __FILE__, __LINE__);
+    ProfIdx inner_i = prof_new_record(f, "perf inner", __FILE__, __LINE__);
+    volatile uint64_t sum = 0;
+    prof_start_(f, outer_i);
+    prof_start_(f, inner_i);
+    for (uint64_t i = 0; i < 1000000; ++i) {   sum += i;   }
+    prof_end_n_unchecked(f, 1);
+    prof_end_n_unchecked(f, 1);
+    test_check(f->record_smpl_tree_n == 2 && perf.smpls_m >= 2);
+    if (perf.fds[PROF_PERF_instructions] >= 0)
+    {
+        test_check(perf.smpls[1].counts[PROF_PERF_instructions] >= 1000000);
+        test_check(perf.smpls[0].counts[PROF_PERF_instructions] >= perf.smpls[1].counts[PROF_PERF_instructions]);
+    }
+
+    FILE *out = 0;
+    prof_dump_timings_file(&out, "professor_test_perf.json", f);
+    fputs("\n]\n", out);
+    fclose(out);
+    char *text = test_read_text("professor_test_perf.json");
+    test_check(text && test_count(text, "\"instructions\": ") == 2 && test_count(text, "\"ipc\":") == 2);
+    free(text);
+    remove("professor_test_perf.json");
+
+    prof_perf_close(f);
+    test_check(! f->perf && perf.smpls_m == 0);
+    prof_dump_close(f);
+    free(f->records);
+    free(f->record_smpl_tree);
+    free(f->hits_smpls);
+}
+#endif // PROF_PERF
+
+#if PROF_CPU_TIME
+// an outer scope spends at least the CPU time its inner one did, and no more than the thread did around it
+static void
+test_cpu_time(void)
+{
+    Prof    c[1];
+    ProfCpu cpu;
+    memset(c, 0, sizeof(c));
+    c->open_record_smpl_tree_i = ~(ProfIdx)0;
+    c->freq = 1000000;
+    prof_cpu_open(c, &cpu);
+    test_check(c->cpu == &cpu);
+
+    ProfIdx outer_i = prof_new_record(c, "cpu outer", __FILE__, __LINE__);
+    ProfIdx inner_i = prof_new_record(c, "cpu inner", __FILE__, __LINE__);
+    volatile uint64_t sum = 0;
+    uint64_t thread_ns = PROF_THREAD_CPU_NS();
+    prof_start_(c, outer_i);
+    prof_start_(c, inner_i);
+    for (uint64_t i = 0; i < 10000000; ++i) {   sum += i;   }
+    prof_end_n_unchecked(c, 1);
+    prof_end_n_unchecked(c, 1);
+    thread_ns = PROF_THREAD_CPU_NS() - thread_ns;
+    test_check(c->record_smpl_tree_n == 2 && cpu.smpls_m >= 2);
+    test_check(cpu.smpls[1].cpu_ns > 0 && cpu.smpls[0].cpu_ns >= cpu.smpls[1].cpu_ns && cpu.smpls[0].cpu_ns <= thread_ns);
+    long cpus_n = sysconf(_SC_NPROCESSORS_CONF);
+    test_check(cpus_n <= 0 || (cpu.smpls[0].cpu_start < cpus_n && cpu.smpls[0].cpu_end < cpus_n));
+
+    FILE *out = 0;
+    prof_dump_timings_file(&out, "professor_test_cpu.json", c);
+    fputs("\n]\n", out);
+    fclose(out);
+    char *text = test_read_text("professor_test_cpu.json");
+    test_check(text && test_count(text, "\"cpu_ms\":") == 2 && test_count(text, "\"off_cpu_ms\":") == 2);
+    test_check(text && test_count(text, "\"cpu\":") == 2);
+    free(text);
+    remove("professor_test_cpu.json");
+
+    prof_cpu_close(c);
+    test_check(! c->cpu && cpu.smpls_m == 0);
+    prof_dump_close(c);
+    free(c->records);
+    free(c->record_smpl_tree);
+    free(c->hits_smpls);
+}
+#endif // PROF_CPU_TIME
+
+#if PROF_ADDR
+static void
+test_addr_fn(void)
+{}
+
+// code addresses get one record each, named by address, and dumps say which loaded file the address is in
+static void
+test_addr_records(void)
+{
+    Prof a[1];
+    memset(a, 0, sizeof(a));
+    a->open_record_smpl_tree_i = ~(ProfIdx)0;
+    void const *fn       = (void const *)(uintptr_t)test_addr_fn;
+    ProfIdx     record_i = prof_add_addr_record(a, fn);
+    char        name[32];
+    snprintf(name, sizeof(name), "0x%llx", (unsigned long long)(uintptr_t)fn);
+    test_check(prof_add_addr_record(a, fn) == record_i && a->records_n == 1);
+    test_check(! strcmp(a->records[record_i].name, name));
+    prof_start_addr(a, fn);
+    prof_start_here(a);
+    prof_end_n_unchecked(a, 1);
+    prof_end_n_unchecked(a, 1);
+    test_check(a->records_n == 2 && a->record_smpl_tree_n == 2 && a->record_smpl_tree[0].record_i == record_i);
+
+    FILE *out = 0;
+    prof_dump_timings_file(&out, "professor_test_addr.json", a);
+    fputs("\n]\n", out);
+    fclose(out);
+    char *text = test_read_text("professor_test_addr.json");
+    test_check(text && strstr(text, name));
+    int is_in_module = 0;
+    for (char const *module = text ? strstr(text, "\"name\":\"prof_module\"") : 0; module; module = strstr(module + 1, "\"name\":\"prof_module\""))
+    {
+        unsigned long long start = 0, end = 0;
+        char const        *args  = strstr(module, "\"args\": {");
+        if (args && sscanf(args, "\"args\": {\"start\":\"0x%llx\", \"end\":\"0x%llx\"", &start, &end) == 2)
+        {   is_in_module |= (start <= (uintptr_t)fn && (uintptr_t)fn < end);   }
+    }
+    test_check(is_in_module);
+    free(text);
+    remove("professor_test_addr.json");
+
+    for (ProfIdx name_i = 0; name_i < a->records_n; ++name_i)
+    {   free((void *)a->records[name_i].name);   }
+    prof_addr_map_free(a->addr_records_i_map);
+    prof_dump_close(a);
+    free(a->records);
+    free(a->record_smpl_tree);
+    free(a->hits_smpls);
+}
+#endif // PROF_ADDR
+
+#if PROF_INSTRUMENT
+// the hooks -finstrument-functions calls, from professor_instrument.c. Called directly here, so this file doesn't
+// have to be built with the flag
+void __cyg_profile_func_enter(void *fn, void *call_site);
+void __cyg_profile_func_exit(void *fn, void *call_site);
+
+static int test_instrument_outer(void)    {   return 1;   } // NOTE: different bodies, so they aren't folded together
+static int test_instrument_inner(void)    {   return 2;   }
+static int test_instrument_excluded(void) {   return 3;   }
+
+// entered functions are nested scopes with a record per address, except in excluded ranges, and exits from
+// functions entered before the thread was instrumented are ignored
+static void
+test_instrument_hooks(void)
+{
+    void *outer    = (void *)(uintptr_t)test_instrument_outer;
+    void *inner    = (void *)(uintptr_t)test_instrument_inner;
+    void *excluded = (void *)(uintptr_t)test_instrument_excluded;
+    Prof  i[1];
+    memset(i, 0, sizeof(i));
+    i->open_record_smpl_tree_i = ~(ProfIdx)0;
+    test_check(prof_instrument_exclude(excluded, (char *)excluded + 1));
+
+    __cyg_profile_func_enter(outer, 0); // not instrumented yet
+    prof_instrument_thread(i);
+    __cyg_profile_func_enter(outer, 0);
+    for (int call_i = 0; call_i < 3; ++call_i)
+    {
+        __cyg_profile_func_enter(inner, 0);
+        __cyg_profile_func_enter(excluded, 0);
+        __cyg_profile_func_exit(excluded, 0);
+        __cyg_profile_func_exit(inner, 0);
+    }
+    __cyg_profile_func_exit(outer, 0);
+    __cyg_profile_func_exit(outer, 0); // entered before
+    prof_instrument_thread(0);
+
+    test_check(i->records_n == 2 && i->record_smpl_tree_n == 4 && ! ~i->open_record_smpl_tree_i);
+    if (i->record_smpl_tree_n == 4)
+    {
+        for (ProfIdx smpl_i = 1; smpl_i < 4; ++smpl_i)
+        {
+            test_check(i->record_smpl_tree[smpl_i].record_i == i->record_smpl_tree[1].record_i);
+            test_check(i->record_smpl_tree[smpl_i].parent_i == 0);
+        }
+        test_check(i->record_smpl_tree[0].record_i != i->record_smpl_tree[1].record_i);
+        test_check(~i->record_smpl_tree[0].cycles_end);
+    }
+
+    for (ProfIdx name_i = 0; name_i < i->records_n; ++name_i)
+    {   free((void *)i->records[name_i].name);   }
+    prof_addr_map_free(i->addr_records_i_map);
+    prof_dump_close(i);
+    free(i->records);
+    free(i->record_smpl_tree);
+    free(i->hits_smpls);
+}
+#endif // PROF_INSTRUMENT
+
+#if PROF_FRAMES
+// only the slowest frames are kept whole, with their samples re-rooted and their hits; every frame is summarized
+static void
+test_frames_slowest(void)
+{
+    static uint64_t const spins[4] = { 10000, 20000000, 100000, 40000000 }; // in cycles; frames 1 and 3 are slowest
+    Prof f[1];
+    memset(f, 0, sizeof(f));
+    f->open_record_smpl_tree_i = ~(ProfIdx)0;
+    ProfIdx scope_i = prof_new_record(f, "frame scope", __FILE__, __LINE__);
+    ProfIdx mark_i  = prof_new_record(f, "frame mark",  __FILE__, __LINE__);
+    ProfFrames frames;
+    prof_frames_open(f, &frames, 2);
+
+    for (int frame_i = 0; frame_i < 4; ++frame_i)
+    {
+        prof_frame_begin(f);
+        prof_start_(f, scope_i);
+        for (uint64_t until = __rdtsc() + spins[frame_i]; __rdtsc() < until;) {}
+        prof_mark_(f, mark_i);
+        prof_end_n_unchecked(f, frame_i ? 5 : 1); // the first frame has no hits
+        prof_frame_end(f);
+        test_check(f->record_smpl_tree_n == 0 && f->hits_smpls_n == 0);
+    }
+
+    test_check(frames.frames_n == 4 && frames.slowest_n == 2);
+    test_check(frames.record_aggs[scope_i].hits_n == 1 + 3 * 5 && frames.record_aggs[mark_i].hits_n == 4);
+    for (ProfIdx slowest_i = 0; slowest_i < frames.slowest_n; ++slowest_i)
+    {
+        ProfFrame const *frame = &frames.slowest[slowest_i];
+        test_check(frame->frame_i == 1 || frame->frame_i == 3);
+        test_check(frame->smpls_n == 2 && frame->smpls[0].parent_i == 0 && frame->smpls[1].parent_i == 0);
+        test_check(frame->hits_smpls_n == 1 && frame->hits_smpls[0].smpl_i == 0 && frame->hits_smpls[0].hits_n == 5);
+    }
+
+    FILE *out = 0;
+    prof_frames_dump(&out, "professor_test_frames.json", f);
+    fputs("\n]\n", out);
+    fclose(out);
+    char *text = test_read_text("professor_test_frames.json");
+    test_check(strstr(text, "\"name\":\"frame 1\"") && strstr(text, "\"name\":\"frame 3\""));
+    test_check(! strstr(text, "\"name\":\"frame 0\"") && ! strstr(text, "\"name\":\"frame 2\""));
+    test_check(test_count(text, "\"hits\": 5") == 2);
+    free(text);
+    remove("professor_test_frames.json");
+
+    prof_frames_close(f);
+    prof_dump_close(f);
+    free(f->records);
+    free(f->record_smpl_tree);
+    free(f->hits_smpls);
+}
+#endif // PROF_FRAMES
+
+#if PROF_SIGNAL
+// the dump a fatal signal would make: a report of the open scopes, and the samples in a binary capture
+static void
+test_signal_dump(void)
+{
+    Prof s[1];
+    memset(s, 0, sizeof(s));
+    s->open_record_smpl_tree_i = ~(ProfIdx)0;
+    ProfIdx outer_i = prof_new_record(s, "signal outer", __FILE__, __LINE__);
+    ProfIdx inner_i = prof_new_record(s, "signal inner", __FILE__, __LINE__);
+    prof_start_(s, outer_i);
+    prof_start_(s, inner_i);
+    prof_end_n_unchecked(s, 1);
+    prof_start_(s, inner_i);
+
+    FILE *report = tmpfile();
+    test_check(report);
+    if (! report)
+    {   return;   }
+    test_check(prof_signal_install(fileno(report), "professor_test_signal"));
+    for (int sig_i = 0; sig_i < 4; ++sig_i)
+    {   sigaction(prof_signal_sigs[sig_i], &prof_signal_state.prev_actions[sig_i], 0);   } // only the dump is tested
+    test_check(prof_signal_register(s));
+
+    prof_signal_dump(SIGTERM); // as a watchdog would
+    char text[1024] = {0};
+    rewind(report);
+    test_check(fread(text, 1, sizeof(text) - 1, report) > 0);
+    fclose(report);
+    char const *outer = strstr(text, "signal outer");
+    char const *inner = strstr(text, "signal inner");
+    test_check(strstr(text, "caught signal 15") && strstr(text, ": 3 samples not yet dumped"));
+    test_check(outer && inner && inner < outer); // innermost first
+    test_check(strstr(text, "samples written to professor_test_signal."));
+
+    char filename[64];
+    snprintf(filename, sizeof(filename), "professor_test_signal.%llu.bin", (unsigned long long)prof_thread_id());
+    FILE         *bin = fopen(filename, "rb");
+    ProfBinHeader hdr;
+    test_check(bin && fread(&hdr, sizeof(hdr), 1, bin) == 1);
+    if (bin)
+    {
+        test_check(! memcmp(hdr.magic, PROF_BIN_MAGIC, sizeof(PROF_BIN_MAGIC)));
+        test_check(hdr.smpls_n == 3 && hdr.open_record_smpl_tree_i == 2 && hdr.records_n == s->records_n);
+        fclose(bin);
+    }
+    remove(filename);
+
+    prof_signal_unregister(s);
+    prof_dump_close(s);
+    free(s->records);
+    free(s->record_smpl_tree);
+    free(s->hits_smpls);
+}
+#endif // PROF_SIGNAL
+
+#if PROF_TRIGGER
+// a scope over its threshold captures the events that finished in the window either side of it, once the
+// trailing window has passed. Samples are fed in directly so their timing is exact
+static void
+test_trigger_capture(void)
+{
+    static struct { char const *name; uint64_t cycles_start, cycles_end; } const smpls[] = {
+        { "early", 0,   5   }, // before the window
+        { "fast",  10,  15  },
+        { "slow",  30,  200 }, // 170 us: triggers
+        { "slow",  100, 205 }, // 105 us: while the first is pending, suppressed
+        { "fast",  206, 208 },
+        { "fast",  209, 212 }, // past the trailing window: the capture is handed off with this
+        { "slow",  300, 400 }, // 100 us: not over the threshold
+    };
+    Prof t[1];
+    memset(t, 0, sizeof(t));
+    t->open_record_smpl_tree_i = ~(ProfIdx)0;
+    t->freq                    = 1e6; // a cycle is a us
+    ProfTrigger trigger;
+    test_check(prof_trigger_open(t, &trigger, "professor_test_trigger", 0.01, 8));
+    if (! t->trigger)
+    {   return;   }
+    prof_trigger_add(t, "slow", 100);
+
+    for (size_t smpl_i = 0; smpl_i < sizeof(smpls) / sizeof(*smpls); ++smpl_i)
+    {
+        ProfRecordSmpl smpl;
+        memset(&smpl, 0, sizeof(smpl));
+        smpl.record_i     = prof_new_record(t, smpls[smpl_i].name, __FILE__, __LINE__);
+        smpl.cycles_start = smpls[smpl_i].cycles_start;
+        smpl.cycles_end   = smpls[smpl_i].cycles_end;
+        prof_trigger_smpl(t, smpl);
+    }
+    test_check(trigger.captures_n == 1 && trigger.suppressed_n == 1 && ! trigger.pending);
+    prof_trigger_close(t); // waits for the writer
+
+    char *text = test_read_text("professor_test_trigger_0.json");
+    test_check(text);
+    test_check(test_count(text, "\"name\":\"trigger: slow\"") == 1);
+    test_check(strstr(text, "\"dur_ms\": 0.170000, \"threshold_ms\": 0.100000"));
+    test_check(test_count(text, "\"ph\":\"X\"") == 4);
+    test_check(! strstr(text, "early") && ! strstr(text, "\"ts\": 0.010000"));
+    free(text);
+    text = test_read_text("professor_test_trigger_1.json");
+    test_check(! text);
+    free(text);
+    remove("professor_test_trigger_0.json");
+
+    free(t->records);
+}
+#endif // PROF_TRIGGER
+
+#if PROF_WAIT
+// waits are totalled per object, then per call site within it, both slowest first; open waits aren't counted
+static void
+test_wait_contention(void)
+{
+    static struct { int site_i; uint32_t kind; uintptr_t obj; uint64_t us; } const waits[] = {
+        { 0, PROF_WAIT_lock, 0x1000, 10  },
+        { 1, PROF_WAIT_lock, 0x1000, 100 },
+        { 0, PROF_WAIT_lock, 0x1000, 30  },
+        { 2, PROF_WAIT_fd,   7,      5   },
+    };
+    Prof c[1];
+    memset(c, 0, sizeof(c));
+    c->open_record_smpl_tree_i = ~(ProfIdx)0;
+    c->freq                    = 1e6; // a cycle is a us
+    ProfWait wait;
+    prof_wait_open(c, &wait);
+    ProfIdx site_records_i[3] = {
+        prof_new_record(c, "site_a", __FILE__, 1),
+        prof_new_record(c, "site_b", __FILE__, 2),
+        prof_new_record(c, "site_c", __FILE__, 3),
+    };
+    for (size_t wait_i = 0; wait_i < sizeof(waits) / sizeof(*waits); ++wait_i)
+    {
+        prof_start_(c, site_records_i[waits[wait_i].site_i]);
+        prof_wait_tag(c, waits[wait_i].kind, waits[wait_i].obj);
+        ProfIdx smpl_i = c->open_record_smpl_tree_i;
+        prof_end_n_unchecked(c, 1);
+        c->record_smpl_tree[smpl_i].cycles_start = 1000 * wait_i; // exact durations
+        c->record_smpl_tree[smpl_i].cycles_end   = 1000 * wait_i + waits[wait_i].us;
+    }
+    prof_start_(c, site_records_i[0]);
+    prof_wait_tag(c, PROF_WAIT_lock, 0x1000); // still waiting
+
+    FILE *out = tmpfile();
+    test_check(out);
+    if (! out)
+    {   return;   }
+    prof_wait_dump_contention(out, c);
+    char text[2048] = {0};
+    rewind(out);
+    test_check(fread(text, 1, sizeof(text) - 1, out) > 0);
+    fclose(out);
+
+    char const *lock   = strstr(text, "lock 0x1000\n");
+    char const *fd     = strstr(text, "fd 7\n");
+    char const *site_a = strstr(text, "site_a (");
+    char const *site_b = strstr(text, "site_b (");
+    test_check(lock && fd && site_a && site_b);
+    test_check(lock < site_b && site_b < site_a && site_a < fd); // slowest first
+    if (lock && site_a && site_b)
+    {
+        char const        *line;
+        unsigned long long waits_n = 0;
+        double             total_ms = 0, per_wait_us = 0, max_us = 0;
+        for (line = lock; line > text && line[-1] != '\n'; --line) {}
+        test_check(sscanf(line, "%llu %lf %lf %lf", &waits_n, &total_ms, &per_wait_us, &max_us) == 4);
+        test_check(waits_n == 3 && total_ms == 0.14 && per_wait_us == 46.6667 && max_us == 100);
+        for (line = site_a; line > text && line[-1] != '\n'; --line) {}
+        test_check(sscanf(line, "%llu %lf %lf %lf", &waits_n, &total_ms, &per_wait_us, &max_us) == 4);
+        test_check(waits_n == 2 && total_ms == 0.04 && per_wait_us == 20 && max_us == 30);
+    }
+
+    prof_end_n_unchecked(c, 1);
+    prof_wait_close(c);
+    prof_dump_close(c);
+    free(c->records);
+    free(c->record_smpl_tree);
+    free(c->hits_smpls);
+}
+#endif // PROF_WAIT
+
+#if PROF_STREAM
+// the next batch on fd, skipping anything else, or 0 if there's none waiting
+static ProfStreamBatch const *
+test_stream_recv(int fd)
+{
+    static union { ProfStreamBatch hdr; char bytes[PROF_STREAM_BATCH_SIZE]; } buf;
+    ssize_t n;
+    while ((n = recv(fd, buf.bytes, sizeof(buf.bytes), MSG_DONTWAIT)) >= 0)
+    {
+        if (n >= (ssize_t)sizeof(buf.hdr) && ! memcmp(buf.hdr.magic, PROF_STREAM_MAGIC, sizeof(PROF_STREAM_MAGIC)))
+        {   return &buf.hdr;   }
+    }
+    return 0;
+}
+
+// the collector throws away flushes that didn't arrive whole, so after one fails, every record goes again,
+// including those that did get through in the failed flush
+static void
+test_stream_resend(void)
+{
+    char const *path = "professor_test.sock";
+    remove(path);
+    Prof s[1];
+    memset(s, 0, sizeof(s));
+    s->open_record_smpl_tree_i = ~(ProfIdx)0;
+    ProfStream stream;
+    test_check(prof_stream_open(s, &stream, path));
+
+    int collector = socket(AF_UNIX, SOCK_DGRAM, 0);
+    int filler    = socket(AF_UNIX, SOCK_DGRAM, 0);
+    test_check(collector >= 0 && filler >= 0 && ! bind(collector, (struct sockaddr const *)&stream.addr, sizeof(stream.addr)));
+    { // fill the collector's queue, then make room for just one more datagram: the records get in, the samples don't
+        char filling[64] = {0};
+        int  filled_n    = 0;
+        while (filled_n < 10000 &&
+               sendto(filler, filling, sizeof(filling), MSG_DONTWAIT, (struct sockaddr const *)&stream.addr, sizeof(stream.addr)) > 0)
+        {   ++filled_n;   }
+        test_check(filled_n < 10000);
+        test_check(recv(collector, filling, sizeof(filling), MSG_DONTWAIT) == sizeof(filling));
+    }
+
+    ProfIdx record_i = prof_new_record(s, "before the failed flush", __FILE__, __LINE__);
+    prof_start_(s, record_i);
+    prof_end_n_unchecked(s, 1);
+    test_check(! prof_stream_flush(s));
+    test_check(stream.flushes_dropped_n == 1 && stream.records_sent_n == 0);
+    ProfStreamBatch const *batch;
+    int                    records_batches_n = 0;
+    while ((batch = test_stream_recv(collector)))
+    {   records_batches_n += (batch->kind == PROF_STREAM_records);   }
+    test_check(records_batches_n == 1); // it did get through
+
+    prof_new_record(s, "after", __FILE__, __LINE__);
+    prof_start_(s, record_i);
+    prof_end_n_unchecked(s, 1);
+    test_check(prof_stream_flush(s));
+    batch = test_stream_recv(collector);
+    test_check(batch && batch->kind == PROF_STREAM_records && batch->first_i == 0 && batch->items_n == 2);
+    test_check(batch && batch->flush_i == 1 && batch->dropped_n == 1);
+    batch = test_stream_recv(collector);
+    test_check(batch && batch->kind == PROF_STREAM_smpls && batch->items_n == 1);
+    batch = test_stream_recv(collector);
+    test_check(batch && batch->kind == PROF_STREAM_end && batch->batch_i == 2);
+
+    prof_new_record(s, "once sent, records aren't sent again", __FILE__, __LINE__);
+    test_check(prof_stream_flush(s));
+    batch = test_stream_recv(collector);
+    test_check(batch && batch->kind == PROF_STREAM_records && batch->first_i == 2 && batch->items_n == 1);
+
+    close(filler);
+    close(collector);
+    remove(path);
+    prof_stream_close(s);
+    prof_dump_close(s);
+    free(s->records);
+    free(s->record_smpl_tree);
+    free(s->hits_smpls);
+}
+#endif // PROF_STREAM
+
 static void
 print_0_x(int x)
 {
-    prof_start(prof, __func__);
+    prof_start_fn(prof);
     for (int i = 0; i < x; ++i)
     {
         printf("i is: %d\n", i);
     }
-    prof_end(prof);
+    prof_end_fn(prof);
 }
 
 static void
 print_0_x_5(int x)
 {
-    prof_start(prof, __func__);
+    prof_start_fn(prof);
     for (int i = 0; i < x; i+=5)
     {
         printf("i is: %d\n"
@@ -27,12 +1457,20 @@ print_0_x_5(int x)
                "i is: %d\n"
                , i, i+1, i+2, i+3, i+4);
     }
-    prof_end(prof);
+    prof_end_fn(prof);
 }
 
 int main()
 {
-    prof_start(prof, __func__);
+#if PROF_REGISTRY
+    prof_registry_init(prof);
+#endif
+#if PROF_COMPACT
+    ProfCompact compact;
+    prof_compact_open(prof, &compact);
+#endif
+
+    prof_start_fn(prof);
 
     prof_scope(prof, "loop")
     for (int j = 0; j < 3; ++j)
@@ -51,12 +1489,76 @@ int main()
             print_0_x(200);
         }
     }
-    prof_end(prof);
+    prof_end_fn(prof);
 
     prof->freq = 3330146; // TODO: add platform-dependent code?
-    FILE *file = prof_dump_timings_init("professor_test.json");
-    prof_dump_timings_file(file, prof, 1);
+    FILE *file = 0;
+    prof_dump_timings_file(&file, "professor_test.json", prof);
+    fputs("\n]\n", file);
     fclose(file);
+#if PROF_COMPRESS
+    { // blocks, with the closing bracket written around them
+        FILE *dumped = prof_lz_fopen("professor_test.json");
+        char  tail[3] = {0};
+        test_check(dumped && getc(dumped) == '[');
+        if (dumped && ! fseek(dumped, -3, SEEK_END))
+        {   test_check(fread(tail, 1, 3, dumped) == 3 && ! memcmp(tail, "\n]\n", 3));   }
+        if (dumped)
+        {   fclose(dumped);   }
+    }
+#endif
 
-    return 0;
+    test_dump_empty();
+    test_writer_ts();
+    test_counters();
+    test_async_ring();
+    test_alloc_attribution();
+    test_after_fork();
+    test_lz_round_trip();
+#if PROF_COMPACT
+    test_compact_round_trip();
+#endif
+#if PROF_MMAP
+    test_recover_truncated();
+#endif
+#if PROF_PARALLEL_DUMP
+    test_parallel_dump();
+#endif
+#if PROF_REGISTRY
+    test_registry();
+#endif
+#if PROF_SHM
+    test_shm_live();
+#endif
+#if PROF_PERF
+    test_perf_counters();
+#endif
+#if PROF_CPU_TIME
+    test_cpu_time();
+#endif
+#if PROF_ADDR
+    test_addr_records();
+#endif
+#if PROF_INSTRUMENT
+    test_instrument_hooks();
+#endif
+#if PROF_FRAMES
+    test_frames_slowest();
+#endif
+#if PROF_SIGNAL
+    test_signal_dump();
+#endif
+#if PROF_TRIGGER
+    test_trigger_capture();
+#endif
+#if PROF_WAIT
+    test_wait_contention();
+#endif
+#if PROF_STREAM
+    test_stream_resend();
+#endif
+
+    if (test_failed_n)
+    {   fprintf(stderr, "%d checks failed\n", test_failed_n);   }
+    return test_failed_n != 0;
 }
@@ -0,0 +1,102 @@
+// professor_test.cpp - checks of the C++ scope guards, built like professor_test.c, e.g.
+//   c++ professor_test.cpp -o professor_test_cpp && ./professor_test_cpp
+//   c++ -DPROF_REGISTRY=1 professor_test.cpp -o professor_test_cpp && ./professor_test_cpp
+//   c++ -DPROFESSOR_DISABLE=1 professor_test.cpp -o professor_test_cpp && ./professor_test_cpp
+// Returns non-zero if any check failed.
+#define _CRT_SECURE_NO_WARNINGS
+#include "professor.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+Prof prof[1];
+
+static int test_failed_n;
+#define test_check(cond) \
+    do { \
+        if (! (cond)) \
+        {   ++test_failed_n; fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   } \
+    } while (0)
+
+struct TestDisabledCategory {};
+template <> struct ProfCategoryEnabled<TestDisabledCategory> { static constexpr bool value = false; };
+
+static ProfIdx
+test_record_i(char const *name)
+{
+    for (ProfIdx record_i = 0; record_i < prof->records_n; ++record_i)
+    {
+        if (strstr(prof->records[record_i].name, name))
+        {   return record_i;   }
+    }
+    return ~(ProfIdx)0;
+}
+
+static int
+test_early_return(int x)
+{
+    prof_guard_fn(prof);
+    if (x)
+    {   return 1;   }
+    prof_guard(prof, "after the return");
+    return 0;
+}
+
+static void
+test_throw(void)
+{
+    prof_guard(prof, "thrown through");
+    throw std::runtime_error("unwinding");
+}
+
+static void
+test_disabled(void)
+{
+    prof_guard_cat(TestDisabledCategory, prof, "disabled category");
+}
+
+int main()
+{
+#if PROF_REGISTRY
+    prof_registry_init(prof);
+#endif
+
+#if PROFESSOR_DISABLE
+    test_early_return(0);
+    test_disabled();
+    {
+        prof_guard_n(prof, "batched", 8);
+    }
+    test_check(! prof->records_n && ! prof->record_smpl_tree_n); // the guards compile to nothing
+    return test_failed_n != 0;
+#endif
+
+    test_early_return(1);
+    test_early_return(0);
+    test_check(! ~prof->open_record_smpl_tree_i);
+    test_check(prof->record_smpl_tree_n == 3);
+
+    try {   test_throw();   }
+    catch (std::exception const &) {}
+    test_check(! ~prof->open_record_smpl_tree_i);
+    test_check(prof->record_smpl_tree_n == 4);
+
+    {
+        prof_guard_n(prof, "batched", 8);
+    }
+    test_check(prof->hits_smpls_n == 1 && prof->hits_smpls[0].hits_n == 8);
+
+    ProfIdx smpls_n = prof->record_smpl_tree_n;
+    test_disabled();
+    test_check(prof->record_smpl_tree_n == smpls_n);
+    test_check(! ~test_record_i("disabled category")); // not even in the registry
+
+    test_check(~test_record_i("test_early_return"));
+    test_check(~test_record_i("after the return"));
+    test_check(~test_record_i("thrown through"));
+    for (ProfIdx smpl_i = 0; smpl_i < prof->record_smpl_tree_n; ++smpl_i)
+    {   test_check(~prof->record_smpl_tree[smpl_i].cycles_end);   }
+
+    if (test_failed_n)
+    {   fprintf(stderr, "%d checks failed\n", test_failed_n);   }
+    return test_failed_n != 0;
+}
@@ -0,0 +1,160 @@
+// professor_top.c - watch the live stats of a running process that uses PROF_SHM
+//
+// usage: professor_top /shm_name [-interval ms] [-n rows] [-once]
+#define _CRT_SECURE_NO_WARNINGS
+#define PROF_SHM 1
+#include "professor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+typedef struct TopRecord {
+    ProfShmRecord record;
+    uint64_t      hits_d;   // since the last refresh
+    uint64_t      cycles_d; // since the last refresh
+} TopRecord;
+
+// reads a consistent copy of a record, retrying while the writer is mid-update
+static void
+top_read_record(ProfShmRecord const *src, ProfShmRecord *dst)
+{
+    for (;;)
+    {
+        uint32_t seq = src->seq;
+        prof_fence_acquire();
+        memcpy(dst, (void const *)src, sizeof(*dst));
+        prof_fence_acquire();
+        if (! (seq & 1) && seq == src->seq)
+        {   break;   }
+    }
+    dst->name[PROF_SHM_NAME_MAX - 1]     = 0;
+    dst->filename[PROF_SHM_NAME_MAX - 1] = 0;
+}
+
+static int
+top_cmp_cycles_d(void const *a, void const *b)
+{
+    uint64_t a_cycles = ((TopRecord const *)a)->cycles_d;
+    uint64_t b_cycles = ((TopRecord const *)b)->cycles_d;
+    return (a_cycles < b_cycles) - (a_cycles > b_cycles);
+}
+
+int main(int argc, char **argv)
+{
+    char const *name        = 0;
+    int         interval_ms = 1000;
+    int         rows_n      = 30;
+    int         once        = 0;
+    for (int arg_i = 1; arg_i < argc; ++arg_i)
+    {
+        if      (! strcmp(argv[arg_i], "-interval") && arg_i + 1 < argc) {   interval_ms = atoi(argv[++arg_i]);   }
+        else if (! strcmp(argv[arg_i], "-n")        && arg_i + 1 < argc) {   rows_n      = atoi(argv[++arg_i]);   }
+        else if (! strcmp(argv[arg_i], "-once"))                          {   once        = 1;                     }
+        else                                                              {   name        = argv[arg_i];           }
+    }
+    if (! name)
+    {
+        fprintf(stderr, "usage: %s /shm_name [-interval ms] [-n rows] [-once]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(ProfShmHeader))
+    {   fprintf(stderr, "could not open shared memory '%s'\n", name); return 1;   }
+
+    ProfShmHeader const *hdr = (ProfShmHeader const *)mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ((void const *)hdr == MAP_FAILED ||
+        memcmp(hdr->magic, PROF_SHM_MAGIC, sizeof(PROF_SHM_MAGIC)) ||
+        hdr->version != PROF_SHM_VERSION ||
+        sizeof(ProfShmHeader) + (size_t)hdr->records_m * sizeof(ProfShmRecord) > (size_t)st.st_size)
+    {   fprintf(stderr, "'%s' is not a professor stats segment\n", name); return 1;   }
+
+    ProfShmRecord const *shm_records = (ProfShmRecord const *)(hdr + 1);
+    ProfIdx              records_m   = hdr->records_m;
+    TopRecord           *records     = (TopRecord *)calloc(records_m, sizeof(*records));
+    uint64_t            *prev_hits   = (uint64_t *)calloc(records_m, sizeof(*prev_hits));
+    uint64_t            *prev_cycles = (uint64_t *)calloc(records_m, sizeof(*prev_cycles));
+
+    for (int refresh_i = 0; ; ++refresh_i)
+    {
+        double  ms        = (hdr->freq != 0.0 ? hdr->freq / 1000.0 : 1.0);
+        ProfIdx records_n = hdr->records_n;
+        if (records_n > records_m)
+        {   records_n = records_m;   }
+
+        for (ProfIdx record_i = 0; record_i < records_n; ++record_i)
+        {
+            TopRecord *record = &records[record_i];
+            top_read_record(&shm_records[record_i], &record->record);
+            record->hits_d   = record->record.hits_n   - prev_hits[record_i];
+            record->cycles_d = record->record.cycles_n - prev_cycles[record_i];
+            prev_hits[record_i]   = record->record.hits_n;
+            prev_cycles[record_i] = record->record.cycles_n;
+        }
+
+        ProfIdx  open_n = 0;
+        ProfIdx  open_record_i[PROF_SHM_OPEN_MAX];
+        uint64_t open_cycles_start[PROF_SHM_OPEN_MAX];
+        for (;;)
+        { // snapshot the open scope stack
+            uint32_t seq = hdr->open_seq;
+            prof_fence_acquire();
+            open_n = hdr->open_n;
+            memcpy(open_record_i,     (void const *)hdr->open_record_i,     sizeof(open_record_i));
+            memcpy(open_cycles_start, (void const *)hdr->open_cycles_start, sizeof(open_cycles_start));
+            prof_fence_acquire();
+            if (! (seq & 1) && seq == hdr->open_seq)
+            {   break;   }
+        }
+
+        // sort a copy so that prev_* stays parallel with the record indices
+        TopRecord *sorted = (TopRecord *)malloc((records_n ? records_n : 1) * sizeof(*sorted));
+        memcpy(sorted, records, records_n * sizeof(*sorted));
+        qsort(sorted, records_n, sizeof(*sorted), top_cmp_cycles_d);
+
+        if (! once)
+        {   fputs("\x1b[H\x1b[2J", stdout);   }
+        printf("%s (pid %llu): %u records, %u scopes open%s\n\n",
+               name, (unsigned long long)hdr->pid, records_n, open_n,
+               refresh_i ? "" : " (first refresh shows totals)");
+        printf("%12s %12s %12s %12s %12s  %s\n",
+               "hits", "ms", "ms/hit", "last ms", "total ms", "record");
+        for (ProfIdx row_i = 0; row_i < records_n && (int)row_i < rows_n; ++row_i)
+        {
+            TopRecord record = sorted[row_i];
+            printf("%12llu %12.3f %12.4f %12.4f %12.3f  %s (%s:%u)\n",
+                   (unsigned long long)record.hits_d,
+                   record.cycles_d / ms,
+                   record.hits_d ? record.cycles_d / ms / record.hits_d : 0.0,
+                   record.record.last_cycles_n / ms,
+                   record.record.cycles_n / ms,
+                   record.record.name, record.record.filename, record.record.line_num);
+        }
+        free(sorted);
+
+        printf("\nopen scopes:\n");
+        uint64_t now_cycles = __rdtsc(); // NOTE: the TSC is shared with the process being watched
+        for (ProfIdx open_i = 0; open_i < open_n && open_i < PROF_SHM_OPEN_MAX; ++open_i)
+        {
+            ProfIdx record_i = open_record_i[open_i];
+            printf("%*s%s (open for %.3f ms)\n", (int)open_i * 2, "",
+                   record_i < records_n ? records[record_i].record.name : "(unknown)",
+                   (now_cycles - open_cycles_start[open_i]) / ms);
+        }
+        fflush(stdout);
+
+        if (once)
+        {   break;   }
+
+        struct timespec wait;
+        wait.tv_sec  = interval_ms / 1000;
+        wait.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+        nanosleep(&wait, 0);
+    }
+
+    return 0;
+}